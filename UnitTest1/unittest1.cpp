@@ -146,6 +146,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_varint_fuzz)
+        {
+            int ret = varint_fuzz_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_varint_bench)
+        {
+            int ret = varint_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_sack)
         {
             int ret = sacktest();
@@ -209,12 +223,61 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(stream_table)
+        {
+            int ret = stream_table_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(stream_output)
         {
             int ret = stream_output_test();
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(stream_priority)
+        {
+            int ret = stream_priority_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stream_buffer)
+        {
+            int ret = stream_buffer_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stream_file)
+        {
+            int ret = stream_file_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(receive_window)
+        {
+            int ret = receive_window_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(datagram_jit)
+        {
+            int ret = datagram_jit_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(datagram_queue)
+        {
+            int ret = datagram_queue_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         TEST_METHOD(stream_retransmit_copy)
         {
             int ret = test_copy_for_retransmit();
@@ -235,6 +298,13 @@ namespace UnitTest1
 			Assert::AreEqual(ret, 0);
 		}
 
+        TEST_METHOD(test_sendack_cache)
+        {
+            int ret = sendack_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_ackrange)
         {
             int ret = ackrange_test();
@@ -263,12 +333,40 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(pn_enc_batch)
+        {
+            int ret = pn_enc_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(aead_bench)
+        {
+            int ret = aead_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(initial_validation)
+        {
+            int ret = initial_validation_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(cid_for_lb)
         {
             int ret = cid_for_lb_test();
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(cnxid_pool)
+        {
+            int ret = cnxid_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         TEST_METHOD(retry_protection_vector)
         {
             int ret = retry_protection_vector_test();
@@ -548,6 +646,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(retry_store_full)
+        {
+            int ret = tls_api_retry_store_full_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(retry_token)
         {
             int ret = tls_retry_token_test();
@@ -618,6 +723,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(netperf_crypto_workers)
+        {
+            int ret = netperf_crypto_workers_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
 #if 0
         /* test disabled because the results are not consistent. */
         TEST_METHOD(nat_attack)
@@ -663,6 +775,27 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(token_reuse_slots)
+        {
+            int ret = token_reuse_slots_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(anti_replay_store)
+        {
+            int ret = anti_replay_store_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(ticket_store_index)
+        {
+            int ret = ticket_store_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_session_resume)
         {
             int ret = session_resume_test();
@@ -670,6 +803,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(shared_ticket_key)
+        {
+            int ret = shared_ticket_key_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(zero_rtt)
         {
             int ret = zero_rtt_test();
@@ -719,6 +859,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(pmtud)
+        {
+            int ret = pmtud_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(jumbo_packet)
+        {
+            int ret = jumbo_packet_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(red_cc)
         {
             int ret = red_cc_test();
@@ -823,6 +977,13 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(cert_compression)
+        {
+            int ret = cert_compression_test();
+
+            Assert::AreEqual(ret, 0);
+        }
     
         TEST_METHOD(test_bad_client_certificate)
         {
@@ -1013,6 +1174,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(handshake_budget)
+        {
+            int ret = handshake_budget_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(initial_close)
         {
             int ret = initial_close_test();
@@ -1337,6 +1505,30 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(multipath_scheduler) {
+            int ret = multipath_scheduler_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_min_rtt) {
+            int ret = multipath_min_rtt_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_round_robin) {
+            int ret = multipath_round_robin_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_redundant) {
+            int ret = multipath_redundant_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_integer) {
             int ret = h3zero_integer_test();
 
@@ -1361,6 +1553,12 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_priority) {
+            int ret = h3zero_priority_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_prepare_qpack) {
             int ret = h3zero_prepare_qpack_test();
 
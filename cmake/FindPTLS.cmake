@@ -11,6 +11,9 @@ set(PTLS_HINTS ${CMAKE_BINARY_DIR}/../picotls ../picotls)
 find_library(PTLS_CORE_LIBRARY picotls-core HINTS ${PTLS_HINTS})
 find_library(PTLS_OPENSSL_LIBRARY picotls-openssl HINTS ${PTLS_HINTS})
 find_library(PTLS_FUSION_LIBRARY picotls-fusion HINTS ${PTLS_HINTS})
+find_library(PTLS_BROTLI_LIBRARY picotls-brotli HINTS ${PTLS_HINTS})
+find_library(BROTLI_DEC_LIBRARY brotlidec)
+find_library(BROTLI_ENC_LIBRARY brotlienc)
 
 include(FindPackageHandleStandardArgs)
 # handle the QUIETLY and REQUIRED arguments and set PTLS_FOUND to TRUE
@@ -24,6 +27,11 @@ find_package_handle_standard_args(PTLS REQUIRED_VARS
 if(PTLS_FOUND)
     set(PTLS_LIBRARIES ${PTLS_CORE_LIBRARY} ${PTLS_OPENSSL_LIBRARY} ${PTLS_FUSION_LIBRARY})
     set(PTLS_INCLUDE_DIRS ${PTLS_INCLUDE_DIR})
+    # Certificate compression is optional, it requires the brotli build of picotls
+    if(PTLS_BROTLI_LIBRARY AND BROTLI_DEC_LIBRARY AND BROTLI_ENC_LIBRARY)
+        set(PTLS_WITH_BROTLI TRUE)
+        list(APPEND PTLS_LIBRARIES ${PTLS_BROTLI_LIBRARY} ${BROTLI_DEC_LIBRARY} ${BROTLI_ENC_LIBRARY})
+    endif()
 endif()
 
-mark_as_advanced(PTLS_LIBRARIES PTLS_INCLUDE_DIRS)
+mark_as_advanced(PTLS_LIBRARIES PTLS_INCLUDE_DIRS PTLS_WITH_BROTLI)
@@ -532,6 +532,12 @@ static int h3zero_server_callback_data(
                 if (ret == 0 && fin_or_event == picoquic_callback_stream_fin) {
                     /* Process the request header. */
                     if (stream_ctx->ps.stream_state.header_found) {
+                        if (stream_ctx->ps.stream_state.header.has_priority) {
+                            /* Serve the response with the priority requested by the client */
+                            (void)picoquic_set_stream_priority(cnx, stream_id,
+                                stream_ctx->ps.stream_state.header.priority_urgency,
+                                stream_ctx->ps.stream_state.header.priority_incremental);
+                        }
                         ret = h3zero_server_process_request_frame(cnx, stream_ctx, ctx);
                     }
                     else {
@@ -381,6 +381,128 @@ int h3zero_parse_status(uint8_t * content, size_t content_length)
     return val;
 }
 
+/* Parse the value of the "priority" header, defined in RFC 9218 as a
+ * structured field dictionary. Only the members "u" (urgency, integer
+ * from 0 to 7) and "i" (incremental, boolean) are used. Unknown members,
+ * out of range values and parameters are ignored. Returns -1 if the
+ * dictionary is malformed, in which case the header should be ignored.
+ */
+static size_t h3zero_skip_priority_ows(uint8_t const * value, size_t value_length, size_t i)
+{
+    while (i < value_length && (value[i] == ' ' || value[i] == '\t')) {
+        i++;
+    }
+    return i;
+}
+
+static size_t h3zero_skip_priority_item(uint8_t const * value, size_t value_length, size_t i)
+{
+    int in_quote = 0;
+
+    while (i < value_length) {
+        if (in_quote) {
+            if (value[i] == '\\') {
+                i++;
+            }
+            else if (value[i] == '"') {
+                in_quote = 0;
+            }
+        }
+        else if (value[i] == '"') {
+            in_quote = 1;
+        }
+        else if (value[i] == ',' || value[i] == ';' || value[i] == ' ' || value[i] == '\t') {
+            break;
+        }
+        i++;
+    }
+
+    return i;
+}
+
+int h3zero_parse_priority_field(uint8_t const * value, size_t value_length,
+    uint8_t * urgency, int * is_incremental)
+{
+    int ret = 0;
+    size_t i = h3zero_skip_priority_ows(value, value_length, 0);
+
+    *urgency = H3ZERO_DEFAULT_PRIORITY_URGENCY;
+    *is_incremental = 0;
+
+    while (ret == 0 && i < value_length) {
+        size_t key_start = i;
+        size_t key_length;
+        size_t item_start;
+        size_t item_length = 0;
+        int has_item = 0;
+
+        while (i < value_length && ((value[i] >= 'a' && value[i] <= 'z') || (value[i] >= '0' && value[i] <= '9') ||
+            value[i] == '_' || value[i] == '-' || value[i] == '.' || value[i] == '*')) {
+            i++;
+        }
+        key_length = i - key_start;
+        if (key_length == 0 || (value[key_start] >= '0' && value[key_start] <= '9')) {
+            ret = -1;
+            break;
+        }
+
+        if (i < value_length && value[i] == '=') {
+            i++;
+            has_item = 1;
+        }
+        item_start = i;
+        if (has_item) {
+            i = h3zero_skip_priority_item(value, value_length, i);
+            item_length = i - item_start;
+            if (item_length == 0) {
+                ret = -1;
+                break;
+            }
+        }
+
+        /* Skip the parameters, if any */
+        while (i < value_length && value[i] == ';') {
+            i = h3zero_skip_priority_item(value, value_length, i + 1);
+        }
+
+        if (key_length == 1 && value[key_start] == 'u') {
+            if (item_length == 1 && value[item_start] >= '0' &&
+                value[item_start] <= '0' + H3ZERO_MAX_PRIORITY_URGENCY) {
+                *urgency = value[item_start] - '0';
+            }
+        }
+        else if (key_length == 1 && value[key_start] == 'i') {
+            if (!has_item || (item_length == 2 && value[item_start] == '?' && value[item_start + 1] == '1')) {
+                *is_incremental = 1;
+            }
+            else if (item_length == 2 && value[item_start] == '?' && value[item_start + 1] == '0') {
+                *is_incremental = 0;
+            }
+        }
+
+        i = h3zero_skip_priority_ows(value, value_length, i);
+        if (i < value_length) {
+            if (value[i] != ',') {
+                ret = -1;
+            }
+            else {
+                i = h3zero_skip_priority_ows(value, value_length, i + 1);
+                if (i >= value_length) {
+                    /* Trailing comma */
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (ret != 0) {
+        *urgency = H3ZERO_DEFAULT_PRIORITY_URGENCY;
+        *is_incremental = 0;
+    }
+
+    return ret;
+}
+
 uint8_t * h3zero_parse_qpack_header_value(uint8_t * bytes, uint8_t * bytes_max,
     http_header_enum_t header, h3zero_header_parts_t * parts)
 {
@@ -453,6 +575,17 @@ uint8_t * h3zero_parse_qpack_header_value(uint8_t * bytes, uint8_t * bytes_max,
                     }
                 }
                 break;
+            case http_header_priority: {
+                uint8_t urgency;
+                int is_incremental;
+                /* Malformed priority headers are ignored */
+                if (h3zero_parse_priority_field(decoded, decoded_length, &urgency, &is_incremental) == 0) {
+                    parts->priority_urgency = urgency;
+                    parts->priority_incremental = is_incremental;
+                    parts->has_priority = 1;
+                }
+                break;
+            }
             default:
                 break;
             }
@@ -469,10 +602,10 @@ uint8_t * h3zero_parse_qpack_header_value(uint8_t * bytes, uint8_t * bytes_max,
 int h3zero_get_interesting_header_type(uint8_t * name, size_t name_length, int is_huffman)
 {
     char const  * interesting_header_name[] = {
-     ":method", ":path", ":status", "content-type", NULL };
+     ":method", ":path", ":status", "content-type", "priority", NULL };
     const http_header_enum_t interesting_header[] = {
         http_pseudo_header_method, http_pseudo_header_path,
-        http_pseudo_header_status, http_header_content_type };
+        http_pseudo_header_status, http_header_content_type, http_header_priority };
     http_header_enum_t val = http_header_unknown;
     uint8_t deHuff[256];
 
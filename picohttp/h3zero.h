@@ -114,6 +114,7 @@ typedef enum {
     http_header_user_agent,
     http_header_x_forwarded_for,
     http_header_x_frame_options,
+    http_header_priority,
 	http_header_max
 } http_header_enum_t;
 
@@ -127,6 +128,9 @@ typedef enum {
 #define H3ZERO_QPACK_SCHEME_HTTPS 23
 #define H3ZERO_QPACK_TEXT_PLAIN 53
 
+#define H3ZERO_DEFAULT_PRIORITY_URGENCY 3
+#define H3ZERO_MAX_PRIORITY_URGENCY 7
+
 typedef struct st_h3zero_qpack_static_t {
     int index;
     http_header_enum_t header;
@@ -172,7 +176,10 @@ typedef struct st_h3zero_header_parts_t {
     size_t path_length;
     int status;
     h3zero_content_type_enum content_type;
+    uint8_t priority_urgency;
     unsigned int path_is_huffman : 1;
+    unsigned int priority_incremental : 1;
+    unsigned int has_priority : 1; /* A valid "priority" header was received */
 } h3zero_header_parts_t;
 
 extern uint8_t const * h3zero_default_setting_frame;
@@ -186,6 +193,8 @@ uint8_t * h3zero_qpack_int_decode(uint8_t * bytes, uint8_t * bytes_max,
 
 uint8_t * h3zero_parse_qpack_header_frame(uint8_t * bytes, uint8_t * bytes_max,
     h3zero_header_parts_t * parts);
+int h3zero_parse_priority_field(uint8_t const * value, size_t value_length,
+    uint8_t * urgency, int * is_incremental);
 uint8_t * h3zero_create_request_header_frame(uint8_t * bytes, uint8_t * bytes_max,
     uint8_t const * path, size_t path_length, char const * host);
 uint8_t * h3zero_create_post_header_frame(uint8_t * bytes, uint8_t * bytes_max,
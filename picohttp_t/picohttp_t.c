@@ -48,6 +48,7 @@ static const picoquic_test_def_t test_table[] = {
     { "qpack_huffman", qpack_huffman_test },
     { "qpack_huffman_base", qpack_huffman_base_test},
     { "h3zero_parse_qpack", h3zero_parse_qpack_test },
+    { "h3zero_priority", h3zero_priority_test },
     { "h3zero_prepare_qpack", h3zero_prepare_qpack_test },
     { "h3zero_qpack_fuzz", h3zero_qpack_fuzz_test },
     { "h3zero_stream_test", h3zero_stream_test },
@@ -138,18 +138,3 @@ void picoquic_hystart_increase(picoquic_path_t * path_x, picoquic_min_max_rtt_t*
 {
     path_x->cwin += nb_delivered;
 }
-
-uint64_t picoquic_cc_increased_window(picoquic_cnx_t* cnx, uint64_t previous_window)
-{
-    uint64_t new_window;
-    if (cnx->path[0]->rtt_min <= PICOQUIC_TARGET_RENO_RTT) {
-        new_window = previous_window * 2;
-    }
-    else {
-        double w = (double)previous_window;
-        w /= (double)PICOQUIC_TARGET_RENO_RTT;
-        w *= (cnx->path[0]->rtt_min > PICOQUIC_TARGET_SATELLITE_RTT)? PICOQUIC_TARGET_SATELLITE_RTT: cnx->path[0]->rtt_min;
-        new_window = (uint64_t)w;
-    }
-    return new_window;
-}
\ No newline at end of file
@@ -0,0 +1,289 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2021, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Crypto workers.
+ *
+ * When a train of 1-RTT packets is prepared for a connection, the AEAD
+ * encryption of the packets is deferred until the train is complete. The
+ * packets of the train are then encrypted in parallel by a pool of threads,
+ * before the header protection is applied to the whole train.
+ *
+ * The AEAD contexts are not thread safe, so each worker uses its own copy of
+ * the connection's encryption context, created at the same time as the
+ * key (see aead_encrypt_workers in the crypto context). The thread that
+ * prepares the packets participates in the encryption with the original
+ * context, and returns only when all packets are encrypted. The packets
+ * stay at their position in the send buffer, so the order in which the
+ * workers process them does not affect the order in which they are sent.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "tls_api.h"
+
+/* The workers wait on condition variables associated with the lock that
+ * protects the batch state, so that a wait always checks its predicate
+ * under that lock and no signal can be lost between the check and the wait.
+ * The portable event of picoquic_utils does not offer that, and on Windows
+ * the picoquic mutex is a kernel object that cannot be used with condition
+ * variables, hence the local definitions.
+ */
+#ifdef _WINDOWS
+typedef CRITICAL_SECTION picoquic_crypto_lock_t;
+typedef CONDITION_VARIABLE picoquic_crypto_cond_t;
+#else
+typedef pthread_mutex_t picoquic_crypto_lock_t;
+typedef pthread_cond_t picoquic_crypto_cond_t;
+#endif
+
+typedef struct st_picoquic_crypto_worker_t {
+    picoquic_crypto_workers_t* workers;
+    picoquic_thread_t thread;
+    int worker_index;
+    int is_started;
+} picoquic_crypto_worker_t;
+
+struct st_picoquic_crypto_workers_t {
+    int nb_workers;
+    int should_stop;
+    picoquic_crypto_lock_t lock;
+    picoquic_crypto_cond_t work_cond; /* Signalled when a batch is posted or the workers shall stop */
+    picoquic_crypto_cond_t done_cond; /* Signalled when the last item of the batch is encrypted */
+    picoquic_hp_batch_t* hp_batch; /* Batch currently being encrypted, or NULL */
+    size_t next_item;
+    size_t nb_done;
+    picoquic_crypto_worker_t worker[PICOQUIC_CRYPTO_WORKERS_MAX];
+};
+
+static int picoquic_crypto_workers_init_sync(picoquic_crypto_workers_t* workers)
+{
+#ifdef _WINDOWS
+    InitializeCriticalSection(&workers->lock);
+    InitializeConditionVariable(&workers->work_cond);
+    InitializeConditionVariable(&workers->done_cond);
+    return 0;
+#else
+    int ret = pthread_mutex_init(&workers->lock, NULL);
+
+    if (ret == 0) {
+        if ((ret = pthread_cond_init(&workers->work_cond, NULL)) == 0) {
+            if ((ret = pthread_cond_init(&workers->done_cond, NULL)) != 0) {
+                (void)pthread_cond_destroy(&workers->work_cond);
+            }
+        }
+        if (ret != 0) {
+            (void)pthread_mutex_destroy(&workers->lock);
+        }
+    }
+    return ret;
+#endif
+}
+
+static void picoquic_crypto_workers_delete_sync(picoquic_crypto_workers_t* workers)
+{
+#ifdef _WINDOWS
+    DeleteCriticalSection(&workers->lock);
+#else
+    (void)pthread_cond_destroy(&workers->done_cond);
+    (void)pthread_cond_destroy(&workers->work_cond);
+    (void)pthread_mutex_destroy(&workers->lock);
+#endif
+}
+
+static void picoquic_crypto_workers_lock(picoquic_crypto_workers_t* workers)
+{
+#ifdef _WINDOWS
+    EnterCriticalSection(&workers->lock);
+#else
+    (void)pthread_mutex_lock(&workers->lock);
+#endif
+}
+
+static void picoquic_crypto_workers_unlock(picoquic_crypto_workers_t* workers)
+{
+#ifdef _WINDOWS
+    LeaveCriticalSection(&workers->lock);
+#else
+    (void)pthread_mutex_unlock(&workers->lock);
+#endif
+}
+
+/* Untimed wait, must be called with the lock held, and within a loop checking the predicate */
+static void picoquic_crypto_workers_wait(picoquic_crypto_workers_t* workers, picoquic_crypto_cond_t* cond)
+{
+#ifdef _WINDOWS
+    (void)SleepConditionVariableCS(cond, &workers->lock, INFINITE);
+#else
+    (void)pthread_cond_wait(cond, &workers->lock);
+#endif
+}
+
+static void picoquic_crypto_workers_wake(picoquic_crypto_cond_t* cond)
+{
+#ifdef _WINDOWS
+    WakeAllConditionVariable(cond);
+#else
+    (void)pthread_cond_broadcast(cond);
+#endif
+}
+
+/* Return the AEAD context used by the worker for the current batch, or NULL
+ * if the worker has nothing to do. Must be called with the lock held.
+ * Worker 0 is the calling thread, which uses the original AEAD context.
+ * Worker N uses the copy number N-1.
+ */
+static void* picoquic_crypto_workers_get_work(picoquic_crypto_workers_t* workers, int worker_index)
+{
+    void* aead_context = NULL;
+
+    if (workers->hp_batch != NULL && workers->next_item < workers->hp_batch->nb_items) {
+        aead_context = (worker_index == 0) ? workers->hp_batch->crypto_context->aead_encrypt :
+            workers->hp_batch->crypto_context->aead_encrypt_workers[worker_index - 1];
+    }
+
+    return aead_context;
+}
+
+/* Process the items of the current batch until none is left.
+ * Must be called with the lock held, which is released during the
+ * encryption of each item and held again on return.
+ */
+static void picoquic_crypto_workers_process(picoquic_crypto_workers_t* workers, int worker_index)
+{
+    void* aead_context;
+
+    while ((aead_context = picoquic_crypto_workers_get_work(workers, worker_index)) != NULL) {
+        picoquic_hp_batch_t* hp_batch = workers->hp_batch;
+        picoquic_hp_batch_item_t* item = &hp_batch->items[workers->next_item++];
+
+        picoquic_crypto_workers_unlock(workers);
+
+        if (item->is_aead_pending) {
+            uint8_t* payload = item->packet + item->h_length;
+            (void)picoquic_aead_encrypt_generic(payload, payload, item->payload_length,
+                item->sequence_number, item->packet, item->h_length, aead_context);
+            item->is_aead_pending = 0;
+        }
+
+        picoquic_crypto_workers_lock(workers);
+        workers->nb_done++;
+        if (workers->nb_done == hp_batch->nb_items) {
+            picoquic_crypto_workers_wake(&workers->done_cond);
+        }
+    }
+}
+
+static picoquic_thread_return_t picoquic_crypto_worker_thread(void* arg)
+{
+    picoquic_crypto_worker_t* worker = (picoquic_crypto_worker_t*)arg;
+    picoquic_crypto_workers_t* workers = worker->workers;
+
+    picoquic_crypto_workers_lock(workers);
+    while (!workers->should_stop) {
+        if (picoquic_crypto_workers_get_work(workers, worker->worker_index) != NULL) {
+            picoquic_crypto_workers_process(workers, worker->worker_index);
+        }
+        else {
+            picoquic_crypto_workers_wait(workers, &workers->work_cond);
+        }
+    }
+    picoquic_crypto_workers_unlock(workers);
+
+    picoquic_thread_do_return;
+}
+
+void picoquic_crypto_workers_encrypt(picoquic_crypto_workers_t* workers, picoquic_hp_batch_t* hp_batch)
+{
+    picoquic_crypto_workers_lock(workers);
+    workers->hp_batch = hp_batch;
+    workers->next_item = 0;
+    workers->nb_done = 0;
+    picoquic_crypto_workers_wake(&workers->work_cond);
+
+    picoquic_crypto_workers_process(workers, 0);
+
+    while (workers->nb_done < hp_batch->nb_items) {
+        picoquic_crypto_workers_wait(workers, &workers->done_cond);
+    }
+    workers->hp_batch = NULL;
+    picoquic_crypto_workers_unlock(workers);
+}
+
+picoquic_crypto_workers_t* picoquic_crypto_workers_create(int nb_workers)
+{
+    int ret = 0;
+    picoquic_crypto_workers_t* workers = NULL;
+
+    if (nb_workers <= 0 || nb_workers > PICOQUIC_CRYPTO_WORKERS_MAX) {
+        return NULL;
+    }
+
+    workers = (picoquic_crypto_workers_t*)malloc(sizeof(picoquic_crypto_workers_t));
+    if (workers == NULL) {
+        return NULL;
+    }
+
+    memset(workers, 0, sizeof(picoquic_crypto_workers_t));
+    workers->nb_workers = nb_workers;
+
+    if ((ret = picoquic_crypto_workers_init_sync(workers)) != 0) {
+        free(workers);
+        workers = NULL;
+    }
+    else {
+        for (int i = 0; ret == 0 && i < nb_workers; i++) {
+            workers->worker[i].workers = workers;
+            workers->worker[i].worker_index = i + 1;
+            if ((ret = picoquic_create_thread(&workers->worker[i].thread, picoquic_crypto_worker_thread,
+                &workers->worker[i])) == 0) {
+                workers->worker[i].is_started = 1;
+            }
+        }
+
+        if (ret != 0) {
+            DBG_PRINTF("Could not start crypto workers, ret = %d", ret);
+            picoquic_crypto_workers_delete(workers);
+            workers = NULL;
+        }
+    }
+
+    return workers;
+}
+
+void picoquic_crypto_workers_delete(picoquic_crypto_workers_t* workers)
+{
+    picoquic_crypto_workers_lock(workers);
+    workers->should_stop = 1;
+    picoquic_crypto_workers_wake(&workers->work_cond);
+    picoquic_crypto_workers_unlock(workers);
+
+    for (int i = 0; i < workers->nb_workers; i++) {
+        if (workers->worker[i].is_started) {
+            picoquic_delete_thread(&workers->worker[i].thread);
+            workers->worker[i].is_started = 0;
+        }
+    }
+
+    picoquic_crypto_workers_delete_sync(workers);
+    free(workers);
+}
@@ -0,0 +1,164 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2021, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* File backed stream data.
+ *
+ * A region of a file is mapped in memory and queued on the stream with
+ * picoquic_add_buffer_to_stream. The data is then copied directly from
+ * the mapping into the packets, without going through stdio buffers or
+ * an intermediate copy in the send queue. The mapping is released when
+ * the stack releases the buffer, i.e., once the last byte is sent, or
+ * when the stream is reset or the connection deleted.
+ *
+ * The end of file is only checked when the region is queued. If the file
+ * is truncated while the mapping is in use, reading the pages past the new
+ * end raises SIGBUS, which kills the process (Windows refuses to truncate a
+ * mapped file). Mapped files must not be truncated or rewritten in place
+ * while queued; updates must create a new file and rename it over the old one.
+ */
+
+#ifdef _WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+typedef struct st_picoquic_file_mapping_t {
+    void* map_base;
+    size_t map_length;
+#ifdef _WINDOWS
+    HANDLE map_handle;
+#endif
+} picoquic_file_mapping_t;
+
+static void picoquic_file_mapping_release(void* release_ctx, uint8_t* bytes, size_t length)
+{
+    picoquic_file_mapping_t* mapping = (picoquic_file_mapping_t*)release_ctx;
+#ifdef _WINDOWS
+    (void)UnmapViewOfFile(mapping->map_base);
+    (void)CloseHandle(mapping->map_handle);
+#else
+    (void)munmap(mapping->map_base, mapping->map_length);
+#endif
+    free(mapping);
+}
+
+/* Map the region [offset, offset + length[ of the file. The start of the
+ * mapping must be aligned, so the region starts "*delta" bytes after it.
+ */
+static int picoquic_file_mapping_create(FILE* F, uint64_t offset, size_t length,
+    picoquic_file_mapping_t* mapping, size_t* delta)
+{
+    int ret = 0;
+#ifdef _WINDOWS
+    HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(F));
+    SYSTEM_INFO system_info;
+    LARGE_INTEGER file_size;
+
+    GetSystemInfo(&system_info);
+
+    if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &file_size) ||
+        offset + length > (uint64_t)file_size.QuadPart) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        uint64_t map_offset = offset - (offset % system_info.dwAllocationGranularity);
+
+        *delta = (size_t)(offset - map_offset);
+        mapping->map_length = *delta + length;
+        mapping->map_handle = CreateFileMapping(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping->map_handle == NULL) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else if ((mapping->map_base = MapViewOfFile(mapping->map_handle, FILE_MAP_READ,
+            (DWORD)(map_offset >> 32), (DWORD)(map_offset & 0xFFFFFFFF), mapping->map_length)) == NULL) {
+            (void)CloseHandle(mapping->map_handle);
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+#else
+    int fd = fileno(F);
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct stat file_stat;
+
+    /* Refuse regions beyond the current end of file, which would fault when read.
+     * This does not protect against a later truncation of the file. */
+    if (fd < 0 || page_size <= 0 || fstat(fd, &file_stat) != 0 ||
+        offset + length > (uint64_t)file_stat.st_size) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        uint64_t map_offset = offset - (offset % (uint64_t)page_size);
+
+        *delta = (size_t)(offset - map_offset);
+        mapping->map_length = *delta + length;
+        mapping->map_base = mmap(NULL, mapping->map_length, PROT_READ, MAP_PRIVATE, fd, (off_t)map_offset);
+        if (mapping->map_base == MAP_FAILED) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+#ifdef MADV_SEQUENTIAL
+        else {
+            /* The data is read once, in order: favor read-ahead */
+            (void)madvise(mapping->map_base, mapping->map_length, MADV_SEQUENTIAL);
+        }
+#endif
+    }
+#endif
+    return ret;
+}
+
+int picoquic_add_file_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id, FILE* F,
+    uint64_t offset, size_t length, int set_fin, void* app_stream_ctx)
+{
+    int ret = 0;
+
+    if (F == NULL || length == 0) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        picoquic_file_mapping_t* mapping = (picoquic_file_mapping_t*)malloc(sizeof(picoquic_file_mapping_t));
+        size_t delta = 0;
+
+        if (mapping == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(mapping, 0, sizeof(picoquic_file_mapping_t));
+            if ((ret = picoquic_file_mapping_create(F, offset, length, mapping, &delta)) != 0) {
+                free(mapping);
+            }
+            else if ((ret = picoquic_add_buffer_to_stream(cnx, stream_id, (uint8_t*)mapping->map_base + delta,
+                length, set_fin, app_stream_ctx, picoquic_file_mapping_release, mapping)) != 0) {
+                /* The buffer was not queued, so it will not be released by the stack */
+                picoquic_file_mapping_release(mapping, NULL, 0);
+            }
+        }
+    }
+
+    return ret;
+}
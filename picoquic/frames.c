@@ -150,7 +150,10 @@ void picoquic_update_stream_initial_remote(picoquic_cnx_t* cnx)
                 stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data_bidi_local;
             }
         }
-        stream = picoquic_next_stream(stream);
+        if (stream->is_blocked_stream) {
+            picoquic_update_output_stream(cnx, stream);
+        }
+        stream = picoquic_next_stream(cnx, stream);
     };
 }
 
@@ -221,13 +224,11 @@ uint8_t * picoquic_format_stream_reset_frame(picoquic_cnx_t* cnx, picoquic_strea
 
             /* Free the queued data */
             while (stream->send_queue != NULL) {
-                picoquic_stream_data_node_t* next = stream->send_queue->next_stream_data;
-                if (stream->send_queue->bytes != NULL) {
-                    free(stream->send_queue->bytes);
-                }
-                free(stream->send_queue);
-                stream->send_queue = next;
+                picoquic_stream_data_node_t* old_node = stream->send_queue;
+                stream->send_queue = old_node->next_stream_data;
+                picoquic_free_send_queue_node(old_node);
             }
+            picoquic_update_output_stream(cnx, stream);
             (void)picoquic_delete_stream_if_closed(cnx, stream);
         }
         else {
@@ -305,7 +306,7 @@ uint8_t * picoquic_format_new_connection_id_frame(picoquic_cnx_t* cnx, uint8_t*
         }
         else {
             *is_pure_ack = 0;
-            (void)picoquic_create_cnxid_reset_secret(cnx->quic, &l_cid->cnx_id, bytes);
+            memcpy(bytes, l_cid->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
             bytes += PICOQUIC_RESET_SECRET_SIZE;
         }
     }
@@ -525,7 +526,7 @@ const uint8_t* picoquic_decode_new_token_frame(picoquic_cnx_t* cnx, const uint8_
         uint8_t * ip_addr;
         uint8_t ip_addr_length;
         picoquic_get_ip_addr(addr_to, &ip_addr, &ip_addr_length);
-        (void)picoquic_store_token(&cnx->quic->p_first_token, current_time, cnx->sni, (uint16_t)strlen(cnx->sni),
+        (void)picoquic_store_retry_token(cnx->quic, current_time, cnx->sni, (uint16_t)strlen(cnx->sni),
             ip_addr, ip_addr_length, token, (uint16_t)length);
     }
 
@@ -885,7 +886,7 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
 
         if (!is_deleted) {
             if (!stream->fin_signalled) {
-                if (!stream->fin_received && !stream->reset_received && 2 * stream->consumed_offset > stream->maxdata_local) {
+                if (!stream->fin_received && !stream->reset_received && picoquic_is_stream_max_data_needed(cnx, stream, current_time)) {
                     cnx->max_stream_data_needed = 1;
                 }
             }
@@ -920,46 +921,52 @@ const uint8_t* picoquic_decode_stream_frame(picoquic_cnx_t* cnx, const uint8_t*
     return bytes;
 }
 
+/* Find the next stream to send. Ready streams are kept in the output list,
+ * so the first stream of that list is normally the next stream to send.
+ * Streams whose state changed since they were queued are moved to the
+ * blocked or idle sets as they are found, and deleted if they are exhausted.
+ * If the connection is blocked by flow control, only the reset and stop
+ * sending frames can be sent; these are found at the front of the list.
+ */
 picoquic_stream_head_t* picoquic_find_ready_stream(picoquic_cnx_t* cnx)
 {
-    picoquic_stream_head_t* first_stream = cnx->first_output_stream;
-    picoquic_stream_head_t* stream = first_stream;
+    picoquic_stream_head_t* stream = cnx->first_output_stream;
     picoquic_stream_head_t* found_stream = NULL;
-    picoquic_stream_head_t* previous_stream = NULL;
-
+    int is_flow_blocked = (cnx->maxdata_remote <= cnx->data_sent);
 
-    /* Look for a ready stream */
     while (stream != NULL) {
-        if ((cnx->maxdata_remote > cnx->data_sent&& stream->sent_offset < stream->maxdata_remote && (stream->is_active ||
-            (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset) ||
-            (stream->fin_requested && !stream->fin_sent))) ||
-            (stream->reset_requested && !stream->reset_sent) ||
+        picoquic_stream_head_t* next_stream = stream->next_output_stream;
+
+        if ((stream->reset_requested && !stream->reset_sent) ||
             (stream->stop_sending_requested && !stream->stop_sending_sent)) {
-            /* Something can be sent */
+            /* Control frames are not subject to flow control */
             found_stream = stream;
             break;
         }
-        else if (((stream->fin_requested && stream->fin_sent) || (stream->reset_requested && stream->reset_sent)) && (!stream->stop_sending_requested || stream->stop_sending_sent)) {
-            picoquic_stream_head_t* next_stream = stream->next_output_stream;
-            /* If stream is exhausted, remove from output list */
-            picoquic_remove_output_stream(cnx, stream, previous_stream);
-
-            picoquic_delete_stream_if_closed(cnx, stream);
-            stream = next_stream;
+        else if (!picoquic_is_stream_ready(cnx, stream)) {
+            /* Stream is exhausted or blocked, remove from output list */
+            picoquic_update_output_stream(cnx, stream);
+            if (!stream->is_blocked_stream) {
+                picoquic_delete_stream_if_closed(cnx, stream);
+            }
         }
-        else {
-            if (stream->is_active ||
-                (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset)) {
-                if (stream->sent_offset >= stream->maxdata_remote) {
-                    cnx->stream_blocked = 1;
-                }
-                else if (cnx->maxdata_remote <= cnx->data_sent) {
-                    cnx->flow_blocked = 1;
-                }
+        else if (is_flow_blocked) {
+            cnx->flow_blocked = 1;
+            if (!stream->is_output_front) {
+                /* No control frame can be found after the front of the list */
+                break;
             }
-            previous_stream = stream;
-            stream = stream->next_output_stream;
         }
+        else {
+            /* Something can be sent */
+            found_stream = stream;
+            break;
+        }
+        stream = next_stream;
+    }
+
+    if (cnx->first_blocked_stream != NULL) {
+        cnx->stream_blocked = 1;
     }
 
     return found_stream;
@@ -1078,7 +1085,7 @@ uint8_t * picoquic_format_one_blocked_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
 
 uint8_t * picoquic_format_blocked_frames(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t * bytes_max, int * more_data, int * is_pure_ack)
 {
-    picoquic_stream_head_t* stream = picoquic_first_stream(cnx);
+    picoquic_stream_head_t* stream = cnx->first_blocked_stream;
     picoquic_stream_head_t* hi_pri_stream = NULL;
 
     /* Check whether there is a high priority stream declared */
@@ -1095,7 +1102,21 @@ uint8_t * picoquic_format_blocked_frames(picoquic_cnx_t* cnx, uint8_t* bytes, ui
             }
         }
 
-        stream = picoquic_next_stream(stream);
+        stream = stream->next_blocked_stream;
+    }
+
+    /* Streams blocked by the connection flow control are still in the output list */
+    if (!*more_data && cnx->maxdata_remote <= cnx->data_sent && !cnx->sent_blocked_frame) {
+        stream = cnx->first_output_stream;
+
+        while (stream != NULL) {
+            if ((hi_pri_stream == NULL || stream == hi_pri_stream) && (stream->is_active ||
+                (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset))) {
+                bytes = picoquic_format_one_blocked_frame(cnx, bytes, bytes_max, more_data, is_pure_ack, stream);
+                break;
+            }
+            stream = stream->next_output_stream;
+        }
     }
 
     return bytes;
@@ -1203,7 +1224,9 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
     }
 
     if (stream->stop_sending_requested && !stream->stop_sending_sent) {
-        return picoquic_format_stop_sending_frame(stream, bytes, bytes_max, more_data, is_pure_ack);
+        bytes = picoquic_format_stop_sending_frame(stream, bytes, bytes_max, more_data, is_pure_ack);
+        picoquic_update_output_stream(cnx, stream);
+        return bytes;
     }
 
     if (!stream->is_active &&
@@ -1316,10 +1339,11 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
 
                     stream->send_queue->offset += length;
                     if (stream->send_queue->offset >= stream->send_queue->length) {
-                        picoquic_stream_data_node_t* next = stream->send_queue->next_stream_data;
-                        free(stream->send_queue->bytes);
-                        free(stream->send_queue);
-                        stream->send_queue = next;
+                        /* The packet holds a copy of the data, which will be used if
+                         * retransmission is needed, so the node can be freed now. */
+                        picoquic_stream_data_node_t* old_node = stream->send_queue;
+                        stream->send_queue = old_node->next_stream_data;
+                        picoquic_free_send_queue_node(old_node);
                     }
 
                     stream->sent_offset += length;
@@ -1349,6 +1373,9 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
         if (*ret == 0) {
             *is_pure_ack &= (bytes == bytes0);
 
+            /* The stream may now be idle or blocked */
+            picoquic_update_output_stream(cnx, stream);
+
             if (!may_close || !picoquic_delete_stream_if_closed(cnx, stream)) {
                 /* mark the stream as unblocked since we sent something */
                 stream->stream_data_blocked_sent = 0;
@@ -1375,6 +1402,8 @@ uint8_t* picoquic_format_available_stream_frames(picoquic_cnx_t* cnx, uint8_t* b
     while (*ret == 0 && stream != NULL && bytes_next < bytes_max) {
         int is_still_active = 0;
 
+        /* Incremental streams yield to the next stream of the same urgency */
+        picoquic_requeue_output_stream(cnx, stream);
         bytes_next = picoquic_format_stream_frame(cnx, stream, bytes_next, bytes_max, &more_stream_data, is_pure_ack, &is_still_active, ret);
 
         if (*ret == 0) {
@@ -1612,10 +1641,9 @@ uint8_t* picoquic_format_crypto_hs_frame(picoquic_stream_head_t* stream, uint8_t
 
                     stream->send_queue->offset += length;
                     if (stream->send_queue->offset >= stream->send_queue->length) {
-                        picoquic_stream_data_node_t* next = stream->send_queue->next_stream_data;
-                        free(stream->send_queue->bytes);
-                        free(stream->send_queue);
-                        stream->send_queue = next;
+                        picoquic_stream_data_node_t* old_node = stream->send_queue;
+                        stream->send_queue = old_node->next_stream_data;
+                        picoquic_free_send_queue_node(old_node);
                     }
 
                     stream->sent_offset += length;
@@ -1693,13 +1721,7 @@ picoquic_packet_t* picoquic_check_spurious_retransmission(picoquic_cnx_t* cnx,
             picoquic_path_t * old_path = p->send_path;
 
             if (old_path != NULL) {
-                if (p->length + p->checksum_overhead > old_path->send_mtu) {
-                    old_path->send_mtu = p->length + p->checksum_overhead;
-                    if (old_path->send_mtu > old_path->send_mtu_max_tried) {
-                        old_path->send_mtu_max_tried = old_path->send_mtu;
-                    }
-                    old_path->mtu_probe_sent = 0; 
-                }
+                picoquic_update_path_mtu_on_ack(old_path, p->length + p->checksum_overhead, p->send_time);
 
                 if (max_spurious_rtt > old_path->max_spurious_rtt) {
                     old_path->max_spurious_rtt = max_spurious_rtt;
@@ -2419,10 +2441,12 @@ void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t* cnx, picoquic_pa
             ret = picoquic_process_ack_of_ack_frame(&cnx->pkt_ctx[p->pc].first_sack_item,
                 &p->bytes[byte_index], p->length - byte_index, &frame_length, 0);
             byte_index += frame_length;
+            cnx->pkt_ctx[p->pc].ack_blocks_cache_valid = 0;
         } else if (p->bytes[byte_index] == picoquic_frame_type_ack_ecn) {
             ret = picoquic_process_ack_of_ack_frame(&cnx->pkt_ctx[p->pc].first_sack_item,
                 &p->bytes[byte_index], p->length - byte_index, &frame_length, 1);
             byte_index += frame_length;
+            cnx->pkt_ctx[p->pc].ack_blocks_cache_valid = 0;
         }
         else if (PICOQUIC_IN_RANGE(p->bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
             ret = picoquic_process_ack_of_stream_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
@@ -2445,7 +2469,7 @@ void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t* cnx, picoquic_pa
 
 static int picoquic_process_ack_range(
     picoquic_cnx_t* cnx, picoquic_packet_context_enum pc, uint64_t highest, uint64_t range, picoquic_packet_t** ppacket,
-    uint64_t current_time)
+    uint64_t ack_delay, uint64_t current_time)
 {
     picoquic_packet_t* p = *ppacket;
     int ret = 0;
@@ -2468,6 +2492,21 @@ static int picoquic_process_ack_range(
                 if (old_path != NULL) {
                     old_path->delivered += p->length;
 
+                    if (p->path_packet_number >= old_path->path_packet_acked_next) {
+                        /* Most recent packet acknowledged on this path */
+                        old_path->path_packet_acked_next = p->path_packet_number + 1;
+                        old_path->path_packet_acked_time = current_time;
+                        old_path->path_packet_acked_sent_time = p->send_time;
+
+                        if (cnx->is_multipath_enabled && p->sequence_number != cnx->pkt_ctx[pc].highest_acknowledged &&
+                            ack_delay < PICOQUIC_ACK_DELAY_MAX) {
+                            /* The RTT of the path of the largest acknowledged packet is already updated.
+                             * The ACK delay of an older packet is at least the ACK delay of the largest one,
+                             * so the RTT sample may be slightly larger than the actual value. */
+                            picoquic_update_path_rtt(cnx, old_path, p->send_time, current_time, ack_delay);
+                        }
+                    }
+
                     if (cnx->congestion_alg != NULL) {
 #if 0
                         if (cnx->pkt_ctx[pc].nb_retransmit >= 2 && p->sequence_number >= cnx->pkt_ctx[pc].retransmit_sequence) {
@@ -2483,12 +2522,7 @@ static int picoquic_process_ack_range(
 
 
                     /* If packet is larger than the current MTU, update the MTU */
-                    if ((p->length + p->checksum_overhead) == old_path->send_mtu) {
-                        old_path->nb_mtu_losses = 0;
-                    } else if ((p->length + p->checksum_overhead) > old_path->send_mtu) {
-                        old_path->send_mtu = p->length + p->checksum_overhead;
-                        old_path->mtu_probe_sent = 0;
-                    }
+                    picoquic_update_path_mtu_on_ack(old_path, p->length + p->checksum_overhead, p->send_time);
                 }
 
                 /* If the packet contained an ACK frame, perform the ACK of ACK pruning logic */
@@ -2521,6 +2555,18 @@ static int picoquic_process_ack_range(
     return ret;
 }
 
+/* Decode the next run of ranges and gaps in an ACK frame */
+static const uint8_t* picoquic_decode_ack_values(const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t* ack_values, size_t* nb_ack_values, size_t* ack_value_index, uint64_t* nb_ack_values_left)
+{
+    *nb_ack_values = (*nb_ack_values_left > 2 * PICOQUIC_MAX_ACK_BLOCKS) ?
+        2 * PICOQUIC_MAX_ACK_BLOCKS : (size_t)*nb_ack_values_left;
+    *nb_ack_values_left -= *nb_ack_values;
+    *ack_value_index = 0;
+
+    return picoquic_frames_varint_decode_n(bytes, bytes_max, ack_values, *nb_ack_values);
+}
+
 const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* bytes,
     const uint8_t* bytes_max, uint64_t current_time, int epoch, int is_ecn, picoquic_packet_data_t* packet_data)
 {
@@ -2532,10 +2578,16 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
     picoquic_packet_context_enum pc = picoquic_context_from_epoch(epoch);
     uint64_t ecnx3[3] = { 0, 0, 0 };
     uint8_t first_byte = bytes[0];
+    uint64_t ack_values[2 * PICOQUIC_MAX_ACK_BLOCKS];
+    size_t nb_ack_values = 0;
+    size_t ack_value_index = 0;
+    uint64_t nb_ack_values_left = 0;
 
     if (picoquic_parse_ack_header(bytes, bytes_max-bytes, &num_block,
         &largest, &ack_delay, &consumed,
-        cnx->remote_parameters.ack_delay_exponent) != 0) {
+        cnx->remote_parameters.ack_delay_exponent) != 0 ||
+        num_block > (uint64_t)(bytes_max - bytes)) {
+        /* Each ack block is at least 2 bytes, a larger number of blocks cannot be valid */
         bytes = NULL;
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, first_byte);
     } else if (largest >= cnx->pkt_ctx[pc].send_sequence) {
@@ -2566,17 +2618,25 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
             }
         }
 
+        /* The first range, and then the gap and range of each block */
+        nb_ack_values_left = 2 * num_block + 1;
+
         do {
             uint64_t range;
             uint64_t block_to_block;
 
-            if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range)) == NULL) {
+            if (ack_value_index >= nb_ack_values) {
+                bytes = picoquic_decode_ack_values(bytes, bytes_max, ack_values, &nb_ack_values, &ack_value_index, &nb_ack_values_left);
+            }
+
+            if (bytes == NULL) {
                 DBG_PRINTF("Malformed ACK RANGE, %d blocks remain.\n", (int)num_block);
                 picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, first_byte);
                 bytes = NULL;
                 break;
             }
 
+            range = ack_values[ack_value_index++];
             range ++;
             if (largest + 1 < range) {
                 DBG_PRINTF("ack range error: largest=%" PRIx64 ", range=%" PRIx64, largest, range);
@@ -2585,7 +2645,7 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
                 break;
             }
 
-            if (picoquic_process_ack_range(cnx, pc, largest, range, &top_packet, current_time) != 0) {
+            if (picoquic_process_ack_range(cnx, pc, largest, range, &top_packet, ack_delay, current_time) != 0) {
                 bytes = NULL;
                 break;
             }
@@ -2598,13 +2658,15 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
                 break;
 
             /* Skip the gap */
-            if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &block_to_block)) == NULL) {
-                DBG_PRINTF("    Malformed ACK GAP, %d blocks remain.\n", (int)num_block);
-                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, first_byte);
-                bytes = NULL;
-                break;
+            if (ack_value_index >= nb_ack_values) {
+                if ((bytes = picoquic_decode_ack_values(bytes, bytes_max, ack_values, &nb_ack_values, &ack_value_index, &nb_ack_values_left)) == NULL) {
+                    DBG_PRINTF("    Malformed ACK GAP, %d blocks remain.\n", (int)num_block);
+                    picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, first_byte);
+                    break;
+                }
             }
 
+            block_to_block = ack_values[ack_value_index++];
             block_to_block += 1; /* add 1, since zero is ruled out by varint, see spec. */
             block_to_block += range;
 
@@ -2648,16 +2710,45 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
     return bytes;
 }
 
+/* Encode the ACK blocks that follow the first range in the packet context cache.
+ * The cache records the end of each block, so that the blocks can be copied
+ * and truncated at a block boundary to fit the available space.
+ */
+static void picoquic_update_ack_blocks_cache(picoquic_packet_context_t* pkt_ctx)
+{
+    picoquic_sack_item_t* next_sack = pkt_ctx->first_sack_item.next_sack;
+    uint64_t lowest_acknowledged = pkt_ctx->first_sack_item.start_of_sack_range;
+    uint8_t* bytes = pkt_ctx->ack_blocks_cache;
+    uint8_t* bytes_max = bytes + sizeof(pkt_ctx->ack_blocks_cache);
+    uint8_t num_block = 0;
+
+    while (num_block < PICOQUIC_MAX_ACK_BLOCKS && next_sack != NULL) {
+        uint64_t ack_gap = lowest_acknowledged - next_sack->end_of_sack_range - 2; /* per spec */
+        uint64_t ack_range = next_sack->end_of_sack_range - next_sack->start_of_sack_range;
+
+        if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, ack_gap)) == NULL ||
+            (bytes = picoquic_frames_varint_encode(bytes, bytes_max, ack_range)) == NULL) {
+            /* Cannot happen, since the cache is sized for the max number of blocks */
+            break;
+        }
+        pkt_ctx->ack_blocks_cache_end[num_block] = (uint16_t)(bytes - pkt_ctx->ack_blocks_cache);
+        lowest_acknowledged = next_sack->start_of_sack_range;
+        next_sack = next_sack->next_sack;
+        num_block++;
+    }
+
+    pkt_ctx->ack_blocks_cache_nb = num_block;
+    pkt_ctx->ack_blocks_cache_first_start = pkt_ctx->first_sack_item.start_of_sack_range;
+    pkt_ctx->ack_blocks_cache_valid = 1;
+}
+
 uint8_t * picoquic_format_ack_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t * bytes_max, 
     int * more_data, uint64_t current_time, picoquic_packet_context_enum pc)
 {
     uint64_t num_block = 0;
     picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[pc];
-    picoquic_sack_item_t* next_sack = pkt_ctx->first_sack_item.next_sack;
     uint64_t ack_delay = 0;
     uint64_t ack_range = 0;
-    uint64_t ack_gap = 0;
-    uint64_t lowest_acknowledged = 0;
     int is_ecn = cnx->pkt_ctx[pc].sending_ecn_ack;
     uint8_t* after_stamp = bytes;
     int has_time_stamp = (pc == picoquic_packet_context_application && cnx->is_time_stamp_sent);
@@ -2692,26 +2783,23 @@ uint8_t * picoquic_format_ack_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t
             *more_data = 1;
         }
         else {
-            /* Set the lowest acknowledged */
-            lowest_acknowledged = pkt_ctx->first_sack_item.start_of_sack_range;
-            /* Encode the ack blocks that fit in the allocated space */
-            while (num_block < 32 && next_sack != NULL) {
-                uint8_t* bytes_start_range = bytes;
-
-                ack_gap = lowest_acknowledged - next_sack->end_of_sack_range - 2; /* per spec */
-                ack_range = next_sack->end_of_sack_range - next_sack->start_of_sack_range;
-
-                if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, ack_gap)) == NULL ||
-                    (bytes = picoquic_frames_varint_encode(bytes, bytes_max, ack_range)) == NULL) {
-                    bytes = bytes_start_range;
-                    *more_data = 1;
-                    break;
-                }
-                else {
-                    lowest_acknowledged = next_sack->start_of_sack_range;
-                    next_sack = next_sack->next_sack;
-                    num_block++;
-                }
+            size_t blocks_length = 0;
+
+            /* Refresh the encoded ack blocks if the sack list changed */
+            if (!pkt_ctx->ack_blocks_cache_valid ||
+                pkt_ctx->ack_blocks_cache_first_start != pkt_ctx->first_sack_item.start_of_sack_range) {
+                picoquic_update_ack_blocks_cache(pkt_ctx);
+            }
+            /* Copy the ack blocks that fit in the allocated space */
+            num_block = pkt_ctx->ack_blocks_cache_nb;
+            while (num_block > 0 && pkt_ctx->ack_blocks_cache_end[num_block - 1] > (size_t)(bytes_max - bytes)) {
+                num_block--;
+                *more_data = 1;
+            }
+            if (num_block > 0) {
+                blocks_length = pkt_ctx->ack_blocks_cache_end[num_block - 1];
+                memcpy(bytes, pkt_ctx->ack_blocks_cache, blocks_length);
+                bytes += blocks_length;
             }
             /* When numbers are lower than 64, varint encoding fits on one byte */
             *num_block_byte = (uint8_t)num_block;
@@ -2963,6 +3051,9 @@ const uint8_t* picoquic_decode_max_stream_data_frame(picoquic_cnx_t* cnx, const
     if (stream != NULL && maxdata > stream->maxdata_remote) {
         /* TODO: call back if the stream was blocked? */
         stream->maxdata_remote = maxdata;
+        if (stream->is_blocked_stream) {
+            picoquic_update_output_stream(cnx, stream);
+        }
     }
 
 
@@ -2977,18 +3068,18 @@ uint8_t * picoquic_format_required_max_stream_data_frames(picoquic_cnx_t* cnx,
 
     while (stream != NULL) {
         if (!stream->fin_received) {
-            uint64_t new_window = picoquic_cc_increased_window(cnx, stream->maxdata_local);
+            uint64_t new_max_data = stream->consumed_offset + stream->receive_window.window;
 
-            if (!stream->reset_received && 2 * stream->consumed_offset > stream->maxdata_local) {
+            if (!stream->reset_received && stream->consumed_offset + stream->receive_window.window / 2 > stream->maxdata_local) {
                 bytes0 = bytes;
 
-                if ((bytes = picoquic_format_max_stream_data_frame(stream, bytes, bytes_max, more_data, is_pure_ack, stream->maxdata_local + new_window)) == bytes0) {
+                if ((bytes = picoquic_format_max_stream_data_frame(stream, bytes, bytes_max, more_data, is_pure_ack, new_max_data)) == bytes0) {
                     /* not enough space for this frame. */
                     break;
                 }
             }
         }
-        stream = picoquic_next_stream(stream);
+        stream = picoquic_next_stream(cnx, stream);
     }
 
     if (stream == NULL) {
@@ -3194,7 +3285,8 @@ uint8_t * picoquic_format_path_response_frame(uint8_t* bytes, uint8_t* bytes_max
 }
 
 
-const uint8_t* picoquic_decode_path_response_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max)
+const uint8_t* picoquic_decode_path_response_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t current_time)
 {
     uint64_t response;
 
@@ -3216,7 +3308,19 @@ const uint8_t* picoquic_decode_path_response_frame(picoquic_cnx_t* cnx, const ui
             }
 
             if (found_challenge) {
-                cnx->path[i]->challenge_verified = 1;
+                picoquic_path_t* path_x = cnx->path[i];
+
+                if (cnx->is_multipath_enabled && !path_x->challenge_verified && !path_x->is_nat_challenge && i > 0) {
+                    /* The path will carry data in parallel with the default path. Start
+                     * its congestion control, and use the challenge for a first RTT sample. */
+                    if (path_x->congestion_alg_state == NULL && cnx->congestion_alg != NULL) {
+                        cnx->congestion_alg->alg_init(path_x, current_time);
+                    }
+                    if (path_x->smoothed_rtt == PICOQUIC_INITIAL_RTT && path_x->rtt_variant == 0) {
+                        picoquic_update_path_rtt(cnx, path_x, path_x->challenge_time, current_time, 0);
+                    }
+                }
+                path_x->challenge_verified = 1;
                 break;
             }
         }
@@ -3391,37 +3495,319 @@ uint8_t * picoquic_format_datagram_frame(uint8_t* bytes, uint8_t* bytes_max, int
     return bytes;
 }
 
-int picoquic_queue_datagram_frame(picoquic_cnx_t * cnx, size_t length, const uint8_t * src)
+/* Queue of datagrams.
+ * Datagrams are kept in order of priority class, and in order of arrival
+ * within a class. The HANDSHAKE_DONE frame is also queued in that list,
+ * but it is not an application datagram: it has no deadline, it is not
+ * counted against the queue bound and it is never evicted.
+ */
+static void picoquic_delete_datagram(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t* frame)
 {
-    int ret;
-    size_t consumed = 0;
-    uint8_t frame_buffer[PICOQUIC_MAX_PACKET_SIZE];
-    int more_data = 0;
-    int is_pure_ack = 1;
-    uint8_t * bytes_next = picoquic_format_datagram_frame(frame_buffer, frame_buffer + sizeof(frame_buffer), &more_data, &is_pure_ack, length, src);
+    if (frame->is_datagram) {
+        cnx->datagram_queue_bytes -= frame->length;
+    }
+    picoquic_delete_misc_or_dg(&cnx->first_datagram, &cnx->last_datagram, frame);
+}
 
-    if ((consumed = bytes_next - frame_buffer) > 0) {
-        ret = picoquic_queue_misc_or_dg_frame(cnx, &cnx->first_datagram, &cnx->last_datagram, 
-            frame_buffer, consumed, 0);
+/* Expired datagrams are dropped when preparing packets, and before queuing
+ * new datagrams so they do not count against the queue bound. The queue is
+ * only scanned when the earliest deadline has passed. */
+static void picoquic_purge_expired_datagrams(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    if (current_time >= cnx->datagram_next_expire_time) {
+        picoquic_misc_frame_header_t* next = cnx->first_datagram;
+
+        cnx->datagram_next_expire_time = UINT64_MAX;
+        while (next != NULL) {
+            picoquic_misc_frame_header_t* frame = next;
+
+            next = next->next_misc_frame;
+            if (frame->expire_time != 0) {
+                if (frame->expire_time <= current_time) {
+                    cnx->nb_datagrams_expired++;
+                    picoquic_delete_datagram(cnx, frame);
+                }
+                else if (frame->expire_time < cnx->datagram_next_expire_time) {
+                    cnx->datagram_next_expire_time = frame->expire_time;
+                }
+            }
+        }
+    }
+}
+
+/* Make room for a new datagram by evicting the oldest datagrams of the
+ * least urgent class, as long as that class is not more urgent than the
+ * new datagram. Nothing is evicted if that would not free enough space.
+ */
+static int picoquic_datagram_queue_make_room(picoquic_cnx_t* cnx, size_t length, uint8_t priority)
+{
+    int ret = 0;
+
+    picoquic_purge_expired_datagrams(cnx, picoquic_get_quic_time(cnx->quic));
+
+    if (cnx->datagram_queue_max_bytes > 0 && cnx->datagram_queue_bytes + length > cnx->datagram_queue_max_bytes) {
+        size_t evictable = 0;
+        picoquic_misc_frame_header_t* frame = cnx->first_datagram;
+
+        while (frame != NULL) {
+            if (frame->is_datagram && frame->priority >= priority) {
+                evictable += frame->length;
+            }
+            frame = frame->next_misc_frame;
+        }
+
+        if (length > cnx->datagram_queue_max_bytes ||
+            cnx->datagram_queue_bytes - evictable + length > cnx->datagram_queue_max_bytes) {
+            ret = PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL;
+        }
+        else {
+            while (cnx->datagram_queue_bytes + length > cnx->datagram_queue_max_bytes) {
+                picoquic_misc_frame_header_t* victim = NULL;
+
+                /* Walk back from the tail to the oldest datagram of the least urgent class */
+                frame = cnx->last_datagram;
+                while (frame != NULL) {
+                    if (frame->is_datagram) {
+                        if (victim != NULL && frame->priority != victim->priority) {
+                            break;
+                        }
+                        victim = frame;
+                    }
+                    frame = frame->previous_misc_frame;
+                }
+                cnx->nb_datagrams_dropped_queue_full++;
+                picoquic_delete_datagram(cnx, victim);
+            }
+        }
+    }
+
+    return ret;
+}
+
+static void picoquic_insert_datagram(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t* frame)
+{
+    picoquic_misc_frame_header_t* previous = cnx->last_datagram;
+
+    while (previous != NULL && previous->priority > frame->priority) {
+        previous = previous->previous_misc_frame;
+    }
+
+    frame->previous_misc_frame = previous;
+    if (previous == NULL) {
+        frame->next_misc_frame = cnx->first_datagram;
+        cnx->first_datagram = frame;
     }
     else {
+        frame->next_misc_frame = previous->next_misc_frame;
+        previous->next_misc_frame = frame;
+    }
+    if (frame->next_misc_frame == NULL) {
+        cnx->last_datagram = frame;
+    }
+    else {
+        frame->next_misc_frame->previous_misc_frame = frame;
+    }
+
+    cnx->datagram_queue_bytes += frame->length;
+    if (frame->expire_time != 0 && frame->expire_time < cnx->datagram_next_expire_time) {
+        cnx->datagram_next_expire_time = frame->expire_time;
+    }
+}
+
+/* Format the datagram frame directly in the queued node, and insert it. */
+static int picoquic_queue_datagram_node(picoquic_cnx_t* cnx, size_t length, const uint8_t* src,
+    uint8_t priority, uint64_t expire_time)
+{
+    int ret = 0;
+    size_t frame_length = 1 + picoquic_encode_varint_length(length) + length;
+    picoquic_misc_frame_header_t* frame = NULL;
+
+    if (priority > PICOQUIC_DATAGRAM_PRIORITY_MAX) {
+        ret = PICOQUIC_ERROR_INVALID_PRIORITY;
+    }
+    else if (frame_length > cnx->quic->max_packet_size) {
         ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
     }
+    else if ((ret = picoquic_datagram_queue_make_room(cnx, frame_length, priority)) != 0) {
+        cnx->nb_datagrams_dropped_queue_full++;
+    }
+    else if ((frame = (picoquic_misc_frame_header_t*)malloc(sizeof(picoquic_misc_frame_header_t) + frame_length)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        uint8_t* bytes = ((uint8_t*)frame) + sizeof(picoquic_misc_frame_header_t);
+        uint8_t* bytes_max = bytes + frame_length;
+
+        memset(frame, 0, sizeof(picoquic_misc_frame_header_t));
+        frame->length = frame_length;
+        frame->is_datagram = 1;
+        frame->priority = priority;
+        frame->expire_time = expire_time;
+        bytes = picoquic_frames_uint8_encode(bytes, bytes_max, picoquic_frame_type_datagram_l);
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, length);
+        if (length > 0) {
+            memcpy(bytes, src, length);
+        }
+        picoquic_insert_datagram(cnx, frame);
+    }
+
+    return ret;
+}
+
+int picoquic_queue_datagram_frame_ex(picoquic_cnx_t* cnx, size_t length, const uint8_t* bytes,
+    uint8_t priority, uint64_t expire_time)
+{
+    int ret = picoquic_queue_datagram_node(cnx, length, bytes, priority, expire_time);
+
+    if (ret == 0) {
+        picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+    }
 
     return ret;
 }
 
+int picoquic_queue_datagram_frame(picoquic_cnx_t * cnx, size_t length, const uint8_t * src)
+{
+    return picoquic_queue_datagram_frame_ex(cnx, length, src, PICOQUIC_DEFAULT_DATAGRAM_PRIORITY, 0);
+}
+
+int picoquic_queue_datagram_batch(picoquic_cnx_t* cnx, const picoquic_datagram_desc_t* datagrams,
+    size_t nb_datagrams, size_t* nb_queued)
+{
+    int ret = 0;
+    size_t i = 0;
+
+    while (i < nb_datagrams && (ret = picoquic_queue_datagram_node(cnx, datagrams[i].length, datagrams[i].bytes,
+        datagrams[i].priority, datagrams[i].expire_time)) == 0) {
+        i++;
+    }
+
+    if (nb_queued != NULL) {
+        *nb_queued = i;
+    }
+    if (i > 0) {
+        /* The wake time is only recomputed once for the whole batch */
+        picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+    }
+
+    return ret;
+}
+
+void picoquic_set_datagram_queue_max(picoquic_cnx_t* cnx, size_t max_bytes)
+{
+    cnx->datagram_queue_max_bytes = max_bytes;
+}
+
+void picoquic_get_datagram_queue_stats(picoquic_cnx_t* cnx, picoquic_datagram_queue_stats_t* stats)
+{
+    stats->queued_bytes = cnx->datagram_queue_bytes;
+    stats->nb_expired = cnx->nb_datagrams_expired;
+    stats->nb_dropped_queue_full = cnx->nb_datagrams_dropped_queue_full;
+    stats->nb_dropped_too_large = cnx->nb_datagrams_dropped_too_large;
+}
+
 uint8_t * picoquic_format_first_datagram_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
-    uint8_t *bytes_max, int * more_data, int * is_pure_ack)
+    uint8_t *bytes_max, int * more_data, int * is_pure_ack, uint64_t current_time)
 {
-    if (bytes + cnx->first_datagram->length > bytes_max) {
+    picoquic_purge_expired_datagrams(cnx, current_time);
+
+    if (cnx->first_datagram == NULL) {
+        /* All queued datagrams have expired */
+    }
+    else if (bytes + cnx->first_datagram->length > bytes_max) {
         /* TODO: don't do that if this is a coalesced packet... */
         /* This datagram is not compatible with the path. Just drop. */
-        picoquic_delete_misc_or_dg(&cnx->first_datagram, &cnx->last_datagram, cnx->first_datagram);
+        if (cnx->first_datagram->is_datagram) {
+            cnx->nb_datagrams_dropped_too_large++;
+        }
+        picoquic_delete_datagram(cnx, cnx->first_datagram);
     }
     else {
-        bytes = picoquic_format_first_misc_or_dg_frame(bytes, bytes_max, more_data, is_pure_ack, 
+        size_t queued_length = (cnx->first_datagram->is_datagram) ? cnx->first_datagram->length : 0;
+        uint8_t* bytes_next = picoquic_format_first_misc_or_dg_frame(bytes, bytes_max, more_data, is_pure_ack,
             &cnx->first_datagram, &cnx->last_datagram);
+
+        if (bytes_next != bytes) {
+            cnx->datagram_queue_bytes -= queued_length;
+        }
+        bytes = bytes_next;
+    }
+
+    return bytes;
+}
+
+/* Just in time datagrams.
+ * When the connection is marked datagram ready, the application is asked
+ * to provide a datagram each time a packet has room for one.
+ */
+typedef struct st_picoquic_datagram_buffer_argument_t {
+    uint8_t* bytes; /* Points to the beginning of the datagram frame */
+    uint8_t* bytes_max; /* End of the space available in the packet */
+    size_t allowed_space; /* Largest datagram that the application can write */
+    uint8_t* after_data; /* Points after the datagram frame once a buffer is provided */
+    int is_still_ready; /* Whether the application has more datagrams to send */
+} picoquic_datagram_buffer_argument_t;
+
+uint8_t* picoquic_provide_datagram_buffer(void* context, size_t length, int is_still_ready)
+{
+    picoquic_datagram_buffer_argument_t* data_ctx = (picoquic_datagram_buffer_argument_t*)context;
+    uint8_t* buffer = NULL;
+
+    data_ctx->is_still_ready = is_still_ready;
+
+    if (length <= data_ctx->allowed_space && data_ctx->after_data == NULL) {
+        uint8_t* bytes;
+
+        if ((bytes = picoquic_frames_uint8_encode(data_ctx->bytes, data_ctx->bytes_max, picoquic_frame_type_datagram_l)) != NULL &&
+            (bytes = picoquic_frames_varint_encode(bytes, data_ctx->bytes_max, length)) != NULL) {
+            buffer = bytes;
+            data_ctx->after_data = bytes + length;
+        }
+    }
+
+    return buffer;
+}
+
+uint8_t* picoquic_format_ready_datagram_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
+    int* more_data, int* is_pure_ack, int* ret)
+{
+    size_t byte_space = bytes_max - bytes;
+    size_t frame_max = byte_space;
+
+    if (cnx->remote_parameters.max_datagram_frame_size == 0) {
+        /* The peer did not negotiate the datagram extension */
+        cnx->is_datagram_ready = 0;
+        frame_max = 0;
+    }
+    else if (frame_max > cnx->remote_parameters.max_datagram_frame_size) {
+        frame_max = cnx->remote_parameters.max_datagram_frame_size;
+    }
+
+    if (frame_max > 1 + picoquic_encode_varint_length(frame_max)) {
+        picoquic_datagram_buffer_argument_t datagram_data_context;
+
+        datagram_data_context.bytes = bytes;
+        datagram_data_context.bytes_max = bytes_max;
+        datagram_data_context.allowed_space = frame_max - 1 - picoquic_encode_varint_length(frame_max);
+        datagram_data_context.after_data = NULL;
+        datagram_data_context.is_still_ready = 0;
+
+        if ((cnx->callback_fn)(cnx, 0, (uint8_t*)&datagram_data_context, datagram_data_context.allowed_space,
+            picoquic_callback_prepare_datagram, cnx->callback_ctx, NULL) != 0) {
+            picoquic_log_app_message(cnx, "Prepare datagram returns error 0x%x", PICOQUIC_TRANSPORT_INTERNAL_ERROR);
+            *ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
+        }
+        else {
+            cnx->is_datagram_ready = datagram_data_context.is_still_ready;
+
+            if (datagram_data_context.after_data != NULL) {
+                bytes = datagram_data_context.after_data;
+                *is_pure_ack = 0;
+            }
+            if (cnx->is_datagram_ready) {
+                *more_data = 1;
+            }
+        }
     }
 
     return bytes;
@@ -3747,7 +4133,7 @@ int picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t * path_x, const
                 bytes = picoquic_decode_path_challenge_frame(cnx, bytes, bytes_max, path_x, addr_from, addr_to);
                 break;
             case picoquic_frame_type_path_response:
-                bytes = picoquic_decode_path_response_frame(cnx, bytes, bytes_max);
+                bytes = picoquic_decode_path_response_frame(cnx, bytes, bytes_max, current_time);
                 break;
             case picoquic_frame_type_crypto_hs:
                 bytes = picoquic_decode_crypto_hs_frame(cnx, bytes, bytes_max, epoch);
@@ -3879,12 +4265,12 @@ static const uint8_t* picoquic_skip_ack_frame_maybe_ecn(const uint8_t* bytes, co
             (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_blocks)) != NULL &&
             (bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL)
         {
-            while (nb_blocks-- != 0) {
-                if ((bytes = picoquic_frames_varint_skip(bytes, bytes_max)) == NULL ||
-                    (bytes = picoquic_frames_varint_skip(bytes, bytes_max)) == NULL)
-                {
-                    break;
-                }
+            /* Each block is encoded as a gap and a range, at least 2 bytes. */
+            if (nb_blocks > (uint64_t)(bytes_max - bytes)) {
+                bytes = NULL;
+            }
+            else {
+                bytes = picoquic_frames_varint_skip_n(bytes, bytes_max, 2 * (size_t)nb_blocks);
             }
         }
     }
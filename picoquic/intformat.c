@@ -20,9 +20,22 @@
 */
 
 #include <stdint.h>
+#include <string.h>
 #ifndef WIN32
 #include <sys/types.h>
 #endif
+#include "picoquic_internal.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define PICOQUIC_VARINT_USE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PICOQUIC_VARINT_USE_NEON
+#endif
 
 void picoformat_16(uint8_t* bytes, uint16_t n16)
 {
@@ -137,7 +150,10 @@ size_t picoquic_varint_decode(const uint8_t* bytes, size_t max_bytes, uint64_t*
 {
     size_t length = ((size_t)1) << ((bytes[0] & 0xC0) >> 6);
 
-    if (length > max_bytes) {
+    if (max_bytes >= 8) {
+        /* Enough bytes to decode without checking the length */
+        *n64 = VARINT_DECODE_8(bytes);
+    } else if (length > max_bytes) {
         length = 0;
         *n64 = 0;
     } else {
@@ -158,3 +174,122 @@ size_t picoquic_varint_skip(const uint8_t* bytes)
 {
     return picoquic_decode_varint_length(bytes[0]);
 }
+
+/*
+ * Decoding of runs of varints, such as the gaps and ranges in ACK frames.
+ * In practice, most of the values in these runs are small, and encoded
+ * on a single byte. We examine blocks of 16 bytes, using vector instructions
+ * when available, count how many single byte varints start the block,
+ * copy them at once, and then decode the next varint with the branch
+ * free decoder.
+ */
+
+#define PICOQUIC_VARINT_BLOCK_SIZE 16
+
+static size_t picoquic_varint_count_single_bytes(const uint8_t* bytes)
+{
+#if defined(PICOQUIC_VARINT_USE_SSE2)
+    __m128i v = _mm_loadu_si128((const __m128i*)bytes);
+    __m128i prefix = _mm_and_si128(v, _mm_set1_epi8((char)0xC0));
+    unsigned int multi = ((unsigned int)~_mm_movemask_epi8(_mm_cmpeq_epi8(prefix, _mm_setzero_si128()))) & 0xFFFF;
+
+    if (multi == 0) {
+        return PICOQUIC_VARINT_BLOCK_SIZE;
+    }
+    else {
+#ifdef _MSC_VER
+        unsigned long first_multi;
+        _BitScanForward(&first_multi, multi);
+        return (size_t)first_multi;
+#else
+        return (size_t)__builtin_ctz(multi);
+#endif
+    }
+#else
+    size_t nb_single = 0;
+#if defined(PICOQUIC_VARINT_USE_NEON)
+    if (vmaxvq_u8(vandq_u8(vld1q_u8(bytes), vdupq_n_u8(0xC0))) == 0) {
+        return PICOQUIC_VARINT_BLOCK_SIZE;
+    }
+#endif
+    while (nb_single < PICOQUIC_VARINT_BLOCK_SIZE && (bytes[nb_single] & 0xC0) == 0) {
+        nb_single++;
+    }
+    return nb_single;
+#endif
+}
+
+size_t picoquic_varint_decode_n(const uint8_t* bytes, size_t max_bytes, uint64_t* n64, size_t nb_varints)
+{
+    size_t byte_index = 0;
+    size_t i = 0;
+
+    while (i < nb_varints) {
+        if (max_bytes - byte_index >= PICOQUIC_VARINT_BLOCK_SIZE) {
+            size_t nb_single = picoquic_varint_count_single_bytes(bytes + byte_index);
+
+            if (nb_single > nb_varints - i) {
+                nb_single = nb_varints - i;
+            }
+            for (size_t j = 0; j < nb_single; j++) {
+                n64[i + j] = bytes[byte_index + j];
+            }
+            i += nb_single;
+            byte_index += nb_single;
+
+            if (i < nb_varints && nb_single < PICOQUIC_VARINT_BLOCK_SIZE && max_bytes - byte_index >= 8) {
+                /* Decode the multibyte varint that ended the run. If fewer than 8
+                 * bytes remain, it will be decoded with the length checks. */
+                n64[i++] = VARINT_DECODE_8(bytes + byte_index);
+                byte_index += VARINT_LEN(bytes + byte_index);
+            }
+        }
+        else {
+            size_t l_v;
+
+            if (byte_index >= max_bytes ||
+                (l_v = picoquic_varint_decode(bytes + byte_index, max_bytes - byte_index, &n64[i])) == 0) {
+                byte_index = 0;
+                break;
+            }
+            byte_index += l_v;
+            i++;
+        }
+    }
+
+    return byte_index;
+}
+
+size_t picoquic_varint_skip_n(const uint8_t* bytes, size_t max_bytes, size_t nb_varints)
+{
+    size_t byte_index = 0;
+    size_t i = 0;
+
+    while (i < nb_varints) {
+        if (max_bytes - byte_index >= PICOQUIC_VARINT_BLOCK_SIZE) {
+            size_t nb_single = picoquic_varint_count_single_bytes(bytes + byte_index);
+
+            if (nb_single > nb_varints - i) {
+                nb_single = nb_varints - i;
+            }
+            i += nb_single;
+            byte_index += nb_single;
+
+            if (i < nb_varints && nb_single < PICOQUIC_VARINT_BLOCK_SIZE && max_bytes - byte_index >= 8) {
+                byte_index += VARINT_LEN(bytes + byte_index);
+                i++;
+            }
+        }
+        else if (byte_index < max_bytes &&
+            byte_index + VARINT_LEN(bytes + byte_index) <= max_bytes) {
+            byte_index += VARINT_LEN(bytes + byte_index);
+            i++;
+        }
+        else {
+            byte_index = 0;
+            break;
+        }
+    }
+
+    return byte_index;
+}
@@ -446,6 +446,9 @@ char const* picoquic_log_tp_name(uint64_t tp_number)
     case picoquic_tp_grease_quic_bit:
         tp_name = "grease_quic_bit";
         break;
+    case picoquic_tp_enable_multipath:
+        tp_name = "enable_multipath";
+        break;
     default:
         break;
     }
@@ -394,22 +394,23 @@ void picoquic_log_pn_dec_trial(picoquic_cnx_t* cnx)
 /*
  * Remove header protection 
  */
-int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
-    uint8_t* bytes, picoquic_packet_header* ph)
+static int picoquic_remove_header_protection_inner(uint8_t* bytes, picoquic_packet_header* ph,
+    picoquic_crypto_context_t* crypto_context, int is_loss_bit_enabled_incoming, uint64_t highest_pn)
 {
     int ret = 0;
     size_t length = ph->offset + ph->payload_length; /* this may change after decrypting the PN */
     void * pn_enc = NULL;
+    void * pn_ecb = NULL;
 
-    pn_enc = cnx->crypto_context[ph->epoch].pn_dec;
+    pn_enc = crypto_context->pn_dec;
+    pn_ecb = crypto_context->pn_dec_ecb;
 
     if (pn_enc != NULL)
     {
         /* The header length is not yet known, will only be known after the sequence number is decrypted */
-        size_t mask_length = 5;
         size_t sample_offset = ph->pn_offset + 4;
         size_t sample_size = picoquic_pn_iv_size(pn_enc);
-        uint8_t mask_bytes[5] = { 0, 0, 0, 0, 0 };
+        uint8_t mask_bytes[PICOQUIC_HP_SAMPLE_SIZE];
 
         if (sample_offset + sample_size > length)
         {
@@ -425,11 +426,12 @@ int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
         else
         {   /* Decode */
             uint8_t first_byte = bytes[0];
-            uint8_t first_mask = ((first_byte & 0x80) == 0x80) ? 0x0F : (cnx->is_loss_bit_enabled_incoming)?0x07:0x1F;
+            uint8_t first_mask = ((first_byte & 0x80) == 0x80) ? 0x0F : (is_loss_bit_enabled_incoming)?0x07:0x1F;
             uint8_t pn_l;
             uint32_t pn_val = 0;
+            const uint8_t* sample = bytes + sample_offset;
 
-            picoquic_pn_encrypt(pn_enc, bytes + sample_offset, mask_bytes, mask_bytes, mask_length);
+            picoquic_pn_encrypt_batch(pn_enc, pn_ecb, &sample, mask_bytes, 1);
             /* Decode the first byte */
             first_byte ^= (mask_bytes[0] & first_mask);
             pn_l = (first_byte & 3) + 1;
@@ -452,11 +454,10 @@ int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
             }
 
             /* Build a packet number to 64 bits */
-            ph->pn64 = picoquic_get_packet_number64(
-                cnx->pkt_ctx[ph->pc].first_sack_item.end_of_sack_range, ph->pnmask, ph->pn);
+            ph->pn64 = picoquic_get_packet_number64(highest_pn, ph->pnmask, ph->pn);
 
             /* Check the reserved bits */
-            ph->has_reserved_bit_set = ((first_byte & 0x80) == 0 && !cnx->is_loss_bit_enabled_incoming &&
+            ph->has_reserved_bit_set = ((first_byte & 0x80) == 0 && !is_loss_bit_enabled_incoming &&
                 (first_byte & 0x18) != 0);
         }
     }
@@ -476,6 +477,45 @@ int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
     return ret;
 }
 
+int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
+    uint8_t* bytes, picoquic_packet_header* ph)
+{
+    return picoquic_remove_header_protection_inner(bytes, ph, &cnx->crypto_context[ph->epoch],
+        cnx->is_loss_bit_enabled_incoming, cnx->pkt_ctx[ph->pc].first_sack_item.end_of_sack_range);
+}
+
+/*
+ * Check an incoming Initial packet for which no connection context exists yet.
+ * The packet is decrypted in place with the initial keys derived from the
+ * destination CID, which are cached in the QUIC context. Packets that do
+ * not decrypt are rejected before any connection context is created. If
+ * a context is created, it inherits the cached keys.
+ */
+static int picoquic_validate_new_initial(picoquic_quic_t* quic, uint8_t* bytes, picoquic_packet_header* ph)
+{
+    picoquic_crypto_context_t* crypto_context = NULL;
+    int ret = picoquic_get_initial_validation_context(quic, ph->version_index, &ph->dest_cnx_id, &crypto_context);
+
+    if (ret == 0) {
+        /* A new connection has no packet received yet, so the highest PN is 0 */
+        ret = picoquic_remove_header_protection_inner(bytes, ph, crypto_context, 0, 0);
+    }
+
+    if (ret == 0) {
+        size_t decoded = picoquic_aead_decrypt_generic(bytes + ph->offset,
+            bytes + ph->offset, ph->payload_length, ph->pn64, bytes, ph->offset, crypto_context->aead_decrypt);
+
+        if (decoded > ph->payload_length) {
+            ret = PICOQUIC_ERROR_AEAD_CHECK;
+        }
+        else {
+            ph->payload_length = (uint16_t)decoded;
+        }
+    }
+
+    return ret;
+}
+
 /*
  * Remove packet protection
  */
@@ -598,6 +638,7 @@ int picoquic_parse_header_and_decrypt(
 {
     /* Parse the clear text header. Ret == 0 means an incorrect packet that could not be parsed */
     int already_received = 0;
+    int is_decrypted = 0;
     size_t decoded_length = 0;
     int ret = picoquic_parse_packet_header(quic, bytes, length, addr_from, ph, pcnx, 1);
 
@@ -621,8 +662,9 @@ int picoquic_parse_header_and_decrypt(
                         /* Initial CID too short -- ignore the packet */
                         ret = PICOQUIC_ERROR_INITIAL_CID_TOO_SHORT;
                     }
-                    else {
+                    else if ((ret = picoquic_validate_new_initial(quic, (uint8_t*)bytes, ph)) == 0) {
                         /* if listening is OK, listen */
+                        is_decrypted = 1;
                         *pcnx = picoquic_create_cnx(quic, ph->dest_cnx_id, ph->srce_cnx_id, addr_from, current_time, ph->vn, NULL, NULL, 0);
                         /* If an incoming connection was created, register the ICID */
                         *new_ctx_created = (*pcnx == NULL) ? 0 : 1;
@@ -638,7 +680,10 @@ int picoquic_parse_header_and_decrypt(
             }
 
             if (ret == 0) {
-                if (*pcnx != NULL) {
+                if (is_decrypted) {
+                    /* Already decrypted by picoquic_validate_new_initial, nothing to do */
+                }
+                else if (*pcnx != NULL) {
                     /* Remove header protection at this point -- values of bytes will change */
                     ret = picoquic_remove_header_protection(*pcnx, (uint8_t *)bytes, ph);
 
@@ -956,7 +1001,7 @@ void picoquic_queue_stateless_retry(picoquic_cnx_t* cnx,
         if (integrity_aead == NULL) {
             bytes[byte_index++] = cnx->initial_cnxid.id_len;
             byte_index += picoquic_format_connection_id(bytes + byte_index,
-                PICOQUIC_MAX_PACKET_SIZE - byte_index - checksum_length, cnx->initial_cnxid);
+                cnx->quic->max_packet_size - byte_index - checksum_length, cnx->initial_cnxid);
         }
 
         /* Add the token */
@@ -964,7 +1009,7 @@ void picoquic_queue_stateless_retry(picoquic_cnx_t* cnx,
         byte_index += token_length;
 
         /* Encode the retry integrity protection if required. */
-        byte_index = picoquic_encode_retry_protection(integrity_aead, bytes, PICOQUIC_MAX_PACKET_SIZE, byte_index, &cnx->initial_cnxid);
+        byte_index = picoquic_encode_retry_protection(integrity_aead, bytes, cnx->quic->max_packet_size, byte_index, &cnx->initial_cnxid);
 
         sp->length = byte_index;
 
@@ -1137,7 +1182,17 @@ int picoquic_incoming_client_initial(
             }
 
             /* processing of client initial packet */
-            if (ret == 0) {
+            if (ret == 0 && (*pcnx)->cnx_state == picoquic_state_server_init &&
+                (*pcnx)->quic->max_handshakes_per_ms > 0) {
+                /* Defer the TLS processing until the connection is scheduled for sending,
+                 * see picoquic_prepare_packet_ex. Nothing was sent yet, so there is nothing to repeat. */
+                if (!(*pcnx)->is_handshake_deferred) {
+                    (*pcnx)->is_handshake_deferred = 1;
+                    (*pcnx)->quic->nb_handshakes_deferred++;
+                }
+                (*pcnx)->initial_repeat_needed = 0;
+            }
+            else if (ret == 0) {
                 int data_consumed = 0;
                 /* initialization of context & creation of data */
                 ret = picoquic_tls_stream_process(*pcnx, &data_consumed);
@@ -1864,7 +1919,7 @@ int  picoquic_incoming_not_decrypted(
                 picoquic_update_path_rtt(cnx, cnx->path[0], cnx->start_time, current_time, 0);
             }
 
-            if (length <= PICOQUIC_MAX_PACKET_SIZE &&
+            if (length <= cnx->quic->max_packet_size &&
                 ((ph->ptype == picoquic_packet_handshake && cnx->client_mode) || ph->ptype == picoquic_packet_1rtt_protected)) {
                 /* stash a copy of the incoming message for processing once the keys are available */
                 picoquic_stateless_packet_t* packet = picoquic_create_stateless_packet(cnx->quic);
@@ -0,0 +1,106 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2021, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Multipath schedulers.
+ *
+ * When multipath is negotiated, the sender calls the scheduler of the
+ * connection before preparing each packet, and sends the packet on the
+ * selected path. The schedulers only consider the paths that are validated
+ * and on which congestion control and pacing allow sending data. If no
+ * such path is available, the sender falls back on the default path, which
+ * is used for acknowledgements, retransmissions and control frames.
+ *
+ * - the min RTT scheduler fills the path with the lowest smoothed RTT first,
+ *   and only uses the other paths when the congestion window of the faster
+ *   paths is full.
+ * - the round robin scheduler rotates between the available paths.
+ * - the redundant scheduler rotates like round robin, but the sender repeats
+ *   the new stream data on the next path. The receiver ignores the second
+ *   copy, so the data arrives at the speed of the fastest path.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+int picoquic_is_path_available_for_data(picoquic_cnx_t* cnx, int path_id, uint64_t current_time, uint64_t* next_wake_time)
+{
+    int is_available = 0;
+
+    if (path_id >= 0 && path_id < cnx->nb_paths) {
+        picoquic_path_t* path_x = cnx->path[path_id];
+
+        is_available = path_x->challenge_verified && !path_x->challenge_failed && !path_x->path_is_demoted &&
+            path_x->bytes_in_transit < path_x->cwin &&
+            picoquic_is_sending_authorized_by_pacing(cnx, path_x, current_time, next_wake_time);
+    }
+
+    return is_available;
+}
+
+static int picoquic_min_rtt_select_path(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t* next_wake_time)
+{
+    int path_id = -1;
+
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        if (picoquic_is_path_available_for_data(cnx, i, current_time, next_wake_time) &&
+            (path_id < 0 || cnx->path[i]->smoothed_rtt < cnx->path[path_id]->smoothed_rtt)) {
+            path_id = i;
+        }
+    }
+
+    return path_id;
+}
+
+static int picoquic_round_robin_select_path(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t* next_wake_time)
+{
+    int path_id = -1;
+
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        int candidate = (cnx->path_scheduler_next + i) % cnx->nb_paths;
+
+        if (picoquic_is_path_available_for_data(cnx, candidate, current_time, next_wake_time)) {
+            path_id = candidate;
+            cnx->path_scheduler_next = candidate + 1;
+            break;
+        }
+    }
+
+    return path_id;
+}
+
+/* Definition records for the schedulers */
+
+picoquic_path_scheduler_t picoquic_min_rtt_scheduler_struct = {
+    "min_rtt", picoquic_min_rtt_select_path, 0
+};
+
+picoquic_path_scheduler_t picoquic_round_robin_scheduler_struct = {
+    "round_robin", picoquic_round_robin_select_path, 0
+};
+
+picoquic_path_scheduler_t picoquic_redundant_scheduler_struct = {
+    "redundant", picoquic_round_robin_select_path, 1
+};
+
+picoquic_path_scheduler_t* picoquic_min_rtt_scheduler = &picoquic_min_rtt_scheduler_struct;
+picoquic_path_scheduler_t* picoquic_round_robin_scheduler = &picoquic_round_robin_scheduler_struct;
+picoquic_path_scheduler_t* picoquic_redundant_scheduler = &picoquic_redundant_scheduler_struct;
@@ -23,6 +23,7 @@
 #define PICOQUIC_H
 
 #include <stdint.h>
+#include <stdio.h>
 #ifdef _WINDOWS
 #include <WS2tcpip.h>
 #include <Ws2def.h>
@@ -90,6 +91,9 @@ extern "C" {
 #define PICOQUIC_NO_ERROR_SIMULATE_NAT (PICOQUIC_ERROR_CLASS + 48)
 #define PICOQUIC_NO_ERROR_SIMULATE_MIGRATION (PICOQUIC_ERROR_CLASS + 49)
 #define PICOQUIC_ERROR_VERSION_NOT_SUPPORTED (PICOQUIC_ERROR_CLASS + 50)
+#define PICOQUIC_ERROR_INVALID_PRIORITY (PICOQUIC_ERROR_CLASS + 51)
+#define PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL (PICOQUIC_ERROR_CLASS + 52)
+#define PICOQUIC_ERROR_INVALID_PACKET_SIZE (PICOQUIC_ERROR_CLASS + 53)
 
 /*
  * Protocol errors defined in the QUIC spec
@@ -114,13 +118,23 @@ extern "C" {
 #define PICOQUIC_TLS_ALERT_WRONG_ALPN (0x178)
 #define PICOQUIC_TLS_HANDSHAKE_FAILED (0x201)
 
-#define PICOQUIC_MAX_PACKET_SIZE 1536
+#ifndef PICOQUIC_MAX_PACKET_SIZE
+#define PICOQUIC_MAX_PACKET_SIZE 1536 /* Default size of the packet buffers */
+#endif
+#define PICOQUIC_MAX_JUMBO_PACKET_SIZE 9216 /* Largest packet buffers, for jumbo frames */
 #define PICOQUIC_INITIAL_MTU_IPV4 1252
 #define PICOQUIC_INITIAL_MTU_IPV6 1232
 #define PICOQUIC_RESET_SECRET_SIZE 16
 #define PICOQUIC_RESET_PACKET_PAD_SIZE 23
 #define PICOQUIC_RESET_PACKET_MIN_SIZE (PICOQUIC_RESET_PACKET_PAD_SIZE + PICOQUIC_RESET_SECRET_SIZE)
 
+#define PICOQUIC_DEFAULT_STREAM_URGENCY 3
+#define PICOQUIC_STREAM_URGENCY_MAX 7
+
+#define PICOQUIC_DEFAULT_DATAGRAM_PRIORITY 3
+#define PICOQUIC_DATAGRAM_PRIORITY_MAX 7
+#define PICOQUIC_DEFAULT_DATAGRAM_QUEUE_MAX 0x100000
+
 #define PICOQUIC_LOG_PACKET_MAX_SEQUENCE 100
 
 #define FOURCC(a, b, c, d) ((((uint32_t)(d)<<24) | ((c)<<16) | ((b)<<8) | (a)))
@@ -203,7 +217,8 @@ typedef enum {
     picoquic_callback_version_negotiation, /* version negotiation requested */
     picoquic_callback_request_alpn_list, /* Provide the list of supported ALPN */
     picoquic_callback_set_alpn, /* Set ALPN to negotiated value */
-    picoquic_callback_pacing_changed /* Pacing rate for the connection changed */
+    picoquic_callback_pacing_changed, /* Pacing rate for the connection changed */
+    picoquic_callback_prepare_datagram /* Ask application to send a datagram, see picoquic_provide_datagram_buffer for details */
 } picoquic_call_back_event_t;
 
 typedef struct st_picoquic_tp_prefered_address_t {
@@ -235,6 +250,7 @@ typedef struct st_picoquic_tp_t {
     int enable_time_stamp; /* (x&1) want, (x&2) can */
     uint64_t min_ack_delay;
     int do_grease_quic_bit;
+    int enable_multipath;
 } picoquic_tp_t;
 
 /*
@@ -291,6 +307,11 @@ typedef int (*picoquic_stream_data_cb_fn)(picoquic_cnx_t* cnx,
     uint64_t stream_id, uint8_t* bytes, size_t length,
     picoquic_call_back_event_t fin_or_event, void* callback_ctx, void * stream_ctx);
 
+/* Callback used to hand back to the application a buffer queued with
+ * picoquic_add_buffer_to_stream, once the stack no longer needs it.
+ */
+typedef void (*picoquic_stream_data_release_fn)(void* release_ctx, uint8_t* bytes, size_t length);
+
 /* Callback from the TLS stack upon receiving a list of proposed ALPN in the Client Hello
  * The stack passes a <list> of io <count> vectors (base, len) each containing a proposed
  * ALPN. The implementation returns the index of the selected ALPN, or a value >= count
@@ -362,6 +383,33 @@ void picoquic_set_random_initial(picoquic_quic_t* quic, int random_initial);
 /* Set the "packet train" mode for pacing */
 void picoquic_set_packet_train_mode(picoquic_quic_t* quic, int train_mode);
 
+/* Use a pool of threads to encrypt the trains of 1-RTT packets prepared
+ * by picoquic_prepare_next_packet_ex. Each worker uses its own copy of
+ * the encryption keys. The number of workers can only be set before
+ * connections are created. Setting it to zero stops the workers.
+ * Returns 0 if successful. */
+int picoquic_set_crypto_workers(picoquic_quic_t* quic, int nb_workers);
+
+/* Limit the number of server handshakes processed per millisecond.
+ * If set, the TLS processing of the client hello, including the signature
+ * of the certificate verify message, is not done when the Initial packet
+ * is received, but when the connection is next scheduled in the wake
+ * list. At most max_handshakes_per_ms such handshakes are processed per
+ * millisecond, the other ones wait for the next period. This keeps the
+ * established connections responsive during bursts of new connections.
+ * Setting the value to 0 restores the processing on arrival. */
+void picoquic_set_max_handshakes_per_ms(picoquic_quic_t* quic, uint32_t max_handshakes_per_ms);
+
+/* Keep a pool of connection IDs and stateless reset secrets computed in advance.
+ * The pool is refilled when picoquic_prepare_next_packet finds no connection
+ * ready to send, and is used when new local connection IDs are created, e.g.,
+ * during handshakes and migrations. The pool is only used if no connection ID
+ * callback is set, or if the callback is the load balancer compatible
+ * generator, because other callbacks may depend on the connection.
+ * Setting the size to 0 (the default) disables the pool.
+ * Returns 0 if successful. */
+int picoquic_set_cnxid_pool_size(picoquic_quic_t* quic, size_t pool_size);
+
 /* set the padding policy.
  * The padding policy is parameterized by two variables:
  * - packets shorter than padding_min_size will be padded to that size.
@@ -466,6 +514,12 @@ picoquic_tp_t const* picoquic_get_transport_parameters(picoquic_cnx_t* cnx, int
 /* Set the TLS certificate chain(DER format) for the QUIC context. The context will take ownership over the certs pointer. */
 void picoquic_set_tls_certificate_chain(picoquic_quic_t* quic, ptls_iovec_t* certs, size_t count);
 
+/* Enable or disable TLS certificate compression (RFC 8879). When enabled, the context
+ * accepts compressed certificates from its peers, and sends its own chain compressed
+ * to peers that support it. Compression is enabled by default if picoquic is built
+ * with PICOQUIC_WITH_CERT_COMPRESSION; otherwise, enabling it returns an error. */
+int picoquic_set_certificate_compression(picoquic_quic_t* quic, int is_enabled);
+
 /* Set the TLS root certificates (DER format) for the QUIC context. The context will take ownership over the certs pointer.
  * The root certificates will be used to verify the certificate chain of the server and client (with client authentication activated).
  * Returns `0` on success, `-1` on error while loading X509 certificate or `-2` on error while adding a cert to the certificate store.
@@ -488,6 +542,15 @@ void picoquic_set_client_authentication(picoquic_quic_t* quic, int client_authen
 /* Set default padding policy for the context */
 void picoquic_set_default_padding(picoquic_quic_t* quic, uint32_t padding_multiple, uint32_t padding_minsize);
 
+/* Receive windows are auto-tuned: the credit granted to the peer grows to
+ * about twice the amount of data received per RTT, starting from the
+ * initial values of the transport parameters. The growth of the windows
+ * beyond these initial values is capped for all connections of the context,
+ * so the total memory committed to reception remains bounded. Setting the
+ * cap to 0 removes it.
+ */
+void picoquic_set_receive_window_growth_max(picoquic_quic_t* quic, uint64_t growth_max);
+
 /* Set default spin bit policy for the context */
 void picoquic_set_default_spinbit_policy(picoquic_quic_t * quic, picoquic_spinbit_version_enum default_spinbit_policy);
 
@@ -509,6 +572,51 @@ int picoquic_load_retry_tokens(picoquic_quic_t* quic, char const* token_store_fi
 int picoquic_save_session_tickets(picoquic_quic_t* quic, char const* ticket_store_filename);
 int picoquic_save_retry_tokens(picoquic_quic_t* quic, char const* token_store_filename);
 
+/* Share the session ticket keys between several QUIC contexts, e.g., server
+ * workers behind the same address, so that a client can resume a session or
+ * use a token with any of them. The ring is created with an initial secret,
+ * or a random one if the secret is NULL. If the rotation interval is not zero,
+ * a new random key is added when the current key is older than the interval.
+ * Keys can also be added explicitly with picoquic_ticket_key_ring_rotate.
+ * The ring keeps the last PICOQUIC_TICKET_KEYS_MAX keys, and tickets or
+ * tokens encrypted with older keys are rejected.
+ * The ring is reference counted: each QUIC context using it holds a
+ * reference, and the creator releases its own after setting the contexts.
+ */
+typedef struct st_picoquic_ticket_key_ring_t picoquic_ticket_key_ring_t;
+picoquic_ticket_key_ring_t* picoquic_ticket_key_ring_create(const uint8_t* secret, size_t secret_length,
+    uint64_t rotation_interval, uint64_t current_time);
+void picoquic_ticket_key_ring_rotate(picoquic_ticket_key_ring_t* ring, const uint8_t* secret, size_t secret_length,
+    uint64_t current_time);
+void picoquic_ticket_key_ring_release(picoquic_ticket_key_ring_t* ring);
+int picoquic_set_ticket_key_ring(picoquic_quic_t* quic, picoquic_ticket_key_ring_t* ring);
+
+/* Detection of token reuse. By default, each QUIC context remembers the
+ * tokens that it accepted. Setting an anti-replay function replaces that
+ * local store, so that several contexts can share the same state. The
+ * function returns 0 if the token was not used before, and registers it
+ * until its expiry time; it returns -1 if the token was already used.
+ * The anti-replay store provides such a function for contexts running in
+ * the same process. An external store, e.g., a local daemon, can be plugged
+ * in the same way.
+ * The local store and the anti-replay store hold at most 1M tokens by
+ * default. When that number is reached, the tokens nearest to expiry are
+ * forgotten to make room for new ones. The cap can be changed with
+ * picoquic_set_token_reuse_max and picoquic_anti_replay_store_set_max_tokens,
+ * a value of 0 restores the default.
+ */
+typedef int (*picoquic_anti_replay_fn)(void* anti_replay_ctx, const uint8_t* token, size_t token_length,
+    uint64_t expiry_time, uint64_t current_time);
+void picoquic_set_anti_replay_fn(picoquic_quic_t* quic, picoquic_anti_replay_fn anti_replay_fn, void* anti_replay_ctx);
+void picoquic_set_token_reuse_max(picoquic_quic_t* quic, size_t max_tokens);
+
+typedef struct st_picoquic_anti_replay_store_t picoquic_anti_replay_store_t;
+picoquic_anti_replay_store_t* picoquic_anti_replay_store_create(void);
+void picoquic_anti_replay_store_delete(picoquic_anti_replay_store_t* store);
+void picoquic_anti_replay_store_set_max_tokens(picoquic_anti_replay_store_t* store, size_t max_tokens);
+int picoquic_anti_replay_store_check(void* anti_replay_ctx, const uint8_t* token, size_t token_length,
+    uint64_t expiry_time, uint64_t current_time);
+
 /* Set default connection ID length for the context.
  * All valid values are supported on the client.
  * Using a null value on the server is not tested, may not work.
@@ -518,6 +626,16 @@ int picoquic_set_default_connection_id_length(picoquic_quic_t* quic, uint8_t cid
 
 void picoquic_set_mtu_max(picoquic_quic_t* quic, uint32_t mtu_max);
 
+/* Set the size of the packet buffers, i.e., the largest UDP payload that
+ * the context can send or receive. The default is PICOQUIC_MAX_PACKET_SIZE.
+ * Values up to PICOQUIC_MAX_JUMBO_PACKET_SIZE enable jumbo frames: the size
+ * is announced to the peers in the max_udp_payload_size transport parameter,
+ * and path MTU discovery probes up to it. The packet loops size their
+ * buffers with picoquic_get_max_packet_size.
+ * Cannot be changed if there are active connections in the context. */
+int picoquic_set_max_packet_size(picoquic_quic_t* quic, size_t max_packet_size);
+size_t picoquic_get_max_packet_size(picoquic_quic_t* quic);
+
 void picoquic_set_alpn_select_fn(picoquic_quic_t* quic, picoquic_alpn_select_fn alpn_select_fn);
 
 void picoquic_set_default_callback(picoquic_quic_t * quic, picoquic_stream_data_cb_fn callback_fn, void * callback_ctx);
@@ -578,6 +696,29 @@ uint64_t picoquic_get_crypto_epoch_length(picoquic_cnx_t* cnx);
 
 void picoquic_cnx_set_pmtud_required(picoquic_cnx_t* cnx, int is_pmtud_required);
 
+/* Path MTU discovery follows the DPLPMTUD logic of RFC 8899. On each path,
+ * the search sends padded probes, confirms that a size fails only after
+ * PICOQUIC_PMTUD_MAX_PROBES probes of that size are lost, and converges by
+ * binary steps. Once complete, the search resumes after the raise timer
+ * in case the path MTU increased. Consecutive losses of full size packets
+ * are treated as a black hole: the path falls back to the initial MTU and
+ * searches again below the size that failed. */
+typedef enum {
+    picoquic_pmtud_searching = 0,
+    picoquic_pmtud_search_complete
+} picoquic_pmtud_state_enum;
+
+typedef struct st_picoquic_path_mtu_stats_t {
+    size_t send_mtu; /* Largest packet size validated on the path */
+    size_t mtu_max_tried; /* Smallest packet size known to fail, 0 if none */
+    picoquic_pmtud_state_enum pmtud_state;
+    uint64_t nb_mtu_probes_sent;
+    uint64_t nb_mtu_probes_lost;
+    uint64_t nb_black_holes;
+} picoquic_path_mtu_stats_t;
+
+int picoquic_get_path_mtu_stats(picoquic_cnx_t* cnx, int path_id, picoquic_path_mtu_stats_t* stats);
+
 int picoquic_tls_is_psk_handshake(picoquic_cnx_t* cnx);
 
 void picoquic_get_peer_addr(picoquic_cnx_t* cnx, struct sockaddr** addr);
@@ -616,6 +757,61 @@ int picoquic_queue_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t
 /* Send datagram frame */
 int picoquic_queue_datagram_frame(picoquic_cnx_t* cnx, size_t length, const uint8_t* bytes);
 
+/* Queued datagrams can be given a priority class and a deadline. Datagrams
+ * are sent in order of priority, lower values first, and in order of
+ * arrival within a class. The "expire_time" is expressed in the same
+ * time base as the "current_time" passed to the stack, and the datagram
+ * is dropped if it is not sent by that time. A value of 0 means no deadline.
+ *
+ * The queue is bounded by a number of bytes, set by default to
+ * PICOQUIC_DEFAULT_DATAGRAM_QUEUE_MAX. If a new datagram would exceed the
+ * bound, the oldest queued datagrams of the least urgent class are dropped
+ * to make room, if that class is not more urgent than the new datagram.
+ * Otherwise, the new datagram is refused with PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL.
+ * Setting the bound to 0 removes it.
+ */
+typedef struct st_picoquic_datagram_desc_t {
+    const uint8_t* bytes;
+    size_t length;
+    uint8_t priority;
+    uint64_t expire_time;
+} picoquic_datagram_desc_t;
+
+int picoquic_queue_datagram_frame_ex(picoquic_cnx_t* cnx, size_t length, const uint8_t* bytes,
+    uint8_t priority, uint64_t expire_time);
+/* Queue a batch of datagrams at once. On return, "nb_queued" holds the
+ * number of datagrams of the batch that were queued. */
+int picoquic_queue_datagram_batch(picoquic_cnx_t* cnx, const picoquic_datagram_desc_t* datagrams,
+    size_t nb_datagrams, size_t* nb_queued);
+void picoquic_set_datagram_queue_max(picoquic_cnx_t* cnx, size_t max_bytes);
+
+/* Statistics of the datagram queue. Each datagram dropped is counted once,
+ * depending on the reason for the drop. */
+typedef struct st_picoquic_datagram_queue_stats_t {
+    size_t queued_bytes;
+    uint64_t nb_expired; /* Deadline passed before the datagram could be sent */
+    uint64_t nb_dropped_queue_full; /* Refused or evicted because of the queue bound */
+    uint64_t nb_dropped_too_large; /* Did not fit in a packet on the path */
+} picoquic_datagram_queue_stats_t;
+
+void picoquic_get_datagram_queue_stats(picoquic_cnx_t* cnx, picoquic_datagram_queue_stats_t* stats);
+
+/* Instead of queuing datagrams in advance, the application can mark the
+ * connection as "datagram ready". The application then receives a callback
+ * of type "picoquic_callback_prepare_datagram" when a packet has room for a
+ * datagram, so the datagram content is as fresh as possible. The "length"
+ * argument of the callback is the largest datagram that fits, and the
+ * "bytes" argument points to an opaque context. The application calls
+ * "picoquic_provide_datagram_buffer" with that context and the length of
+ * the datagram, and copies the datagram at the returned address. The
+ * "is_still_ready" argument tells whether the application has more
+ * datagrams to send. If the application does not provide a buffer, no
+ * datagram is sent and the connection is no longer marked ready.
+ * Datagrams queued with picoquic_queue_datagram_frame are sent first.
+ */
+int picoquic_mark_datagram_ready(picoquic_cnx_t* cnx, int is_ready);
+uint8_t* picoquic_provide_datagram_buffer(void* context, size_t length, int is_still_ready);
+
 /* The incoming packet API is used to pass incoming packets to a 
  * Quic context. The API handles the decryption of the packets
  * and their processing in the context of connections.
@@ -747,6 +943,19 @@ int picoquic_mark_active_stream(picoquic_cnx_t* cnx,
 int picoquic_mark_high_priority_stream(picoquic_cnx_t* cnx,
     uint64_t stream_id, int is_high_priority);
 
+/* Set the priority of a stream, following the extensible priority
+ * scheme of RFC 9218. Streams with a lower urgency value are served
+ * before streams with a higher value; the default urgency is
+ * PICOQUIC_DEFAULT_STREAM_URGENCY. Non incremental streams of the same
+ * urgency are served one at a time, in the order in which they became
+ * ready. Incremental streams of the same urgency share the bandwidth
+ * in round robin, one stream frame at a time.
+ * The high priority stream is still served before any other stream.
+ */
+
+int picoquic_set_stream_priority(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t urgency, int is_incremental);
+
 /* If a stream is marked active, the application will receive a callback with
  * event type "picoquic_callback_prepare_to_send" when the transport is ready to
  * send data on a stream. The "length" argument in the call back indicates the
@@ -781,6 +990,35 @@ void picoquic_reset_stream_ctx(picoquic_cnx_t* cnx, uint64_t stream_id);
  */
 int picoquic_add_to_stream_with_ctx(picoquic_cnx_t * cnx, uint64_t stream_id, const uint8_t * data, size_t length, int set_fin, void * app_stream_ctx);
 
+/* Queue application owned data on a stream, without copying it in an
+ * intermediate buffer. The buffer must remain valid and unchanged until
+ * the stack calls release_fn, which happens once all the bytes have been
+ * copied into packets, or when the stream is reset or the connection deleted.
+ * Retransmissions use the copy kept with the sent packets, so the buffer is
+ * not held until the data is acknowledged. The release function is called
+ * exactly once for each successful call with length > 0; if the call fails,
+ * the application keeps ownership of the buffer.
+ */
+int picoquic_add_buffer_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx);
+
+/* Queue a region of a file on a stream. The region is memory mapped and
+ * queued with picoquic_add_buffer_to_stream, so the data is copied from the
+ * file mapping directly into packets. The file can be closed as soon as the
+ * call returns. If the region cannot be mapped, for example because it
+ * extends past the end of the file, nothing is queued and the function
+ * returns PICOQUIC_ERROR_INVALID_FILE.
+ * The mapping is read until the last byte of the region is sent. The file
+ * must not be truncated or rewritten in place during that time: on POSIX
+ * systems, reading a page past the new end of file raises SIGBUS, which
+ * kills the process. Files that may be updated must be replaced by rename,
+ * and files that the application does not control should rather be sent
+ * with picoquic_mark_active_stream and picoquic_provide_stream_data_buffer.
+ */
+int picoquic_add_file_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id, FILE* F,
+    uint64_t offset, size_t length, int set_fin, void* app_stream_ctx);
+
 /* Reset a stream, indicating that no more data will be sent on 
  * that stream and that any data currently queued can be abandoned. */
 int picoquic_reset_stream(picoquic_cnx_t* cnx,
@@ -886,6 +1124,35 @@ void picoquic_set_default_congestion_algorithm_by_name(picoquic_quic_t* quic, ch
 
 void picoquic_set_congestion_algorithm(picoquic_cnx_t* cnx, picoquic_congestion_algorithm_t const* algo);
 
+/* Multipath scheduling.
+ * If both peers enable the multipath transport parameter, validated paths are no
+ * longer promoted to default path. Instead, each path keeps its own congestion
+ * window and pacing state, and a scheduler selects for each packet the path on
+ * which it will be sent. The select_path function returns the index of a path
+ * on which data can be sent at the current time, or -1 if no such path is
+ * available. If the scheduler is redundant, stream data sent on one path is
+ * also repeated on another path, trading bandwidth for latency.
+ */
+typedef int (*picoquic_path_scheduler_select_fn)(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t* next_wake_time);
+
+typedef struct st_picoquic_path_scheduler_t {
+    char const* path_scheduler_id;
+    picoquic_path_scheduler_select_fn select_path;
+    int is_redundant;
+} picoquic_path_scheduler_t;
+
+extern picoquic_path_scheduler_t* picoquic_min_rtt_scheduler;
+extern picoquic_path_scheduler_t* picoquic_round_robin_scheduler;
+extern picoquic_path_scheduler_t* picoquic_redundant_scheduler;
+
+void picoquic_set_default_path_scheduler(picoquic_quic_t* quic, picoquic_path_scheduler_t const* scheduler);
+
+void picoquic_set_path_scheduler(picoquic_cnx_t* cnx, picoquic_path_scheduler_t const* scheduler);
+
+/* Check whether a path is validated and can send data now, per congestion control
+ * and pacing. If the path is only blocked by pacing, the next wake time is updated. */
+int picoquic_is_path_available_for_data(picoquic_cnx_t* cnx, int path_id, uint64_t current_time, uint64_t* next_wake_time);
+
 /* Bandwidth update and congestion control parameters value.
  * Congestion control in picoquic is characterized by three values:
  * - pacing rate, expressed in bytes per second (for example, 10Mbps would be noted as 1250000)
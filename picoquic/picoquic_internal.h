@@ -37,9 +37,6 @@ extern "C" {
 
 #define PICOQUIC_VERSION "0.32b"
 
-#ifndef PICOQUIC_MAX_PACKET_SIZE
-#define PICOQUIC_MAX_PACKET_SIZE 1536
-#endif
 #define PICOQUIC_MIN_SEGMENT_SIZE 256
 #define PICOQUIC_ENFORCED_INITIAL_MTU 1200
 #define PICOQUIC_ENFORCED_INITIAL_CID_LENGTH 8
@@ -50,6 +47,7 @@ extern "C" {
 #define PICOQUIC_NB_PATH_TARGET 8
 #define PICOQUIC_NB_PATH_DEFAULT 2
 #define PICOQUIC_MAX_PACKETS_IN_POOL 0x8000
+#define PICOQUIC_CNXID_POOL_REFILL_MAX 8 /* CIDs prepared per call to picoquic_refill_cnxid_pool */
 
 #define PICOQUIC_INITIAL_RTT 250000ull /* 250 ms */
 #define PICOQUIC_TARGET_RENO_RTT 100000ull /* 100 ms */
@@ -68,6 +66,9 @@ extern "C" {
 #define PICOQUIC_TOKEN_DELAY_SHORT (2*60*1000000ull) /* 2 minutes */
 #define PICOQUIC_CID_REFRESH_DELAY (5*1000000ull) /* if idle for 5 seconds, refresh the CID */
 #define PICOQUIC_MTU_LOSS_THRESHOLD 10 /* if threshold of full MTU packetlost, reset MTU */
+#define PICOQUIC_MTU_PROBE_STEP_MIN 64 /* stop the search when closer than that to the size that failed */
+#define PICOQUIC_PMTUD_MAX_PROBES 3 /* number of lost probes confirming that a size fails */
+#define PICOQUIC_PMTUD_RAISE_TIMER 600000000ull /* 10 minutes, search again after that */
 
 #define PICOQUIC_BANDWIDTH_ESTIMATE_MAX 10000000000ull /* 10 GB per second */
 #define PICOQUIC_BANDWIDTH_TIME_INTERVAL_MIN 1000
@@ -88,6 +89,7 @@ extern "C" {
 
 #define PICOQUIC_DEFAULT_SIMULTANEOUS_LOGS 32
 #define PICOQUIC_DEFAULT_HALF_OPEN_RETRY_THRESHOLD 64
+#define PICOQUIC_DEFAULT_RECEIVE_WINDOW_GROWTH_MAX 0x10000000 /* 256 MB */
 
 #define PICOQUIC_PN_RANDOM_MIN 0xffff
 #define PICOQUIC_PN_RANDOM_RANGE 0x10000
@@ -98,6 +100,13 @@ extern "C" {
 
 #define PICOQUIC_ALPN_NUMBER_MAX 8
 
+#define PICOQUIC_MAX_ACK_BLOCKS 32
+#define PICOQUIC_ACK_BLOCKS_CACHE_SIZE (16*PICOQUIC_MAX_ACK_BLOCKS) /* gap + range, 8 bytes max each */
+
+#define PICOQUIC_HP_SAMPLE_SIZE 16
+#define PICOQUIC_HP_BATCH_MAX 64
+#define PICOQUIC_CRYPTO_WORKERS_MAX 8
+
 /*
  * Types of frames
  */
@@ -309,7 +318,7 @@ typedef struct st_picoquic_stateless_packet_t {
     picoquic_connection_id_t initial_cid;
     picoquic_packet_type_enum ptype;
 
-    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t* bytes; /* Buffer of quic->max_packet_size bytes, allocated after the structure */
 } picoquic_stateless_packet_t;
 
 /* Handling of stateless packets */
@@ -331,6 +340,7 @@ typedef struct st_picoquic_packet_t {
     struct st_picoquic_packet_t* next_packet;
     struct st_picoquic_path_t* send_path;
     uint64_t sequence_number;
+    uint64_t path_packet_number; /* Order of the packet on its send path, for per path loss detection */
     uint64_t send_time;
     uint64_t delivered_prior;
     uint64_t delivered_time_prior;
@@ -347,7 +357,7 @@ typedef struct st_picoquic_packet_t {
     unsigned int is_ack_trap : 1;
     unsigned int delivered_app_limited : 1;
 
-    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t* bytes; /* Buffer of quic->max_packet_size bytes, allocated after the structure */
 } picoquic_packet_t;
 
 picoquic_packet_t* picoquic_create_packet(picoquic_quic_t* quic);
@@ -355,21 +365,114 @@ void picoquic_recycle_packet(picoquic_quic_t* quic, picoquic_packet_t* packet);
 
 /* Definition of the token register used to prevent repeated usage of
  * the same new token, retry token, or session ticket.
+ *
+ * Tokens are kept in a ring of slots, selected by the expiry time of the
+ * token. Each slot has a bloom filter, checked before the exact lookup
+ * in the hash table of the slot, so that most new tokens are registered
+ * without walking any list. The filter is resized with the hash table, so
+ * that it keeps the same number of bits per token whatever the rate at
+ * which tokens are registered in the slot. A slot is emptied in one step
+ * once all the tokens that it holds have expired. The total number of
+ * tokens held by the store is capped; once the cap is reached, the slot
+ * holding the tokens nearest to expiry is emptied to make room for the
+ * new ones.
  */
+#define PICOQUIC_TOKEN_REUSE_NB_SLOTS 64
+#define PICOQUIC_TOKEN_REUSE_SLOT_WIDTH (30*60*1000000ull) /* 30 minutes, the ring covers 32 hours */
+#define PICOQUIC_TOKEN_REUSE_FILTER_BITS_PER_ENTRY 32 /* 16 bits per token when the table is full */
+#define PICOQUIC_TOKEN_REUSE_TABLE_MIN 64
+#define PICOQUIC_TOKEN_REUSE_MAX_TOKENS (1u<<20)
 
 typedef struct st_picoquic_registered_token_t {
-    picosplay_node_t registered_token_node;
+    struct st_picoquic_registered_token_t* next_token;
     uint64_t token_time;
     uint64_t token_hash; /* The last 8 bytes of the token, normally taken from AEAD checksum */
     int count;
 } picoquic_registered_token_t;
 
+typedef struct st_picoquic_token_reuse_slot_t {
+    uint64_t time_max; /* Largest expiry time of the tokens in the slot */
+    size_t nb_tokens;
+    size_t table_size;
+    picoquic_registered_token_t** table;
+    uint64_t* filter; /* table_size * PICOQUIC_TOKEN_REUSE_FILTER_BITS_PER_ENTRY bits */
+} picoquic_token_reuse_slot_t;
+
+typedef struct st_picoquic_token_reuse_store_t {
+    picoquic_token_reuse_slot_t* slots; /* Allocated at the first registration */
+    size_t nb_tokens; /* Number of tokens held in all slots */
+    size_t max_tokens; /* Cap on nb_tokens, PICOQUIC_TOKEN_REUSE_MAX_TOKENS if 0 */
+    uint64_t clear_time; /* Tokens expiring before that time are ignored */
+    uint64_t scan_id; /* Slot width interval at which expired slots were last freed */
+} picoquic_token_reuse_store_t;
+
+int picoquic_token_reuse_store_check(picoquic_token_reuse_store_t* store, const uint8_t* token, size_t token_length, uint64_t expiry_time);
+void picoquic_token_reuse_store_clear(picoquic_token_reuse_store_t* store, uint64_t expiry_time_max);
+void picoquic_token_reuse_store_free(picoquic_token_reuse_store_t* store);
+
+/* Anti-replay store shared by several QUIC contexts in the same process,
+ * e.g., server workers running in separate threads behind the same address.
+ */
+struct st_picoquic_anti_replay_store_t {
+    picoquic_mutex_t mutex;
+    picoquic_token_reuse_store_t store;
+};
+
+/* Ring of session ticket keys, shared by several QUIC contexts.
+ * The ring holds the secrets, from which each QUIC context derives its
+ * own AEAD contexts, because these contexts are not thread safe. The
+ * first key of the ring is used for encryption, all keys are accepted
+ * for decryption. Tickets and tokens carry the identifier of their key.
+ */
+#define PICOQUIC_TICKET_KEYS_MAX 4
+#define PICOQUIC_TICKET_SECRET_SIZE 32
+
+typedef struct st_picoquic_ticket_key_t {
+    uint8_t key_id;
+    uint64_t creation_time;
+    uint8_t secret[PICOQUIC_TICKET_SECRET_SIZE];
+} picoquic_ticket_key_t;
+
+struct st_picoquic_ticket_key_ring_t {
+    picoquic_mutex_t mutex;
+    int ref_count;
+    uint64_t generation; /* Incremented each time a key is added */
+    uint64_t rotation_interval; /* If not zero, interval after which a new key is created */
+    uint8_t next_key_id;
+    int nb_keys;
+    picoquic_ticket_key_t keys[PICOQUIC_TICKET_KEYS_MAX]; /* Newest first */
+};
+
+/* AEAD contexts derived from a ticket key, in the QUIC context */
+typedef struct st_picoquic_ticket_aead_t {
+    uint8_t key_id;
+    void* aead_encrypt;
+    void* aead_decrypt;
+} picoquic_ticket_aead_t;
+
 /*
  * Definition of the session ticket store and connection token
  * store that can be associated with a
  * client context.
+ *
+ * In the QUIC context, the stored tickets and tokens are indexed by
+ * SNI and ALPN, or by SNI, so that lookups do not scan the list. Tickets
+ * that are superseded or used are marked "was_used" and removed from the
+ * list in batches. The store is saved in an append-only file: new entries
+ * are appended, used entries are cancelled by appending a record without
+ * ticket or token, and the file is rewritten once most of its records
+ * are obsolete.
  */
 
+#define PICOQUIC_STORE_INDEX_BINS 1024
+
+typedef struct st_picoquic_store_state_t {
+    picohash_table* index;
+    size_t sweep_count; /* Number of indexed entries after the last sweep */
+    char* file_name; /* File in which the store was last loaded or fully saved */
+    size_t nb_file_records; /* Records in that file, including obsolete ones */
+} picoquic_store_state_t;
+
 typedef enum {
     picoquic_tp_0rtt_max_data = 0,
     picoquic_tp_0rtt_max_stream_data_bidi_local = 1,
@@ -391,6 +494,8 @@ typedef struct st_picoquic_stored_ticket_t {
     uint16_t alpn_length;
     uint16_t ticket_length;
     unsigned int was_used : 1;
+    unsigned int is_saved : 1; /* A record of the ticket is present in the store file */
+    unsigned int is_referenced : 1; /* The ticket bytes are used by a connection handshake, do not free */
 } picoquic_stored_ticket_t;
 
 int picoquic_store_ticket(picoquic_stored_ticket_t** p_first_ticket,
@@ -408,6 +513,20 @@ int picoquic_load_tickets(picoquic_stored_ticket_t** pp_first_ticket,
     uint64_t current_time, char const* ticket_file_name);
 void picoquic_free_tickets(picoquic_stored_ticket_t** pp_first_ticket);
 
+int picoquic_store_session_ticket(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t* ticket, uint16_t ticket_length, picoquic_tp_t const* tp);
+int picoquic_get_session_ticket(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t** ticket, uint16_t* ticket_length, picoquic_tp_t* tp, int mark_used);
+int picoquic_get_session_ticket_ex(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t** ticket, uint16_t* ticket_length, picoquic_tp_t* tp, int mark_used,
+    picoquic_stored_ticket_t** p_stored);
+void picoquic_release_session_ticket(picoquic_stored_ticket_t** p_stored);
+int picoquic_load_session_tickets(picoquic_quic_t* quic, uint64_t current_time, char const* ticket_store_filename);
+void picoquic_free_session_tickets(picoquic_quic_t* quic);
+
 typedef struct st_picoquic_stored_token_t {
     struct st_picoquic_stored_token_t* next_token;
     char const* sni;
@@ -418,6 +537,7 @@ typedef struct st_picoquic_stored_token_t {
     uint16_t token_length;
     uint8_t ip_addr_length;
     unsigned int was_used : 1;
+    unsigned int is_saved : 1; /* A record of the token is present in the store file */
 } picoquic_stored_token_t;
 
 int picoquic_store_token(picoquic_stored_token_t** p_first_token,
@@ -437,6 +557,16 @@ int picoquic_load_tokens(picoquic_stored_token_t** pp_first_token,
     uint64_t current_time, char const* token_file_name);
 void picoquic_free_tokens(picoquic_stored_token_t** pp_first_token);
 
+int picoquic_store_retry_token(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length,
+    uint8_t const* ip_addr, uint8_t ip_addr_length,
+    uint8_t const* token, uint16_t token_length);
+int picoquic_get_retry_token(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length,
+    uint8_t const* ip_addr, uint8_t ip_addr_length,
+    uint8_t** token, uint16_t* token_length, int mark_used);
+void picoquic_free_retry_tokens(picoquic_quic_t* quic);
+
 /*
  * Transport parameters, as defined by the QUIC transport specification
  */
@@ -465,7 +595,8 @@ typedef enum {
     picoquic_tp_enable_loss_bit = 0x1057,
     picoquic_tp_min_ack_delay = 0xDE1A,
     picoquic_tp_enable_time_stamp = 0x7158, /* x&1 = */
-    picoquic_tp_grease_quic_bit = 0x2ab2
+    picoquic_tp_grease_quic_bit = 0x2ab2,
+    picoquic_tp_enable_multipath = 0xbab5
 } picoquic_tp_enum;
 
 /* Callback for converting binary log to quic log at the end of a connection. 
@@ -474,9 +605,47 @@ typedef enum {
  */
 typedef int (*picoquic_autoqlog_fn)(picoquic_cnx_t * cnx);
 
+/* Batch of 1-RTT packets waiting for header protection.
+ * When a train of packets is prepared for the same connection, the AEAD
+ * encryption is done packet per packet, but the header protection masks
+ * are computed for the whole train in a single call to the HP cipher.
+ * If crypto workers are configured, the AEAD encryption is also deferred,
+ * and the packets of the train are encrypted in parallel before the
+ * header protection is applied.
+ */
+typedef struct st_picoquic_hp_batch_item_t {
+    uint8_t* packet;
+    size_t pn_offset;
+    size_t h_length;
+    size_t payload_length;
+    uint64_t sequence_number;
+    uint8_t first_mask;
+    int is_aead_pending;
+} picoquic_hp_batch_item_t;
+
+typedef struct st_picoquic_hp_batch_t {
+    struct st_picoquic_crypto_context_t* crypto_context;
+    size_t nb_items;
+    int is_active;
+    picoquic_hp_batch_item_t items[PICOQUIC_HP_BATCH_MAX];
+} picoquic_hp_batch_t;
+
+/* Pool of threads used to encrypt the packets of a batch in parallel */
+typedef struct st_picoquic_crypto_workers_t picoquic_crypto_workers_t;
+
+picoquic_crypto_workers_t* picoquic_crypto_workers_create(int nb_workers);
+void picoquic_crypto_workers_delete(picoquic_crypto_workers_t* workers);
+void picoquic_crypto_workers_encrypt(picoquic_crypto_workers_t* workers, picoquic_hp_batch_t* hp_batch);
+
 /* QUIC context, defining the tables of connections,
  * open sockets, etc.
  */
+/* Connection ID and reset secret prepared in advance, see picoquic_set_cnxid_pool_size */
+typedef struct st_picoquic_cnxid_pool_item_t {
+    picoquic_connection_id_t cnx_id;
+    uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
+} picoquic_cnxid_pool_item_t;
+
 typedef struct st_picoquic_quic_t {
     void* tls_master_ctx;
     struct st_ptls_key_exchange_context_t * esni_key_exchange[16];
@@ -491,10 +660,17 @@ typedef struct st_picoquic_quic_t {
     char const* token_file_name;
     picoquic_stored_ticket_t * p_first_ticket;
     picoquic_stored_token_t * p_first_token;
-    picosplay_tree_t token_reuse_tree; /* detection of token reuse */
+    picoquic_store_state_t ticket_store; /* Index and file state of the session tickets */
+    picoquic_store_state_t token_store; /* Index and file state of the tokens */
+    picoquic_token_reuse_store_t token_reuse; /* detection of token reuse */
+    picoquic_anti_replay_fn anti_replay_fn; /* If set, replaces the local detection of token reuse */
+    void* anti_replay_ctx;
     uint32_t mtu_max;
+    size_t max_packet_size; /* Size of the packet buffers */
     uint32_t padding_multiple_default;
     uint32_t padding_minsize_default;
+    uint64_t receive_window_growth_max; /* Cap on the sum of receive window growths, 0 if none */
+    uint64_t receive_window_growth_total;
     uint32_t sequence_hole_pseudo_period; /* Optimistic ack defense */
     picoquic_spinbit_version_enum default_spin_policy;
     uint64_t crypto_epoch_length_max; /* Default packet interval between key rotations */
@@ -502,6 +678,10 @@ typedef struct st_picoquic_quic_t {
     uint32_t current_number_of_open_logs;
     uint32_t max_half_open_before_retry;
     uint32_t current_number_half_open;
+    uint32_t max_handshakes_per_ms; /* If not zero, budget of deferred server handshakes */
+    uint32_t nb_handshakes_in_period;
+    uint64_t handshake_period;
+    uint64_t nb_handshakes_deferred;
 
     /* Flags */
     unsigned int check_token : 1;
@@ -522,6 +702,7 @@ typedef struct st_picoquic_quic_t {
     picoquic_stateless_packet_t* pending_stateless_packet;
 
     picoquic_congestion_algorithm_t const* default_congestion_alg;
+    picoquic_path_scheduler_t const* default_path_scheduler;
 
     struct st_picoquic_cnx_t* cnx_list;
     struct st_picoquic_cnx_t* cnx_last;
@@ -537,13 +718,28 @@ typedef struct st_picoquic_quic_t {
     picoquic_packet_t * p_first_packet;
     size_t nb_packets_in_pool;
 
+    picoquic_hp_batch_t hp_batch;
+    picoquic_crypto_workers_t* crypto_workers;
+    int nb_crypto_workers;
+
     picoquic_connection_id_cb_fn cnx_id_callback_fn;
     void* cnx_id_callback_ctx;
 
-    void* aead_encrypt_ticket_ctx;
-    void* aead_decrypt_ticket_ctx;
+    picoquic_cnxid_pool_item_t* cnxid_pool;
+    size_t cnxid_pool_size;
+    size_t cnxid_pool_count;
+    picoquic_connection_id_cb_fn cnxid_pool_cb_fn; /* CID callback in use when the pool was filled */
+    void* cnxid_pool_cb_ctx;
+    uint8_t cnxid_pool_cid_length;
+
+    picoquic_ticket_aead_t ticket_aead[PICOQUIC_TICKET_KEYS_MAX]; /* Current key first */
+    int nb_ticket_aead;
+    picoquic_ticket_key_ring_t* ticket_key_ring; /* If set, source of the ticket keys */
+    uint64_t ticket_key_generation; /* Generation of the ring when the AEAD contexts were derived */
     void ** retry_integrity_sign_ctx;
     void ** retry_integrity_verify_ctx;
+    void ** initial_salt_hmac_ctx; /* Per version, HMAC keyed with the initial salt */
+    struct st_picoquic_initial_validation_t* initial_validation; /* Keys of the last Initial checked before creating a connection */
 
     picoquic_verify_certificate_cb_fn verify_certificate_callback_fn;
     picoquic_free_verify_certificate_ctx free_verify_certificate_callback_fn;
@@ -569,10 +765,13 @@ typedef struct st_picoquic_quic_t {
 
 picoquic_packet_context_enum picoquic_context_from_epoch(int epoch);
 
-int picoquic_registered_token_check_reuse(picoquic_quic_t* quic, const uint8_t* token, size_t token_length, uint64_t expiry_time);
+int picoquic_registered_token_check_reuse(picoquic_quic_t* quic, const uint8_t* token, size_t token_length,
+    uint64_t expiry_time, uint64_t current_time);
 
 void picoquic_registered_token_clear(picoquic_quic_t* quic, uint64_t expiry_time_max);
 
+void picoquic_registered_token_free(picoquic_quic_t* quic);
+
 /*
  * SACK dashboard item, part of connection context. Each item
  * holds a range of packet numbers that have been received.
@@ -615,17 +814,31 @@ typedef struct st_picoquic_stream_data_node_t {
     uint64_t offset;  /* Stream offset of the first octet in "bytes" */
     size_t length;    /* Number of octets in "bytes" */
     uint8_t* bytes;
+    picoquic_stream_data_release_fn release_fn; /* If not NULL, "bytes" is owned by the application */
+    void* release_ctx;
 } picoquic_stream_data_node_t;
 
+/* Receive window auto-tuning state, see picoquic_tune_receive_window.
+ * The window is the credit granted to the peer ahead of the data received
+ * on the connection, or consumed on the stream. */
+typedef struct st_picoquic_receive_window_t {
+    uint64_t window;
+    uint64_t epoch_start_time;
+    uint64_t epoch_start_offset;
+    uint64_t bytes_per_rtt; /* Measured during the previous epoch */
+} picoquic_receive_window_t;
+
 typedef struct st_picoquic_stream_head_t {
-    picosplay_node_t stream_node; /* splay of streams in connection context */
     struct st_picoquic_stream_head_t * next_output_stream; /* link in the list of output streams */
     struct st_picoquic_stream_head_t * previous_output_stream;
+    struct st_picoquic_stream_head_t * next_blocked_stream; /* link in the list of blocked streams */
+    struct st_picoquic_stream_head_t * previous_blocked_stream;
     uint64_t stream_id;
     uint64_t consumed_offset; /* amount of data consumed by the application */
     uint64_t fin_offset; /* If the fin mark is received, index of the byte after last */
     uint64_t maxdata_local; /* flow control limit of how much the peer is authorized to send */
     uint64_t maxdata_remote; /* flow control limit of how much we authorize the peer to send */
+    picoquic_receive_window_t receive_window;
     uint64_t local_error;
     uint64_t remote_error;
     uint64_t local_stop_error;
@@ -637,6 +850,7 @@ typedef struct st_picoquic_stream_head_t {
     picoquic_stream_direct_receive_fn direct_receive_fn; /* direct receive function, if not NULL */
     void* direct_receive_ctx; /* direct receive context */
     picoquic_sack_item_t first_sack_item; /* Track which parts of the stream were acknowledged by the peer */
+    uint8_t urgency; /* Extensible priority urgency, 0 (most urgent) to 7, see RFC 9218 */
     /* Flags describing the state of the stream */
     unsigned int is_active : 1; /* The application is actively managing data sending through callbacks */
     unsigned int fin_requested : 1; /* Application has requested Fin of sending stream */
@@ -654,6 +868,9 @@ typedef struct st_picoquic_stream_head_t {
     unsigned int max_stream_updated : 1; /* After stream was closed in both directions, the max stream id number was updated */
     unsigned int stream_data_blocked_sent : 1; /* If stream_data_blocked has been sent to peer, and no data sent on stream since */
     unsigned int is_output_stream : 1; /* If stream is listed in the output list */
+    unsigned int is_output_front : 1; /* Stream was inserted in front of the output list, see picoquic_insert_output_stream */
+    unsigned int is_blocked_stream : 1; /* If stream is listed in the blocked list */
+    unsigned int is_incremental : 1; /* Stream shares bandwidth with other incremental streams of same urgency */
     unsigned int is_closed : 1; /* Stream is closed, closure is accouted for */
 } picoquic_stream_head_t;
 
@@ -665,6 +882,30 @@ typedef struct st_picoquic_stream_head_t {
 #define STREAM_TYPE_FROM_ID(id) ((id)&3)
 #define NEXT_STREAM_ID_FOR_TYPE(id) ((id)+4)
 
+/*
+ * The streams of each type are kept in a table indexed by stream rank.
+ * Stream IDs of a given type are opened in sequence, so the table is
+ * dense. The table is made of pages of PICOQUIC_STREAM_PAGE_SIZE entries,
+ * and a page is freed when all its streams are deleted, so the table
+ * slides forward as old streams are closed and new ones are opened.
+ */
+#define PICOQUIC_STREAM_PAGE_BITS 6
+#define PICOQUIC_STREAM_PAGE_SIZE (1 << PICOQUIC_STREAM_PAGE_BITS)
+#define PICOQUIC_STREAM_PAGE_MASK (PICOQUIC_STREAM_PAGE_SIZE - 1)
+
+typedef struct st_picoquic_stream_page_t {
+    size_t nb_streams;
+    picoquic_stream_head_t* stream[PICOQUIC_STREAM_PAGE_SIZE];
+} picoquic_stream_page_t;
+
+typedef struct st_picoquic_stream_table_t {
+    picoquic_stream_page_t** page; /* page[i] holds the streams of page number first_page + i, or NULL */
+    uint64_t first_page;
+    size_t nb_pages;
+    size_t nb_pages_max;
+    size_t nb_streams;
+} picoquic_stream_table_t;
+
 /*
  * Frame queue. This is used for miscellaneous packets. It is also used for
  * various tests, allowing for fault injection. 
@@ -682,6 +923,9 @@ typedef struct st_picoquic_misc_frame_header_t {
     struct st_picoquic_misc_frame_header_t* previous_misc_frame;
     size_t length;
     int is_pure_ack;
+    int is_datagram; /* Application datagram, subject to expiry and to the queue limit */
+    uint8_t priority; /* Datagram priority class, lower values are sent first */
+    uint64_t expire_time; /* Datagram is dropped if not sent by that time, 0 if no deadline */
 } picoquic_misc_frame_header_t;
 
 /* Local CID.
@@ -698,6 +942,7 @@ typedef struct st_picoquic_local_cnxid_t {
     struct st_picoquic_cnx_id_key_t* first_cnx_id;
     uint64_t sequence;
     picoquic_connection_id_t cnx_id;
+    uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
 } picoquic_local_cnxid_t;
 
 /*
@@ -774,9 +1019,22 @@ typedef struct st_picoquic_path_t {
     uint64_t max_reorder_gap;
     uint64_t latest_sent_time;
 
-    /* MTU */
+    /* Per path loss detection, used in multipath mode. The packets sent on the
+     * path are numbered in sequence. The acknowledgement of the most recent one
+     * is the reference for the RACK logic, instead of the connection wide
+     * highest acknowledged packet. */
+    uint64_t path_packet_next;
+    uint64_t path_packet_acked_next; /* 1 + highest path packet number acknowledged, 0 if none */
+    uint64_t path_packet_acked_time;
+    uint64_t path_packet_acked_sent_time;
+
+    /* MTU discovery */
     size_t send_mtu;
-    size_t send_mtu_max_tried;
+    size_t send_mtu_max_tried; /* Smallest size known to fail, 0 if none */
+    size_t mtu_probe_size; /* Size of the last probe sent */
+    int mtu_probe_losses; /* Number of probes of that size lost */
+    picoquic_pmtud_state_enum pmtud_state;
+    uint64_t pmtud_raise_time; /* Search again after that time, once complete */
 
     /* Bandwidth measurement */
     uint64_t delivered; /* The total amount of data delivered so far on the path */
@@ -821,8 +1079,13 @@ typedef struct st_picoquic_path_t {
     int64_t pacing_packet_time_nanosec;
     uint64_t pacing_packet_time_microsec;
 
-    /* MTU safety tracking */
+    /* MTU safety tracking. Losses of full size packets are only counted if no
+     * full size packet sent later was acknowledged. */
     uint64_t nb_mtu_losses;
+    uint64_t mtu_acked_sent_time; /* Send time of last full size packet acknowledged */
+    uint64_t nb_mtu_probes_sent;
+    uint64_t nb_mtu_probes_lost;
+    uint64_t nb_mtu_black_holes;
 
     /* Loss bit data */
     uint64_t total_bytes_lost; /* Sum of length of packet lost on this path */
@@ -843,6 +1106,9 @@ typedef struct st_picoquic_crypto_context_t {
     void* aead_decrypt;
     void* pn_enc; /* Used for PN encryption */
     void* pn_dec; /* Used for PN decryption */
+    void* pn_enc_ecb; /* ECB form of the PN encryption key if the suite uses AES, for batch masks */
+    void* pn_dec_ecb; /* ECB form of the PN decryption key */
+    void* aead_encrypt_workers[PICOQUIC_CRYPTO_WORKERS_MAX]; /* copies of aead_encrypt, one per crypto worker */
 } picoquic_crypto_context_t;
 
 /* Per epoch sequence/packet context.
@@ -881,7 +1147,16 @@ typedef struct st_picoquic_packet_context_t {
     uint64_t ecn_ect0_total_remote;
     uint64_t ecn_ect1_total_remote;
     uint64_t ecn_ce_total_remote;
+    /* Cache of the encoded ACK blocks that follow the first range. The
+     * encoding of these blocks only depends on the start of the first range
+     * and on the following ranges, so it remains valid while packets arrive
+     * in sequence and only extend the first range. */
+    uint64_t ack_blocks_cache_first_start;
+    uint16_t ack_blocks_cache_end[PICOQUIC_MAX_ACK_BLOCKS]; /* end of each encoded block in cache */
+    uint8_t ack_blocks_cache[PICOQUIC_ACK_BLOCKS_CACHE_SIZE];
+    uint8_t ack_blocks_cache_nb;
     /* Flags */
+    unsigned int ack_blocks_cache_valid : 1;
     unsigned int ack_needed : 1;
     unsigned int ack_of_ack_requested : 1;
     unsigned int ack_after_fin : 1;
@@ -940,6 +1215,7 @@ typedef struct st_picoquic_cnx_t {
     unsigned int is_loss_bit_enabled_outgoing : 1; /* Insert the loss bits in outgoing packets */
     unsigned int is_pmtud_required : 1; /* Force PMTU discovery */
     unsigned int is_ack_frequency_negotiated : 1; /* Ack Frequency extension negotiated */
+    unsigned int is_datagram_ready : 1; /* Application provides datagrams just in time */
     unsigned int is_ack_frequency_updated : 1; /* Should send an ack frequency frame asap. */
     unsigned int recycle_sooner_needed : 1; /* There may be a need to recycle "sooner" packets */
     unsigned int is_time_stamp_enabled : 1; /* Read time stamp on on incoming */
@@ -952,6 +1228,9 @@ typedef struct st_picoquic_cnx_t {
     unsigned int quic_bit_received_0 : 1; /* Indicate whether the quic bit was received as zero at least once */
     unsigned int is_half_open : 1; /* for server side connections, created but not yet complete */
     unsigned int did_receive_short_initial : 1; /* whether peer sent unpadded initial packet */
+    unsigned int is_handshake_deferred : 1; /* server side, client hello waiting for the handshake budget */
+    unsigned int is_next_key_phase_needed : 1; /* Keys of the next key phase shall be computed before the next update */
+    unsigned int is_multipath_enabled : 1; /* Negotiated concurrent use of multiple paths */
 
     /* Spin bit policy */
     picoquic_spinbit_version_enum spin_policy;
@@ -988,6 +1267,7 @@ typedef struct st_picoquic_cnx_t {
     uint64_t offending_frame_type;
     uint16_t retry_token_length;
     uint8_t * retry_token;
+    picoquic_stored_ticket_t* resumption_ticket; /* Stored ticket used by the handshake, released when complete */
 
     /* Next time sending data is expected */
     uint64_t next_wake_time;
@@ -1028,12 +1308,16 @@ typedef struct st_picoquic_cnx_t {
     uint64_t nb_packets_logged;
     uint64_t nb_retransmission_total;
     uint64_t nb_spurious;
+    uint64_t nb_stream_frames_redundant; /* Stream frames copied by the redundant path scheduler */
     uint64_t nb_crypto_key_rotations;
     unsigned int cwin_blocked : 1;
     unsigned int flow_blocked : 1;
     unsigned int stream_blocked : 1;
     /* Congestion algorithm */
     picoquic_congestion_algorithm_t const* congestion_alg;
+    /* Multipath scheduler */
+    picoquic_path_scheduler_t const* path_scheduler;
+    int path_scheduler_next; /* Next path considered by the round robin schedulers */
     uint64_t pacing_rate_signalled;
     uint64_t pacing_increase_threshold;
     uint64_t pacing_decrease_threshold;
@@ -1047,6 +1331,8 @@ typedef struct st_picoquic_cnx_t {
     uint64_t data_received;
     uint64_t maxdata_local;
     uint64_t maxdata_remote;
+    picoquic_receive_window_t receive_window;
+    uint64_t receive_window_growth; /* Part of the window counted in the context's growth total */
     uint64_t max_stream_id_bidir_local;
     uint64_t max_stream_id_bidir_local_computed;
     uint64_t max_stream_id_unidir_local;
@@ -1059,9 +1345,11 @@ typedef struct st_picoquic_cnx_t {
     picoquic_misc_frame_header_t* last_misc_frame;
 
     /* Management of streams */
-    picosplay_tree_t stream_tree;
+    picoquic_stream_table_t stream_table[4]; /* One table per stream type, see STREAM_TYPE_FROM_ID */
     picoquic_stream_head_t * first_output_stream;
     picoquic_stream_head_t * last_output_stream;
+    picoquic_stream_head_t * last_output_stream_by_urgency[PICOQUIC_STREAM_URGENCY_MAX + 1];
+    picoquic_stream_head_t * first_blocked_stream;
     uint64_t high_priority_stream_id;
     uint64_t next_stream_id[4];
 
@@ -1073,6 +1361,12 @@ typedef struct st_picoquic_cnx_t {
     /* Management of datagrams */
     picoquic_misc_frame_header_t* first_datagram;
     picoquic_misc_frame_header_t* last_datagram;
+    size_t datagram_queue_bytes;
+    size_t datagram_queue_max_bytes; /* 0 if the queue is not bounded */
+    uint64_t datagram_next_expire_time; /* Earliest deadline in the queue, UINT64_MAX if none */
+    uint64_t nb_datagrams_expired;
+    uint64_t nb_datagrams_dropped_queue_full;
+    uint64_t nb_datagrams_dropped_too_large;
 
     /* If not `0`, the connection will send keep alive messages in the given interval. */
     uint64_t keep_alive_interval;
@@ -1144,6 +1438,9 @@ void picoquic_set_path_challenge(picoquic_cnx_t* cnx, int path_id, uint64_t curr
 int picoquic_find_path_by_address(picoquic_cnx_t* cnx, const struct sockaddr* addr_local, const struct sockaddr* addr_peer, int* partial_match);
 int picoquic_assign_peer_cnxid_to_path(picoquic_cnx_t* cnx, int path_id);
 void picoquic_reset_path_mtu(picoquic_path_t* path_x);
+void picoquic_update_path_mtu_on_ack(picoquic_path_t* path_x, size_t packet_size, uint64_t send_time);
+void picoquic_update_path_mtu_on_loss(picoquic_cnx_t* cnx, picoquic_path_t* path_x, size_t packet_size,
+    uint64_t send_time);
 int picoquic_probe_new_path_ex(picoquic_cnx_t* cnx, const struct sockaddr* addr_from,
     const struct sockaddr* addr_to, uint64_t current_time, int to_preferred_address);
 
@@ -1193,6 +1490,7 @@ void picoquic_update_pacing_rate(picoquic_cnx_t* cnx, picoquic_path_t* path_x, d
 /* Next time is used to order the list of available connections,
         * so ready connections are polled first */
 void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx, uint64_t next_time);
+void picoquic_refill_cnxid_pool(picoquic_quic_t* quic);
 
 /* Integer parsing macros */
 #define PICOPARSE_16(b) ((((uint16_t)(b)[0]) << 8) | (uint16_t)((b)[1]))
@@ -1200,6 +1498,11 @@ void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
 #define PICOPARSE_32(b) ((((uint32_t)PICOPARSE_16(b)) << 16) | (uint32_t)PICOPARSE_16((b) + 2))
 #define PICOPARSE_64(b) ((((uint64_t)PICOPARSE_32(b)) << 32) | (uint64_t)PICOPARSE_32((b) + 4))
 
+/* Branch free decoding of a varint, assuming that at least 8 bytes are available.
+ * The 8 bytes are parsed as a 64 bit integer, which is then shifted and masked
+ * according to the length encoded in the first 2 bits. */
+#define VARINT_DECODE_8(b) ((PICOPARSE_64(b) >> (64 - (8 << ((b)[0] >> 6)))) & (UINT64_MAX >> (66 - (8 << ((b)[0] >> 6)))))
+
 /* Integer formatting functions */
 void picoformat_16(uint8_t* bytes, uint16_t n16);
 void picoformat_24(uint8_t* bytes, uint32_t n24);
@@ -1212,6 +1515,8 @@ size_t picoquic_varint_decode(const uint8_t* bytes, size_t max_bytes, uint64_t*
 const uint8_t* picoquic_frames_varint_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* n64);
 const uint8_t* picoquic_frames_varint_skip(const uint8_t* bytes, const uint8_t* bytes_max);
 size_t picoquic_varint_skip(const uint8_t* bytes);
+size_t picoquic_varint_decode_n(const uint8_t* bytes, size_t max_bytes, uint64_t* n64, size_t nb_varints);
+size_t picoquic_varint_skip_n(const uint8_t* bytes, size_t max_bytes, size_t nb_varints);
 
 size_t picoquic_encode_varint_length(uint64_t n64);
 size_t picoquic_decode_varint_length(uint8_t byte);
@@ -1258,6 +1563,8 @@ void picoquic_finalize_and_protect_packet(picoquic_cnx_t *cnx, picoquic_packet_t
     picoquic_connection_id_t * local_cnxid,
     picoquic_path_t * path_x, uint64_t current_time);
 
+void picoquic_protect_batch_flush(picoquic_quic_t* quic);
+
 void picoquic_implicit_handshake_ack(picoquic_cnx_t* cnx, picoquic_packet_context_enum pc, uint64_t current_time);
 void picoquic_ready_state_transition(picoquic_cnx_t* cnx, uint64_t current_time);
 
@@ -1315,12 +1622,17 @@ int picoquic_delete_stream_if_closed(picoquic_cnx_t* cnx, picoquic_stream_head_t
 
 void picoquic_update_stream_initial_remote(picoquic_cnx_t* cnx);
 
-picoquic_stream_head_t * picoquic_stream_from_node(picosplay_node_t * node);
 void picoquic_insert_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream);
 void picoquic_remove_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream, picoquic_stream_head_t * previous_stream);
+void picoquic_requeue_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+void picoquic_remove_blocked_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+int picoquic_is_stream_blocked(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+int picoquic_is_stream_ready(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+void picoquic_update_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
 picoquic_stream_head_t * picoquic_first_stream(picoquic_cnx_t * cnx);
 picoquic_stream_head_t * picoquic_last_stream(picoquic_cnx_t * cnx);
-picoquic_stream_head_t * picoquic_next_stream(picoquic_stream_head_t * stream);
+picoquic_stream_head_t * picoquic_next_stream(picoquic_cnx_t * cnx, picoquic_stream_head_t * stream);
+size_t picoquic_nb_streams(picoquic_cnx_t * cnx);
 picoquic_stream_head_t* picoquic_find_stream(picoquic_cnx_t* cnx, uint64_t stream_id);
 void picoquic_add_output_streams(picoquic_cnx_t * cnx, uint64_t old_limit, uint64_t new_limit, unsigned int is_bidir);
 picoquic_stream_head_t* picoquic_find_ready_stream(picoquic_cnx_t* cnx);
@@ -1356,6 +1668,10 @@ int picoquic_copy_before_retransmit(picoquic_packet_t * old_p,
     int * packet_is_pure_ack,
     int * do_not_detect_spurious,
     size_t * length);
+picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    uint64_t current_time);
+size_t picoquic_prepare_mtu_probe(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    size_t header_length, size_t checksum_length, uint8_t* bytes, size_t bytes_max);
 
 void picoquic_set_ack_needed(picoquic_cnx_t* cnx, uint64_t current_time, picoquic_packet_context_enum pc);
 
@@ -1381,9 +1697,16 @@ uint8_t* picoquic_format_application_close_frame(picoquic_cnx_t* cnx, uint8_t* b
 uint8_t* picoquic_format_required_max_stream_data_frames(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 uint8_t* picoquic_format_max_data_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, uint64_t maxdata_increase);
 uint8_t* picoquic_format_max_stream_data_frame(picoquic_stream_head_t* stream, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, uint64_t new_max_data);
-uint64_t picoquic_cc_increased_window(picoquic_cnx_t* cnx, uint64_t previous_window); /* Trigger sending more data if window increases */
+
+/* Receive window auto-tuning */
+uint64_t picoquic_tune_receive_window(picoquic_receive_window_t* receive_window, uint64_t offset,
+    uint64_t rtt, uint64_t current_time);
+void picoquic_tune_connection_receive_window(picoquic_cnx_t* cnx, uint64_t current_time);
+int picoquic_is_stream_max_data_needed(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint64_t current_time);
+int picoquic_should_send_max_data(picoquic_cnx_t* cnx);
 uint8_t* picoquic_format_max_streams_frame_if_needed(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 void picoquic_clear_stream(picoquic_stream_head_t* stream);
+void picoquic_free_send_queue_node(picoquic_stream_data_node_t* stream_data);
 void picoquic_delete_stream(picoquic_cnx_t * cnx, picoquic_stream_head_t * stream);
 picoquic_local_cnxid_t* picoquic_create_local_cnxid(picoquic_cnx_t* cnx, picoquic_connection_id_t* suggested_value);
 void picoquic_delete_local_cnxid(picoquic_cnx_t* cnx, picoquic_local_cnxid_t* l_cid);
@@ -1401,7 +1724,8 @@ uint8_t* picoquic_format_first_misc_frame(picoquic_cnx_t* cnx, uint8_t* bytes, u
 int picoquic_queue_misc_or_dg_frame(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, const uint8_t* bytes, size_t length, int is_pure_ack);
 void picoquic_delete_misc_or_dg(picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, picoquic_misc_frame_header_t* frame);
 int picoquic_queue_handshake_done_frame(picoquic_cnx_t* cnx);
-uint8_t* picoquic_format_first_datagram_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
+uint8_t* picoquic_format_first_datagram_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, uint64_t current_time);
+uint8_t* picoquic_format_ready_datagram_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, int* ret);
 const uint8_t* picoquic_parse_ack_frequency_frame(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* seq, uint64_t* packets, uint64_t* microsec);
 uint8_t* picoquic_format_ack_frequency_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data);
 uint8_t* picoquic_format_time_stamp_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, uint64_t current_time);
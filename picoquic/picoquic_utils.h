@@ -147,10 +147,16 @@ FILE * picoquic_file_close(FILE * F);
 
 int picoquic_file_delete(char const* file_name, int* last_err);
 
+/* Map a file in memory for reading, in a portable way */
+uint8_t* picoquic_file_map(char const* file_name, size_t* file_size, int* last_err);
+void picoquic_file_unmap(uint8_t* bytes, size_t file_size);
+
 /* Skip and decoding functions */
 const uint8_t* picoquic_frames_fixed_skip(const uint8_t * bytes, const uint8_t * bytes_max, size_t size);
 const uint8_t* picoquic_frames_varint_skip(const uint8_t * bytes, const uint8_t * bytes_max);
 const uint8_t* picoquic_frames_varint_decode(const uint8_t * bytes, const uint8_t * bytes_max, uint64_t * n64);
+const uint8_t* picoquic_frames_varint_decode_n(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* n64, size_t nb_varints);
+const uint8_t* picoquic_frames_varint_skip_n(const uint8_t* bytes, const uint8_t* bytes_max, size_t nb_varints);
 const uint8_t* picoquic_frames_varlen_decode(const uint8_t * bytes, const uint8_t * bytes_max, size_t * n);
 const uint8_t* picoquic_frames_uint8_decode(const uint8_t * bytes, const uint8_t * bytes_max, uint8_t * n);
 const uint8_t* picoquic_frames_uint16_decode(const uint8_t * bytes, const uint8_t * bytes_max, uint16_t * n);
@@ -239,7 +245,7 @@ typedef struct st_picoquictest_sim_packet_t {
     size_t length;
     struct sockaddr_storage addr_from;
     struct sockaddr_storage addr_to;
-    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t bytes[PICOQUIC_MAX_JUMBO_PACKET_SIZE];
 } picoquictest_sim_packet_t;
 
 typedef struct st_picoquictest_sim_link_t {
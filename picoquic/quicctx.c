@@ -229,77 +229,308 @@ picoquic_packet_context_enum picoquic_context_from_epoch(int epoch)
 
 /* Token reuse management */
 
-static int64_t picoquic_registered_token_compare(void* l, void* r)
+static picoquic_token_reuse_slot_t* picoquic_registered_token_slot(picoquic_token_reuse_store_t* store, uint64_t expiry_time)
 {
-    /* STream values are from 0 to 2^62-1, which means we are not worried with rollover */
-    picoquic_registered_token_t* rt_l = (picoquic_registered_token_t*)l;
-    picoquic_registered_token_t* rt_r = (picoquic_registered_token_t*)r;
-    int64_t ret = rt_l->token_time - rt_r->token_time;
-    if (ret == 0) {
-        ret = rt_l->token_hash - rt_r->token_hash;
+    if (store->slots == NULL) {
+        store->slots = (picoquic_token_reuse_slot_t*)malloc(
+            sizeof(picoquic_token_reuse_slot_t) * PICOQUIC_TOKEN_REUSE_NB_SLOTS);
+        if (store->slots == NULL) {
+            return NULL;
+        }
+        memset(store->slots, 0, sizeof(picoquic_token_reuse_slot_t) * PICOQUIC_TOKEN_REUSE_NB_SLOTS);
     }
-    return ret;
+
+    return &store->slots[(expiry_time / PICOQUIC_TOKEN_REUSE_SLOT_WIDTH) % PICOQUIC_TOKEN_REUSE_NB_SLOTS];
 }
 
-static picosplay_node_t* picoquic_registered_token_create(void* value)
+static void picoquic_registered_token_slot_empty(picoquic_token_reuse_store_t* store, picoquic_token_reuse_slot_t* slot)
 {
-    return &((picoquic_registered_token_t*)value)->registered_token_node;
+    for (size_t i = 0; i < slot->table_size; i++) {
+        while (slot->table[i] != NULL) {
+            picoquic_registered_token_t* rt = slot->table[i];
+            slot->table[i] = rt->next_token;
+            free(rt);
+        }
+    }
+    if (slot->table != NULL) {
+        free(slot->table);
+    }
+    if (slot->filter != NULL) {
+        free(slot->filter);
+    }
+    store->nb_tokens -= slot->nb_tokens;
+    memset(slot, 0, sizeof(picoquic_token_reuse_slot_t));
 }
 
+/* The token hash comes from an AEAD checksum. Its low bits are used as
+ * index in the table, and the filter positions are derived from the high
+ * bits of the hash multiplied by three odd constants, so that they do not
+ * depend on the size of the filter. */
+static int picoquic_registered_token_filter_check(picoquic_token_reuse_slot_t* slot, uint64_t token_hash, int do_set)
+{
+    static const uint64_t filter_mult[3] = {
+        0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull };
+    size_t filter_bits = slot->table_size * PICOQUIC_TOKEN_REUSE_FILTER_BITS_PER_ENTRY;
+    int is_present = 1;
+
+    if (slot->filter == NULL) {
+        /* No token registered in the slot yet */
+        return 0;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        uint64_t bit = ((token_hash * filter_mult[i]) >> 32) & (filter_bits - 1);
+        uint64_t mask = 1ull << (bit & 63);
+
+        if ((slot->filter[bit >> 6] & mask) == 0) {
+            is_present = 0;
+        }
+        if (do_set) {
+            slot->filter[bit >> 6] |= mask;
+        }
+    }
+
+    return is_present;
+}
 
-static void* picoquic_registered_token_value(picosplay_node_t* node)
+static int picoquic_registered_token_table_grow(picoquic_token_reuse_slot_t* slot)
 {
-    return (void*)((char*)node - offsetof(struct st_picoquic_registered_token_t, registered_token_node));
+    int ret = 0;
+    size_t new_size = (slot->table_size == 0) ? PICOQUIC_TOKEN_REUSE_TABLE_MIN : 2 * slot->table_size;
+    size_t filter_words = new_size * PICOQUIC_TOKEN_REUSE_FILTER_BITS_PER_ENTRY / 64;
+    picoquic_registered_token_t** new_table = (picoquic_registered_token_t**)malloc(
+        sizeof(picoquic_registered_token_t*) * new_size);
+    uint64_t* new_filter = (uint64_t*)malloc(sizeof(uint64_t) * filter_words);
+
+    if (new_table == NULL || new_filter == NULL) {
+        if (new_table != NULL) {
+            free(new_table);
+        }
+        if (new_filter != NULL) {
+            free(new_filter);
+        }
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(new_table, 0, sizeof(picoquic_registered_token_t*) * new_size);
+        memset(new_filter, 0, sizeof(uint64_t) * filter_words);
+        for (size_t i = 0; i < slot->table_size; i++) {
+            while (slot->table[i] != NULL) {
+                picoquic_registered_token_t* rt = slot->table[i];
+                size_t x = (size_t)(rt->token_hash & (new_size - 1));
+                slot->table[i] = rt->next_token;
+                rt->next_token = new_table[x];
+                new_table[x] = rt;
+            }
+        }
+        if (slot->table != NULL) {
+            free(slot->table);
+        }
+        if (slot->filter != NULL) {
+            free(slot->filter);
+        }
+        slot->table = new_table;
+        slot->table_size = new_size;
+        slot->filter = new_filter;
+        /* Rebuild the filter for the new size */
+        for (size_t i = 0; i < new_size; i++) {
+            for (picoquic_registered_token_t* rt = new_table[i]; rt != NULL; rt = rt->next_token) {
+                (void)picoquic_registered_token_filter_check(slot, rt->token_hash, 1);
+            }
+        }
+    }
+
+    return ret;
 }
 
-static void picoquic_registered_token_delete(void* tree, picosplay_node_t* node)
+/* When the store is full, empty the slot whose tokens are nearest to expiry.
+ * The evicted tokens could be replayed until they expire, but refusing all
+ * new tokens until then would fail every new handshake that uses a token.
+ */
+static int picoquic_registered_token_evict(picoquic_token_reuse_store_t* store)
 {
-    picoquic_registered_token_t* rt = (picoquic_registered_token_t*)picoquic_registered_token_value(node);
-    free(rt);
+    picoquic_token_reuse_slot_t* oldest = NULL;
+
+    for (int i = 0; i < PICOQUIC_TOKEN_REUSE_NB_SLOTS; i++) {
+        picoquic_token_reuse_slot_t* slot = &store->slots[i];
+        if (slot->nb_tokens > 0 && (oldest == NULL || slot->time_max < oldest->time_max)) {
+            oldest = slot;
+        }
+    }
+
+    if (oldest != NULL) {
+        DBG_PRINTF("Token store full, evicting %zu tokens", oldest->nb_tokens);
+        picoquic_registered_token_slot_empty(store, oldest);
+    }
+
+    return (oldest != NULL);
 }
 
-int picoquic_registered_token_check_reuse(picoquic_quic_t * quic,
+int picoquic_token_reuse_store_check(picoquic_token_reuse_store_t* store,
     const uint8_t * token, size_t token_length, uint64_t expiry_time)
 {
     int ret = -1;
     if (token_length >= 8) {
-        picoquic_registered_token_t* rt = (picoquic_registered_token_t*)malloc(sizeof(picoquic_registered_token_t));
-        if (rt != NULL) {
-            picosplay_node_t* rt_n = NULL;
-            memset(rt, 0, sizeof(picoquic_registered_token_t));
-            rt->token_time = expiry_time;
-            rt->token_hash = PICOPARSE_64(token + token_length - 8);
-            rt->count = 1;
-            rt_n = picosplay_find(&quic->token_reuse_tree, rt);
-            if (rt_n != NULL) {
-                free(rt);
-                rt = (picoquic_registered_token_t*)picoquic_registered_token_value(rt_n);
+        uint64_t token_hash = PICOPARSE_64(token + token_length - 8);
+        picoquic_token_reuse_slot_t* slot = picoquic_registered_token_slot(store, expiry_time);
+        picoquic_registered_token_t* rt = NULL;
+
+        if (slot != NULL) {
+            size_t max_tokens = (store->max_tokens == 0) ? PICOQUIC_TOKEN_REUSE_MAX_TOKENS : store->max_tokens;
+
+            if (slot->nb_tokens > 0 && slot->time_max < store->clear_time) {
+                /* All the tokens in the slot have expired */
+                picoquic_registered_token_slot_empty(store, slot);
+            }
+
+            if (picoquic_registered_token_filter_check(slot, token_hash, 0)) {
+                /* Possible reuse, confirm with an exact lookup */
+                rt = slot->table[token_hash & (slot->table_size - 1)];
+                while (rt != NULL && (rt->token_hash != token_hash || rt->token_time != expiry_time)) {
+                    rt = rt->next_token;
+                }
+            }
+
+            if (rt != NULL && rt->token_time >= store->clear_time) {
                 rt->count++;
                 DBG_PRINTF("Token reuse detected, count=%d", rt->count);
             }
-            else {
-                (void)picosplay_insert(&quic->token_reuse_tree, rt);
+            else if (rt != NULL) {
+                /* The previous registration had expired */
+                rt->count = 1;
                 ret = 0;
             }
+            else if ((store->nb_tokens < max_tokens || picoquic_registered_token_evict(store)) &&
+                (slot->nb_tokens < 2 * slot->table_size || picoquic_registered_token_table_grow(slot) == 0)) {
+                rt = (picoquic_registered_token_t*)malloc(sizeof(picoquic_registered_token_t));
+                if (rt != NULL) {
+                    size_t x = (size_t)(token_hash & (slot->table_size - 1));
+                    memset(rt, 0, sizeof(picoquic_registered_token_t));
+                    rt->token_time = expiry_time;
+                    rt->token_hash = token_hash;
+                    rt->count = 1;
+                    rt->next_token = slot->table[x];
+                    slot->table[x] = rt;
+                    slot->nb_tokens++;
+                    store->nb_tokens++;
+                    if (expiry_time > slot->time_max) {
+                        slot->time_max = expiry_time;
+                    }
+                    (void)picoquic_registered_token_filter_check(slot, token_hash, 1);
+                    ret = 0;
+                }
+            }
         }
     }
 
     return ret;
 }
 
-void picoquic_registered_token_clear(picoquic_quic_t* quic, uint64_t expiry_time_max)
+void picoquic_token_reuse_store_clear(picoquic_token_reuse_store_t* store, uint64_t expiry_time_max)
 {
-    int end_reached = 0;
-    do {
-        picoquic_registered_token_t* rt_first = (picoquic_registered_token_t*)
-            picoquic_registered_token_value(picosplay_first(&quic->token_reuse_tree));
-        if (rt_first == NULL || rt_first->token_time >= expiry_time_max) {
-            end_reached = 1;
+    if (expiry_time_max > store->clear_time) {
+        uint64_t scan_id = expiry_time_max / PICOQUIC_TOKEN_REUSE_SLOT_WIDTH;
+
+        store->clear_time = expiry_time_max;
+
+        /* Expired slots are freed at most once per slot width */
+        if (scan_id != store->scan_id && store->slots != NULL) {
+            store->scan_id = scan_id;
+            for (int i = 0; i < PICOQUIC_TOKEN_REUSE_NB_SLOTS; i++) {
+                picoquic_token_reuse_slot_t* slot = &store->slots[i];
+                if (slot->nb_tokens > 0 && slot->time_max < expiry_time_max) {
+                    picoquic_registered_token_slot_empty(store, slot);
+                }
+            }
         }
-        else {
-            picosplay_delete_hint(&quic->token_reuse_tree, &rt_first->registered_token_node);
+    }
+}
+
+void picoquic_token_reuse_store_free(picoquic_token_reuse_store_t* store)
+{
+    if (store->slots != NULL) {
+        for (int i = 0; i < PICOQUIC_TOKEN_REUSE_NB_SLOTS; i++) {
+            picoquic_registered_token_slot_empty(store, &store->slots[i]);
+        }
+        free(store->slots);
+        store->slots = NULL;
+    }
+}
+
+int picoquic_registered_token_check_reuse(picoquic_quic_t* quic,
+    const uint8_t* token, size_t token_length, uint64_t expiry_time, uint64_t current_time)
+{
+    if (quic->anti_replay_fn != NULL) {
+        return quic->anti_replay_fn(quic->anti_replay_ctx, token, token_length, expiry_time, current_time);
+    }
+    else {
+        return picoquic_token_reuse_store_check(&quic->token_reuse, token, token_length, expiry_time);
+    }
+}
+
+void picoquic_registered_token_clear(picoquic_quic_t* quic, uint64_t expiry_time_max)
+{
+    picoquic_token_reuse_store_clear(&quic->token_reuse, expiry_time_max);
+}
+
+void picoquic_registered_token_free(picoquic_quic_t* quic)
+{
+    picoquic_token_reuse_store_free(&quic->token_reuse);
+}
+
+void picoquic_set_token_reuse_max(picoquic_quic_t* quic, size_t max_tokens)
+{
+    quic->token_reuse.max_tokens = max_tokens;
+}
+
+void picoquic_set_anti_replay_fn(picoquic_quic_t* quic, picoquic_anti_replay_fn anti_replay_fn, void* anti_replay_ctx)
+{
+    quic->anti_replay_fn = anti_replay_fn;
+    quic->anti_replay_ctx = anti_replay_ctx;
+}
+
+/* Anti-replay store shared between QUIC contexts */
+picoquic_anti_replay_store_t* picoquic_anti_replay_store_create(void)
+{
+    picoquic_anti_replay_store_t* store = (picoquic_anti_replay_store_t*)malloc(sizeof(picoquic_anti_replay_store_t));
+
+    if (store != NULL) {
+        memset(store, 0, sizeof(picoquic_anti_replay_store_t));
+        if (picoquic_create_mutex(&store->mutex) != 0) {
+            free(store);
+            store = NULL;
         }
-    } while (!end_reached);
+    }
+
+    return store;
+}
+
+void picoquic_anti_replay_store_delete(picoquic_anti_replay_store_t* store)
+{
+    picoquic_token_reuse_store_free(&store->store);
+    (void)picoquic_delete_mutex(&store->mutex);
+    free(store);
+}
+
+int picoquic_anti_replay_store_check(void* anti_replay_ctx, const uint8_t* token, size_t token_length,
+    uint64_t expiry_time, uint64_t current_time)
+{
+    int ret;
+    picoquic_anti_replay_store_t* store = (picoquic_anti_replay_store_t*)anti_replay_ctx;
+
+    (void)picoquic_lock_mutex(&store->mutex);
+    picoquic_token_reuse_store_clear(&store->store, current_time);
+    ret = picoquic_token_reuse_store_check(&store->store, token, token_length, expiry_time);
+    (void)picoquic_unlock_mutex(&store->mutex);
+
+    return ret;
+}
+
+void picoquic_anti_replay_store_set_max_tokens(picoquic_anti_replay_store_t* store, size_t max_tokens)
+{
+    (void)picoquic_lock_mutex(&store->mutex);
+    store->store.max_tokens = max_tokens;
+    (void)picoquic_unlock_mutex(&store->mutex);
 }
 
 /* Forward reference */
@@ -333,6 +564,7 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
         quic->default_callback_fn = default_callback_fn;
         quic->default_callback_ctx = default_callback_ctx;
         quic->default_congestion_alg = PICOQUIC_DEFAULT_CONGESTION_ALGORITHM;
+        quic->default_path_scheduler = picoquic_min_rtt_scheduler;
         quic->default_alpn = picoquic_string_duplicate(default_alpn);
         quic->cnx_id_callback_fn = cnx_id_callback;
         quic->cnx_id_callback_ctx = cnx_id_callback_ctx;
@@ -343,6 +575,8 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
         quic->crypto_epoch_length_max = 0;
         quic->max_simultaneous_logs = PICOQUIC_DEFAULT_SIMULTANEOUS_LOGS;
         quic->max_half_open_before_retry = PICOQUIC_DEFAULT_HALF_OPEN_RETRY_THRESHOLD;
+        quic->receive_window_growth_max = PICOQUIC_DEFAULT_RECEIVE_WINDOW_GROWTH_MAX;
+        quic->max_packet_size = PICOQUIC_MAX_PACKET_SIZE;
         picoquic_wake_list_init(quic);
 
         if (cnx_id_callback != NULL) {
@@ -351,7 +585,7 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
 
         if (ticket_file_name != NULL) {
             quic->ticket_file_name = ticket_file_name;
-            ret = picoquic_load_tickets(&quic->p_first_ticket, current_time, ticket_file_name);
+            ret = picoquic_load_session_tickets(quic, current_time, ticket_file_name);
 
             if (ret == PICOQUIC_ERROR_NO_SUCH_FILE) {
                 DBG_PRINTF("Ticket file <%s> not created yet.\n", ticket_file_name);
@@ -376,9 +610,6 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
             quic->table_cnx_by_secret = picohash_create((size_t)nb_connections * 4,
                 picoquic_net_secret_hash, picoquic_net_secret_compare);
 
-            picosplay_init_tree(&quic->token_reuse_tree, picoquic_registered_token_compare,
-                picoquic_registered_token_create, picoquic_registered_token_delete, picoquic_registered_token_value);
-
             if (quic->table_cnx_by_id == NULL || quic->table_cnx_by_net == NULL ||
                 quic->table_cnx_by_icid == NULL || quic->table_cnx_by_secret == NULL) {
                 ret = -1;
@@ -415,8 +646,7 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
 
 int picoquic_load_token_file(picoquic_quic_t* quic, char const * token_file_name)
 {
-    uint64_t current_time = picoquic_get_quic_time(quic);
-    int ret = picoquic_load_tokens(&quic->p_first_token, current_time, token_file_name);
+    int ret = picoquic_load_retry_tokens(quic, token_file_name);
 
     if (ret == PICOQUIC_ERROR_NO_SUCH_FILE) {
         DBG_PRINTF("Ticket file <%s> not created yet.\n", token_file_name);
@@ -457,6 +687,11 @@ void picoquic_set_default_padding(picoquic_quic_t* quic, uint32_t padding_multip
     quic->padding_multiple_default = padding_multiple;
 }
 
+void picoquic_set_receive_window_growth_max(picoquic_quic_t* quic, uint64_t growth_max)
+{
+    quic->receive_window_growth_max = growth_max;
+}
+
 void picoquic_set_default_spinbit_policy(picoquic_quic_t * quic, picoquic_spinbit_version_enum default_spinbit_policy)
 {
     quic->default_spin_policy = default_spinbit_policy;
@@ -519,15 +754,18 @@ void picoquic_free(picoquic_quic_t* quic)
 
         /* Delete TLS and AEAD cntexts */
         picoquic_delete_retry_protection_contexts(quic);
+        picoquic_delete_initial_key_cache(quic);
 
-        if (quic->aead_encrypt_ticket_ctx != NULL) {
-            picoquic_aead_free(quic->aead_encrypt_ticket_ctx);
-            quic->aead_encrypt_ticket_ctx = NULL;
+        if (quic->cnxid_pool != NULL) {
+            free(quic->cnxid_pool);
+            quic->cnxid_pool = NULL;
         }
 
-        if (quic->aead_decrypt_ticket_ctx != NULL) {
-            picoquic_aead_free(quic->aead_decrypt_ticket_ctx);
-            quic->aead_decrypt_ticket_ctx = NULL;
+        picoquic_delete_ticket_aead_contexts(quic);
+
+        if (quic->ticket_key_ring != NULL) {
+            picoquic_ticket_key_ring_release(quic->ticket_key_ring);
+            quic->ticket_key_ring = NULL;
         }
 
         if (quic->default_alpn != NULL) {
@@ -535,11 +773,18 @@ void picoquic_free(picoquic_quic_t* quic)
             quic->default_alpn = NULL;
         }
 
-        /* delete the stored tickets */
-        picoquic_free_tickets(&quic->p_first_ticket);
+        /* delete the stored tickets and tokens */
+        picoquic_free_session_tickets(quic);
+        picoquic_free_retry_tokens(quic);
 
         /* Deelete the reused tokens tree */
-        picosplay_empty_tree(&quic->token_reuse_tree);
+        picoquic_registered_token_free(quic);
+
+        /* stop the crypto workers */
+        if (quic->crypto_workers != NULL) {
+            picoquic_crypto_workers_delete(quic->crypto_workers);
+            quic->crypto_workers = NULL;
+        }
 
         /* delete packets in pool */
         while (quic->p_first_packet != NULL) {
@@ -633,12 +878,23 @@ uint32_t picoquic_get_max_half_open_retry_threshold(picoquic_quic_t* quic)
     return quic->max_half_open_before_retry;
 }
 
+void picoquic_set_max_handshakes_per_ms(picoquic_quic_t* quic, uint32_t max_handshakes_per_ms)
+{
+    quic->max_handshakes_per_ms = max_handshakes_per_ms;
+}
+
 picoquic_stateless_packet_t* picoquic_create_stateless_packet(picoquic_quic_t* quic)
 {
 #ifdef _WINDOWS
     UNREFERENCED_PARAMETER(quic);
 #endif
-    return (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
+    picoquic_stateless_packet_t* sp = (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t) + quic->max_packet_size);
+
+    if (sp != NULL) {
+        sp->bytes = (uint8_t*)(sp + 1);
+    }
+
+    return sp;
 }
 
 void picoquic_delete_stateless_packet(picoquic_stateless_packet_t* sp)
@@ -1052,6 +1308,94 @@ static void picoquic_create_random_cnx_id(picoquic_quic_t* quic, picoquic_connec
     cnx_id->id_len = id_length;
 }
 
+/* Pool of connection IDs and reset secrets.
+ * The pooled values are only valid for the CID length and callback used
+ * when they were created. If these change, the pool is emptied.
+ * The pool is refilled in small batches, so that a large pool does not
+ * delay the sending loop.
+ */
+static int picoquic_cnxid_pool_is_usable(picoquic_quic_t* quic)
+{
+    return (quic->cnxid_pool_size > 0 && quic->local_cnxid_length > 0 &&
+        (quic->cnx_id_callback_fn == NULL || quic->cnx_id_callback_fn == picoquic_lb_compat_cid_generate));
+}
+
+static int picoquic_cnxid_pool_is_current(picoquic_quic_t* quic)
+{
+    return (quic->cnxid_pool_cb_fn == quic->cnx_id_callback_fn &&
+        quic->cnxid_pool_cb_ctx == quic->cnx_id_callback_ctx &&
+        quic->cnxid_pool_cid_length == quic->local_cnxid_length);
+}
+
+int picoquic_set_cnxid_pool_size(picoquic_quic_t* quic, size_t pool_size)
+{
+    int ret = 0;
+    picoquic_cnxid_pool_item_t* pool = NULL;
+
+    if (pool_size > 0) {
+        pool = (picoquic_cnxid_pool_item_t*)malloc(sizeof(picoquic_cnxid_pool_item_t) * pool_size);
+        if (pool == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+    }
+
+    if (ret == 0) {
+        if (quic->cnxid_pool != NULL) {
+            free(quic->cnxid_pool);
+        }
+        quic->cnxid_pool = pool;
+        quic->cnxid_pool_size = pool_size;
+        quic->cnxid_pool_count = 0;
+    }
+
+    return ret;
+}
+
+void picoquic_refill_cnxid_pool(picoquic_quic_t* quic)
+{
+    int nb_created = 0;
+
+    if (picoquic_cnxid_pool_is_usable(quic)) {
+        if (!picoquic_cnxid_pool_is_current(quic)) {
+            quic->cnxid_pool_count = 0;
+            quic->cnxid_pool_cb_fn = quic->cnx_id_callback_fn;
+            quic->cnxid_pool_cb_ctx = quic->cnx_id_callback_ctx;
+            quic->cnxid_pool_cid_length = quic->local_cnxid_length;
+        }
+
+        while (quic->cnxid_pool_count < quic->cnxid_pool_size && nb_created < PICOQUIC_CNXID_POOL_REFILL_MAX) {
+            picoquic_cnxid_pool_item_t* item = &quic->cnxid_pool[quic->cnxid_pool_count];
+
+            picoquic_create_random_cnx_id(quic, &item->cnx_id, quic->local_cnxid_length);
+            if (quic->cnx_id_callback_fn) {
+                quic->cnx_id_callback_fn(quic, item->cnx_id, picoquic_null_connection_id,
+                    quic->cnx_id_callback_ctx, &item->cnx_id);
+            }
+            if (picoquic_create_cnxid_reset_secret(quic, &item->cnx_id, item->reset_secret) != 0) {
+                break;
+            }
+            quic->cnxid_pool_count++;
+            nb_created++;
+        }
+    }
+}
+
+static int picoquic_get_cnxid_from_pool(picoquic_quic_t* quic, picoquic_local_cnxid_t* l_cid)
+{
+    int ret = -1;
+
+    if (quic->cnxid_pool_count > 0 && picoquic_cnxid_pool_is_usable(quic) &&
+        picoquic_cnxid_pool_is_current(quic)) {
+        picoquic_cnxid_pool_item_t* item = &quic->cnxid_pool[--quic->cnxid_pool_count];
+
+        l_cid->cnx_id = item->cnx_id;
+        memcpy(l_cid->reset_secret, item->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+        ret = 0;
+    }
+
+    return ret;
+}
+
 /* Path management -- returns the index of the path that was created. */
 
 int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, const struct sockaddr* local_addr, const struct sockaddr* peer_addr)
@@ -1534,15 +1878,22 @@ int picoquic_probe_new_path(picoquic_cnx_t* cnx, const struct sockaddr* addr_fro
     return picoquic_probe_new_path_ex(cnx, addr_from, addr_to, current_time, 0);
 }
 
-/* Reset the path MTU, for example if too many packet losses are detected */
+/* Reset the path MTU, for example if too many packet losses are detected.
+ * The MTU that was in use is presumed to fail, and bounds the next search. */
 void picoquic_reset_path_mtu(picoquic_path_t* path_x)
 {
+    size_t failed_mtu = path_x->send_mtu;
+
     /* Re-initialize the MTU */
     path_x->send_mtu = (path_x->peer_addr.ss_family == 0 || path_x->peer_addr.ss_family == AF_INET) ?
         PICOQUIC_INITIAL_MTU_IPV4 : PICOQUIC_INITIAL_MTU_IPV6;
     /* Reset the MTU discovery context */
-    path_x->send_mtu_max_tried = 0;
+    path_x->send_mtu_max_tried = (failed_mtu > path_x->send_mtu) ? failed_mtu : 0;
     path_x->mtu_probe_sent = 0;
+    path_x->mtu_probe_size = 0;
+    path_x->mtu_probe_losses = 0;
+    path_x->pmtud_state = picoquic_pmtud_searching;
+    path_x->nb_mtu_losses = 0;
 }
 
 /*
@@ -1848,109 +2199,391 @@ void picoquic_stream_data_node_delete(void* tree, picosplay_node_t* node)
     free(stream_data);
 }
 
-/* Stream splay management */
-
-static int64_t picoquic_stream_node_compare(void *l, void *r)
+/* Free a node of the send queue. If the data was provided by the application
+ * without copy, the buffer is handed back through the release callback.
+ * The node must already be unlinked from the send queue, because the
+ * callback may queue more data on the stream.
+ */
+void picoquic_free_send_queue_node(picoquic_stream_data_node_t* stream_data)
 {
-    /* STream values are from 0 to 2^62-1, which means we are not worried with rollover */
-    return ((picoquic_stream_head_t*)l)->stream_id - ((picoquic_stream_head_t*)r)->stream_id;
+    if (stream_data->release_fn != NULL) {
+        stream_data->release_fn(stream_data->release_ctx, stream_data->bytes, stream_data->length);
+    }
+    else if (stream_data->bytes != NULL) {
+        free(stream_data->bytes);
+    }
+    free(stream_data);
 }
 
-static picosplay_node_t * picoquic_stream_node_create(void * value)
+void picoquic_clear_stream(picoquic_stream_head_t* stream)
 {
-    return &((picoquic_stream_head_t *)value)->stream_node;
+    picoquic_stream_data_node_t* next;
+
+    while ((next = stream->send_queue) != NULL) {
+        stream->send_queue = next->next_stream_data;
+        picoquic_free_send_queue_node(next);
+    }
+
+    picosplay_empty_tree(&stream->stream_data_tree);
+
+    while (stream->first_sack_item.next_sack != NULL) {
+        picoquic_sack_item_t * sack = stream->first_sack_item.next_sack;
+        stream->first_sack_item.next_sack = sack->next_sack;
+        free(sack);
+    }
 }
 
 
-static void * picoquic_stream_node_value(picosplay_node_t * node)
+/* Stream table management.
+ * The index of a stream in the table of its type is stream_id >> 2.
+ */
+
+static int picoquic_stream_table_reserve(picoquic_stream_table_t* table, size_t nb_pages)
 {
-    return (void*)((char*)node - offsetof(struct st_picoquic_stream_head_t, stream_node));
+    int ret = 0;
+
+    if (nb_pages > table->nb_pages_max) {
+        size_t new_max = (table->nb_pages_max == 0) ? 4 : 2 * table->nb_pages_max;
+        picoquic_stream_page_t** new_page;
+
+        while (new_max < nb_pages) {
+            new_max *= 2;
+        }
+
+        if (new_max > SIZE_MAX / sizeof(picoquic_stream_page_t*) ||
+            (new_page = (picoquic_stream_page_t**)realloc(table->page, new_max * sizeof(picoquic_stream_page_t*))) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            table->page = new_page;
+            table->nb_pages_max = new_max;
+        }
+    }
+
+    return ret;
 }
 
-void picoquic_clear_stream(picoquic_stream_head_t* stream)
+/* Slide the table past the empty pages at either end.
+ * The page array itself is kept for reuse. */
+static void picoquic_stream_table_trim(picoquic_stream_table_t* table)
 {
-    picoquic_stream_data_node_t* ready = stream->send_queue;
-    picoquic_stream_data_node_t* next;
+    while (table->nb_pages > 0 && table->page[table->nb_pages - 1] == NULL) {
+        table->nb_pages--;
+    }
+    if (table->nb_pages > 0 && table->page[0] == NULL) {
+        size_t nb_empty = 1;
+        while (table->page[nb_empty] == NULL) {
+            nb_empty++;
+        }
+        memmove(table->page, table->page + nb_empty, (table->nb_pages - nb_empty) * sizeof(picoquic_stream_page_t*));
+        table->first_page += nb_empty;
+        table->nb_pages -= nb_empty;
+    }
+}
 
-    while ((next = ready) != NULL) {
-        ready = next->next_stream_data;
+static int picoquic_stream_table_insert(picoquic_stream_table_t* table, picoquic_stream_head_t* stream)
+{
+    int ret = 0;
+    uint64_t stream_index = stream->stream_id >> 2;
+    uint64_t page_number = stream_index >> PICOQUIC_STREAM_PAGE_BITS;
+    picoquic_stream_page_t* page;
 
-        if (next->bytes != NULL) {
-            free(next->bytes);
+    if (table->nb_pages == 0) {
+        if ((ret = picoquic_stream_table_reserve(table, 1)) == 0) {
+            table->first_page = page_number;
+            table->page[0] = NULL;
+            table->nb_pages = 1;
         }
-        free(next);
     }
+    else if (page_number < table->first_page) {
+        /* Streams are normally opened in order, but nothing prevents the
+         * application from opening a lower stream later. */
+        uint64_t delta = table->first_page - page_number;
 
-    picosplay_empty_tree(&stream->stream_data_tree);
+        if (delta > SIZE_MAX - table->nb_pages) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if ((ret = picoquic_stream_table_reserve(table, table->nb_pages + (size_t)delta)) == 0) {
+            memmove(table->page + delta, table->page, table->nb_pages * sizeof(picoquic_stream_page_t*));
+            memset(table->page, 0, (size_t)delta * sizeof(picoquic_stream_page_t*));
+            table->first_page = page_number;
+            table->nb_pages += (size_t)delta;
+        }
+    }
+    else if (page_number - table->first_page >= table->nb_pages) {
+        uint64_t nb_pages = page_number - table->first_page + 1;
 
-    while (stream->first_sack_item.next_sack != NULL) {
-        picoquic_sack_item_t * sack = stream->first_sack_item.next_sack;
-        stream->first_sack_item.next_sack = sack->next_sack;
-        free(sack);
+        if (nb_pages > SIZE_MAX) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if ((ret = picoquic_stream_table_reserve(table, (size_t)nb_pages)) == 0) {
+            memset(table->page + table->nb_pages, 0, ((size_t)nb_pages - table->nb_pages) * sizeof(picoquic_stream_page_t*));
+            table->nb_pages = (size_t)nb_pages;
+        }
     }
+
+    if (ret == 0) {
+        size_t page_index = (size_t)(page_number - table->first_page);
+
+        if ((page = table->page[page_index]) == NULL) {
+            page = (picoquic_stream_page_t*)malloc(sizeof(picoquic_stream_page_t));
+            if (page == NULL) {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                memset(page, 0, sizeof(picoquic_stream_page_t));
+                table->page[page_index] = page;
+            }
+        }
+
+        if (page != NULL) {
+            page->stream[stream_index & PICOQUIC_STREAM_PAGE_MASK] = stream;
+            page->nb_streams++;
+            table->nb_streams++;
+        }
+        else {
+            /* Remove the empty pages that might have been added */
+            picoquic_stream_table_trim(table);
+        }
+    }
+
+    return ret;
 }
 
+static picoquic_stream_head_t* picoquic_stream_table_find(picoquic_stream_table_t* table, uint64_t stream_id)
+{
+    picoquic_stream_head_t* stream = NULL;
+    uint64_t stream_index = stream_id >> 2;
+    uint64_t page_number = stream_index >> PICOQUIC_STREAM_PAGE_BITS;
+
+    if (page_number >= table->first_page && page_number - table->first_page < table->nb_pages) {
+        picoquic_stream_page_t* page = table->page[page_number - table->first_page];
 
-static void picoquic_stream_node_delete(void * tree, picosplay_node_t * node)
+        if (page != NULL) {
+            stream = page->stream[stream_index & PICOQUIC_STREAM_PAGE_MASK];
+        }
+    }
+
+    return stream;
+}
+
+static void picoquic_stream_table_remove(picoquic_stream_table_t* table, picoquic_stream_head_t* stream)
 {
-    picoquic_stream_head_t * stream = picoquic_stream_node_value(node);
+    uint64_t stream_index = stream->stream_id >> 2;
+    uint64_t page_number = stream_index >> PICOQUIC_STREAM_PAGE_BITS;
 
-    picoquic_clear_stream(stream);
+    if (picoquic_stream_table_find(table, stream->stream_id) == stream) {
+        size_t page_index = (size_t)(page_number - table->first_page);
+        picoquic_stream_page_t* page = table->page[page_index];
 
-    free(stream);
+        page->stream[stream_index & PICOQUIC_STREAM_PAGE_MASK] = NULL;
+        page->nb_streams--;
+        table->nb_streams--;
+
+        if (page->nb_streams == 0) {
+            free(page);
+            table->page[page_index] = NULL;
+            picoquic_stream_table_trim(table);
+        }
+    }
 }
 
-/* Management of streams */
+/* Return the first stream in the table whose index is at least index_min */
+static picoquic_stream_head_t* picoquic_stream_table_next(picoquic_stream_table_t* table, uint64_t index_min)
+{
+    uint64_t page_number = index_min >> PICOQUIC_STREAM_PAGE_BITS;
+    size_t slot = (size_t)(index_min & PICOQUIC_STREAM_PAGE_MASK);
+
+    if (page_number < table->first_page) {
+        page_number = table->first_page;
+        slot = 0;
+    }
+
+    for (uint64_t i = page_number - table->first_page; i < table->nb_pages; i++) {
+        picoquic_stream_page_t* page = table->page[i];
+
+        if (page != NULL) {
+            for (; slot < PICOQUIC_STREAM_PAGE_SIZE; slot++) {
+                if (page->stream[slot] != NULL) {
+                    return page->stream[slot];
+                }
+            }
+        }
+        slot = 0;
+    }
+
+    return NULL;
+}
 
-picoquic_stream_head_t * picoquic_stream_from_node(picosplay_node_t * node)
+static picoquic_stream_head_t* picoquic_stream_table_last(picoquic_stream_table_t* table)
 {
-#ifdef TOO_CAUTIOUS
-    return(picoquic_stream_head_t *)((node == NULL)?NULL:picoquic_stream_node_value(node));
-#else
-    return (picoquic_stream_head_t *)node;
-#endif
+    /* The last page is never empty */
+    if (table->nb_pages > 0) {
+        picoquic_stream_page_t* page = table->page[table->nb_pages - 1];
+
+        for (int slot = PICOQUIC_STREAM_PAGE_SIZE - 1; slot >= 0; slot--) {
+            if (page->stream[slot] != NULL) {
+                return page->stream[slot];
+            }
+        }
+    }
+
+    return NULL;
 }
 
+static void picoquic_stream_table_clear(picoquic_stream_table_t* table)
+{
+    for (size_t i = 0; i < table->nb_pages; i++) {
+        picoquic_stream_page_t* page = table->page[i];
+
+        if (page != NULL) {
+            for (int slot = 0; slot < PICOQUIC_STREAM_PAGE_SIZE; slot++) {
+                if (page->stream[slot] != NULL) {
+                    picoquic_clear_stream(page->stream[slot]);
+                    free(page->stream[slot]);
+                }
+            }
+            free(page);
+        }
+    }
+
+    if (table->page != NULL) {
+        free(table->page);
+    }
+
+    memset(table, 0, sizeof(picoquic_stream_table_t));
+}
+
+/* Management of streams */
+
 picoquic_stream_head_t * picoquic_first_stream(picoquic_cnx_t* cnx)
 {
-#ifdef TOO_CAUTIOUS
-    return picoquic_stream_from_node(picosplay_first(&cnx->stream_tree));
-#else
-    return (picoquic_stream_head_t *)picosplay_first(&cnx->stream_tree);
-#endif
+    picoquic_stream_head_t* first_stream = NULL;
+
+    for (int stream_type = 0; stream_type < 4; stream_type++) {
+        picoquic_stream_head_t* stream = picoquic_stream_table_next(&cnx->stream_table[stream_type], 0);
+
+        if (stream != NULL && (first_stream == NULL || stream->stream_id < first_stream->stream_id)) {
+            first_stream = stream;
+        }
+    }
+
+    return first_stream;
 }
 
 picoquic_stream_head_t * picoquic_last_stream(picoquic_cnx_t* cnx)
 {
-#ifdef TOO_CAUTIOUS
-    return picoquic_stream_from_node(picosplay_last(&cnx->stream_tree));
-#else
-    return (picoquic_stream_head_t *)picosplay_last(&cnx->stream_tree);
-#endif
+    picoquic_stream_head_t* last_stream = NULL;
+
+    for (int stream_type = 0; stream_type < 4; stream_type++) {
+        picoquic_stream_head_t* stream = picoquic_stream_table_last(&cnx->stream_table[stream_type]);
+
+        if (stream != NULL && (last_stream == NULL || stream->stream_id > last_stream->stream_id)) {
+            last_stream = stream;
+        }
+    }
+
+    return last_stream;
+}
+
+size_t picoquic_nb_streams(picoquic_cnx_t* cnx)
+{
+    size_t nb_streams = 0;
+
+    for (int stream_type = 0; stream_type < 4; stream_type++) {
+        nb_streams += cnx->stream_table[stream_type].nb_streams;
+    }
+
+    return nb_streams;
+}
+
+/* Streams are kept in one of three sets:
+ *
+ * - ready streams have something to send that flow control and stream
+ *   limits allow, or a pending reset or stop sending frame. They are
+ *   kept in the output list, in which the next stream to send is the
+ *   first one, unless the connection is blocked by flow control.
+ * - blocked streams have data to send but are waiting for a
+ *   MAX_STREAM_DATA or MAX_STREAMS frame from the peer. They are kept
+ *   in the blocked list, which is used to send the blocked frames.
+ * - idle streams are not in any list.
+ *
+ * Streams are moved between sets by picoquic_update_output_stream, which is
+ * called when the state of the stream changes.
+ *
+ * The output list is ordered by urgency. The high priority stream and
+ * the streams with pending control frames are inserted in front of the list.
+ * The other streams are inserted at the end of the group of streams with
+ * the same urgency, which is found by keeping track of the last stream of
+ * each group.
+ */
+
+static int picoquic_stream_has_control_frame(picoquic_stream_head_t* stream)
+{
+    return (stream->reset_requested && !stream->reset_sent) ||
+        (stream->stop_sending_requested && !stream->stop_sending_sent);
+}
+
+static int picoquic_stream_has_data_to_send(picoquic_stream_head_t* stream)
+{
+    return stream->is_active ||
+        (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset) ||
+        (stream->fin_requested && !stream->fin_sent);
+}
+
+static int picoquic_is_output_front(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    return stream->stream_id == cnx->high_priority_stream_id || picoquic_stream_has_control_frame(stream);
+}
+
+static void picoquic_link_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
+    picoquic_stream_head_t* previous_stream)
+{
+    stream->previous_output_stream = previous_stream;
+    if (previous_stream == NULL) {
+        stream->next_output_stream = cnx->first_output_stream;
+        cnx->first_output_stream = stream;
+    }
+    else {
+        stream->next_output_stream = previous_stream->next_output_stream;
+        previous_stream->next_output_stream = stream;
+    }
+
+    if (stream->next_output_stream == NULL) {
+        cnx->last_output_stream = stream;
+    }
+    else {
+        stream->next_output_stream->previous_output_stream = stream;
+    }
 }
 
 void picoquic_insert_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream)
 {
     if (stream->is_output_stream == 0) {
-        if (stream->stream_id == cnx->high_priority_stream_id) {
+        if (picoquic_is_output_front(cnx, stream)) {
             /* insert in front */
-            stream->previous_output_stream = NULL;
-            stream->next_output_stream = cnx->first_output_stream;
-            if (cnx->first_output_stream != NULL) {
-                cnx->first_output_stream->previous_output_stream = stream;
-            }
-            cnx->first_output_stream = stream;
+            picoquic_link_output_stream(cnx, stream, NULL);
+            stream->is_output_front = 1;
         } else {
-            stream->previous_output_stream = cnx->last_output_stream;
-            stream->next_output_stream = NULL;
-            if (cnx->last_output_stream == NULL) {
-                cnx->first_output_stream = stream;
-                cnx->last_output_stream = stream;
+            /* insert after the last stream of same or lower urgency,
+             * or after the streams inserted in front of the list */
+            picoquic_stream_head_t* previous_stream = NULL;
+
+            for (int u = stream->urgency; u >= 0 && previous_stream == NULL; u--) {
+                previous_stream = cnx->last_output_stream_by_urgency[u];
             }
-            else {
-                cnx->last_output_stream->next_output_stream = stream;
-                cnx->last_output_stream = stream;
+
+            if (previous_stream == NULL) {
+                picoquic_stream_head_t* next_stream = cnx->first_output_stream;
+
+                while (next_stream != NULL && next_stream->is_output_front) {
+                    previous_stream = next_stream;
+                    next_stream = next_stream->next_output_stream;
+                }
             }
+
+            picoquic_link_output_stream(cnx, stream, previous_stream);
+            cnx->last_output_stream_by_urgency[stream->urgency] = stream;
         }
         stream->is_output_stream = 1;
     }
@@ -1961,6 +2594,15 @@ void picoquic_remove_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t *
     if (stream->is_output_stream) {
         stream->is_output_stream = 0;
 
+        if (cnx->last_output_stream_by_urgency[stream->urgency] == stream) {
+            picoquic_stream_head_t* previous_in_group = stream->previous_output_stream;
+
+            cnx->last_output_stream_by_urgency[stream->urgency] = (previous_in_group != NULL &&
+                !previous_in_group->is_output_front && previous_in_group->urgency == stream->urgency) ?
+                previous_in_group : NULL;
+        }
+        stream->is_output_front = 0;
+
         if (stream->previous_output_stream == NULL) {
             cnx->first_output_stream = stream->next_output_stream;
         }
@@ -1974,38 +2616,156 @@ void picoquic_remove_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t *
         else {
             stream->next_output_stream->previous_output_stream = stream->previous_output_stream;
         }
+        stream->next_output_stream = NULL;
+        stream->previous_output_stream = NULL;
     }
 }
 
-picoquic_stream_head_t * picoquic_next_stream(picoquic_stream_head_t * stream)
+static void picoquic_insert_blocked_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    return (picoquic_stream_head_t *)picosplay_next((picosplay_node_t *)stream);
+    if (!stream->is_blocked_stream) {
+        stream->previous_blocked_stream = NULL;
+        stream->next_blocked_stream = cnx->first_blocked_stream;
+        if (cnx->first_blocked_stream != NULL) {
+            cnx->first_blocked_stream->previous_blocked_stream = stream;
+        }
+        cnx->first_blocked_stream = stream;
+        stream->is_blocked_stream = 1;
+    }
 }
 
-picoquic_stream_head_t* picoquic_find_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
+void picoquic_remove_blocked_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->is_blocked_stream) {
+        if (stream->previous_blocked_stream == NULL) {
+            cnx->first_blocked_stream = stream->next_blocked_stream;
+        }
+        else {
+            stream->previous_blocked_stream->next_blocked_stream = stream->next_blocked_stream;
+        }
+        if (stream->next_blocked_stream != NULL) {
+            stream->next_blocked_stream->previous_blocked_stream = stream->previous_blocked_stream;
+        }
+        stream->next_blocked_stream = NULL;
+        stream->previous_blocked_stream = NULL;
+        stream->is_blocked_stream = 0;
+    }
+}
+
+static int picoquic_is_stream_send_allowed(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    return IS_BIDIR_STREAM_ID(stream->stream_id) || IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode);
+}
+
+int picoquic_is_stream_blocked(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    int is_blocked = 0;
+
+    if (!picoquic_is_stream_send_allowed(cnx, stream)) {
+        is_blocked = 1;
+    }
+    else if (IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode) &&
+        stream->stream_id > ((IS_BIDIR_STREAM_ID(stream->stream_id)) ? cnx->max_stream_id_bidir_remote : cnx->max_stream_id_unidir_remote)) {
+        is_blocked = 1;
+    }
+    else {
+        is_blocked = (stream->sent_offset >= stream->maxdata_remote);
+    }
+
+    return is_blocked;
+}
+
+/* Check whether a stream belongs in the output list. Data can only be sent
+ * in an authorized direction, on streams allowed by the peer's stream limits,
+ * and within the stream's flow control limit. The connection flow control is
+ * checked when the stream is picked.
+ */
+int picoquic_is_stream_ready(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    return picoquic_stream_has_control_frame(stream) ||
+        (picoquic_stream_has_data_to_send(stream) && !picoquic_is_stream_blocked(cnx, stream));
+}
+
+void picoquic_update_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    picoquic_stream_head_t target;
-    target.stream_id = stream_id;
+    if (picoquic_is_stream_ready(cnx, stream)) {
+        picoquic_remove_blocked_stream(cnx, stream);
+        if (stream->is_output_stream && stream->is_output_front != (unsigned int)picoquic_is_output_front(cnx, stream)) {
+            /* Move the stream in or out of the front of the list */
+            picoquic_remove_output_stream(cnx, stream, NULL);
+        }
+        picoquic_insert_output_stream(cnx, stream);
+    }
+    else {
+        picoquic_remove_output_stream(cnx, stream, NULL);
+        if (picoquic_stream_has_data_to_send(stream) && picoquic_is_stream_send_allowed(cnx, stream)) {
+            picoquic_insert_blocked_stream(cnx, stream);
+        }
+        else {
+            picoquic_remove_blocked_stream(cnx, stream);
+        }
+    }
+}
+
+/* After an incremental stream has sent some data, move it to the end
+ * of its urgency group, so the streams of the group are served in
+ * round robin.
+ */
+void picoquic_requeue_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->is_output_stream && stream->is_incremental && !stream->is_output_front &&
+        cnx->last_output_stream_by_urgency[stream->urgency] != stream) {
+        picoquic_remove_output_stream(cnx, stream, NULL);
+        picoquic_insert_output_stream(cnx, stream);
+    }
+}
+
+/* Streams are returned in order of stream ID, which requires looking at
+ * the next stream of each type.
+ */
+picoquic_stream_head_t * picoquic_next_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream)
+{
+    picoquic_stream_head_t* next_stream = NULL;
+    uint64_t stream_index = stream->stream_id >> 2;
+
+    for (uint64_t stream_type = 0; stream_type < 4; stream_type++) {
+        uint64_t index_min = (stream_type > STREAM_TYPE_FROM_ID(stream->stream_id)) ? stream_index : stream_index + 1;
+        picoquic_stream_head_t* candidate = picoquic_stream_table_next(&cnx->stream_table[stream_type], index_min);
+
+        if (candidate != NULL && (next_stream == NULL || candidate->stream_id < next_stream->stream_id)) {
+            next_stream = candidate;
+        }
+    }
 
-    return (picoquic_stream_head_t *)picosplay_find(&cnx->stream_tree, (void*)&target);
+    return next_stream;
+}
+
+picoquic_stream_head_t* picoquic_find_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    return picoquic_stream_table_find(&cnx->stream_table[STREAM_TYPE_FROM_ID(stream_id)], stream_id);
 }
 
 void picoquic_add_output_streams(picoquic_cnx_t* cnx, uint64_t old_limit, uint64_t new_limit, unsigned int is_bidir)
 {
-    uint64_t old_rank = STREAM_RANK_FROM_ID(old_limit);
-    uint64_t first_new_id = STREAM_ID_FROM_RANK(old_rank + 1ull, !cnx->client_mode, !is_bidir);
-    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, first_new_id );
+    picoquic_stream_head_t* stream = cnx->first_blocked_stream;
 
+    /* Apply the new limit before checking the streams, as some callers only update it after the call */
+    if (is_bidir && new_limit > cnx->max_stream_id_bidir_remote) {
+        cnx->max_stream_id_bidir_remote = new_limit;
+    }
+    else if (!is_bidir && new_limit > cnx->max_stream_id_unidir_remote) {
+        cnx->max_stream_id_unidir_remote = new_limit;
+    }
+
+    /* Only the streams waiting for the new limit need to be checked */
     while (stream) {
-        if (stream->stream_id > old_limit) {
-            if (stream->stream_id > new_limit) {
-                break;
-            }
-            if (IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode) && IS_BIDIR_STREAM_ID(stream->stream_id) == is_bidir) {
-                picoquic_insert_output_stream(cnx, stream);
-            }
+        picoquic_stream_head_t* next_stream = stream->next_blocked_stream;
+
+        if (stream->stream_id > old_limit && stream->stream_id <= new_limit &&
+            IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode) && IS_BIDIR_STREAM_ID(stream->stream_id) == is_bidir) {
+            picoquic_update_output_stream(cnx, stream);
         }
-        stream = picoquic_next_stream(stream);
+        stream = next_stream;
     }
 }
 
@@ -2013,48 +2773,43 @@ picoquic_stream_head_t* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t str
 {
     picoquic_stream_head_t* stream = (picoquic_stream_head_t*)malloc(sizeof(picoquic_stream_head_t));
     if (stream != NULL) {
-        int is_output_stream = 0;
         memset(stream, 0, sizeof(picoquic_stream_head_t));
         stream->stream_id = stream_id;
+        stream->urgency = PICOQUIC_DEFAULT_STREAM_URGENCY;
 
         if (IS_LOCAL_STREAM_ID(stream_id, cnx->client_mode)) {
             if (IS_BIDIR_STREAM_ID(stream_id)) {
                 stream->maxdata_local = cnx->local_parameters.initial_max_stream_data_bidi_local;
                 stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data_bidi_remote;
-                is_output_stream = stream->stream_id <= cnx->max_stream_id_bidir_remote;
-
             }
             else {
                 stream->maxdata_local = 0;
                 stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data_uni;
-                is_output_stream = stream->stream_id <= cnx->max_stream_id_unidir_remote;
             }
         }
         else {
             if (IS_BIDIR_STREAM_ID(stream_id)) {
                 stream->maxdata_local = cnx->local_parameters.initial_max_stream_data_bidi_remote;
                 stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data_bidi_local;
-                is_output_stream = 1;
             }
             else {
                 stream->maxdata_local = cnx->local_parameters.initial_max_stream_data_uni;
                 stream->maxdata_remote = 0;
-                is_output_stream = 0;
             }
         }
 
+        stream->receive_window.window = stream->maxdata_local;
+        stream->receive_window.epoch_start_time = picoquic_get_quic_time(cnx->quic);
+
         picosplay_init_tree(&stream->stream_data_tree, picoquic_stream_data_node_compare, picoquic_stream_data_node_create, picoquic_stream_data_node_delete, picoquic_stream_data_node_value);
 
-        picosplay_insert(&cnx->stream_tree, stream);
-        if (is_output_stream) {
-            picoquic_insert_output_stream(cnx, stream);
+        /* The stream is idle until data is queued or the stream is marked active,
+         * see picoquic_update_output_stream */
+        if (picoquic_stream_table_insert(&cnx->stream_table[STREAM_TYPE_FROM_ID(stream_id)], stream) != 0) {
+            free(stream);
+            stream = NULL;
         }
-        else {
-            picoquic_remove_output_stream(cnx, stream, NULL);
-            picoquic_delete_stream_if_closed(cnx, stream);
-        }
-
-        if (stream_id >= cnx->next_stream_id[STREAM_TYPE_FROM_ID(stream_id)]) {
+        else if (stream_id >= cnx->next_stream_id[STREAM_TYPE_FROM_ID(stream_id)]) {
             cnx->next_stream_id[STREAM_TYPE_FROM_ID(stream_id)] = NEXT_STREAM_ID_FOR_TYPE(stream_id);
         }
     }
@@ -2064,7 +2819,11 @@ picoquic_stream_head_t* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t str
 
 void picoquic_delete_stream(picoquic_cnx_t * cnx, picoquic_stream_head_t* stream)
 {
-    picosplay_delete(&cnx->stream_tree, stream);
+    picoquic_remove_output_stream(cnx, stream, NULL);
+    picoquic_remove_blocked_stream(cnx, stream);
+    picoquic_stream_table_remove(&cnx->stream_table[STREAM_TYPE_FROM_ID(stream->stream_id)], stream);
+    picoquic_clear_stream(stream);
+    free(stream);
 }
 
 int picoquic_mark_direct_receive_stream(picoquic_cnx_t* cnx, uint64_t stream_id, picoquic_stream_direct_receive_fn direct_receive_fn, void* direct_receive_ctx)
@@ -2138,15 +2897,21 @@ picoquic_local_cnxid_t* picoquic_create_local_cnxid(picoquic_cnx_t* cnx, picoqui
     l_cid = (picoquic_local_cnxid_t*)malloc(sizeof(picoquic_local_cnxid_t));
 
     if (l_cid != NULL) {
+        int is_pooled = 0;
+
         memset(l_cid, 0, sizeof(picoquic_local_cnxid_t));
         if (cnx->quic->local_cnxid_length == 0) {
             is_unique = 1;
         }
         else {
             for (int i = 0; i < 32; i++) {
+                is_pooled = 0;
                 if (i == 0 && suggested_value != NULL) {
                     l_cid->cnx_id = *suggested_value;
                 }
+                else if (picoquic_get_cnxid_from_pool(cnx->quic, l_cid) == 0) {
+                    is_pooled = 1;
+                }
                 else {
                     picoquic_create_random_cnx_id(cnx->quic, &l_cid->cnx_id, cnx->quic->local_cnxid_length);
 
@@ -2182,6 +2947,10 @@ picoquic_local_cnxid_t* picoquic_create_local_cnxid(picoquic_cnx_t* cnx, picoqui
             l_cid->sequence = cnx->local_cnxid_sequence_next++;
             cnx->nb_local_cnxid++;
 
+            if (!is_pooled) {
+                (void)picoquic_create_cnxid_reset_secret(cnx->quic, &l_cid->cnx_id, l_cid->reset_secret);
+            }
+
             if (cnx->quic->local_cnxid_length > 0) {
                 picoquic_register_cnx_id(cnx->quic, cnx, l_cid);
             }
@@ -2282,6 +3051,25 @@ picoquic_local_cnxid_t* picoquic_find_local_cnxid(picoquic_cnx_t* cnx, picoquic_
 /* Connection management
  */
 
+/* The max_udp_payload_size parameter announces the largest packet that the
+ * context can receive. It cannot exceed the size of the packet buffers, and
+ * the whole buffer is announced when jumbo packets are enabled.
+ */
+static void picoquic_set_local_max_packet_size(picoquic_cnx_t* cnx)
+{
+    if (cnx->quic->mtu_max > 0)
+    {
+        cnx->local_parameters.max_packet_size = cnx->quic->mtu_max;
+    }
+    else if (cnx->quic->max_packet_size > PICOQUIC_MAX_PACKET_SIZE) {
+        cnx->local_parameters.max_packet_size = (uint32_t)cnx->quic->max_packet_size;
+    }
+
+    if (cnx->local_parameters.max_packet_size > cnx->quic->max_packet_size) {
+        cnx->local_parameters.max_packet_size = (uint32_t)cnx->quic->max_packet_size;
+    }
+}
+
 picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
     picoquic_connection_id_t initial_cnx_id, picoquic_connection_id_t remote_cnx_id, 
     const struct sockaddr* addr_to, uint64_t start_time, uint32_t preferred_version,
@@ -2322,6 +3110,8 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
             cnx->path[0]->challenge_verified = 1;
 
             cnx->high_priority_stream_id = (uint64_t)((int64_t)-1);
+            cnx->datagram_queue_max_bytes = PICOQUIC_DEFAULT_DATAGRAM_QUEUE_MAX;
+            cnx->datagram_next_expire_time = UINT64_MAX;
             for (int i = 0; i < 4; i++) {
                 cnx->next_stream_id[i] = i;
             }
@@ -2341,9 +3131,9 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
                 if (cnxid1 != NULL){
                     /* copy the connection ID into the local parameter */
                     cnx->local_parameters.prefered_address.connection_id = cnxid1->cnx_id;
-                    /* Create the reset secret */
-                    (void)picoquic_create_cnxid_reset_secret(cnx->quic, &cnxid1->cnx_id,
-                        cnx->local_parameters.prefered_address.statelessResetToken);
+                    /* Copy the reset secret */
+                    memcpy(cnx->local_parameters.prefered_address.statelessResetToken, cnxid1->reset_secret,
+                        PICOQUIC_RESET_SECRET_SIZE);
                 }
             }
         }
@@ -2352,13 +3142,12 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
             cnx->local_parameters.migration_disabled = 1;
         }
 
-        if (cnx->quic->mtu_max > 0)
-        {
-            cnx->local_parameters.max_packet_size = cnx->quic->mtu_max;
-        }
+        picoquic_set_local_max_packet_size(cnx);
 
         /* Initialize local flow control variables to advertised values */
         cnx->maxdata_local = ((uint64_t)cnx->local_parameters.initial_max_data);
+        cnx->receive_window.window = cnx->maxdata_local;
+        cnx->receive_window.epoch_start_time = start_time;
         cnx->max_stream_id_bidir_local = cnx->local_parameters.initial_max_stream_id_bidir;
         cnx->max_stream_id_bidir_local_computed = STREAM_TYPE_FROM_ID(cnx->local_parameters.initial_max_stream_id_bidir);
         cnx->max_stream_id_unidir_local = cnx->local_parameters.initial_max_stream_id_unidir;
@@ -2392,6 +3181,7 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
         cnx->callback_fn = quic->default_callback_fn;
         cnx->callback_ctx = quic->default_callback_ctx;
         cnx->congestion_alg = quic->default_congestion_alg;
+        cnx->path_scheduler = quic->default_path_scheduler;
 
         /* Initialize key rotation interval to default value */
         cnx->crypto_epoch_length_max = quic->crypto_epoch_length_max;
@@ -2481,9 +3271,6 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
             cnx->tls_stream[epoch].stream_id = 0;
             cnx->tls_stream[epoch].consumed_offset = 0;
             cnx->tls_stream[epoch].fin_offset = 0;
-            cnx->tls_stream[epoch].stream_node.left = NULL;
-            cnx->tls_stream[epoch].stream_node.parent = NULL;
-            cnx->tls_stream[epoch].stream_node.right = NULL;
             cnx->tls_stream[epoch].sent_offset = 0;
             cnx->tls_stream[epoch].local_error = 0;
             cnx->tls_stream[epoch].remote_error = 0;
@@ -2502,8 +3289,6 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
         cnx->ack_gap_remote = 2;
         cnx->ack_delay_remote = PICOQUIC_ACK_DELAY_MAX_DEFAULT;
 
-        picosplay_init_tree(&cnx->stream_tree, picoquic_stream_node_compare, picoquic_stream_node_create, picoquic_stream_node_delete, picoquic_stream_node_value);
-
         cnx->congestion_alg = cnx->quic->default_congestion_alg;
         if (cnx->congestion_alg != NULL) {
             cnx->congestion_alg->alg_init(cnx->path[0], start_time);
@@ -2567,12 +3352,18 @@ picoquic_cnx_t* picoquic_create_client_cnx(picoquic_quic_t* quic,
 int picoquic_start_client_cnx(picoquic_cnx_t * cnx)
 {
     int ret = picoquic_initialize_tls_stream(cnx, picoquic_get_quic_time(cnx->quic));
+    uint64_t old_bidir_limit = cnx->max_stream_id_bidir_remote;
+    uint64_t old_unidir_limit = cnx->max_stream_id_unidir_remote;
     /* A remote session ticket may have been loaded as part of initializing TLS,
      * and remote parameters may have been initialized to the initial value
      * of the previous session. Apply these new parameters. */
     cnx->maxdata_remote = cnx->remote_parameters.initial_max_data;
     cnx->max_stream_id_bidir_remote = cnx->remote_parameters.initial_max_stream_id_bidir;
     cnx->max_stream_id_unidir_remote = cnx->remote_parameters.initial_max_stream_id_unidir;
+    /* Streams created before the start may be waiting for these parameters */
+    picoquic_update_stream_initial_remote(cnx);
+    picoquic_add_output_streams(cnx, old_bidir_limit, cnx->max_stream_id_bidir_remote, 1);
+    picoquic_add_output_streams(cnx, old_unidir_limit, cnx->max_stream_id_unidir_remote, 0);
 
     picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
 
@@ -2583,14 +3374,12 @@ void picoquic_set_transport_parameters(picoquic_cnx_t * cnx, picoquic_tp_t const
 {
     cnx->local_parameters = *tp;
 
-    if (cnx->quic->mtu_max > 0)
-    {
-        cnx->local_parameters.max_packet_size = cnx->quic->mtu_max;
-    }
+    picoquic_set_local_max_packet_size(cnx);
 
     /* Initialize local flow control variables to advertised values */
 
     cnx->maxdata_local = ((uint64_t)cnx->local_parameters.initial_max_data);
+    cnx->receive_window.window = cnx->maxdata_local + cnx->receive_window_growth;
     cnx->max_stream_id_bidir_local = cnx->local_parameters.initial_max_stream_id_bidir;
     cnx->max_stream_id_unidir_local = cnx->local_parameters.initial_max_stream_id_unidir;
 }
@@ -2682,6 +3471,27 @@ void picoquic_cnx_set_pmtud_required(picoquic_cnx_t* cnx, int is_pmtud_required)
     cnx->is_pmtud_required = is_pmtud_required;
 }
 
+int picoquic_get_path_mtu_stats(picoquic_cnx_t* cnx, int path_id, picoquic_path_mtu_stats_t* stats)
+{
+    int ret = 0;
+
+    if (path_id < 0 || path_id >= cnx->nb_paths) {
+        ret = -1;
+    }
+    else {
+        picoquic_path_t* path_x = cnx->path[path_id];
+
+        stats->send_mtu = path_x->send_mtu;
+        stats->mtu_max_tried = path_x->send_mtu_max_tried;
+        stats->pmtud_state = path_x->pmtud_state;
+        stats->nb_mtu_probes_sent = path_x->nb_mtu_probes_sent;
+        stats->nb_mtu_probes_lost = path_x->nb_mtu_probes_lost;
+        stats->nb_black_holes = path_x->nb_mtu_black_holes;
+    }
+
+    return ret;
+}
+
 /*
  * Provide clock time
  */
@@ -2848,6 +3658,35 @@ void picoquic_set_packet_train_mode(picoquic_quic_t* quic, int train_mode)
     quic->packet_train_mode = (train_mode > 0) ? 1 : 0;
 }
 
+int picoquic_set_crypto_workers(picoquic_quic_t* quic, int nb_workers)
+{
+    int ret = 0;
+
+    if (quic->cnx_list != NULL || nb_workers < 0 || nb_workers > PICOQUIC_CRYPTO_WORKERS_MAX) {
+        /* The per worker keys are created with the connection keys, so the
+         * number of workers cannot change once connections exist */
+        ret = -1;
+    }
+    else {
+        if (quic->crypto_workers != NULL) {
+            picoquic_crypto_workers_delete(quic->crypto_workers);
+            quic->crypto_workers = NULL;
+            quic->nb_crypto_workers = 0;
+        }
+
+        if (nb_workers > 0) {
+            if ((quic->crypto_workers = picoquic_crypto_workers_create(nb_workers)) == NULL) {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                quic->nb_crypto_workers = nb_workers;
+            }
+        }
+    }
+
+    return ret;
+}
+
 void picoquic_set_padding_policy(picoquic_quic_t* quic, uint32_t padding_min_size, uint32_t padding_multiple)
 {
     quic->padding_minsize_default = padding_min_size;
@@ -2878,6 +3717,37 @@ void picoquic_set_mtu_max(picoquic_quic_t* quic, uint32_t mtu_max)
     quic->mtu_max = mtu_max;
 }
 
+int picoquic_set_max_packet_size(picoquic_quic_t* quic, size_t max_packet_size)
+{
+    int ret = 0;
+
+    if (max_packet_size != quic->max_packet_size) {
+        if (max_packet_size < PICOQUIC_ENFORCED_INITIAL_MTU || max_packet_size > PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
+            ret = PICOQUIC_ERROR_INVALID_PACKET_SIZE;
+        }
+        else if (quic->cnx_list != NULL || quic->pending_stateless_packet != NULL) {
+            ret = PICOQUIC_ERROR_CANNOT_CHANGE_ACTIVE_CONTEXT;
+        }
+        else {
+            /* The packets in the pool were allocated with the previous size */
+            while (quic->p_first_packet != NULL) {
+                picoquic_packet_t* p = quic->p_first_packet->next_packet;
+                free(quic->p_first_packet);
+                quic->p_first_packet = p;
+            }
+            quic->nb_packets_in_pool = 0;
+            quic->max_packet_size = max_packet_size;
+        }
+    }
+
+    return ret;
+}
+
+size_t picoquic_get_max_packet_size(picoquic_quic_t* quic)
+{
+    return quic->max_packet_size;
+}
+
 void picoquic_set_alpn_select_fn(picoquic_quic_t* quic, picoquic_alpn_select_fn alpn_select_fn)
 {
     if (quic->default_alpn != NULL) {
@@ -3013,6 +3883,7 @@ void picoquic_reset_packet_context(picoquic_cnx_t* cnx,
 
     pkt_ctx->first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
     pkt_ctx->first_sack_item.end_of_sack_range = 0;
+    pkt_ctx->ack_blocks_cache_valid = 0;
     /* Reset the ECN data */
     pkt_ctx->ecn_ect0_total_local = 0;
     pkt_ctx->ecn_ect1_total_local = 0;
@@ -3163,6 +4034,9 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
             cnx->is_half_open = 0;
         }
 
+        cnx->quic->receive_window_growth_total -= cnx->receive_window_growth;
+        cnx->receive_window_growth = 0;
+
         if (cnx->cnx_state < picoquic_state_disconnected) {
             /* Give the application a chance to clean up its state */
             cnx->cnx_state = picoquic_state_disconnected;
@@ -3186,6 +4060,8 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
             cnx->retry_token = NULL;
         }
 
+        picoquic_release_session_ticket(&cnx->resumption_ticket);
+
         picoquic_delete_sooner_packets(cnx);
 
         picoquic_remove_cnx_from_list(cnx);
@@ -3214,7 +4090,9 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
             picoquic_clear_stream(&cnx->tls_stream[epoch]);
         }
 
-        picosplay_empty_tree(&cnx->stream_tree);
+        for (int stream_type = 0; stream_type < 4; stream_type++) {
+            picoquic_stream_table_clear(&cnx->stream_table[stream_type]);
+        }
 
         if (cnx->tls_ctx != NULL) {
             picoquic_tlscontext_free(cnx->tls_ctx);
@@ -3391,6 +4269,17 @@ void picoquic_set_congestion_algorithm(picoquic_cnx_t* cnx, picoquic_congestion_
     }
 }
 
+void picoquic_set_default_path_scheduler(picoquic_quic_t* quic, picoquic_path_scheduler_t const* scheduler)
+{
+    quic->default_path_scheduler = scheduler;
+}
+
+void picoquic_set_path_scheduler(picoquic_cnx_t* cnx, picoquic_path_scheduler_t const* scheduler)
+{
+    cnx->path_scheduler = scheduler;
+    cnx->path_scheduler_next = 0;
+}
+
 void picoquic_subscribe_pacing_rate_updates(picoquic_cnx_t* cnx, uint64_t decrease_threshold, uint64_t increase_threshold)
 {
     cnx->pacing_decrease_threshold = decrease_threshold;
@@ -3836,10 +4725,12 @@ int picoquic_lb_compat_cid_config(picoquic_quic_t* quic, picoquic_load_balancer_
                     free(lb_ctx);
                     lb_ctx = NULL;
                 } else {
-                    /* Configure the CID generation */
+                    /* Configure the CID generation. The new context may reuse the
+                     * address of a freed one, so the pooled CIDs are dropped. */
                     quic->local_cnxid_length = lb_ctx->connection_id_length;
                     quic->cnx_id_callback_fn = picoquic_lb_compat_cid_generate;
                     quic->cnx_id_callback_ctx = (void*)lb_ctx;
+                    quic->cnxid_pool_count = 0;
                 }
             }
         }
@@ -3859,5 +4750,6 @@ void picoquic_lb_compat_cid_config_free(picoquic_quic_t* quic)
         /* Reset the Quic context */
         quic->cnx_id_callback_fn = NULL;
         quic->cnx_id_callback_ctx = NULL;
+        quic->cnxid_pool_count = 0;
     }
 }
\ No newline at end of file
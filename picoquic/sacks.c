@@ -185,13 +185,21 @@ int picoquic_record_pn_received(picoquic_cnx_t* cnx,
         sack->start_of_sack_range = pn64;
         sack->end_of_sack_range = pn64;
         cnx->pkt_ctx[pc].time_stamp_largest_received = current_microsec;
+        cnx->pkt_ctx[pc].ack_blocks_cache_valid = 0;
     } 
     else {
+        uint64_t previous_end = sack->end_of_sack_range;
+
         if (pn64 > sack->end_of_sack_range) {
             cnx->pkt_ctx[pc].time_stamp_largest_received = current_microsec;
         }
 
         ret = picoquic_update_sack_list(sack, pn64, pn64);
+
+        /* The cached ACK blocks remain valid if the packet only extends the first range */
+        if (ret == 0 && pn64 != previous_end + 1) {
+            cnx->pkt_ctx[pc].ack_blocks_cache_valid = 0;
+        }
     }
 
     return ret;
@@ -95,6 +95,7 @@ int picoquic_mark_active_stream(picoquic_cnx_t* cnx,
                 cnx->callback_fn != NULL) {
                 stream->is_active = 1;
                 stream->app_stream_ctx = app_stream_ctx;
+                picoquic_update_output_stream(cnx, stream);
                 picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
             }
             else {
@@ -103,6 +104,7 @@ int picoquic_mark_active_stream(picoquic_cnx_t* cnx,
         }
         else {
             stream->is_active = 0;
+            picoquic_update_output_stream(cnx, stream);
         }
     }
 
@@ -111,6 +113,9 @@ int picoquic_mark_active_stream(picoquic_cnx_t* cnx,
 
 int picoquic_mark_high_priority_stream(picoquic_cnx_t * cnx, uint64_t stream_id, int is_high_priority)
 {
+    uint64_t old_stream_id = cnx->high_priority_stream_id;
+    picoquic_stream_head_t* stream;
+
     if (is_high_priority) {
         cnx->high_priority_stream_id = stream_id;
     }
@@ -118,11 +123,53 @@ int picoquic_mark_high_priority_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
         cnx->high_priority_stream_id = (uint64_t)((int64_t)-1);
     }
 
+    /* Move the previous and new high priority streams to their place in the output list */
+    if (old_stream_id != cnx->high_priority_stream_id) {
+        if (old_stream_id != (uint64_t)((int64_t)-1) && (stream = picoquic_find_stream(cnx, old_stream_id)) != NULL &&
+            stream->is_output_stream) {
+            picoquic_update_output_stream(cnx, stream);
+        }
+        if (cnx->high_priority_stream_id != (uint64_t)((int64_t)-1) &&
+            (stream = picoquic_find_stream(cnx, cnx->high_priority_stream_id)) != NULL && stream->is_output_stream) {
+            picoquic_update_output_stream(cnx, stream);
+        }
+    }
+
     return 0;
 }
 
-int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
-    const uint8_t* data, size_t length, int set_fin, void * app_stream_ctx)
+int picoquic_set_stream_priority(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t urgency, int is_incremental)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = NULL;
+
+    if (urgency > PICOQUIC_STREAM_URGENCY_MAX) {
+        ret = PICOQUIC_ERROR_INVALID_PRIORITY;
+    }
+    else if ((stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret)) != NULL && ret == 0) {
+        if (stream->is_output_stream && (stream->urgency != urgency || stream->is_incremental != (unsigned int)(is_incremental != 0))) {
+            /* Move the stream to its new position in the output list */
+            picoquic_remove_output_stream(cnx, stream, NULL);
+            stream->urgency = urgency;
+            stream->is_incremental = (is_incremental != 0);
+            picoquic_insert_output_stream(cnx, stream);
+        }
+        else {
+            stream->urgency = urgency;
+            stream->is_incremental = (is_incremental != 0);
+        }
+    }
+
+    return ret;
+}
+
+/* Queue data on a stream. If release_fn is NULL, the data is copied.
+ * Otherwise the buffer is queued as is, and handed back to the application
+ * through release_fn when the node is freed.
+ */
+static int picoquic_queue_stream_data(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
 {
     int ret = 0;
     picoquic_stream_head_t* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
@@ -149,7 +196,12 @@ int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
         if (stream_data == 0) {
             ret = -1;
         } else {
-            stream_data->bytes = (uint8_t*)malloc(length);
+            if (release_fn != NULL) {
+                stream_data->bytes = (uint8_t*)data;
+            }
+            else if ((stream_data->bytes = (uint8_t*)malloc(length)) != NULL) {
+                memcpy(stream_data->bytes, data, length);
+            }
 
             if (stream_data->bytes == NULL) {
                 free(stream_data);
@@ -159,7 +211,8 @@ int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
                 picoquic_stream_data_node_t** pprevious = &stream->send_queue;
                 picoquic_stream_data_node_t* next = stream->send_queue;
 
-                memcpy(stream_data->bytes, data, length);
+                stream_data->release_fn = release_fn;
+                stream_data->release_ctx = release_ctx;
                 stream_data->length = length;
                 stream_data->offset = 0;
                 stream_data->next_stream_data = NULL;
@@ -180,17 +233,50 @@ int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
         cnx->nb_bytes_queued += length;
         stream->is_active = 0;
         stream->app_stream_ctx = app_stream_ctx;
+        picoquic_update_output_stream(cnx, stream);
     }
 
     return ret;
 }
 
+int picoquic_mark_datagram_ready(picoquic_cnx_t* cnx, int is_ready)
+{
+    cnx->is_datagram_ready = (is_ready != 0);
+    if (cnx->is_datagram_ready) {
+        picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+    }
+
+    return 0;
+}
+
+int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void * app_stream_ctx)
+{
+    return picoquic_queue_stream_data(cnx, stream_id, data, length, set_fin, app_stream_ctx, NULL, NULL);
+}
+
 int picoquic_add_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
     const uint8_t* data, size_t length, int set_fin)
 {
     return picoquic_add_to_stream_with_ctx(cnx, stream_id, data, length, set_fin, NULL);
 }
 
+int picoquic_add_buffer_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
+{
+    int ret = 0;
+
+    if (release_fn == NULL || (data == NULL && length > 0)) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else {
+        ret = picoquic_queue_stream_data(cnx, stream_id, data, length, set_fin, app_stream_ctx, release_fn, release_ctx);
+    }
+
+    return ret;
+}
+
 int picoquic_open_flow_control(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t expected_data_size)
 {
     int ret = 0;
@@ -253,6 +339,7 @@ int picoquic_reset_stream(picoquic_cnx_t* cnx,
         else if (!stream->reset_requested) {
             stream->local_error = local_stream_error;
             stream->reset_requested = 1;
+            picoquic_update_output_stream(cnx, stream);
         }
     }
 
@@ -288,7 +375,7 @@ int picoquic_stop_sending(picoquic_cnx_t* cnx,
         else if (!stream->stop_sending_requested) {
             stream->local_stop_error = local_stream_error;
             stream->stop_sending_requested = 1;
-            picoquic_insert_output_stream(cnx, stream);
+            picoquic_update_output_stream(cnx, stream);
         }
     }
 
@@ -343,7 +430,10 @@ picoquic_packet_t* picoquic_create_packet(picoquic_quic_t * quic)
     picoquic_packet_t* packet = quic->p_first_packet;
     
     if (packet == NULL) {
-        packet = (picoquic_packet_t*)malloc(sizeof(picoquic_packet_t));
+        packet = (picoquic_packet_t*)malloc(sizeof(picoquic_packet_t) + quic->max_packet_size);
+        if (packet != NULL) {
+            packet->bytes = (uint8_t*)(packet + 1);
+        }
     }
     else {
         quic->p_first_packet = packet->next_packet;
@@ -586,6 +676,62 @@ size_t picoquic_get_checksum_length(picoquic_cnx_t* cnx, picoquic_epoch_enum epo
     return ret;
 }
 
+/* Apply the header protection mask to the first byte and to the
+ * packet number of an encrypted packet.
+ */
+static void picoquic_apply_header_mask(uint8_t* send_buffer, size_t pn_offset, uint8_t first_mask, const uint8_t* mask_bytes)
+{
+    /* Encode the first byte */
+    uint8_t pn_l = (send_buffer[0] & 3) + 1;
+    send_buffer[0] ^= (mask_bytes[0] & first_mask);
+
+    /* Packet encoding is 1 to 4 bytes */
+    for (uint8_t i = 0; i < pn_l; i++) {
+        send_buffer[pn_offset + i] ^= mask_bytes[i + 1];
+    }
+}
+
+/* Complete the protection of all the packets in the batch. If the AEAD
+ * encryption was deferred, the packets are first encrypted, in parallel if
+ * crypto workers are available. Then, all the header protection masks
+ * are computed in a single call.
+ */
+void picoquic_protect_batch_flush(picoquic_quic_t* quic)
+{
+    picoquic_hp_batch_t* hp_batch = &quic->hp_batch;
+
+    if (hp_batch->nb_items > 0) {
+        const uint8_t* samples[PICOQUIC_HP_BATCH_MAX];
+        uint8_t masks[PICOQUIC_HP_BATCH_MAX * PICOQUIC_HP_SAMPLE_SIZE];
+
+        if (quic->crypto_workers != NULL) {
+            picoquic_crypto_workers_encrypt(quic->crypto_workers, hp_batch);
+        }
+
+        for (size_t i = 0; i < hp_batch->nb_items; i++) {
+            if (hp_batch->items[i].is_aead_pending) {
+                /* Workers not available, encrypt in place */
+                uint8_t* payload = hp_batch->items[i].packet + hp_batch->items[i].h_length;
+                (void)picoquic_aead_encrypt_generic(payload, payload, hp_batch->items[i].payload_length,
+                    hp_batch->items[i].sequence_number, hp_batch->items[i].packet, hp_batch->items[i].h_length,
+                    hp_batch->crypto_context->aead_encrypt);
+                hp_batch->items[i].is_aead_pending = 0;
+            }
+            /* The sample is located 4 bytes after the PN offset */
+            samples[i] = hp_batch->items[i].packet + hp_batch->items[i].pn_offset + 4;
+        }
+
+        picoquic_pn_encrypt_batch(hp_batch->crypto_context->pn_enc, hp_batch->crypto_context->pn_enc_ecb,
+            samples, masks, hp_batch->nb_items);
+
+        for (size_t i = 0; i < hp_batch->nb_items; i++) {
+            picoquic_apply_header_mask(hp_batch->items[i].packet, hp_batch->items[i].pn_offset,
+                hp_batch->items[i].first_mask, masks + i * PICOQUIC_HP_SAMPLE_SIZE);
+        }
+        hp_batch->nb_items = 0;
+    }
+}
+
 static size_t picoquic_protect_packet(picoquic_cnx_t* cnx, 
     picoquic_packet_type_enum ptype,
     uint8_t * bytes, 
@@ -594,9 +740,13 @@ static size_t picoquic_protect_packet(picoquic_cnx_t* cnx,
     picoquic_connection_id_t * local_cnxid,
     size_t length, size_t header_length,
     uint8_t* send_buffer, size_t send_buffer_max,
-    void * aead_context, void* pn_enc,
+    picoquic_crypto_context_t * crypto_context,
     picoquic_path_t* path_x, uint64_t current_time)
 {
+    void* aead_context = crypto_context->aead_encrypt;
+    picoquic_hp_batch_t* hp_batch;
+    int is_batched;
+    int is_aead_deferred;
     size_t send_length;
     size_t h_length;
     size_t pn_offset = 0;
@@ -647,10 +797,25 @@ static size_t picoquic_protect_packet(picoquic_cnx_t* cnx,
         }
     }
 
-    /* Encrypt the packet */
-    send_length = picoquic_aead_encrypt_generic(send_buffer + /* header_length */ h_length,
-        bytes + header_length, length - header_length,
-        sequence_number, send_buffer, /* header_length */ h_length, aead_context);
+    /* Encrypt the packet, or defer encryption to the crypto workers if
+     * the packet is part of a batch */
+    hp_batch = &cnx->quic->hp_batch;
+    is_batched = (ptype == picoquic_packet_1rtt_protected && hp_batch->is_active);
+    if (is_batched && hp_batch->nb_items > 0 &&
+        (hp_batch->nb_items >= PICOQUIC_HP_BATCH_MAX || hp_batch->crypto_context != crypto_context)) {
+        picoquic_protect_batch_flush(cnx->quic);
+    }
+    is_aead_deferred = (is_batched && cnx->quic->crypto_workers != NULL);
+
+    if (is_aead_deferred) {
+        memcpy(send_buffer + h_length, bytes + header_length, length - header_length);
+        send_length = length - header_length + aead_checksum_length;
+    }
+    else {
+        send_length = picoquic_aead_encrypt_generic(send_buffer + /* header_length */ h_length,
+            bytes + header_length, length - header_length,
+            sequence_number, send_buffer, /* header_length */ h_length, aead_context);
+    }
 
     send_length += /* header_length */ h_length;
 
@@ -665,17 +830,26 @@ static size_t picoquic_protect_packet(picoquic_cnx_t* cnx,
     if (pn_offset < sample_offset)
     {
         /* This is always true, as use pn_length = 4 */
-        uint8_t mask_bytes[5] = { 0, 0, 0, 0, 0 };
-        uint8_t pn_l;
-
-        picoquic_pn_encrypt(pn_enc, send_buffer + sample_offset, mask_bytes, mask_bytes, 5);
-        /* Encode the first byte */
-        pn_l = (send_buffer[0] & 3) + 1;
-        send_buffer[0] ^= (mask_bytes[0] & first_mask);
+        if (is_batched) {
+            /* Defer the header protection until the whole train is ready */
+            picoquic_hp_batch_item_t* item = &hp_batch->items[hp_batch->nb_items];
+
+            hp_batch->crypto_context = crypto_context;
+            item->packet = send_buffer;
+            item->pn_offset = pn_offset;
+            item->h_length = h_length;
+            item->payload_length = length - header_length;
+            item->sequence_number = sequence_number;
+            item->first_mask = first_mask;
+            item->is_aead_pending = is_aead_deferred;
+            hp_batch->nb_items++;
+        }
+        else {
+            uint8_t mask_bytes[PICOQUIC_HP_SAMPLE_SIZE];
+            const uint8_t* sample = send_buffer + sample_offset;
 
-        /* Packet encoding is 1 to 4 bytes */
-        for (uint8_t i = 0; i < pn_l; i++) {
-            send_buffer[pn_offset+i] ^= mask_bytes[i+1];
+            picoquic_pn_encrypt_batch(crypto_context->pn_enc, crypto_context->pn_enc_ecb, &sample, mask_bytes, 1);
+            picoquic_apply_header_mask(send_buffer, pn_offset, first_mask, mask_bytes);
         }
     }
 
@@ -867,6 +1041,7 @@ void picoquic_queue_for_retransmit(picoquic_cnx_t* cnx, picoquic_path_t * path_x
     cnx->pkt_ctx[pc].retransmit_newest = packet;
 
     if (!packet->is_ack_trap) {
+        packet->path_packet_number = path_x->path_packet_next++;
         /* Account for bytes in transit, for congestion control */
         path_x->bytes_in_transit += length;
         /* Update the pacing data */
@@ -1035,35 +1210,35 @@ void picoquic_finalize_and_protect_packet(picoquic_cnx_t *cnx, picoquic_packet_t
             length = picoquic_protect_packet(cnx, packet->ptype, packet->bytes, packet->sequence_number,
                 remote_cnxid, local_cnxid,
                 length, header_length,
-                send_buffer, send_buffer_max, cnx->crypto_context[picoquic_epoch_initial].aead_encrypt, cnx->crypto_context[picoquic_epoch_initial].pn_enc,
+                send_buffer, send_buffer_max, &cnx->crypto_context[picoquic_epoch_initial],
                 path_x, current_time);
             break;
         case picoquic_packet_handshake:
             length = picoquic_protect_packet(cnx, packet->ptype, packet->bytes, packet->sequence_number,
                 remote_cnxid, local_cnxid,
                 length, header_length,
-                send_buffer, send_buffer_max, cnx->crypto_context[picoquic_epoch_handshake].aead_encrypt, cnx->crypto_context[picoquic_epoch_handshake].pn_enc,
+                send_buffer, send_buffer_max, &cnx->crypto_context[picoquic_epoch_handshake],
                 path_x, current_time);
             break;
         case picoquic_packet_retry:
             length = picoquic_protect_packet(cnx, packet->ptype, packet->bytes, packet->sequence_number,
                 remote_cnxid, local_cnxid,
                 length, header_length,
-                send_buffer, send_buffer_max, cnx->crypto_context[picoquic_epoch_0rtt].aead_encrypt, cnx->crypto_context[picoquic_epoch_0rtt].pn_enc,
+                send_buffer, send_buffer_max, &cnx->crypto_context[picoquic_epoch_0rtt],
                 path_x, current_time);
             break;
         case picoquic_packet_0rtt_protected:
             length = picoquic_protect_packet(cnx, packet->ptype, packet->bytes, packet->sequence_number, 
                 remote_cnxid, local_cnxid,
                 length, header_length,
-                send_buffer, send_buffer_max, cnx->crypto_context[picoquic_epoch_0rtt].aead_encrypt, cnx->crypto_context[picoquic_epoch_0rtt].pn_enc,
+                send_buffer, send_buffer_max, &cnx->crypto_context[picoquic_epoch_0rtt],
                 path_x, current_time);
             break;
         case picoquic_packet_1rtt_protected:
             length = picoquic_protect_packet(cnx, packet->ptype, packet->bytes, packet->sequence_number,
                 remote_cnxid, local_cnxid,
                 length, header_length,
-                send_buffer, send_buffer_max, cnx->crypto_context[picoquic_epoch_1rtt].aead_encrypt, cnx->crypto_context[picoquic_epoch_1rtt].pn_enc,
+                send_buffer, send_buffer_max, &cnx->crypto_context[picoquic_epoch_1rtt],
                 path_x, current_time);
             break;
         default:
@@ -1095,9 +1270,9 @@ void picoquic_finalize_and_protect_packet(picoquic_cnx_t *cnx, picoquic_packet_t
  * a different path, with different MTU.
  */
 
-static uint64_t picoquic_current_retransmit_timer(picoquic_cnx_t* cnx, picoquic_packet_context_enum pc)
+static uint64_t picoquic_current_retransmit_timer(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_context_enum pc)
 {
-    uint64_t rto = cnx->path[0]->retransmit_timer;
+    uint64_t rto = path_x->retransmit_timer;
 
     rto <<= cnx->pkt_ctx[pc].nb_retransmit;
     if (cnx->cnx_state < picoquic_state_ready) {
@@ -1107,8 +1282,8 @@ static uint64_t picoquic_current_retransmit_timer(picoquic_cnx_t* cnx, picoquic_
     }
     else if (rto > PICOQUIC_LARGE_RETRANSMIT_TIMER){
         uint64_t alt_rto = PICOQUIC_LARGE_RETRANSMIT_TIMER;
-        if (cnx->path[0]->rtt_min > PICOQUIC_TARGET_SATELLITE_RTT) {
-            alt_rto = (cnx->path[0]->smoothed_rtt * 3) >> 1;
+        if (path_x->rtt_min > PICOQUIC_TARGET_SATELLITE_RTT) {
+            alt_rto = (path_x->smoothed_rtt * 3) >> 1;
         }
         if (alt_rto < rto) {
             rto = alt_rto;
@@ -1122,34 +1297,46 @@ static int picoquic_retransmit_needed_by_packet(picoquic_cnx_t* cnx,
     picoquic_packet_t* p, uint64_t current_time, uint64_t * next_retransmit_time, int* timer_based)
 {
     picoquic_packet_context_enum pc = p->pc;
+    picoquic_path_t* path_x = cnx->path[0];
     uint64_t retransmit_time;
     int64_t delta_seq = cnx->pkt_ctx[pc].highest_acknowledged - p->sequence_number;
+    uint64_t highest_acknowledged_time = cnx->pkt_ctx[pc].highest_acknowledged_time;
+    uint64_t latest_time_acknowledged = cnx->pkt_ctx[pc].latest_time_acknowledged;
     int should_retransmit = 0;
     int is_timer_based = 0;
 
+    if (cnx->is_multipath_enabled && p->send_path != NULL && !p->is_ack_trap) {
+        /* Packets sent on paths with different delays are not acknowledged in
+         * sequence. Only the packets sent on the same path are used as reference. */
+        path_x = p->send_path;
+        delta_seq = (int64_t)path_x->path_packet_acked_next - 1 - (int64_t)p->path_packet_number;
+        highest_acknowledged_time = path_x->path_packet_acked_time;
+        latest_time_acknowledged = path_x->path_packet_acked_sent_time;
+    }
+
     if (delta_seq > 0) {
         /* By default, we use an RTO  */
-        retransmit_time = p->send_time + cnx->path[0]->retransmit_timer;
+        retransmit_time = p->send_time + path_x->retransmit_timer;
         /* RACK logic works best when the amount of reordering is not too large */
         if (delta_seq < 3) {
             /* When just a few ulterior packets are acknowledged, we work from the right edge. */
-            uint64_t rack_timer_min = cnx->pkt_ctx[pc].highest_acknowledged_time +
-                cnx->remote_parameters.max_ack_delay + (cnx->path[0]->smoothed_rtt >> 2);
+            uint64_t rack_timer_min = highest_acknowledged_time +
+                cnx->remote_parameters.max_ack_delay + (path_x->smoothed_rtt >> 2);
             if (retransmit_time > rack_timer_min) {
                 retransmit_time = rack_timer_min;
             }
         } else {
             /* When enough ulterior packets are acknowledged, we work from the right edge. */
-            uint64_t rack_timer_min = p->send_time + (cnx->path[0]->smoothed_rtt >> 2);
-            if (rack_timer_min < cnx->pkt_ctx[pc].latest_time_acknowledged) {
-                retransmit_time = cnx->pkt_ctx[pc].highest_acknowledged_time;
+            uint64_t rack_timer_min = p->send_time + (path_x->smoothed_rtt >> 2);
+            if (rack_timer_min < latest_time_acknowledged) {
+                retransmit_time = highest_acknowledged_time;
             }
         }
     }
     else
     {
         /* There has not been any higher packet acknowledged, thus we fall back on timer logic. */
-        retransmit_time = p->send_time + picoquic_current_retransmit_timer(cnx, pc);
+        retransmit_time = p->send_time + picoquic_current_retransmit_timer(cnx, path_x, pc);
         is_timer_based = 1;
     }
 
@@ -1204,6 +1391,36 @@ int picoquic_queue_stream_frame_for_retransmit(picoquic_cnx_t* cnx, uint8_t * by
     return ret;
 }
 
+/* With the redundant scheduler, the new stream frames are also queued for
+ * retransmission. The copies are sent in the next packet, which the round
+ * robin selection places on another path if one is available. The copies
+ * are not repeated again. */
+static int picoquic_queue_redundant_stream_frames(picoquic_cnx_t* cnx, uint8_t* bytes, size_t length)
+{
+    int ret = 0;
+    size_t byte_index = 0;
+    int nb_verified_paths = 0;
+
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        nb_verified_paths += (cnx->path[i]->challenge_verified && !cnx->path[i]->path_is_demoted);
+    }
+
+    while (ret == 0 && nb_verified_paths > 1 && byte_index < length) {
+        size_t frame_length = 0;
+        int frame_is_pure_ack = 0;
+
+        if ((ret = picoquic_skip_frame(bytes + byte_index, length - byte_index, &frame_length, &frame_is_pure_ack)) == 0) {
+            if (PICOQUIC_IN_RANGE(bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max) &&
+                (ret = picoquic_queue_stream_frame_for_retransmit(cnx, bytes + byte_index, frame_length)) == 0) {
+                cnx->nb_stream_frames_redundant++;
+            }
+            byte_index += frame_length;
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_copy_before_retransmit(picoquic_packet_t * old_p,
     picoquic_cnx_t * cnx,
     uint8_t * new_bytes,
@@ -1220,9 +1437,29 @@ int picoquic_copy_before_retransmit(picoquic_packet_t * old_p,
     
     if (old_p->is_mtu_probe) {
         if (old_p->send_path != NULL) {
-            /* MTU probe was lost, presumably because of packet too big */
-            old_p->send_path->mtu_probe_sent = 0;
-            old_p->send_path->send_mtu_max_tried = old_p->length + old_p->checksum_overhead;
+            /* MTU probe was lost, presumably because of packet too big. The size
+             * is only marked as failed after several probes of that size are lost,
+             * because a single loss may be due to congestion. */
+            picoquic_path_t* path_x = old_p->send_path;
+            size_t probe_size = old_p->length + old_p->checksum_overhead;
+
+            path_x->mtu_probe_sent = 0;
+            path_x->nb_mtu_probes_lost++;
+            if (probe_size > path_x->send_mtu) {
+                if (probe_size == path_x->mtu_probe_size) {
+                    path_x->mtu_probe_losses++;
+                }
+                else {
+                    path_x->mtu_probe_size = probe_size;
+                    path_x->mtu_probe_losses = 1;
+                }
+                if (path_x->mtu_probe_losses >= PICOQUIC_PMTUD_MAX_PROBES) {
+                    if (path_x->send_mtu_max_tried == 0 || probe_size < path_x->send_mtu_max_tried) {
+                        path_x->send_mtu_max_tried = probe_size;
+                    }
+                    path_x->mtu_probe_losses = 0;
+                }
+            }
         }
         /* MTU probes should not be retransmitted */
         *packet_is_pure_ack = 1;
@@ -1277,8 +1514,19 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
     picoquic_packet_t* packet, size_t send_buffer_max, size_t* header_length)
 {
     picoquic_packet_t* old_p = cnx->pkt_ctx[pc].retransmit_oldest;
+    picoquic_path_t* waiting_path[PICOQUIC_NB_PATH_TARGET];
+    int nb_waiting_paths = 0;
+    int nb_active_paths = 0;
     size_t length = 0;
 
+    if (cnx->is_multipath_enabled) {
+        for (int i = 0; i < cnx->nb_paths && nb_active_paths < PICOQUIC_NB_PATH_TARGET; i++) {
+            if (cnx->path[i]->bytes_in_transit > 0) {
+                nb_active_paths++;
+            }
+        }
+    }
+
     /* TODO: while packets are pure ACK, drop them from retransmit queue */
     while (old_p != NULL) {
         picoquic_path_t * old_path = old_p->send_path; /* should be the path on which the packet was transmitted */
@@ -1311,6 +1559,26 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
                     *next_wake_time = next_retransmit_time;
                     SET_LAST_WAKE(cnx->quic, PICOQUIC_SENDER);
                 }
+                if (cnx->is_multipath_enabled && old_path != NULL) {
+                    /* In multipath mode, the packets are only sent in order on each path.
+                     * Keep checking the packets sent on other paths, until a packet is
+                     * found waiting on each of the paths with data in transit. */
+                    int is_waiting = 0;
+
+                    for (int i = 0; i < nb_waiting_paths; i++) {
+                        if (waiting_path[i] == old_path) {
+                            is_waiting = 1;
+                            break;
+                        }
+                    }
+                    if (!is_waiting && nb_waiting_paths < PICOQUIC_NB_PATH_TARGET) {
+                        waiting_path[nb_waiting_paths++] = old_path;
+                    }
+                    if (nb_waiting_paths < nb_active_paths) {
+                        old_p = p_next;
+                        continue;
+                    }
+                }
                 break;
             }
         } else if (old_p->is_ack_trap){
@@ -1427,16 +1695,9 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
                 if (old_p == NULL || packet_is_pure_ack) {
                     length = 0;
                 } else {
-                    if (old_p->send_path != NULL &&
-                        (old_p->length + old_p->checksum_overhead) == old_p->send_path->send_mtu) {
-                        old_p->send_path->nb_mtu_losses++;
-                        if (old_p->send_path->nb_mtu_losses > PICOQUIC_MTU_LOSS_THRESHOLD) {
-                            picoquic_reset_path_mtu(old_p->send_path);
-                            picoquic_log_app_message(cnx,
-                                "Reset path MTU after %d retransmissions, %d MTU losses",
-                                cnx->pkt_ctx[pc].nb_retransmit,
-                                old_p->send_path->nb_mtu_losses);
-                        }
+                    if (old_p->send_path != NULL) {
+                        picoquic_update_path_mtu_on_loss(cnx, old_p->send_path,
+                            old_p->length + old_p->checksum_overhead, old_p->send_time);
                     }
 
                     if (timer_based_retransmit != 0) {
@@ -1552,32 +1813,122 @@ int picoquic_is_cnx_backlog_empty(picoquic_cnx_t* cnx)
     return backlog_empty;
 }
 
-/* Decide whether MAX data need to be sent or not */
+/* Receive window auto-tuning.
+ * Once per RTT, measure the amount of data received (or consumed) during
+ * the last epoch, scaled to one RTT. The window is set to at least twice
+ * that amount, so the peer is not blocked by flow control while its
+ * congestion window grows, and to up to twice more if the rate is
+ * increasing. The window never shrinks. Returns the desired window; the
+ * caller decides how much of it can be granted.
+ */
+uint64_t picoquic_tune_receive_window(picoquic_receive_window_t* receive_window, uint64_t offset,
+    uint64_t rtt, uint64_t current_time)
+{
+    uint64_t desired = receive_window->window;
+
+    if (current_time >= receive_window->epoch_start_time + rtt && current_time > receive_window->epoch_start_time &&
+        offset >= receive_window->epoch_start_offset) {
+        double elapsed = (double)(current_time - receive_window->epoch_start_time);
+        uint64_t bytes_per_rtt = (uint64_t)(((double)(offset - receive_window->epoch_start_offset)) * ((double)rtt) / elapsed);
+        uint64_t target = 2 * bytes_per_rtt;
+
+        if (receive_window->bytes_per_rtt > 0 && bytes_per_rtt > receive_window->bytes_per_rtt) {
+            uint64_t growth = bytes_per_rtt - receive_window->bytes_per_rtt;
+
+            if (growth > receive_window->bytes_per_rtt) {
+                growth = receive_window->bytes_per_rtt;
+            }
+            target += (uint64_t)(((double)target) * ((double)growth) / ((double)receive_window->bytes_per_rtt));
+        }
+
+        if (target > desired) {
+            desired = target;
+        }
+
+        receive_window->bytes_per_rtt = bytes_per_rtt;
+        receive_window->epoch_start_time = current_time;
+        receive_window->epoch_start_offset = offset;
+    }
+
+    return desired;
+}
+
+/* The growth of the connection window is charged to the QUIC context,
+ * within the limit of the context wide cap. */
+void picoquic_tune_connection_receive_window(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    uint64_t desired = picoquic_tune_receive_window(&cnx->receive_window, cnx->data_received,
+        cnx->path[0]->smoothed_rtt, current_time);
+
+    if (desired > cnx->receive_window.window) {
+        picoquic_quic_t* quic = cnx->quic;
+        uint64_t increase = desired - cnx->receive_window.window;
+
+        if (quic->receive_window_growth_max > 0) {
+            uint64_t budget = (quic->receive_window_growth_total < quic->receive_window_growth_max) ?
+                quic->receive_window_growth_max - quic->receive_window_growth_total : 0;
+
+            if (increase > budget) {
+                increase = budget;
+            }
+        }
+
+        cnx->receive_window.window += increase;
+        cnx->receive_window_growth += increase;
+        quic->receive_window_growth_total += increase;
+    }
+}
+
+/* Stream windows are tuned on the data consumed by the application. There
+ * is no point in a stream window larger than the connection window. */
+int picoquic_is_stream_max_data_needed(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint64_t current_time)
+{
+    uint64_t desired = picoquic_tune_receive_window(&stream->receive_window, stream->consumed_offset,
+        cnx->path[0]->smoothed_rtt, current_time);
+
+    if (desired > cnx->receive_window.window) {
+        desired = cnx->receive_window.window;
+    }
+    if (desired > stream->receive_window.window) {
+        stream->receive_window.window = desired;
+    }
+
+    return (stream->consumed_offset + stream->receive_window.window / 2 > stream->maxdata_local);
+}
+
+/* Decide whether MAX data need to be sent or not: the credit left to the
+ * peer is less than half the receive window */
 int picoquic_should_send_max_data(picoquic_cnx_t* cnx)
 {
     int ret = 0;
 
-    if (2 * cnx->data_received > cnx->maxdata_local)
+    if (cnx->data_received + cnx->receive_window.window / 2 > cnx->maxdata_local)
         ret = 1;
 
     return ret;
 }
 
-/* Compute the next logical probe length */
+/* Compute the next logical probe length.
+ * The first probe tries the largest size allowed by the peer and by the
+ * local packet buffers. A lost probe is repeated until the loss of
+ * PICOQUIC_PMTUD_MAX_PROBES probes confirms that the size fails. The search
+ * then tries the common Ethernet sizes, and proceeds by binary steps between
+ * the largest size that worked and the smallest that failed. It stops when
+ * the two are closer than PICOQUIC_MTU_PROBE_STEP_MIN. */
 static size_t picoquic_next_mtu_probe_length(picoquic_cnx_t* cnx, picoquic_path_t * path_x)
 {
     size_t probe_length;
 
-    if (path_x->send_mtu_max_tried == 0) {
+    if (path_x->mtu_probe_losses > 0 && path_x->mtu_probe_size > path_x->send_mtu) {
+        probe_length = path_x->mtu_probe_size;
+    }
+    else if (path_x->send_mtu_max_tried == 0) {
         if (cnx->remote_parameters.max_packet_size > 0) {
             probe_length = cnx->remote_parameters.max_packet_size;
 
             if (cnx->quic->mtu_max > 0 && (int)probe_length > cnx->quic->mtu_max) {
                 probe_length = cnx->quic->mtu_max;
             }
-            else if (probe_length > PICOQUIC_MAX_PACKET_SIZE) {
-                probe_length = PICOQUIC_MAX_PACKET_SIZE;
-            }
             if (probe_length < path_x->send_mtu) {
                 probe_length = path_x->send_mtu;
             }
@@ -1585,33 +1936,50 @@ static size_t picoquic_next_mtu_probe_length(picoquic_cnx_t* cnx, picoquic_path_
         else if (cnx->quic->mtu_max > 0) {
             probe_length = cnx->quic->mtu_max;
         }
+        else if (cnx->quic->max_packet_size > PICOQUIC_MAX_PACKET_SIZE) {
+            probe_length = cnx->quic->max_packet_size;
+        }
         else {
             probe_length = PICOQUIC_PRACTICAL_MAX_MTU;
         }
     }
+    else if (path_x->send_mtu_max_tried <= path_x->send_mtu + PICOQUIC_MTU_PROBE_STEP_MIN) {
+        probe_length = path_x->send_mtu;
+    }
+    else if (path_x->send_mtu_max_tried > 1500 && path_x->send_mtu < 1500) {
+        probe_length = 1500;
+    }
+    else if (path_x->send_mtu_max_tried > 1400 && path_x->send_mtu < 1400) {
+        probe_length = 1400;
+    }
     else {
-        if (path_x->send_mtu_max_tried > 1500) {
-            probe_length = 1500;
-        }
-        else if (path_x->send_mtu_max_tried > 1400) {
-            probe_length = 1400;
-        }
-        else {
-            probe_length = (path_x->send_mtu + path_x->send_mtu_max_tried) / 2;
-        }
+        probe_length = (path_x->send_mtu + path_x->send_mtu_max_tried) / 2;
+    }
+
+    if (probe_length > cnx->quic->max_packet_size) {
+        probe_length = cnx->quic->max_packet_size;
     }
 
     return probe_length;
 }
 
-/* Decide whether to send an MTU probe */
-picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t* cnx, picoquic_path_t * path_x)
+/* Decide whether to send an MTU probe.
+ * When the search is complete, it resumes after the raise timer, in case
+ * the path now supports larger packets. */
+picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
+    uint64_t current_time)
 {
     int ret = picoquic_pmtu_discovery_not_needed;
 
     if ((cnx->cnx_state == picoquic_state_ready || cnx->cnx_state == picoquic_state_client_ready_start || cnx->cnx_state == picoquic_state_server_false_start)
         && path_x->mtu_probe_sent == 0) {
-        if (path_x->send_mtu_max_tried == 0 || path_x->send_mtu_max_tried > 1400) {
+        if (path_x->pmtud_state == picoquic_pmtud_search_complete && current_time >= path_x->pmtud_raise_time) {
+            path_x->pmtud_state = picoquic_pmtud_searching;
+            path_x->send_mtu_max_tried = 0;
+            path_x->mtu_probe_losses = 0;
+        }
+
+        if (path_x->pmtud_state == picoquic_pmtud_searching) {
             /* MTU discovery is required if the chances of success are large enough
              * and there are enough packets to send to amortize the discovery cost.
              * Of course we don't know at this stage how much data will be sent 
@@ -1634,13 +2002,18 @@ picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t*
                     }
                 }
             }
+            else {
+                path_x->pmtud_state = picoquic_pmtud_search_complete;
+                path_x->pmtud_raise_time = current_time + PICOQUIC_PMTUD_RAISE_TIMER;
+            }
         }
     }
 
     return ret;
 }
 
-/* Prepare an MTU probe packet */
+/* Prepare an MTU probe packet. The probe is a PING frame padded to the
+ * probe size. */
 size_t picoquic_prepare_mtu_probe(picoquic_cnx_t* cnx,
     picoquic_path_t * path_x,
     size_t header_length, size_t checksum_length,
@@ -1653,12 +2026,60 @@ size_t picoquic_prepare_mtu_probe(picoquic_cnx_t* cnx,
         probe_length = bytes_max;
     }
 
+    if (probe_length != path_x->mtu_probe_size) {
+        path_x->mtu_probe_size = probe_length;
+        path_x->mtu_probe_losses = 0;
+    }
+    path_x->nb_mtu_probes_sent++;
+
     bytes[length++] = picoquic_frame_type_ping;
     memset(&bytes[length], 0, probe_length - checksum_length - length);
 
     return probe_length - checksum_length;
 }
 
+/* Update the MTU discovery state when a packet is acknowledged. A packet
+ * larger than the current MTU is a successful probe. */
+void picoquic_update_path_mtu_on_ack(picoquic_path_t* path_x, size_t packet_size, uint64_t send_time)
+{
+    if (packet_size > path_x->send_mtu) {
+        path_x->send_mtu = packet_size;
+        path_x->mtu_probe_sent = 0;
+        if (path_x->send_mtu_max_tried != 0 && path_x->send_mtu_max_tried <= packet_size) {
+            /* The size that failed before works now */
+            path_x->send_mtu_max_tried = 0;
+        }
+        if (path_x->mtu_probe_size <= packet_size) {
+            path_x->mtu_probe_losses = 0;
+        }
+    }
+
+    if (packet_size == path_x->send_mtu) {
+        path_x->nb_mtu_losses = 0;
+        if (send_time > path_x->mtu_acked_sent_time) {
+            path_x->mtu_acked_sent_time = send_time;
+        }
+    }
+}
+
+/* Update the MTU discovery state when a packet is declared lost.
+ * Losses of full size packets are counted if no full size packet sent later
+ * was acknowledged, because otherwise the loss is due to congestion. Too many
+ * such losses indicate a black hole, for example after a route change. */
+void picoquic_update_path_mtu_on_loss(picoquic_cnx_t* cnx, picoquic_path_t* path_x, size_t packet_size,
+    uint64_t send_time)
+{
+    if (packet_size == path_x->send_mtu && send_time > path_x->mtu_acked_sent_time) {
+        path_x->nb_mtu_losses++;
+        if (path_x->nb_mtu_losses > PICOQUIC_MTU_LOSS_THRESHOLD) {
+            picoquic_log_app_message(cnx, "Reset path MTU %zu after %"PRIu64" MTU losses",
+                path_x->send_mtu, path_x->nb_mtu_losses);
+            path_x->nb_mtu_black_holes++;
+            picoquic_reset_path_mtu(path_x);
+        }
+    }
+}
+
 /* Prepare the next packet to 0-RTT packet to send in the client initial
  * state, when 0-RTT is available
  */
@@ -1969,7 +2390,7 @@ int picoquic_prepare_packet_client_init(picoquic_cnx_t* cnx, picoquic_path_t * p
     switch (cnx->cnx_state) {
     case picoquic_state_client_init:
         if (cnx->retry_token_length == 0 && cnx->sni != NULL) {
-            (void)picoquic_get_token(cnx->quic->p_first_token, current_time, cnx->sni, (uint16_t)strlen(cnx->sni),
+            (void)picoquic_get_retry_token(cnx->quic, current_time, cnx->sni, (uint16_t)strlen(cnx->sni),
                 NULL, 0, &cnx->retry_token, &cnx->retry_token_length, 1);
         }
         break;
@@ -2017,7 +2438,7 @@ int picoquic_prepare_packet_client_init(picoquic_cnx_t* cnx, picoquic_path_t * p
                     /* There is a risk of deadlock if the server is doing DDOS mitigation
                      * and does not receive the Handshake sent by the client. If more than RTT has elapsed since
                      * the last handshake packet was sent, force another one to be sent. */
-                    uint64_t rto = picoquic_current_retransmit_timer(cnx, picoquic_packet_context_handshake);
+                    uint64_t rto = picoquic_current_retransmit_timer(cnx, cnx->path[0], picoquic_packet_context_handshake);
                     uint64_t repeat_time = cnx->pkt_ctx[pc].retransmit_newest->send_time + rto;
 
                     if (repeat_time <= current_time) {
@@ -2040,7 +2461,7 @@ int picoquic_prepare_packet_client_init(picoquic_cnx_t* cnx, picoquic_path_t * p
             /* There is a risk of deadlock if the server is doing DDOS mitigation
              * and does not repeat an initial or handshake packet that was lost. If more than RTT has elapsed since
              * the last initial packet was sent, force another one to be sent. */
-            uint64_t rto = picoquic_current_retransmit_timer(cnx, picoquic_packet_context_initial);
+            uint64_t rto = picoquic_current_retransmit_timer(cnx, cnx->path[0], picoquic_packet_context_initial);
             uint64_t repeat_time = cnx->path[0]->latest_sent_time + rto;
             force_handshake_padding = (repeat_time <= current_time);
         }
@@ -2160,6 +2581,8 @@ int picoquic_prepare_packet_client_init(picoquic_cnx_t* cnx, picoquic_path_t * p
                                 cnx->tls_stream[1].send_queue == NULL &&
                                 cnx->tls_stream[2].send_queue == NULL) {
                                 cnx->cnx_state = picoquic_state_client_ready_start;
+                                /* The TLS handshake no longer needs the resumption ticket */
+                                picoquic_release_session_ticket(&cnx->resumption_ticket);
                                 /* Reset the HS retransmission count, since end of flight counts as acknowledgement */
                                 cnx->pkt_ctx[picoquic_packet_context_handshake].nb_retransmit = 0;
                                 /* Signal the application, because data can now be sent. */
@@ -2715,6 +3138,9 @@ void picoquic_ready_state_transition(picoquic_cnx_t* cnx, uint64_t current_time)
     picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_0rtt]);
     picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_handshake]);
 
+    /* If key rotation was configured, prepare the keys of the first update */
+    cnx->is_next_key_phase_needed = (cnx->crypto_epoch_length_max != 0);
+
     /* Set the confidentiality limit if not already set */
     if (cnx->crypto_epoch_length_max == 0) {
         cnx->crypto_epoch_length_max = 
@@ -2911,7 +3337,7 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                      * three values: not needed at all, optional, or required.
                      * If required, PMTU discovery takes priority over sending stream data.
                      */
-                    picoquic_pmtu_discovery_status_enum pmtu_discovery_needed = picoquic_is_mtu_probe_needed(cnx, path_x);
+                    picoquic_pmtu_discovery_status_enum pmtu_discovery_needed = picoquic_is_mtu_probe_needed(cnx, path_x, current_time);
 
                     /* if present, send tls data */
                     if (tls_ready) {
@@ -2939,8 +3365,13 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                         }
 
                         /* Start of CC controlled frames */
-                        if (ret == 0 && length <= header_length && cnx->first_datagram != NULL) {
-                            bytes_next = picoquic_format_first_datagram_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack);
+                        if (ret == 0 && length <= header_length) {
+                            if (cnx->first_datagram != NULL) {
+                                bytes_next = picoquic_format_first_datagram_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack, current_time);
+                            }
+                            else if (cnx->is_datagram_ready) {
+                                bytes_next = picoquic_format_ready_datagram_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack, &ret);
+                            }
                         }
 
                         /* If present, send stream frames queued for retransmission */
@@ -3233,9 +3664,12 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                                 cnx->local_parameters.initial_max_data);
                         }
                     }
-                    else if (2 * cnx->data_received > cnx->maxdata_local) {
-                        bytes_next = picoquic_format_max_data_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack,
-                            picoquic_cc_increased_window(cnx, cnx->maxdata_local));
+                    else {
+                        picoquic_tune_connection_receive_window(cnx, current_time);
+                        if (picoquic_should_send_max_data(cnx)) {
+                            bytes_next = picoquic_format_max_data_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack,
+                                cnx->data_received + cnx->receive_window.window - cnx->maxdata_local);
+                        }
                     }
                 }
 
@@ -3277,7 +3711,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                      */
                     int datagram_tried_and_failed = 0;
                     int stream_tried_and_failed = 0;
-                    picoquic_pmtu_discovery_status_enum pmtu_discovery_needed = picoquic_is_mtu_probe_needed(cnx, path_x);
+                    picoquic_pmtu_discovery_status_enum pmtu_discovery_needed = picoquic_is_mtu_probe_needed(cnx, path_x, current_time);
 
                     /* if present, send tls data */
                     if (picoquic_is_tls_stream_ready(cnx)) {
@@ -3297,7 +3731,10 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
 
                         if (ret == 0 && length <= header_length) {
                             if (cnx->first_datagram != NULL) {
-                                bytes_next = picoquic_format_first_datagram_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack);
+                                bytes_next = picoquic_format_first_datagram_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack, current_time);
+                            }
+                            else if (cnx->is_datagram_ready) {
+                                bytes_next = picoquic_format_ready_datagram_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack, &ret);
                             }
                             else {
                                 datagram_tried_and_failed = 1;
@@ -3316,7 +3753,12 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
 
                         /* Encode the stream frame, or frames */
                         if (ret == 0 && !split_repeat_queued && bytes_next + 8 < bytes_max) {
+                            uint8_t* bytes_stream = bytes_next;
                             bytes_next = picoquic_format_available_stream_frames(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack, &stream_tried_and_failed, &ret);
+                            if (ret == 0 && bytes_next > bytes_stream && cnx->is_multipath_enabled &&
+                                cnx->path_scheduler != NULL && cnx->path_scheduler->is_redundant) {
+                                ret = picoquic_queue_redundant_stream_frames(cnx, bytes_stream, bytes_next - bytes_stream);
+                            }
                         }
 
                         length = bytes_next - bytes;
@@ -3455,7 +3897,7 @@ static int picoquic_check_idle_timer(picoquic_cnx_t* cnx, uint64_t* next_wake_ti
     uint64_t idle_timer = 0;
 
     if (cnx->cnx_state >= picoquic_state_ready) {
-        uint64_t rto = picoquic_current_retransmit_timer(cnx, picoquic_packet_context_application);
+        uint64_t rto = picoquic_current_retransmit_timer(cnx, cnx->path[0], picoquic_packet_context_application);
         idle_timer = cnx->idle_timeout;
         if (idle_timer < 3 * rto) {
             idle_timer = 3 * rto;
@@ -3560,6 +4002,10 @@ int picoquic_prepare_segment(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoq
  * This code finds whether there is a path being probed that could become the
  * default path, or that needs an immediate challenge sent or replied to.
  *
+ * If multipath is negotiated, validated paths are not promoted, except after
+ * a NAT rebinding. Instead, the scheduler of the connection picks the path
+ * on which the next packet is sent.
+ *
  * If no other path is suitable, the code returns the default path.
  */
 
@@ -3576,7 +4022,13 @@ static int picoquic_select_next_path(picoquic_cnx_t * cnx, uint64_t current_time
             continue;
         }
         else if (cnx->path[i]->challenge_verified) {
-            /* TODO: selection logic if multiple paths are available! */
+            if (cnx->is_multipath_enabled && !cnx->path[i]->is_nat_challenge) {
+                /* The path stays available to the scheduler */
+                if (path_id < 0 && cnx->path[i]->response_required) {
+                    path_id = i;
+                }
+                continue;
+            }
             /* This path becomes the new default */
             picoquic_promote_path_to_default(cnx, i, current_time);
             path_id = 0;
@@ -3601,6 +4053,11 @@ static int picoquic_select_next_path(picoquic_cnx_t * cnx, uint64_t current_time
         }
     }
 
+    if (path_id < 0 && cnx->is_multipath_enabled && cnx->path_scheduler != NULL &&
+        cnx->cnx_state == picoquic_state_ready) {
+        path_id = cnx->path_scheduler->select_path(cnx, current_time, next_wake_time);
+    }
+
     if (path_id < 0) {
         path_id = 0;
     }
@@ -3631,8 +4088,44 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
     memset(&addr_from_log, 0, sizeof(addr_from_log));
     *send_length = 0;
 
+    if (cnx->is_handshake_deferred) {
+        /* Process the deferred client hello if the handshake budget allows */
+        uint64_t period = current_time / 1000;
+
+        if (period != cnx->quic->handshake_period) {
+            cnx->quic->handshake_period = period;
+            cnx->quic->nb_handshakes_in_period = 0;
+        }
+        if (cnx->quic->nb_handshakes_in_period >= cnx->quic->max_handshakes_per_ms &&
+            cnx->quic->max_handshakes_per_ms > 0) {
+            picoquic_reinsert_by_wake_time(cnx->quic, cnx, (period + 1) * 1000);
+            return 0;
+        }
+        cnx->quic->nb_handshakes_in_period++;
+        cnx->is_handshake_deferred = 0;
+        ret = picoquic_tls_stream_process(cnx, NULL);
+        if (ret != 0 || cnx->cnx_state == picoquic_state_disconnected) {
+            /* As when the client hello is processed on arrival, the half open
+             * connection is abandoned. The error code set by the TLS processing
+             * is kept in the connection context. */
+            picoquic_log_app_message(cnx, "Deferred handshake fails, ret = 0x%x, error = 0x%x",
+                ret, (int)cnx->local_error);
+            cnx->cnx_state = picoquic_state_disconnected;
+            return PICOQUIC_ERROR_DISCONNECTED;
+        }
+    }
+
     ret = picoquic_check_idle_timer(cnx, &next_wake_time, current_time);
 
+    if (ret == 0 && cnx->is_next_key_phase_needed && cnx->cnx_state == picoquic_state_ready) {
+        /* Compute the keys of the next key phase now, instead of when the next key
+         * update is started or detected while processing packets */
+        cnx->is_next_key_phase_needed = 0;
+        if (picoquic_compute_new_rotated_keys(cnx) != 0) {
+            picoquic_log_app_message(cnx, "%s", "Cannot precompute the keys of the next key phase");
+        }
+    }
+
     if (send_buffer_max < PICOQUIC_ENFORCED_INITIAL_MTU) {
         DBG_PRINTF("Invalid buffer size: %zu", send_buffer_max);
         ret = -1;
@@ -3677,6 +4170,8 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
             *send_msg_size = cnx->path[path_id]->send_mtu;
         }
         initial_next_time = next_wake_time;
+        /* When preparing a train of packets, batch the header protection */
+        cnx->quic->hp_batch.is_active = (send_msg_size != NULL);
 
         while (ret == 0)
         {
@@ -3795,6 +4290,8 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
         if (*send_length > 0) {
             cnx->nb_trains_sent++;
         }
+        picoquic_protect_batch_flush(cnx->quic);
+        cnx->quic->hp_batch.is_active = 0;
     }
     
     picoquic_reinsert_by_wake_time(cnx->quic, cnx, next_wake_time);
@@ -3869,6 +4366,10 @@ int picoquic_prepare_next_packet_ex(picoquic_quic_t* quic,
 
         if (cnx == NULL) {
             *send_length = 0;
+            /* Nothing to send, use the idle time to prepare connection IDs */
+            if (quic->cnxid_pool_count < quic->cnxid_pool_size) {
+                picoquic_refill_cnxid_pool(quic);
+            }
         }
         else {
             ret = picoquic_prepare_packet_ex(cnx, current_time, send_buffer, send_buffer_max, send_length, p_addr_to, p_addr_from, 
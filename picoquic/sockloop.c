@@ -155,8 +155,9 @@ int picoquic_packet_loop(picoquic_quic_t* quic,
     struct sockaddr_storage addr_from;
     struct sockaddr_storage addr_to;
     int if_index_to;
-    uint8_t buffer[1536];
-    uint8_t send_buffer[1536];
+    size_t buffer_size = picoquic_get_max_packet_size(quic);
+    uint8_t* buffer = (uint8_t*)malloc(buffer_size);
+    uint8_t* send_buffer = (uint8_t*)malloc(buffer_size);
     size_t send_length = 0;
     int bytes_recv;
     uint64_t loop_count_time = current_time;
@@ -175,7 +176,10 @@ int picoquic_packet_loop(picoquic_quic_t* quic,
 #endif
     memset(sock_af, 0, sizeof(sock_af));
 
-    if ((nb_sockets = picoquic_packet_loop_open_sockets(local_port, local_af, s_socket, sock_af, PICOQUIC_PACKET_LOOP_SOCKETS_MAX)) == 0) {
+    if (buffer == NULL || send_buffer == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((nb_sockets = picoquic_packet_loop_open_sockets(local_port, local_af, s_socket, sock_af, PICOQUIC_PACKET_LOOP_SOCKETS_MAX)) == 0) {
         ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
     }
     else if (loop_callback != NULL) {
@@ -194,7 +198,7 @@ int picoquic_packet_loop(picoquic_quic_t* quic,
         bytes_recv = picoquic_select_ex(s_socket, nb_sockets,
             &addr_from,
             &addr_to, &if_index_to, &received_ecn,
-            buffer, sizeof(buffer),
+            buffer, (int)buffer_size,
             delta_t, &socket_rank, &current_time);
 
         nb_loops++;
@@ -267,7 +271,7 @@ int picoquic_packet_loop(picoquic_quic_t* quic,
                 int sock_err = 0;
 
                 ret = picoquic_prepare_next_packet(quic, loop_time,
-                    send_buffer, sizeof(send_buffer), &send_length,
+                    send_buffer, buffer_size, &send_length,
                     &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx);
 
                 if (ret == 0 && send_length > 0) {
@@ -390,5 +394,12 @@ int picoquic_packet_loop(picoquic_quic_t* quic,
         }
     }
 
+    if (buffer != NULL) {
+        free(buffer);
+    }
+    if (send_buffer != NULL) {
+        free(send_buffer);
+    }
+
     return ret;
 }
\ No newline at end of file
@@ -178,13 +178,16 @@ int picoquic_deserialize_ticket(picoquic_stored_ticket_t ** ticket, uint8_t * by
     return ret;
 }
 
-int picoquic_store_ticket(picoquic_stored_ticket_t** pp_first_ticket,
+/* Verify the ticket and compute its expiry time before storing it */
+static int picoquic_create_stored_ticket(picoquic_stored_ticket_t** p_stored,
     uint64_t current_time,
     char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
-    uint8_t* ticket, uint16_t ticket_length, picoquic_tp_t const * tp)
+    uint8_t* ticket, uint16_t ticket_length, picoquic_tp_t const* tp)
 {
     int ret = 0;
 
+    *p_stored = NULL;
+
     if (ticket_length < 17) {
         ret = PICOQUIC_ERROR_INVALID_TICKET;
     } else {
@@ -204,32 +207,45 @@ int picoquic_store_ticket(picoquic_stored_ticket_t** pp_first_ticket,
         if (current_time != 0 && time_valid_until < current_time) {
             ret = PICOQUIC_ERROR_INVALID_TICKET;
         } else {
-            picoquic_stored_ticket_t* stored = picoquic_format_ticket(time_valid_until, sni, sni_length,
-                    alpn, alpn_length, ticket, ticket_length, tp);
-            if (stored == NULL) {
+            *p_stored = picoquic_format_ticket(time_valid_until, sni, sni_length,
+                alpn, alpn_length, ticket, ticket_length, tp);
+            if (*p_stored == NULL) {
                 ret = PICOQUIC_ERROR_MEMORY;
             }
-            else {
-                picoquic_stored_ticket_t* next;
-                picoquic_stored_ticket_t** pprevious;
-
-                stored->next_ticket = next = *pp_first_ticket;
-                *pp_first_ticket = stored;
-                pprevious = &stored->next_ticket;
-
-                /* Now remove the old tickets for that SNI & ALPN */
-                while (next != NULL) {
-                    if (next->time_valid_until <= stored->time_valid_until && next->sni_length == sni_length && next->alpn_length == alpn_length && memcmp(next->sni, sni, sni_length) == 0 && memcmp(next->alpn, alpn, alpn_length) == 0) {
-                        picoquic_stored_ticket_t* deleted = next;
-                        next = next->next_ticket;
-                        *pprevious = next;
-                        memset(&deleted->ticket, 0, deleted->ticket_length);
-                        free(deleted);
-                    } else {
-                        pprevious = &next->next_ticket;
-                        next = next->next_ticket;
-                    }
-                }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_store_ticket(picoquic_stored_ticket_t** pp_first_ticket,
+    uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t* ticket, uint16_t ticket_length, picoquic_tp_t const * tp)
+{
+    picoquic_stored_ticket_t* stored = NULL;
+    int ret = picoquic_create_stored_ticket(&stored, current_time, sni, sni_length, alpn, alpn_length,
+        ticket, ticket_length, tp);
+
+    if (ret == 0) {
+        picoquic_stored_ticket_t* next;
+        picoquic_stored_ticket_t** pprevious;
+
+        stored->next_ticket = next = *pp_first_ticket;
+        *pp_first_ticket = stored;
+        pprevious = &stored->next_ticket;
+
+        /* Now remove the old tickets for that SNI & ALPN */
+        while (next != NULL) {
+            if (next->time_valid_until <= stored->time_valid_until && next->sni_length == sni_length && next->alpn_length == alpn_length && memcmp(next->sni, sni, sni_length) == 0 && memcmp(next->alpn, alpn, alpn_length) == 0) {
+                picoquic_stored_ticket_t* deleted = next;
+                next = next->next_ticket;
+                *pprevious = next;
+                memset(&deleted->ticket, 0, deleted->ticket_length);
+                free(deleted);
+            } else {
+                pprevious = &next->next_ticket;
+                next = next->next_ticket;
             }
         }
     }
@@ -237,6 +253,18 @@ int picoquic_store_ticket(picoquic_stored_ticket_t** pp_first_ticket,
     return ret;
 }
 
+static void picoquic_copy_ticket_tp(picoquic_stored_ticket_t* stored, picoquic_tp_t* tp)
+{
+    if (tp != NULL) {
+        tp->initial_max_data = stored->tp_0rtt[picoquic_tp_0rtt_max_data];
+        tp->initial_max_stream_data_bidi_local = stored->tp_0rtt[picoquic_tp_0rtt_max_stream_data_bidi_local];
+        tp->initial_max_stream_data_bidi_remote = stored->tp_0rtt[picoquic_tp_0rtt_max_stream_data_bidi_remote];
+        tp->initial_max_stream_data_uni = stored->tp_0rtt[picoquic_tp_0rtt_max_stream_data_uni];
+        tp->initial_max_stream_id_bidir = stored->tp_0rtt[picoquic_tp_0rtt_max_streams_id_bidir];
+        tp->initial_max_stream_id_unidir = stored->tp_0rtt[picoquic_tp_0rtt_max_streams_id_unidir];
+    }
+}
+
 int picoquic_get_ticket(picoquic_stored_ticket_t* p_first_ticket,
     uint64_t current_time,
     char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
@@ -258,14 +286,7 @@ int picoquic_get_ticket(picoquic_stored_ticket_t* p_first_ticket,
         *ticket_length = 0;
         ret = -1;
     } else {
-        if (tp != NULL) {
-            tp->initial_max_data = next->tp_0rtt[picoquic_tp_0rtt_max_data];
-            tp->initial_max_stream_data_bidi_local = next->tp_0rtt[picoquic_tp_0rtt_max_stream_data_bidi_local];
-            tp->initial_max_stream_data_bidi_remote = next->tp_0rtt[picoquic_tp_0rtt_max_stream_data_bidi_remote];
-            tp->initial_max_stream_data_uni = next->tp_0rtt[picoquic_tp_0rtt_max_stream_data_uni];
-            tp->initial_max_stream_id_bidir = next->tp_0rtt[picoquic_tp_0rtt_max_streams_id_bidir];
-            tp->initial_max_stream_id_unidir = next->tp_0rtt[picoquic_tp_0rtt_max_streams_id_unidir];
-        }
+        picoquic_copy_ticket_tp(next, tp);
         *ticket = next->ticket;
         *ticket_length = next->ticket_length;
         next->was_used = mark_used;
@@ -274,6 +295,21 @@ int picoquic_get_ticket(picoquic_stored_ticket_t* p_first_ticket,
     return ret;
 }
 
+static int picoquic_write_ticket_record(FILE* F, const picoquic_stored_ticket_t* stored)
+{
+    uint8_t buffer[2048];
+    size_t record_size;
+    int ret = picoquic_serialize_ticket(stored, buffer, sizeof(buffer), &record_size);
+
+    if (ret == 0) {
+        if (fwrite(&record_size, 4, 1, F) != 1 || fwrite(buffer, 1, record_size, F) != record_size) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_save_tickets(const picoquic_stored_ticket_t* first_ticket,
     uint64_t current_time,
     char const* ticket_file_name)
@@ -288,18 +324,7 @@ int picoquic_save_tickets(const picoquic_stored_ticket_t* first_ticket,
         while (ret == 0 && next != NULL) {
             /* Only store the tickets that are valid going forward */
             if (next->time_valid_until > current_time && next->was_used == 0) {
-                /* Compute the serialized size */
-                uint8_t buffer[2048];
-                size_t record_size;
-
-                ret = picoquic_serialize_ticket(next, buffer, sizeof(buffer), &record_size);
-
-                if (ret == 0) {
-                    if (fwrite(&record_size, 4, 1, F) != 1 || fwrite(buffer, 1, record_size, F) != record_size) {
-                        ret = PICOQUIC_ERROR_INVALID_FILE;
-                        break;
-                    }
-                }
+                ret = picoquic_write_ticket_record(F, next);
             }
             next = next->next_ticket;
         }
@@ -309,71 +334,184 @@ int picoquic_save_tickets(const picoquic_stored_ticket_t* first_ticket,
     return ret;
 }
 
-int picoquic_load_tickets(picoquic_stored_ticket_t** pp_first_ticket,
-    uint64_t current_time, char const* ticket_file_name)
+/* Index of the stored tickets by SNI and ALPN */
+static uint64_t picoquic_stored_ticket_hash(const void* key)
+{
+    const picoquic_stored_ticket_t* stored = (const picoquic_stored_ticket_t*)key;
+
+    return picohash_hash_mix(picohash_bytes((const uint8_t*)stored->sni, stored->sni_length),
+        picohash_bytes((const uint8_t*)stored->alpn, stored->alpn_length));
+}
+
+static int picoquic_stored_ticket_compare(const void* key1, const void* key2)
+{
+    const picoquic_stored_ticket_t* t1 = (const picoquic_stored_ticket_t*)key1;
+    const picoquic_stored_ticket_t* t2 = (const picoquic_stored_ticket_t*)key2;
+
+    return (t1->sni_length == t2->sni_length && t1->alpn_length == t2->alpn_length &&
+        memcmp(t1->sni, t2->sni, t1->sni_length) == 0 && memcmp(t1->alpn, t2->alpn, t1->alpn_length) == 0) ? 0 : -1;
+}
+
+static picohash_item* picoquic_ticket_index_first(picohash_table* index, const picoquic_stored_ticket_t* key, uint64_t* hash)
+{
+    *hash = picoquic_stored_ticket_hash(key);
+    return index->hash_bin[*hash % index->nb_bin];
+}
+
+/* Mark as used the tickets of the same SNI and ALPN that expire before the new one,
+ * as picoquic_store_ticket does. If the ticket is a cancel record read from the file,
+ * only mark the ticket with the same expiry time, which is already cancelled in the file.
+ */
+static void picoquic_ticket_index_supersede(picohash_table* index, const picoquic_stored_ticket_t* stored, int is_cancel)
+{
+    uint64_t hash;
+    picohash_item* item = picoquic_ticket_index_first(index, stored, &hash);
+
+    while (item != NULL) {
+        picoquic_stored_ticket_t* indexed = (picoquic_stored_ticket_t*)item->key;
+
+        if (indexed != stored && item->hash == hash && picoquic_stored_ticket_compare(indexed, stored) == 0) {
+            if (!is_cancel && indexed->time_valid_until <= stored->time_valid_until) {
+                indexed->was_used = 1;
+            }
+            else if (is_cancel && indexed->time_valid_until == stored->time_valid_until) {
+                indexed->was_used = 1;
+                indexed->is_saved = 0;
+            }
+        }
+        item = item->next_in_bin;
+    }
+}
+
+static void picoquic_ticket_index_remove(picohash_table* index, const picoquic_stored_ticket_t* stored)
+{
+    uint64_t hash;
+    picohash_item* item = picoquic_ticket_index_first(index, stored, &hash);
+
+    while (item != NULL && item->key != stored) {
+        item = item->next_in_bin;
+    }
+    if (item != NULL) {
+        picohash_delete_item(index, item, 0);
+    }
+}
+
+/* Free the used tickets, except those that still need to be cancelled in the file
+ * and those that a connection still references */
+static void picoquic_sweep_tickets(picoquic_stored_ticket_t** pp_first_ticket, picohash_table* index)
+{
+    picoquic_stored_ticket_t** pprevious = pp_first_ticket;
+    picoquic_stored_ticket_t* next;
+
+    while ((next = *pprevious) != NULL) {
+        if (next->was_used && !next->is_saved && !next->is_referenced) {
+            *pprevious = next->next_ticket;
+            if (index != NULL) {
+                picoquic_ticket_index_remove(index, next);
+            }
+            memset(next->ticket, 0, next->ticket_length);
+            free(next);
+        }
+        else {
+            pprevious = &next->next_ticket;
+        }
+    }
+}
+
+/* Load the records of a ticket file, and add the valid tickets at the end of the list.
+ * Records without ticket cancel the ticket of the same SNI, ALPN and expiry time.
+ */
+static int picoquic_load_tickets_ex(picoquic_stored_ticket_t** pp_first_ticket, picohash_table* index,
+    uint64_t current_time, char const* ticket_file_name, size_t* nb_records)
 {
     int ret = 0;
     int file_err = 0;
-    FILE* F = NULL;
-    picoquic_stored_ticket_t* previous = NULL;
-    picoquic_stored_ticket_t* next = NULL;
-    uint32_t record_size;
-    uint32_t storage_size;
+    size_t file_size = 0;
+    size_t byte_index = 0;
+    picoquic_stored_ticket_t** pp_last = pp_first_ticket;
+    uint8_t* bytes = picoquic_file_map(ticket_file_name, &file_size, &file_err);
 
+    *nb_records = 0;
 
-    if ((F = picoquic_file_open_ex(ticket_file_name, "rb", &file_err)) == NULL) {
+    if (bytes == NULL && file_err != 0) {
         ret = (file_err == ENOENT) ? PICOQUIC_ERROR_NO_SUCH_FILE : -1;
     }
 
-    while (ret == 0) {
-        if (fread(&storage_size, 4, 1, F) != 1) {
-            /* end of file */
-            break;
-        }
-        else if (storage_size > 2048 ||
-            (record_size = storage_size + offsetof(struct st_picoquic_stored_ticket_t, time_valid_until)) > 2048) {
+    while (*pp_last != NULL) {
+        pp_last = &(*pp_last)->next_ticket;
+    }
+
+    while (ret == 0 && byte_index + 4 <= file_size) {
+        uint32_t storage_size;
+
+        memcpy(&storage_size, bytes + byte_index, 4);
+        byte_index += 4;
+
+        if (storage_size > 2048 || storage_size > file_size - byte_index) {
             ret = PICOQUIC_ERROR_INVALID_FILE;
-            break;
         }
         else {
-            uint8_t buffer[2048];
-            if (fread(buffer, 1, storage_size, F)
-                != storage_size) {
+            picoquic_stored_ticket_t* next = NULL;
+            size_t consumed = 0;
+
+            ret = picoquic_deserialize_ticket(&next, bytes + byte_index, storage_size, &consumed);
+            byte_index += storage_size;
+
+            if (ret == 0 && (consumed != storage_size || next == NULL)) {
                 ret = PICOQUIC_ERROR_INVALID_FILE;
             }
-            else {
-                size_t consumed = 0;
-                ret = picoquic_deserialize_ticket(&next, buffer, storage_size, &consumed);
 
-                if (ret == 0 && (consumed != storage_size || next == NULL)) {
-                    ret = PICOQUIC_ERROR_INVALID_FILE;
-                }
+            if (ret == 0) {
+                (*nb_records)++;
 
-                if (ret == 0 && next != NULL) {
-                    if (next->time_valid_until < current_time) {
-                        free(next);
-                        next = NULL;
-                    }
-                    else {
-                        next->sni = ((char*)next) + sizeof(picoquic_stored_ticket_t);
-                        next->alpn = next->sni + next->sni_length + 1;
-                        next->ticket = (uint8_t*)(next->alpn + next->alpn_length + 1);
-                        next->next_ticket = NULL;
-                        if (previous == NULL) {
-                            *pp_first_ticket = next;
-                        }
-                        else {
-                            previous->next_ticket = next;
-                        }
-
-                        previous = next;
-                    }
+                if (next->ticket_length == 0) {
+                    picoquic_ticket_index_supersede(index, next, 1);
+                    free(next);
+                }
+                else if (next->time_valid_until < current_time) {
+                    free(next);
+                }
+                else if (picohash_insert(index, next) != 0) {
+                    free(next);
+                    ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    next->is_saved = 1;
+                    *pp_last = next;
+                    pp_last = &next->next_ticket;
                 }
             }
+            else if (next != NULL) {
+                free(next);
+            }
         }
     }
 
-    picoquic_file_close(F);
+    if (ret == 0 && byte_index != file_size) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+
+    picoquic_file_unmap(bytes, file_size);
+    picoquic_sweep_tickets(pp_first_ticket, index);
+
+    return ret;
+}
+
+int picoquic_load_tickets(picoquic_stored_ticket_t** pp_first_ticket,
+    uint64_t current_time, char const* ticket_file_name)
+{
+    int ret = 0;
+    size_t nb_records = 0;
+    picohash_table* index = picohash_create(PICOQUIC_STORE_INDEX_BINS,
+        picoquic_stored_ticket_hash, picoquic_stored_ticket_compare);
+
+    if (index == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        ret = picoquic_load_tickets_ex(pp_first_ticket, index, current_time, ticket_file_name, &nb_records);
+        picohash_delete(index, 0);
+    }
 
     return ret;
 }
@@ -389,17 +527,237 @@ void picoquic_free_tickets(picoquic_stored_ticket_t** pp_first_ticket)
     }
 }
 
-int picoquic_save_session_tickets(picoquic_quic_t* quic, char const* ticket_store_filename)
+/* Indexed store of session tickets in the QUIC context */
+static picohash_table* picoquic_ticket_index(picoquic_quic_t* quic)
 {
-    return picoquic_save_tickets(quic->p_first_ticket, picoquic_get_quic_time(quic), ticket_store_filename);
+    if (quic->ticket_store.index == NULL) {
+        quic->ticket_store.index = picohash_create(PICOQUIC_STORE_INDEX_BINS,
+            picoquic_stored_ticket_hash, picoquic_stored_ticket_compare);
+
+        if (quic->ticket_store.index != NULL) {
+            /* Tickets may have been added to the list directly */
+            for (picoquic_stored_ticket_t* next = quic->p_first_ticket; next != NULL; next = next->next_ticket) {
+                if (picohash_insert(quic->ticket_store.index, next) != 0) {
+                    picohash_delete(quic->ticket_store.index, 0);
+                    quic->ticket_store.index = NULL;
+                    break;
+                }
+            }
+        }
+        if (quic->ticket_store.index != NULL) {
+            quic->ticket_store.sweep_count = quic->ticket_store.index->count;
+        }
+    }
+
+    return quic->ticket_store.index;
 }
 
-int picoquic_load_retry_tokens(picoquic_quic_t* quic, char const* token_store_filename)
+int picoquic_store_session_ticket(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t* ticket, uint16_t ticket_length, picoquic_tp_t const* tp)
 {
-    return picoquic_load_tokens(&quic->p_first_token, picoquic_get_quic_time(quic), token_store_filename);
+    int ret = 0;
+    picohash_table* index = picoquic_ticket_index(quic);
+
+    if (index == NULL) {
+        ret = picoquic_store_ticket(&quic->p_first_ticket, current_time, sni, sni_length, alpn, alpn_length,
+            ticket, ticket_length, tp);
+    }
+    else {
+        picoquic_stored_ticket_t* stored = NULL;
+
+        ret = picoquic_create_stored_ticket(&stored, current_time, sni, sni_length, alpn, alpn_length,
+            ticket, ticket_length, tp);
+
+        if (ret == 0 && picohash_insert(index, stored) != 0) {
+            free(stored);
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+
+        if (ret == 0) {
+            stored->next_ticket = quic->p_first_ticket;
+            quic->p_first_ticket = stored;
+            picoquic_ticket_index_supersede(index, stored, 0);
+
+            if (index->count > 2 * quic->ticket_store.sweep_count + 16) {
+                picoquic_sweep_tickets(&quic->p_first_ticket, index);
+                quic->ticket_store.sweep_count = index->count;
+            }
+        }
+    }
+
+    return ret;
 }
 
-int picoquic_save_retry_tokens(picoquic_quic_t* quic, char const* ticket_store_filename)
+/* Get a ticket for the SNI and ALPN. If p_stored is not NULL, the stored ticket
+ * is referenced, so that the ticket bytes are not freed by a sweep of the store
+ * while the handshake uses them. The reference is dropped with
+ * picoquic_release_session_ticket.
+ */
+int picoquic_get_session_ticket_ex(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t** ticket, uint16_t* ticket_length, picoquic_tp_t* tp, int mark_used,
+    picoquic_stored_ticket_t** p_stored)
 {
-    return picoquic_save_tokens(quic->p_first_token, picoquic_get_quic_time(quic), ticket_store_filename);
-}
\ No newline at end of file
+    int ret = 0;
+    picohash_table* index = picoquic_ticket_index(quic);
+
+    if (p_stored != NULL) {
+        *p_stored = NULL;
+    }
+
+    if (index == NULL) {
+        ret = picoquic_get_ticket(quic->p_first_ticket, current_time, sni, sni_length, alpn, alpn_length,
+            ticket, ticket_length, tp, mark_used);
+    }
+    else {
+        picoquic_stored_ticket_t key;
+        picoquic_stored_ticket_t* found = NULL;
+        uint64_t hash;
+        picohash_item* item;
+
+        memset(&key, 0, sizeof(key));
+        key.sni = (char*)sni;
+        key.sni_length = sni_length;
+        key.alpn = (char*)alpn;
+        key.alpn_length = alpn_length;
+        item = picoquic_ticket_index_first(index, &key, &hash);
+
+        while (item != NULL && found == NULL) {
+            picoquic_stored_ticket_t* indexed = (picoquic_stored_ticket_t*)item->key;
+
+            if (item->hash == hash && indexed->time_valid_until > current_time && indexed->was_used == 0 &&
+                picoquic_stored_ticket_compare(indexed, &key) == 0) {
+                found = indexed;
+            }
+            item = item->next_in_bin;
+        }
+
+        if (found == NULL) {
+            *ticket = NULL;
+            *ticket_length = 0;
+            ret = -1;
+        }
+        else {
+            picoquic_copy_ticket_tp(found, tp);
+            *ticket = found->ticket;
+            *ticket_length = found->ticket_length;
+            found->was_used = mark_used;
+            if (p_stored != NULL) {
+                found->is_referenced = 1;
+                *p_stored = found;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_get_session_ticket(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint8_t** ticket, uint16_t* ticket_length, picoquic_tp_t* tp, int mark_used)
+{
+    return picoquic_get_session_ticket_ex(quic, current_time, sni, sni_length, alpn, alpn_length,
+        ticket, ticket_length, tp, mark_used, NULL);
+}
+
+void picoquic_release_session_ticket(picoquic_stored_ticket_t** p_stored)
+{
+    if (*p_stored != NULL) {
+        (*p_stored)->is_referenced = 0;
+        *p_stored = NULL;
+    }
+}
+
+int picoquic_load_session_tickets(picoquic_quic_t* quic, uint64_t current_time, char const* ticket_store_filename)
+{
+    int ret = 0;
+    picohash_table* index = picoquic_ticket_index(quic);
+
+    if (index == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        ret = picoquic_load_tickets_ex(&quic->p_first_ticket, index, current_time, ticket_store_filename,
+            &quic->ticket_store.nb_file_records);
+        quic->ticket_store.sweep_count = index->count;
+        quic->ticket_store.file_name = picoquic_string_free(quic->ticket_store.file_name);
+        if (ret == 0) {
+            quic->ticket_store.file_name = picoquic_string_duplicate(ticket_store_filename);
+        }
+    }
+
+    return ret;
+}
+
+/* Save the tickets of the QUIC context. If the file is the one from which the
+ * tickets were loaded or in which they were last saved, only the changes are
+ * appended, unless most records in the file are obsolete.
+ */
+int picoquic_save_session_tickets(picoquic_quic_t* quic, char const* ticket_store_filename)
+{
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    size_t nb_live = 0;
+    size_t nb_changes = 0;
+    picoquic_stored_ticket_t* next;
+
+    for (next = quic->p_first_ticket; next != NULL; next = next->next_ticket) {
+        if (next->time_valid_until > current_time && next->was_used == 0) {
+            nb_live++;
+            nb_changes += !next->is_saved;
+        }
+        else if (next->was_used) {
+            nb_changes += next->is_saved;
+        }
+    }
+
+    if (quic->ticket_store.file_name != NULL && strcmp(quic->ticket_store.file_name, ticket_store_filename) == 0 &&
+        quic->ticket_store.nb_file_records + nb_changes <= 2 * nb_live + 16) {
+        FILE* F = NULL;
+
+        if (nb_changes > 0 && (F = picoquic_file_open(ticket_store_filename, "ab")) == NULL) {
+            ret = -1;
+        }
+        for (next = quic->p_first_ticket; ret == 0 && F != NULL && next != NULL; next = next->next_ticket) {
+            if (next->time_valid_until > current_time && next->was_used == 0) {
+                if (!next->is_saved && (ret = picoquic_write_ticket_record(F, next)) == 0) {
+                    next->is_saved = 1;
+                    quic->ticket_store.nb_file_records++;
+                }
+            }
+            else if (next->was_used && next->is_saved) {
+                /* Cancel the ticket with a record of the same key and expiry, without ticket */
+                picoquic_stored_ticket_t cancel = *next;
+                cancel.ticket_length = 0;
+                if ((ret = picoquic_write_ticket_record(F, &cancel)) == 0) {
+                    next->is_saved = 0;
+                    quic->ticket_store.nb_file_records++;
+                }
+            }
+        }
+        (void)picoquic_file_close(F);
+    }
+    else if ((ret = picoquic_save_tickets(quic->p_first_ticket, current_time, ticket_store_filename)) == 0) {
+        for (next = quic->p_first_ticket; next != NULL; next = next->next_ticket) {
+            next->is_saved = (next->time_valid_until > current_time && next->was_used == 0);
+        }
+        quic->ticket_store.nb_file_records = nb_live;
+        if (quic->ticket_store.file_name == NULL || strcmp(quic->ticket_store.file_name, ticket_store_filename) != 0) {
+            (void)picoquic_string_free(quic->ticket_store.file_name);
+            quic->ticket_store.file_name = picoquic_string_duplicate(ticket_store_filename);
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_free_session_tickets(picoquic_quic_t* quic)
+{
+    if (quic->ticket_store.index != NULL) {
+        picohash_delete(quic->ticket_store.index, 0);
+        quic->ticket_store.index = NULL;
+    }
+    quic->ticket_store.file_name = picoquic_string_free(quic->ticket_store.file_name);
+    picoquic_free_tickets(&quic->p_first_ticket);
+}
@@ -52,6 +52,9 @@
 #if !defined(_WINDOWS) || defined(_WINDOWS64)
 #include "picotls/fusion.h"
 #endif
+#ifdef PICOQUIC_WITH_CERT_COMPRESSION
+#include "picotls/certificate_compression.h"
+#endif
 #if 0
 #include "picotls/ffx.h"
 #endif
@@ -159,6 +162,56 @@ ptls_cipher_suite_t picoquic_fusion_aes256gcmsha384 = { PTLS_CIPHER_SUITE_AES_25
                                                     &ptls_openssl_sha384 };
 #endif
 
+/* Check once whether the CPU supports the fusion AES-GCM engine (AES-NI, PCLMUL, AVX2).
+ * The result is cached, since the test requires issuing CPUID instructions.
+ */
+static int picoquic_fusion_support = -1;
+static int picoquic_fusion_disabled = 0;
+
+static int picoquic_is_fusion_supported()
+{
+    if (picoquic_fusion_support < 0) {
+#if !defined(_WINDOWS) || defined(_WINDOWS64)
+        picoquic_fusion_support = (ptls_fusion_is_supported_by_cpu()) ? 1 : 0;
+#else
+        picoquic_fusion_support = 0;
+#endif
+    }
+    return picoquic_fusion_support && !picoquic_fusion_disabled;
+}
+
+/* Enable or disable the use of fusion for the keys created after this call,
+ * e.g., to compare the performance of the crypto providers.
+ * Returns 1 if fusion will be used, 0 otherwise.
+ */
+int picoquic_set_fusion_enabled(int enabled)
+{
+    picoquic_fusion_disabled = !enabled;
+    return picoquic_is_fusion_supported();
+}
+
+/* Obtain the fusion equivalent of an AES-GCM suite, if fusion is supported.
+ * This is used when installing the packet protection keys, so that the fastest
+ * engine is used even if the suite negotiated by TLS comes from another provider.
+ * The hash functions are the same, so the derived keys do not change.
+ */
+static ptls_cipher_suite_t* picoquic_get_fusion_equivalent_suite(ptls_cipher_suite_t* cipher)
+{
+    ptls_cipher_suite_t* fusion_cipher = cipher;
+
+#if !defined(_WINDOWS) || defined(_WINDOWS64)
+    if (picoquic_is_fusion_supported()) {
+        if (cipher->aead == &ptls_openssl_aes128gcm && cipher->hash == &ptls_openssl_sha256) {
+            fusion_cipher = &picoquic_fusion_aes128gcmsha256;
+        }
+        else if (cipher->aead == &ptls_openssl_aes256gcm && cipher->hash == &ptls_openssl_sha384) {
+            fusion_cipher = &picoquic_fusion_aes256gcmsha384;
+        }
+    }
+#endif
+    return fusion_cipher;
+}
+
 /* Setting of cipher suites. This is provisional code,
    using the most performant functions from openssl or fusion */
 
@@ -167,7 +220,7 @@ static int picoquic_set_cipher_suite_list(ptls_cipher_suite_t** selected_suites,
     int nb_suites = 0;
         /* Check first if fusion is enabled */
 #if !defined(_WINDOWS) || defined(_WINDOWS64)
-        if (ptls_fusion_is_supported_by_cpu()) {
+        if (picoquic_is_fusion_supported()) {
             if (cipher_suite_id == 0 || cipher_suite_id == 128) {
                 selected_suites[nb_suites++] = &picoquic_fusion_aes128gcmsha256;
             }
@@ -784,6 +837,10 @@ void picoquic_log_crypto_errors(picoquic_cnx_t* cnx, int ret)
 int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
     ptls_context_t* tls_ctx,
     const uint8_t* secret, size_t secret_length);
+static int picoquic_ticket_aead_refresh(picoquic_quic_t* quic, uint64_t current_time);
+static void* picoquic_ticket_aead_decrypt_context(picoquic_quic_t* quic, uint8_t key_id);
+static void picoquic_ticket_key_ring_add_key(picoquic_ticket_key_ring_t* ring, const uint8_t* secret, size_t secret_length,
+    uint64_t current_time);
 
 /*
  * Provide access to transport received transport extension for
@@ -1106,42 +1163,52 @@ int picoquic_server_encrypt_ticket_call_back(ptls_encrypt_ticket_t* encrypt_tick
 #endif
 
     /* Assume that the keys are in the quic context 
-     * The tickets are composed of a 64 bit "sequence number" 
+     * The tickets are composed of a 64 bit "sequence number",
+     * the identifier of the ticket key,
      * followed by the result of the clear text encryption.
      */
     int ret = 0;
     picoquic_quic_t** ppquic = (picoquic_quic_t**)(((char*)encrypt_ticket_ctx) + sizeof(ptls_encrypt_ticket_t));
     picoquic_quic_t* quic = *ppquic;
 
+    (void)picoquic_ticket_aead_refresh(quic, picoquic_get_quic_time(quic));
+
     if (is_encrypt != 0) {
-        ptls_aead_context_t* aead_enc = (ptls_aead_context_t*)quic->aead_encrypt_ticket_ctx;
+        ptls_aead_context_t* aead_enc = (quic->nb_ticket_aead > 0) ?
+            (ptls_aead_context_t*)quic->ticket_aead[0].aead_encrypt : NULL;
         /* Encoding*/
         if (aead_enc == NULL) {
             ret = -1;
-        } else if ((ret = ptls_buffer_reserve(dst, 8 + src.len + aead_enc->algo->tag_size)) == 0) {
+        } else if ((ret = ptls_buffer_reserve(dst, 9 + src.len + aead_enc->algo->tag_size)) == 0) {
             /* Create and store the ticket sequence number */
             uint64_t seq_num = picoquic_public_random_64();
             picoformat_64(dst->base + dst->off, seq_num);
             dst->off += 8;
+            dst->base[dst->off++] = quic->ticket_aead[0].key_id;
             /* Run AEAD encryption */
             dst->off += ptls_aead_encrypt(aead_enc, dst->base + dst->off,
                 src.base, src.len, seq_num, NULL, 0);
         }
     } else {
-        ptls_aead_context_t* aead_dec = (ptls_aead_context_t*)quic->aead_decrypt_ticket_ctx;
+        ptls_aead_context_t* aead_dec = (src.len < 9) ? NULL :
+            (ptls_aead_context_t*)picoquic_ticket_aead_decrypt_context(quic, src.base[8]);
         /* Encoding*/
         if (aead_dec == NULL) {
             ret = -1;
-        } else if (src.len < 8 + aead_dec->algo->tag_size) {
+            if (quic->F_log != NULL) {
+                picoquic_log_app_message(quic->cnx_in_progress, "%s",
+                    "Session ticket key is not available");
+            }
+        } else if (src.len < 9 + aead_dec->algo->tag_size) {
             ret = -1;
         } else if ((ret = ptls_buffer_reserve(dst, src.len)) == 0) {
             /* Decode the ticket sequence number */
             uint64_t seq_num = PICOPARSE_64(src.base);
             /* Decrypt */
             size_t decrypted = ptls_aead_decrypt(aead_dec, dst->base + dst->off,
-                src.base + 8, src.len - 8, seq_num, NULL, 0);
+                src.base + 9, src.len - 9, seq_num, NULL, 0);
 
-            if (decrypted > src.len - 8) {
+            if (decrypted > src.len - 9) {
                 /* decryption error */
                 ret = -1;
                 if (quic->F_log != NULL) {
@@ -1180,7 +1247,7 @@ int picoquic_client_save_ticket_call_back(ptls_save_ticket_t* save_ticket_ctx,
     }
 
     if (sni != NULL && alpn != NULL) {
-        ret = picoquic_store_ticket(&quic->p_first_ticket, 0, sni, (uint16_t)strlen(sni),
+        ret = picoquic_store_session_ticket(quic, 0, sni, (uint16_t)strlen(sni),
             alpn, (uint16_t)strlen(alpn), input.base, (uint16_t)input.len, &cnx->remote_parameters);
     } else {
         DBG_PRINTF("Received incorrect session resume ticket, sni = %s, alpn = %s, length = %d\n",
@@ -1306,9 +1373,30 @@ static int picoquic_set_aead_from_secret(void ** v_aead,ptls_cipher_suite_t * ci
     return ret;
 }
 
-static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, ptls_cipher_suite_t * cipher, int is_enc, const void *secret)
+/* Header protection with AES is defined as the AES-ECB encryption of the sample.
+ * Keeping an ECB context with the same key lets us compute the masks of many
+ * packets in a single cipher call, instead of one CTR setup per packet.
+ */
+static ptls_cipher_algorithm_t* picoquic_get_pn_ecb_algo(ptls_cipher_algorithm_t const* ctr_cipher)
+{
+    ptls_cipher_algorithm_t* ecb_algo = NULL;
+
+    if (ctr_cipher->name != NULL) {
+        if (strcmp(ctr_cipher->name, "AES128-CTR") == 0) {
+            ecb_algo = &ptls_openssl_aes128ecb;
+        }
+        else if (strcmp(ctr_cipher->name, "AES256-CTR") == 0) {
+            ecb_algo = &ptls_openssl_aes256ecb;
+        }
+    }
+
+    return ecb_algo;
+}
+
+static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, void ** v_pn_ecb, ptls_cipher_suite_t * cipher, int is_enc, const void *secret)
 {
     uint8_t pnekey[PTLS_MAX_SECRET_SIZE];
+    ptls_cipher_algorithm_t* ecb_algo;
     int ret;
 
     if (*v_pn_enc != NULL) {
@@ -1316,13 +1404,25 @@ static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, ptls_cipher_suite_t
         *v_pn_enc = NULL;
     }
 
+    if (v_pn_ecb != NULL && *v_pn_ecb != NULL) {
+        ptls_cipher_free((ptls_cipher_context_t *)*v_pn_ecb);
+        *v_pn_ecb = NULL;
+    }
+
     if ((ret = ptls_hkdf_expand_label(cipher->hash, pnekey, 
         cipher->aead->ctr_cipher->key_size, ptls_iovec_init(secret, cipher->hash->digest_size), 
         PICOQUIC_LABEL_HP, ptls_iovec_init(NULL, 0), PICOQUIC_LABEL_QUIC_KEY_BASE)) == 0) {
         if ((*v_pn_enc = ptls_cipher_new(cipher->aead->ctr_cipher, is_enc, pnekey)) == NULL) {
             ret = PTLS_ERROR_NO_MEMORY;
         }
+        else if (v_pn_ecb != NULL && (ecb_algo = picoquic_get_pn_ecb_algo(cipher->aead->ctr_cipher)) != NULL) {
+            /* The mask is always obtained by encrypting the sample, on both sides.
+             * Failing to get the ECB context is not an error, the CTR context can be used instead. */
+            *v_pn_ecb = ptls_cipher_new(ecb_algo, 1, pnekey);
+        }
     }
+
+    ptls_clear_memory(pnekey, sizeof(pnekey));
     
     return ret;
 }
@@ -1337,21 +1437,32 @@ void picoquic_aes128_ecb_encrypt(void* v_aesecb, uint8_t * output, const uint8_t
     ptls_cipher_encrypt((ptls_cipher_context_t*)v_aesecb, output, input, len);
 }
 
-static int picoquic_set_key_from_secret(ptls_cipher_suite_t * cipher, int is_enc, int is_rotation, picoquic_crypto_context_t * ctx, const void *secret)
+/* Set the keys of a crypto context from the traffic secret.
+ * If crypto workers are used, create one copy of the encryption
+ * context per worker.
+ */
+static int picoquic_set_key_from_secret(ptls_cipher_suite_t * cipher, int is_enc, int is_rotation, picoquic_crypto_context_t * ctx, const void *secret,
+    int nb_workers)
 {
     int ret = 0;
 
+    cipher = picoquic_get_fusion_equivalent_suite(cipher);
+
     if (is_enc != 0) {
         ret = picoquic_set_aead_from_secret(&ctx->aead_encrypt, cipher, is_enc, secret);
+
+        for (int i = 0; ret == 0 && i < nb_workers && i < PICOQUIC_CRYPTO_WORKERS_MAX; i++) {
+            ret = picoquic_set_aead_from_secret(&ctx->aead_encrypt_workers[i], cipher, is_enc, secret);
+        }
         
         if (ret == 0 && !is_rotation) {
-            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_enc, cipher, is_enc, secret);
+            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_enc, &ctx->pn_enc_ecb, cipher, is_enc, secret);
         }
     } else {
         ret = picoquic_set_aead_from_secret(&ctx->aead_decrypt, cipher, is_enc, secret);
         
         if (ret == 0 && !is_rotation) {
-            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_dec, cipher, is_enc, secret);
+            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_dec, &ctx->pn_dec_ecb, cipher, is_enc, secret);
         }
     }
 
@@ -1393,7 +1504,8 @@ static int picoquic_update_traffic_key_callback(ptls_update_traffic_key_t * self
     ptls_cipher_suite_t * cipher = ptls_get_cipher(tls);
     UNREFERENCED_PARAMETER(self);
 
-    int ret = picoquic_set_key_from_secret(cipher, is_enc, 0, &cnx->crypto_context[epoch], secret);
+    int ret = picoquic_set_key_from_secret(cipher, is_enc, 0, &cnx->crypto_context[epoch], secret,
+        (epoch == picoquic_epoch_1rtt) ? cnx->quic->nb_crypto_workers : 0);
     if (cnx->cnx_state < picoquic_state_ready) {
         cnx->recycle_sooner_needed = 1;
     }
@@ -1471,24 +1583,163 @@ int picoquic_setup_initial_secrets(
     return ret;
 }
 
+/* Initial key cache.
+ *
+ * The initial master secret is an HKDF extract keyed with the salt of the
+ * version. The HMAC context keyed with the salt is kept per version in the
+ * QUIC context, and reset after each use instead of being recreated.
+ *
+ * Servers also keep the keys derived when checking an incoming Initial
+ * packet for which no connection exists yet. If the packet decrypts and
+ * a connection is created, the decryption context and the master secret
+ * are handed to the new connection instead of being derived again.
+ */
+
+typedef struct st_picoquic_initial_validation_t {
+    picoquic_connection_id_t initial_cnxid;
+    int version_index;
+    uint8_t master_secret[PTLS_MAX_DIGEST_SIZE];
+    picoquic_crypto_context_t crypto_context;
+} picoquic_initial_validation_t;
+
+static int picoquic_get_initial_master_secret(picoquic_quic_t* quic, ptls_cipher_suite_t* cipher,
+    int version_index, const picoquic_connection_id_t* initial_cnxid, uint8_t* master_secret)
+{
+    int ret = 0;
+    ptls_hash_context_t* hmac_ctx = NULL;
+    ptls_iovec_t salt;
+
+    picoquic_setup_cleartext_aead_salt(version_index, &salt);
+
+    if (quic != NULL) {
+        if (quic->initial_salt_hmac_ctx == NULL) {
+            quic->initial_salt_hmac_ctx = (void**)malloc(sizeof(void*) * picoquic_nb_supported_versions);
+            if (quic->initial_salt_hmac_ctx != NULL) {
+                memset(quic->initial_salt_hmac_ctx, 0, sizeof(void*) * picoquic_nb_supported_versions);
+            }
+        }
+        if (quic->initial_salt_hmac_ctx != NULL) {
+            hmac_ctx = (ptls_hash_context_t*)quic->initial_salt_hmac_ctx[version_index];
+            if (hmac_ctx == NULL) {
+                hmac_ctx = ptls_hmac_create(cipher->hash, salt.base, salt.len);
+                quic->initial_salt_hmac_ctx[version_index] = (void*)hmac_ctx;
+            }
+        }
+    }
+
+    if (hmac_ctx == NULL) {
+        ret = picoquic_setup_initial_master_secret(cipher, salt, *initial_cnxid, master_secret);
+    }
+    else {
+        uint8_t cnx_id_serialized[PICOQUIC_CONNECTION_ID_MAX_SIZE];
+        size_t id_length = picoquic_format_connection_id(cnx_id_serialized, PICOQUIC_CONNECTION_ID_MAX_SIZE,
+            *initial_cnxid);
+
+        hmac_ctx->update(hmac_ctx, cnx_id_serialized, id_length);
+        hmac_ctx->final(hmac_ctx, master_secret, PTLS_HASH_FINAL_MODE_RESET);
+    }
+
+    return ret;
+}
+
+int picoquic_get_initial_validation_context(picoquic_quic_t* quic, int version_index,
+    const picoquic_connection_id_t* initial_cnxid, picoquic_crypto_context_t** p_crypto_context)
+{
+    int ret = 0;
+    ptls_cipher_suite_t* cipher = picoquic_get_aes128gcm_sha256();
+    picoquic_initial_validation_t* validation = quic->initial_validation;
+
+    *p_crypto_context = NULL;
+
+    if (cipher == NULL) {
+        ret = -1;
+    }
+    else if (validation == NULL) {
+        validation = (picoquic_initial_validation_t*)malloc(sizeof(picoquic_initial_validation_t));
+        if (validation == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(validation, 0, sizeof(picoquic_initial_validation_t));
+            quic->initial_validation = validation;
+        }
+    }
+
+    if (ret == 0) {
+        if (validation->crypto_context.aead_decrypt == NULL ||
+            validation->version_index != version_index ||
+            picoquic_compare_connection_id(&validation->initial_cnxid, initial_cnxid) != 0) {
+            uint8_t client_secret[PTLS_MAX_DIGEST_SIZE];
+            uint8_t server_secret[PTLS_MAX_DIGEST_SIZE];
+
+            picoquic_crypto_context_free(&validation->crypto_context);
+            validation->initial_cnxid = *initial_cnxid;
+            validation->version_index = version_index;
+
+            ret = picoquic_get_initial_master_secret(quic, cipher, version_index, initial_cnxid, validation->master_secret);
+            if (ret == 0) {
+                ret = picoquic_setup_initial_secrets(cipher, validation->master_secret, client_secret, server_secret);
+            }
+            if (ret == 0) {
+                ret = picoquic_set_key_from_secret(cipher, 0, 0, &validation->crypto_context, client_secret, 0);
+            }
+            if (ret != 0) {
+                picoquic_crypto_context_free(&validation->crypto_context);
+            }
+        }
+
+        if (ret == 0) {
+            *p_crypto_context = &validation->crypto_context;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_delete_initial_key_cache(picoquic_quic_t* quic)
+{
+    if (quic->initial_salt_hmac_ctx != NULL) {
+        for (size_t i = 0; i < picoquic_nb_supported_versions; i++) {
+            ptls_hash_context_t* hmac_ctx = (ptls_hash_context_t*)quic->initial_salt_hmac_ctx[i];
+            if (hmac_ctx != NULL) {
+                hmac_ctx->final(hmac_ctx, NULL, PTLS_HASH_FINAL_MODE_FREE);
+            }
+        }
+        free(quic->initial_salt_hmac_ctx);
+        quic->initial_salt_hmac_ctx = NULL;
+    }
+
+    if (quic->initial_validation != NULL) {
+        picoquic_crypto_context_free(&quic->initial_validation->crypto_context);
+        free(quic->initial_validation);
+        quic->initial_validation = NULL;
+    }
+}
+
 int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx)
 {
     int ret = 0;
     uint8_t master_secret[256]; /* secret_max */
     ptls_cipher_suite_t * cipher = picoquic_get_aes128gcm_sha256();
-    ptls_iovec_t salt;
     uint8_t client_secret[256];
     uint8_t server_secret[256];
     uint8_t *secret1, *secret2;
+    picoquic_initial_validation_t* validation = cnx->quic->initial_validation;
+    int is_validated = 0;
 
     if (cipher == NULL) {
         ret = -1;
     }
+    else if (!cnx->client_mode && validation != NULL && validation->crypto_context.aead_decrypt != NULL &&
+        validation->version_index == cnx->version_index &&
+        picoquic_compare_connection_id(&validation->initial_cnxid, &cnx->initial_cnxid) == 0) {
+        /* The first Initial packet was already decrypted with these keys, reuse them */
+        is_validated = 1;
+        memcpy(master_secret, validation->master_secret, cipher->hash->digest_size);
+    }
     else {
-        picoquic_setup_cleartext_aead_salt(cnx->version_index, &salt);
-
         /* Extract the master key -- key length will be 32 per SHA256 */
-        ret = picoquic_setup_initial_master_secret(cipher, salt, cnx->initial_cnxid, master_secret);
+        ret = picoquic_get_initial_master_secret(cnx->quic, cipher, cnx->version_index, &cnx->initial_cnxid, master_secret);
     }
 
     /* set up client and server secrets */
@@ -1507,10 +1758,23 @@ int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx)
             secret2 = server_secret;
         }
         
-        ret = picoquic_set_key_from_secret(cipher, 1, 0, &cnx->crypto_context[0], secret1);
+        ret = picoquic_set_key_from_secret(cipher, 1, 0, &cnx->crypto_context[0], secret1, 0);
 
         if (ret == 0) {
-            ret = picoquic_set_key_from_secret(cipher, 0, 0, &cnx->crypto_context[0], secret2);
+            if (is_validated) {
+                /* Move the decryption context from the validation cache to the connection */
+                picoquic_crypto_context_t* ctx = &cnx->crypto_context[0];
+
+                ctx->aead_decrypt = validation->crypto_context.aead_decrypt;
+                ctx->pn_dec = validation->crypto_context.pn_dec;
+                ctx->pn_dec_ecb = validation->crypto_context.pn_dec_ecb;
+                validation->crypto_context.aead_decrypt = NULL;
+                validation->crypto_context.pn_dec = NULL;
+                validation->crypto_context.pn_dec_ecb = NULL;
+            }
+            else {
+                ret = picoquic_set_key_from_secret(cipher, 0, 0, &cnx->crypto_context[0], secret2, 0);
+            }
         }
     }
 
@@ -1596,7 +1860,8 @@ int picoquic_compute_new_rotated_keys(picoquic_cnx_t * cnx)
     }
 
     if (ret == 0) {
-        ret = picoquic_set_key_from_secret(cipher, 1, 1, &cnx->crypto_context_new, tls_ctx->app_secret_enc);
+        ret = picoquic_set_key_from_secret(cipher, 1, 1, &cnx->crypto_context_new, tls_ctx->app_secret_enc,
+            cnx->quic->nb_crypto_workers);
     }
 
     if (ret == 0) {
@@ -1614,7 +1879,7 @@ int picoquic_compute_new_rotated_keys(picoquic_cnx_t * cnx)
     }
 
     if (ret == 0) {
-        ret = picoquic_set_key_from_secret(cipher, 0, 1, &cnx->crypto_context_new, tls_ctx->app_secret_dec);
+        ret = picoquic_set_key_from_secret(cipher, 0, 1, &cnx->crypto_context_new, tls_ctx->app_secret_dec, 0);
     }
 
     return (ret == 0)?0: PICOQUIC_ERROR_CANNOT_COMPUTE_KEY;
@@ -1623,6 +1888,9 @@ int picoquic_compute_new_rotated_keys(picoquic_cnx_t * cnx)
 void picoquic_apply_rotated_keys(picoquic_cnx_t * cnx, int is_enc)
 {
     if (is_enc) {
+        /* Packets waiting in the protection batch still use the old key */
+        picoquic_protect_batch_flush(cnx->quic);
+
         if (cnx->crypto_context[3].aead_encrypt != NULL) {
             ptls_aead_free((ptls_aead_context_t *)cnx->crypto_context[3].aead_encrypt);
         }
@@ -1630,6 +1898,14 @@ void picoquic_apply_rotated_keys(picoquic_cnx_t * cnx, int is_enc)
         cnx->crypto_context[3].aead_encrypt = cnx->crypto_context_new.aead_encrypt;
         cnx->crypto_context_new.aead_encrypt = NULL;
 
+        for (int i = 0; i < PICOQUIC_CRYPTO_WORKERS_MAX; i++) {
+            if (cnx->crypto_context[3].aead_encrypt_workers[i] != NULL) {
+                ptls_aead_free((ptls_aead_context_t *)cnx->crypto_context[3].aead_encrypt_workers[i]);
+            }
+            cnx->crypto_context[3].aead_encrypt_workers[i] = cnx->crypto_context_new.aead_encrypt_workers[i];
+            cnx->crypto_context_new.aead_encrypt_workers[i] = NULL;
+        }
+
         cnx->key_phase_enc ^= 1;
         picoquic_log_pn_dec_trial(cnx);
     }
@@ -1644,6 +1920,11 @@ void picoquic_apply_rotated_keys(picoquic_cnx_t * cnx, int is_enc)
 
         cnx->key_phase_dec ^= 1;
     }
+
+    if (cnx->crypto_context_new.aead_encrypt == NULL && cnx->crypto_context_new.aead_decrypt == NULL) {
+        /* The key update is complete, the next phase keys will be computed by the sender */
+        cnx->is_next_key_phase_needed = 1;
+    }
 }
 
 /*
@@ -1671,6 +1952,23 @@ void picoquic_crypto_context_free(picoquic_crypto_context_t * ctx)
         ptls_cipher_free((ptls_cipher_context_t *)ctx->pn_dec);
         ctx->pn_dec = NULL;
     }
+
+    for (int i = 0; i < PICOQUIC_CRYPTO_WORKERS_MAX; i++) {
+        if (ctx->aead_encrypt_workers[i] != NULL) {
+            ptls_aead_free((ptls_aead_context_t *)ctx->aead_encrypt_workers[i]);
+            ctx->aead_encrypt_workers[i] = NULL;
+        }
+    }
+
+    if (ctx->pn_enc_ecb != NULL) {
+        ptls_cipher_free((ptls_cipher_context_t *)ctx->pn_enc_ecb);
+        ctx->pn_enc_ecb = NULL;
+    }
+
+    if (ctx->pn_dec_ecb != NULL) {
+        ptls_cipher_free((ptls_cipher_context_t *)ctx->pn_dec_ecb);
+        ctx->pn_dec_ecb = NULL;
+    }
 }
 
 /*
@@ -1797,6 +2095,10 @@ int picoquic_master_tlscontext(picoquic_quic_t* quic,
         if (ret == 0) {
             quic->tls_master_ctx = ctx;
             picoquic_public_random_seed(quic);
+#ifdef PICOQUIC_WITH_CERT_COMPRESSION
+            /* Compression is enabled by default. The connection proceeds without it if the chain cannot be compressed */
+            (void)picoquic_set_certificate_compression(quic, 1);
+#endif
         } else {
             free(ctx);
         }
@@ -1805,6 +2107,62 @@ int picoquic_master_tlscontext(picoquic_quic_t* quic,
     return ret;
 }
 
+#ifdef PICOQUIC_WITH_CERT_COMPRESSION
+/*
+ * Certificate compression (RFC 8879).
+ * When compression is enabled, the context accepts compressed certificates, and
+ * the local certificate chain is compressed with brotli once, when the chain is set.
+ * Picotls sends the uncompressed chain to peers that do not support compression.
+ */
+static void picoquic_dispose_compressed_certificate(ptls_context_t* ctx)
+{
+    if (ctx->emit_certificate != NULL) {
+        ptls_dispose_compressed_certificate((ptls_emit_compressed_certificate_t*)ctx->emit_certificate);
+        free(ctx->emit_certificate);
+        ctx->emit_certificate = NULL;
+    }
+}
+
+static int picoquic_update_compressed_certificate(ptls_context_t* ctx)
+{
+    int ret = 0;
+
+    picoquic_dispose_compressed_certificate(ctx);
+
+    if (ctx->decompress_certificate != NULL && ctx->certificates.count > 0) {
+        ptls_emit_compressed_certificate_t* ecc = (ptls_emit_compressed_certificate_t*)malloc(sizeof(ptls_emit_compressed_certificate_t));
+
+        if (ecc == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if ((ret = ptls_init_compressed_certificate(ecc, ctx->certificates.list, ctx->certificates.count,
+            ptls_iovec_init(NULL, 0))) != 0) {
+            DBG_PRINTF("Cannot compress the certificate chain, ret = %d", ret);
+            free(ecc);
+        }
+        else {
+            ctx->emit_certificate = &ecc->super;
+        }
+    }
+
+    return ret;
+}
+#endif
+
+int picoquic_set_certificate_compression(picoquic_quic_t* quic, int is_enabled)
+{
+#ifdef PICOQUIC_WITH_CERT_COMPRESSION
+    ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+
+    ctx->decompress_certificate = (is_enabled) ? &ptls_decompress_certificate : NULL;
+
+    return picoquic_update_compressed_certificate(ctx);
+#else
+    UNREFERENCED_PARAMETER(quic);
+    return (is_enabled) ? -1 : 0;
+#endif
+}
+
 static void free_certificates_list(ptls_iovec_t* certs, size_t len) {
     if (certs == NULL) {
         return;
@@ -1836,6 +2194,9 @@ void picoquic_master_tlscontext_free(picoquic_quic_t* quic)
             ctx->get_time = NULL;
         }
 
+#ifdef PICOQUIC_WITH_CERT_COMPRESSION
+        picoquic_dispose_compressed_certificate(ctx);
+#endif
         free_certificates_list(ctx->certificates.list, ctx->certificates.count);
 
         if (ctx->sign_certificate != NULL) {
@@ -2161,6 +2522,8 @@ static int picoquic_add_to_tls_stream(picoquic_cnx_t* cnx, const uint8_t* data,
                 stream_data->length = length;
                 stream_data->offset = 0;
                 stream_data->next_stream_data = NULL;
+                stream_data->release_fn = NULL;
+                stream_data->release_ctx = NULL;
 
                 while (next != NULL) {
                     pprevious = &next->next_stream_data;
@@ -2243,9 +2606,11 @@ int picoquic_initialize_tls_stream(picoquic_cnx_t* cnx, uint64_t current_time)
         uint8_t* ticket = NULL;
         uint16_t ticket_length = 0;
 
-        if (picoquic_get_ticket(cnx->quic->p_first_ticket, current_time,
+        /* Drop the reference taken by a previous attempt, e.g., before a retry */
+        picoquic_release_session_ticket(&cnx->resumption_ticket);
+        if (picoquic_get_session_ticket_ex(cnx->quic, current_time,
             cnx->sni, (uint16_t)strlen(cnx->sni), cnx->alpn, (uint16_t)strlen(cnx->alpn),
-            &ticket, &ticket_length, &cnx->remote_parameters, 1)
+            &ticket, &ticket_length, &cnx->remote_parameters, 1, &cnx->resumption_ticket)
             == 0) {
             ctx->handshake_properties.client.session_ticket.base = ticket;
             ctx->handshake_properties.client.session_ticket.len = ticket_length;
@@ -2315,7 +2680,7 @@ void * picoquic_pn_enc_create_for_test(const uint8_t * secret)
     ptls_cipher_suite_t *cipher = picoquic_get_aes128gcm_sha256();
     void *v_pn_enc = NULL;
     
-    (void)picoquic_set_pn_enc_from_secret(&v_pn_enc, cipher, 1, secret);
+    (void)picoquic_set_pn_enc_from_secret(&v_pn_enc, NULL, cipher, 1, secret);
 
     return v_pn_enc;
 }
@@ -2331,6 +2696,29 @@ void picoquic_pn_encrypt(void *pn_enc, const void * iv, void *output, const void
     ptls_cipher_encrypt((ptls_cipher_context_t *) pn_enc, output, input, len);
 }
 
+/* Compute the header protection masks for a batch of samples.
+ * Each mask uses PICOQUIC_HP_SAMPLE_SIZE bytes in the output, of which only
+ * the first 5 are meaningful. If an ECB context is available, all the masks
+ * are obtained in a single cipher call, which lets the AES implementation
+ * pipeline the blocks. Otherwise, the CTR context is used one sample at a time.
+ */
+void picoquic_pn_encrypt_batch(void* pn_enc, void* pn_ecb, const uint8_t** samples, uint8_t* masks, size_t nb_samples)
+{
+    if (pn_ecb != NULL) {
+        for (size_t i = 0; i < nb_samples; i++) {
+            memcpy(masks + i * PICOQUIC_HP_SAMPLE_SIZE, samples[i], PICOQUIC_HP_SAMPLE_SIZE);
+        }
+        ptls_cipher_encrypt((ptls_cipher_context_t*)pn_ecb, masks, masks, nb_samples * PICOQUIC_HP_SAMPLE_SIZE);
+    }
+    else {
+        for (size_t i = 0; i < nb_samples; i++) {
+            uint8_t* mask = masks + i * PICOQUIC_HP_SAMPLE_SIZE;
+            memset(mask, 0, 5);
+            picoquic_pn_encrypt(pn_enc, samples[i], mask, mask, 5);
+        }
+    }
+}
+
 /* Utility functions, so applications do not have to load picotls.h */
 
 void picoquic_aead_free(void* aead_context)
@@ -2359,6 +2747,92 @@ void * picoquic_setup_test_aead_context(int is_encrypt, const uint8_t * secret)
     return v_aead;
 }
 
+static int picoquic_ticket_aead_create(picoquic_ticket_aead_t* ticket_aead, uint8_t key_id, const uint8_t* secret)
+{
+    int ret;
+    ptls_cipher_suite_t* cipher = picoquic_get_aes128gcm_sha256();
+
+    memset(ticket_aead, 0, sizeof(picoquic_ticket_aead_t));
+    ticket_aead->key_id = key_id;
+    ret = picoquic_set_aead_from_secret(&ticket_aead->aead_encrypt, cipher, 1, secret);
+    if (ret == 0) {
+        ret = picoquic_set_aead_from_secret(&ticket_aead->aead_decrypt, cipher, 0, secret);
+    }
+
+    return ret;
+}
+
+static void picoquic_ticket_aead_delete(picoquic_ticket_aead_t* ticket_aead)
+{
+    if (ticket_aead->aead_encrypt != NULL) {
+        picoquic_aead_free(ticket_aead->aead_encrypt);
+        ticket_aead->aead_encrypt = NULL;
+    }
+    if (ticket_aead->aead_decrypt != NULL) {
+        picoquic_aead_free(ticket_aead->aead_decrypt);
+        ticket_aead->aead_decrypt = NULL;
+    }
+}
+
+/* Rotate the keys of the shared ring if the current key is too old, and
+ * derive the AEAD contexts again if the ring changed since the last call.
+ */
+static int picoquic_ticket_aead_refresh(picoquic_quic_t* quic, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_ticket_key_ring_t* ring = quic->ticket_key_ring;
+
+    if (ring != NULL) {
+        (void)picoquic_lock_mutex(&ring->mutex);
+        if (ring->rotation_interval > 0 && current_time >= ring->keys[0].creation_time + ring->rotation_interval) {
+            picoquic_ticket_key_ring_add_key(ring, NULL, 0, current_time);
+        }
+        if (ring->generation != quic->ticket_key_generation) {
+            picoquic_ticket_aead_t new_aead[PICOQUIC_TICKET_KEYS_MAX];
+            int nb_new = 0;
+
+            for (int i = 0; ret == 0 && i < ring->nb_keys; i++) {
+                int j = 0;
+                while (j < quic->nb_ticket_aead && (quic->ticket_aead[j].aead_encrypt == NULL ||
+                    quic->ticket_aead[j].key_id != ring->keys[i].key_id)) {
+                    j++;
+                }
+                if (j < quic->nb_ticket_aead) {
+                    /* Keep the contexts already derived for that key */
+                    new_aead[nb_new++] = quic->ticket_aead[j];
+                    memset(&quic->ticket_aead[j], 0, sizeof(picoquic_ticket_aead_t));
+                }
+                else if ((ret = picoquic_ticket_aead_create(&new_aead[nb_new], ring->keys[i].key_id, ring->keys[i].secret)) == 0) {
+                    nb_new++;
+                }
+                else {
+                    picoquic_ticket_aead_delete(&new_aead[nb_new]);
+                }
+            }
+
+            picoquic_delete_ticket_aead_contexts(quic);
+            memcpy(quic->ticket_aead, new_aead, sizeof(picoquic_ticket_aead_t) * nb_new);
+            quic->nb_ticket_aead = nb_new;
+            if (ret == 0) {
+                quic->ticket_key_generation = ring->generation;
+            }
+        }
+        (void)picoquic_unlock_mutex(&ring->mutex);
+    }
+
+    return ret;
+}
+
+static void* picoquic_ticket_aead_decrypt_context(picoquic_quic_t* quic, uint8_t key_id)
+{
+    for (int i = 0; i < quic->nb_ticket_aead; i++) {
+        if (quic->ticket_aead[i].key_id == key_id) {
+            return quic->ticket_aead[i].aead_decrypt;
+        }
+    }
+    return NULL;
+}
+
 int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
     ptls_context_t* tls_ctx,
     const uint8_t* secret, size_t secret_length)
@@ -2377,10 +2851,11 @@ int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
             tls_ctx->random_bytes(temp_secret, cipher->hash->digest_size);
         }
 
-        /* Create the AEAD contexts */
-        ret = picoquic_set_aead_from_secret(&quic->aead_encrypt_ticket_ctx, cipher, 1, temp_secret);
+        /* Create the AEAD contexts of the local key */
+        picoquic_delete_ticket_aead_contexts(quic);
+        ret = picoquic_ticket_aead_create(&quic->ticket_aead[0], 0, temp_secret);
         if (ret == 0) {
-            ret = picoquic_set_aead_from_secret(&quic->aead_decrypt_ticket_ctx, cipher, 0, temp_secret);
+            quic->nb_ticket_aead = 1;
         }
 
         /* erase the temporary secret */
@@ -2389,6 +2864,108 @@ int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
     return ret;
 }
 
+void picoquic_delete_ticket_aead_contexts(picoquic_quic_t* quic)
+{
+    for (int i = 0; i < quic->nb_ticket_aead; i++) {
+        picoquic_ticket_aead_delete(&quic->ticket_aead[i]);
+    }
+    quic->nb_ticket_aead = 0;
+}
+
+/* Shared ring of ticket keys.
+ * The QUIC contexts that use the ring check its generation before encrypting
+ * or decrypting tickets, and derive their AEAD contexts again if keys were
+ * added. The AEAD contexts of keys still present in the ring are kept.
+ */
+static void picoquic_ticket_key_ring_add_key(picoquic_ticket_key_ring_t* ring, const uint8_t* secret, size_t secret_length,
+    uint64_t current_time)
+{
+    picoquic_ticket_key_t* key = &ring->keys[0];
+
+    memmove(&ring->keys[1], &ring->keys[0], sizeof(picoquic_ticket_key_t) * (PICOQUIC_TICKET_KEYS_MAX - 1));
+    if (ring->nb_keys < PICOQUIC_TICKET_KEYS_MAX) {
+        ring->nb_keys++;
+    }
+    memset(key, 0, sizeof(picoquic_ticket_key_t));
+    key->key_id = ring->next_key_id++;
+    key->creation_time = current_time;
+    if (secret != NULL && secret_length > 0) {
+        memcpy(key->secret, secret, (secret_length > PICOQUIC_TICKET_SECRET_SIZE) ? PICOQUIC_TICKET_SECRET_SIZE : secret_length);
+    }
+    else {
+        ptls_openssl_random_bytes(key->secret, PICOQUIC_TICKET_SECRET_SIZE);
+    }
+    ring->generation++;
+}
+
+picoquic_ticket_key_ring_t* picoquic_ticket_key_ring_create(const uint8_t* secret, size_t secret_length,
+    uint64_t rotation_interval, uint64_t current_time)
+{
+    picoquic_ticket_key_ring_t* ring = (picoquic_ticket_key_ring_t*)malloc(sizeof(picoquic_ticket_key_ring_t));
+
+    if (ring != NULL) {
+        memset(ring, 0, sizeof(picoquic_ticket_key_ring_t));
+        if (picoquic_create_mutex(&ring->mutex) != 0) {
+            free(ring);
+            ring = NULL;
+        }
+        else {
+            ring->ref_count = 1;
+            ring->rotation_interval = rotation_interval;
+            ring->next_key_id = 1;
+            picoquic_ticket_key_ring_add_key(ring, secret, secret_length, current_time);
+        }
+    }
+
+    return ring;
+}
+
+void picoquic_ticket_key_ring_rotate(picoquic_ticket_key_ring_t* ring, const uint8_t* secret, size_t secret_length,
+    uint64_t current_time)
+{
+    (void)picoquic_lock_mutex(&ring->mutex);
+    picoquic_ticket_key_ring_add_key(ring, secret, secret_length, current_time);
+    (void)picoquic_unlock_mutex(&ring->mutex);
+}
+
+void picoquic_ticket_key_ring_release(picoquic_ticket_key_ring_t* ring)
+{
+    int ref_count;
+
+    (void)picoquic_lock_mutex(&ring->mutex);
+    ref_count = --ring->ref_count;
+    (void)picoquic_unlock_mutex(&ring->mutex);
+
+    if (ref_count <= 0) {
+        ptls_clear_memory(ring->keys, sizeof(ring->keys));
+        (void)picoquic_delete_mutex(&ring->mutex);
+        free(ring);
+    }
+}
+
+int picoquic_set_ticket_key_ring(picoquic_quic_t* quic, picoquic_ticket_key_ring_t* ring)
+{
+    if (ring != NULL) {
+        (void)picoquic_lock_mutex(&ring->mutex);
+        ring->ref_count++;
+        (void)picoquic_unlock_mutex(&ring->mutex);
+    }
+    if (quic->ticket_key_ring != NULL) {
+        picoquic_ticket_key_ring_release(quic->ticket_key_ring);
+    }
+    quic->ticket_key_ring = ring;
+    quic->ticket_key_generation = 0;
+    /* The current keys are replaced by the keys of the ring, or by a new local key */
+    picoquic_delete_ticket_aead_contexts(quic);
+
+    if (ring == NULL) {
+        return picoquic_server_setup_ticket_aead_contexts(quic, (ptls_context_t*)quic->tls_master_ctx, NULL, 0);
+    }
+    else {
+        return picoquic_ticket_aead_refresh(quic, picoquic_get_quic_time(quic));
+    }
+}
+
 /* Access integrity limit for AEAD */
 uint64_t picoquic_aead_integrity_limit(void* aead_ctx)
 {
@@ -2761,6 +3338,10 @@ void picoquic_set_tls_certificate_chain(picoquic_quic_t* quic, ptls_iovec_t* cer
 
     ctx->certificates.list = certs;
     ctx->certificates.count = count;
+
+#ifdef PICOQUIC_WITH_CERT_COMPRESSION
+    (void)picoquic_update_compressed_certificate(ctx);
+#endif
 }
 
 void picoquic_tls_set_client_authentication(picoquic_quic_t* quic, int client_authentication) {
@@ -2783,6 +3364,7 @@ int picoquic_tls_client_authentication_activated(picoquic_quic_t* quic) {
  * This is encrypted using the same AEAD contexts as the encryption of session tickets.
  * The encrypted structure is:
  * - 64 bit random sequence number.
+ * - Identifier of the ticket key, one byte.
  * - Encrypted value of the token.
  * - AEAD checksum.
  * The most significant bit of the random number is set to 1 (0x80) for a "new token",
@@ -2802,7 +3384,7 @@ static int picoquic_server_encrypt_retry_token(picoquic_quic_t * quic, const str
     uint8_t* auth_data;
     size_t auth_data_length;
 
-    if (text_length + 1u + 16u > token_max) {
+    if (text_length + 9u + 16u > token_max || quic->nb_ticket_aead == 0) {
         ret = -1;
         *token_length = 0;
     }
@@ -2824,9 +3406,10 @@ static int picoquic_server_encrypt_retry_token(picoquic_quic_t * quic, const str
             token[0] &= 0x7F;
         }
         sequence = PICOPARSE_64(token);
+        token[8] = quic->ticket_aead[0].key_id;
 
-        *token_length = (size_t)8u + picoquic_aead_encrypt_generic(token + 8, text, text_length,
-            sequence, auth_data, auth_data_length, quic->aead_encrypt_ticket_ctx);
+        *token_length = (size_t)9u + picoquic_aead_encrypt_generic(token + 9, text, text_length,
+            sequence, auth_data, auth_data_length, quic->ticket_aead[0].aead_encrypt);
     }
 
     return ret;
@@ -2839,6 +3422,7 @@ int picoquic_server_decrypt_retry_token(picoquic_quic_t* quic, const struct sock
     uint64_t sequence;
     uint8_t* auth_data;
     size_t auth_data_length;
+    void* aead_decrypt = NULL;
 
     if (addr_peer->sa_family == AF_INET) {
         auth_data = (uint8_t*)&((struct sockaddr_in *)addr_peer)->sin_addr;
@@ -2849,7 +3433,7 @@ int picoquic_server_decrypt_retry_token(picoquic_quic_t* quic, const struct sock
         auth_data_length = 16;
     }
 
-    if (token_length < 8) {
+    if (token_length < 9 || (aead_decrypt = picoquic_ticket_aead_decrypt_context(quic, token[8])) == NULL) {
         *is_new_token = 0;
         ret = -1;
     }
@@ -2857,9 +3441,9 @@ int picoquic_server_decrypt_retry_token(picoquic_quic_t* quic, const struct sock
         *is_new_token = ((token[0] & 0x80) == 0) ? 0: 1;
         sequence = PICOPARSE_64(token);
 
-        *text_length = picoquic_aead_decrypt_generic(text, token+8, token_length-8,
-            sequence, auth_data, auth_data_length, quic->aead_decrypt_ticket_ctx);
-        if (*text_length >= token_length - 8) {
+        *text_length = picoquic_aead_decrypt_generic(text, token+9, token_length-9,
+            sequence, auth_data, auth_data_length, aead_decrypt);
+        if (*text_length >= token_length - 9) {
             ret = -1;
         }
     }
@@ -2878,6 +3462,8 @@ int picoquic_prepare_retry_token(picoquic_quic_t* quic, const struct sockaddr* a
     uint8_t* bytes = text;
     uint8_t* bytes_max = text + sizeof(text);
 
+    (void)picoquic_ticket_aead_refresh(quic, current_time);
+
     /* set a short life time for short lived tokens, 24 hours otherwise */
     if (odcid->id_len == 0) {
         token_time += 24ull * 3600ull * 1000000ull;
@@ -2917,6 +3503,7 @@ int picoquic_verify_retry_token(picoquic_quic_t* quic, const struct sockaddr * a
     uint64_t token_pn;
 
     odcid->id_len = 0;
+    (void)picoquic_ticket_aead_refresh(quic, current_time);
 
     /* decode the encrypted token */
     ret = picoquic_server_decrypt_retry_token(quic, addr_peer, is_new_token, token, token_size,
@@ -2943,7 +3530,7 @@ int picoquic_verify_retry_token(picoquic_quic_t* quic, const struct sockaddr * a
             else {
                 /* Remove old tickets before testing this one. */
                 picoquic_registered_token_clear(quic, current_time);
-                if (new_context_created && (ret = picoquic_registered_token_check_reuse(quic, token, token_size, token_time)) != 0) {
+                if (new_context_created && (ret = picoquic_registered_token_check_reuse(quic, token, token_size, token_time, current_time)) != 0) {
                     picoquic_log_context_free_app_message(quic, rcid, "Duplicate token test returns %d", ret);
                 }
                 else if (odcid->id_len > 0 &&
@@ -83,6 +83,8 @@ size_t picoquic_pn_iv_size(void *pn_enc);
 
 void picoquic_pn_encrypt(void *pn_enc, const void * iv, void *output, const void *input, size_t len);
 
+void picoquic_pn_encrypt_batch(void* pn_enc, void* pn_ecb, const uint8_t** samples, uint8_t* masks, size_t nb_samples);
+
 typedef const struct st_ptls_cipher_suite_t ptls_cipher_suite_t;
 
 int picoquic_setup_initial_master_secret(
@@ -98,6 +100,10 @@ int picoquic_setup_initial_secrets(
     uint8_t * server_secret);
 
 int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx);
+int picoquic_get_initial_validation_context(picoquic_quic_t* quic, int version_index,
+    const picoquic_connection_id_t* initial_cnxid, picoquic_crypto_context_t** p_crypto_context);
+void picoquic_delete_initial_key_cache(picoquic_quic_t* quic);
+void picoquic_delete_ticket_aead_contexts(picoquic_quic_t* quic);
 
 uint8_t * picoquic_get_app_secret(picoquic_cnx_t* cnx, int is_enc);
 size_t picoquic_get_app_secret_size(picoquic_cnx_t* cnx);
@@ -184,6 +190,9 @@ int picoquic_verify_retry_protection(void * integrity_aead, uint8_t * bytes, siz
 /* Exportable definition of ciphersuites */
 void* picoquic_get_cipher_suite_by_id_v(int cipher_suite_id);
 
+/* Use of the fusion AES-GCM engine, when supported by the CPU */
+int picoquic_set_fusion_enabled(int enabled);
+
 /* Exportable version of ciphersuite definition for AES128GCM SHA256 ciphersuite */
 void* picoquic_get_aes128gcm_sha256_v();
 
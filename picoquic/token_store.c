@@ -240,6 +240,21 @@ int picoquic_get_token(picoquic_stored_token_t* p_first_token,
     return ret;
 }
 
+static int picoquic_write_token_record(FILE* F, const picoquic_stored_token_t* stored)
+{
+    uint8_t buffer[2048];
+    size_t record_size;
+    int ret = picoquic_serialize_token(stored, buffer, sizeof(buffer), &record_size);
+
+    if (ret == 0) {
+        if (fwrite(&record_size, 4, 1, F) != 1 || fwrite(buffer, 1, record_size, F) != record_size) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_save_tokens(const picoquic_stored_token_t* first_token,
     uint64_t current_time,
     char const* token_file_name)
@@ -254,18 +269,7 @@ int picoquic_save_tokens(const picoquic_stored_token_t* first_token,
         while (ret == 0 && next != NULL) {
             /* Only store the tokens that are valid going forward */
             if (next->time_valid_until > current_time && next->was_used == 0) {
-                /* Compute the serialized size */
-                uint8_t buffer[2048];
-                size_t record_size;
-
-                ret = picoquic_serialize_token(next, buffer, sizeof(buffer), &record_size);
-
-                if (ret == 0) {
-                    if (fwrite(&record_size, 4, 1, F) != 1 || fwrite(buffer, 1, record_size, F) != record_size) {
-                        ret = PICOQUIC_ERROR_INVALID_FILE;
-                        break;
-                    }
-                }
+                ret = picoquic_write_token_record(F, next);
             }
             next = next->next_token;
         }
@@ -275,69 +279,183 @@ int picoquic_save_tokens(const picoquic_stored_token_t* first_token,
     return ret;
 }
 
-int picoquic_load_tokens(picoquic_stored_token_t** pp_first_token,
-    uint64_t current_time, char const* token_file_name)
+/* Index of the stored tokens by SNI. The tokens of the same SNI differ
+ * by the IP address of the server. */
+static uint64_t picoquic_stored_token_hash(const void* key)
 {
-    int ret = 0;
-    int file_ret = 0;
-    FILE* F = NULL;
-    picoquic_stored_token_t* previous = NULL;
-    picoquic_stored_token_t* next = NULL;
-    uint32_t record_size;
-    uint32_t storage_size;
+    const picoquic_stored_token_t* stored = (const picoquic_stored_token_t*)key;
+
+    return picohash_bytes((const uint8_t*)stored->sni, stored->sni_length);
+}
+
+static int picoquic_stored_token_compare(const void* key1, const void* key2)
+{
+    const picoquic_stored_token_t* t1 = (const picoquic_stored_token_t*)key1;
+    const picoquic_stored_token_t* t2 = (const picoquic_stored_token_t*)key2;
+
+    return (t1->sni_length == t2->sni_length && memcmp(t1->sni, t2->sni, t1->sni_length) == 0) ? 0 : -1;
+}
 
-    if ((F = picoquic_file_open_ex(token_file_name, "rb", &file_ret)) == NULL) {
-        ret = (file_ret == ENOENT) ? PICOQUIC_ERROR_NO_SUCH_FILE : -1;
+static picohash_item* picoquic_token_index_first(picohash_table* index, const picoquic_stored_token_t* key, uint64_t* hash)
+{
+    *hash = picoquic_stored_token_hash(key);
+    return index->hash_bin[*hash % index->nb_bin];
+}
+
+/* Mark as used the tokens of the same SNI and IP address that expire before
+ * the new one, as picoquic_store_token does. If the token is a cancel record
+ * read from the file, only mark the token with the same expiry time.
+ */
+static void picoquic_token_index_supersede(picohash_table* index, const picoquic_stored_token_t* stored, int is_cancel)
+{
+    uint64_t hash;
+    picohash_item* item = picoquic_token_index_first(index, stored, &hash);
+
+    while (item != NULL) {
+        picoquic_stored_token_t* indexed = (picoquic_stored_token_t*)item->key;
+
+        if (indexed != stored && item->hash == hash && picoquic_stored_token_compare(indexed, stored) == 0 &&
+            indexed->ip_addr_length == stored->ip_addr_length &&
+            memcmp(indexed->ip_addr, stored->ip_addr, stored->ip_addr_length) == 0) {
+            if (!is_cancel && indexed->time_valid_until <= stored->time_valid_until) {
+                indexed->was_used = 1;
+            }
+            else if (is_cancel && indexed->time_valid_until == stored->time_valid_until) {
+                indexed->was_used = 1;
+                indexed->is_saved = 0;
+            }
+        }
+        item = item->next_in_bin;
     }
+}
+
+static void picoquic_token_index_remove(picohash_table* index, const picoquic_stored_token_t* stored)
+{
+    uint64_t hash;
+    picohash_item* item = picoquic_token_index_first(index, stored, &hash);
 
-    while (ret == 0) {
-        if (fread(&storage_size, 4, 1, F) != 1) {
-            /* end of file */
-            break;
+    while (item != NULL && item->key != stored) {
+        item = item->next_in_bin;
+    }
+    if (item != NULL) {
+        picohash_delete_item(index, item, 0);
+    }
+}
+
+/* Free the used tokens, except those that still need to be cancelled in the file */
+static void picoquic_sweep_tokens(picoquic_stored_token_t** pp_first_token, picohash_table* index)
+{
+    picoquic_stored_token_t** pprevious = pp_first_token;
+    picoquic_stored_token_t* next;
+
+    while ((next = *pprevious) != NULL) {
+        if (next->was_used && !next->is_saved) {
+            *pprevious = next->next_token;
+            if (index != NULL) {
+                picoquic_token_index_remove(index, next);
+            }
+            free(next);
         }
-        else if (storage_size > 2048 ||
-            (record_size = storage_size + offsetof(struct st_picoquic_stored_token_t, time_valid_until)) > 2048) {
+        else {
+            pprevious = &next->next_token;
+        }
+    }
+}
+
+/* Load the records of a token file, and add the valid tokens at the end of the list.
+ * Records without token cancel the token of the same SNI, IP address and expiry time.
+ */
+static int picoquic_load_tokens_ex(picoquic_stored_token_t** pp_first_token, picohash_table* index,
+    uint64_t current_time, char const* token_file_name, size_t* nb_records)
+{
+    int ret = 0;
+    int file_err = 0;
+    size_t file_size = 0;
+    size_t byte_index = 0;
+    picoquic_stored_token_t** pp_last = pp_first_token;
+    uint8_t* bytes = picoquic_file_map(token_file_name, &file_size, &file_err);
+
+    *nb_records = 0;
+
+    if (bytes == NULL && file_err != 0) {
+        ret = (file_err == ENOENT) ? PICOQUIC_ERROR_NO_SUCH_FILE : -1;
+    }
+
+    while (*pp_last != NULL) {
+        pp_last = &(*pp_last)->next_token;
+    }
+
+    while (ret == 0 && byte_index + 4 <= file_size) {
+        uint32_t storage_size;
+
+        memcpy(&storage_size, bytes + byte_index, 4);
+        byte_index += 4;
+
+        if (storage_size > 2048 || storage_size > file_size - byte_index) {
             ret = PICOQUIC_ERROR_INVALID_FILE;
-            break;
         }
         else {
-            uint8_t buffer[2048];
-            if (fread(buffer, 1, storage_size, F) != storage_size) {
+            picoquic_stored_token_t* next = NULL;
+            size_t consumed = 0;
+
+            ret = picoquic_deserialize_token(&next, bytes + byte_index, storage_size, &consumed);
+            byte_index += storage_size;
+
+            if (ret == 0 && (consumed != storage_size || next == NULL)) {
                 ret = PICOQUIC_ERROR_INVALID_FILE;
             }
-            else {
-                size_t consumed = 0;
-                ret = picoquic_deserialize_token(&next, buffer, storage_size, &consumed);
 
-                if (ret == 0 && (consumed != storage_size || next == NULL)) {
-                    ret = PICOQUIC_ERROR_INVALID_FILE;
-                }
+            if (ret == 0) {
+                (*nb_records)++;
 
-                if (ret == 0 && next != NULL) {
-                    if (next->time_valid_until < current_time) {
-                        free(next);
-                        next = NULL;
-                    }
-                    else {
-                        next->sni = ((char*)next) + sizeof(picoquic_stored_token_t);
-                        next->ip_addr = ((uint8_t*)next->sni) + next->sni_length + 1;
-                        next->token = (uint8_t*)(next->ip_addr + next->ip_addr_length + 1);
-                        next->next_token = NULL;
-                        if (previous == NULL) {
-                            *pp_first_token = next;
-                        }
-                        else {
-                            previous->next_token = next;
-                        }
-
-                        previous = next;
-                    }
+                if (next->token_length == 0) {
+                    picoquic_token_index_supersede(index, next, 1);
+                    free(next);
+                }
+                else if (next->time_valid_until < current_time) {
+                    free(next);
+                }
+                else if (picohash_insert(index, next) != 0) {
+                    free(next);
+                    ret = PICOQUIC_ERROR_MEMORY;
                 }
+                else {
+                    next->is_saved = 1;
+                    *pp_last = next;
+                    pp_last = &next->next_token;
+                }
+            }
+            else if (next != NULL) {
+                free(next);
             }
         }
     }
 
-    (void)picoquic_file_close(F);
+    if (ret == 0 && byte_index != file_size) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+
+    picoquic_file_unmap(bytes, file_size);
+    picoquic_sweep_tokens(pp_first_token, index);
+
+    return ret;
+}
+
+int picoquic_load_tokens(picoquic_stored_token_t** pp_first_token,
+    uint64_t current_time, char const* token_file_name)
+{
+    int ret = 0;
+    size_t nb_records = 0;
+    picohash_table* index = picohash_create(PICOQUIC_STORE_INDEX_BINS,
+        picoquic_stored_token_hash, picoquic_stored_token_compare);
+
+    if (index == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        ret = picoquic_load_tokens_ex(pp_first_token, index, current_time, token_file_name, &nb_records);
+        picohash_delete(index, 0);
+    }
 
     return ret;
 }
@@ -352,3 +470,221 @@ void picoquic_free_tokens(picoquic_stored_token_t** pp_first_token)
         free(next);
     }
 }
+
+/* Indexed store of tokens in the QUIC context */
+static picohash_table* picoquic_token_index(picoquic_quic_t* quic)
+{
+    if (quic->token_store.index == NULL) {
+        quic->token_store.index = picohash_create(PICOQUIC_STORE_INDEX_BINS,
+            picoquic_stored_token_hash, picoquic_stored_token_compare);
+
+        if (quic->token_store.index != NULL) {
+            /* Tokens may have been added to the list directly */
+            for (picoquic_stored_token_t* next = quic->p_first_token; next != NULL; next = next->next_token) {
+                if (picohash_insert(quic->token_store.index, next) != 0) {
+                    picohash_delete(quic->token_store.index, 0);
+                    quic->token_store.index = NULL;
+                    break;
+                }
+            }
+        }
+        if (quic->token_store.index != NULL) {
+            quic->token_store.sweep_count = quic->token_store.index->count;
+        }
+    }
+
+    return quic->token_store.index;
+}
+
+int picoquic_store_retry_token(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length,
+    uint8_t const* ip_addr, uint8_t ip_addr_length,
+    uint8_t const* token, uint16_t token_length)
+{
+    int ret = 0;
+    picohash_table* index = picoquic_token_index(quic);
+
+    if (index == NULL) {
+        ret = picoquic_store_token(&quic->p_first_token, current_time, sni, sni_length, ip_addr, ip_addr_length,
+            token, token_length);
+    }
+    else if (token_length < 1 || sni == NULL || sni_length == 0) {
+        ret = PICOQUIC_ERROR_INVALID_TOKEN;
+    }
+    else {
+        /* There is no explicit TTL for tokens. We assume they are OK for 24 hours */
+        uint64_t time_valid_until = current_time + ((uint64_t)24 * 3600) * ((uint64_t)1000000);
+        picoquic_stored_token_t* stored = picoquic_format_token(time_valid_until, sni, sni_length,
+            ip_addr, ip_addr_length, token, token_length);
+
+        if (stored == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if (picohash_insert(index, stored) != 0) {
+            free(stored);
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            stored->next_token = quic->p_first_token;
+            quic->p_first_token = stored;
+            picoquic_token_index_supersede(index, stored, 0);
+
+            if (index->count > 2 * quic->token_store.sweep_count + 16) {
+                picoquic_sweep_tokens(&quic->p_first_token, index);
+                quic->token_store.sweep_count = index->count;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_get_retry_token(picoquic_quic_t* quic, uint64_t current_time,
+    char const* sni, uint16_t sni_length,
+    uint8_t const* ip_addr, uint8_t ip_addr_length,
+    uint8_t** token, uint16_t* token_length, int mark_used)
+{
+    int ret = 0;
+    picohash_table* index = picoquic_token_index(quic);
+
+    if (index == NULL) {
+        ret = picoquic_get_token(quic->p_first_token, current_time, sni, sni_length, ip_addr, ip_addr_length,
+            token, token_length, mark_used);
+    }
+    else {
+        picoquic_stored_token_t key;
+        picoquic_stored_token_t* best_match = NULL;
+        uint64_t hash;
+        picohash_item* item;
+
+        memset(&key, 0, sizeof(key));
+        key.sni = sni;
+        key.sni_length = sni_length;
+        item = picoquic_token_index_first(index, &key, &hash);
+
+        /* Same selection as picoquic_get_token, within the tokens of the SNI */
+        while (item != NULL) {
+            picoquic_stored_token_t* next = (picoquic_stored_token_t*)item->key;
+
+            if (item->hash == hash && next->time_valid_until > current_time && next->was_used == 0 &&
+                picoquic_stored_token_compare(next, &key) == 0) {
+                if (ip_addr_length > 0) {
+                    if (next->ip_addr_length == ip_addr_length && memcmp(next->ip_addr, ip_addr, ip_addr_length) == 0) {
+                        best_match = next;
+                        break;
+                    }
+                }
+                else if (best_match == NULL || next->time_valid_until > best_match->time_valid_until) {
+                    best_match = next;
+                }
+            }
+            item = item->next_in_bin;
+        }
+
+        if (best_match == NULL || best_match->token_length == 0 || (*token = (uint8_t*)malloc(best_match->token_length)) == NULL) {
+            *token = NULL;
+            *token_length = 0;
+            ret = -1;
+        }
+        else {
+            *token_length = best_match->token_length;
+            memcpy(*token, (uint8_t*)best_match->token, best_match->token_length);
+            best_match->was_used = mark_used;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_load_retry_tokens(picoquic_quic_t* quic, char const* token_store_filename)
+{
+    int ret = 0;
+    picohash_table* index = picoquic_token_index(quic);
+
+    if (index == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        ret = picoquic_load_tokens_ex(&quic->p_first_token, index, picoquic_get_quic_time(quic), token_store_filename,
+            &quic->token_store.nb_file_records);
+        quic->token_store.sweep_count = index->count;
+        quic->token_store.file_name = picoquic_string_free(quic->token_store.file_name);
+        if (ret == 0) {
+            quic->token_store.file_name = picoquic_string_duplicate(token_store_filename);
+        }
+    }
+
+    return ret;
+}
+
+/* Save the tokens of the QUIC context, appending only the changes if the
+ * file is the one from which the tokens were loaded or in which they were
+ * last saved, as picoquic_save_session_tickets does.
+ */
+int picoquic_save_retry_tokens(picoquic_quic_t* quic, char const* token_store_filename)
+{
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    size_t nb_live = 0;
+    size_t nb_changes = 0;
+    picoquic_stored_token_t* next;
+
+    for (next = quic->p_first_token; next != NULL; next = next->next_token) {
+        if (next->time_valid_until > current_time && next->was_used == 0) {
+            nb_live++;
+            nb_changes += !next->is_saved;
+        }
+        else if (next->was_used) {
+            nb_changes += next->is_saved;
+        }
+    }
+
+    if (quic->token_store.file_name != NULL && strcmp(quic->token_store.file_name, token_store_filename) == 0 &&
+        quic->token_store.nb_file_records + nb_changes <= 2 * nb_live + 16) {
+        FILE* F = NULL;
+
+        if (nb_changes > 0 && (F = picoquic_file_open(token_store_filename, "ab")) == NULL) {
+            ret = -1;
+        }
+        for (next = quic->p_first_token; ret == 0 && F != NULL && next != NULL; next = next->next_token) {
+            if (next->time_valid_until > current_time && next->was_used == 0) {
+                if (!next->is_saved && (ret = picoquic_write_token_record(F, next)) == 0) {
+                    next->is_saved = 1;
+                    quic->token_store.nb_file_records++;
+                }
+            }
+            else if (next->was_used && next->is_saved) {
+                /* Cancel the token with a record of the same key and expiry, without token */
+                picoquic_stored_token_t cancel = *next;
+                cancel.token_length = 0;
+                if ((ret = picoquic_write_token_record(F, &cancel)) == 0) {
+                    next->is_saved = 0;
+                    quic->token_store.nb_file_records++;
+                }
+            }
+        }
+        (void)picoquic_file_close(F);
+    }
+    else if ((ret = picoquic_save_tokens(quic->p_first_token, current_time, token_store_filename)) == 0) {
+        for (next = quic->p_first_token; next != NULL; next = next->next_token) {
+            next->is_saved = (next->time_valid_until > current_time && next->was_used == 0);
+        }
+        quic->token_store.nb_file_records = nb_live;
+        if (quic->token_store.file_name == NULL || strcmp(quic->token_store.file_name, token_store_filename) != 0) {
+            (void)picoquic_string_free(quic->token_store.file_name);
+            quic->token_store.file_name = picoquic_string_duplicate(token_store_filename);
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_free_retry_tokens(picoquic_quic_t* quic)
+{
+    if (quic->token_store.index != NULL) {
+        picohash_delete(quic->token_store.index, 0);
+        quic->token_store.index = NULL;
+    }
+    quic->token_store.file_name = picoquic_string_free(quic->token_store.file_name);
+    picoquic_free_tokens(&quic->p_first_token);
+}
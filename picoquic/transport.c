@@ -337,7 +337,7 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
             (bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_tp_stateless_reset_token)) != NULL &&
             (bytes = picoquic_frames_varint_encode(bytes, bytes_max, PICOQUIC_RESET_SECRET_SIZE)) != NULL) {
             if (bytes + PICOQUIC_RESET_SECRET_SIZE < bytes_max) {
-                (void)picoquic_create_cnxid_reset_secret(cnx->quic, &cnx->path[0]->p_local_cnxid->cnx_id, bytes);
+                memcpy(bytes, cnx->path[0]->p_local_cnxid->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
                 bytes += PICOQUIC_RESET_SECRET_SIZE;
             }
             else {
@@ -399,6 +399,10 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
         bytes = picoquic_transport_param_type_flag_encode(bytes, bytes_max, picoquic_tp_grease_quic_bit);
     }
 
+    if (cnx->local_parameters.enable_multipath > 0 && bytes != NULL) {
+        bytes = picoquic_transport_param_type_flag_encode(bytes, bytes_max, picoquic_tp_enable_multipath);
+    }
+
     if (bytes == NULL) {
         *consumed = 0;
         ret = PICOQUIC_ERROR_EXTENSION_BUFFER_TOO_SMALL;
@@ -436,6 +440,7 @@ void picoquic_clear_transport_extensions(picoquic_cnx_t* cnx)
     cnx->remote_parameters.enable_time_stamp = 0;
     cnx->remote_parameters.min_ack_delay = 0;
     cnx->remote_parameters.do_grease_quic_bit = 0;
+    cnx->remote_parameters.enable_multipath = 0;
 }
 
 int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mode,
@@ -676,6 +681,14 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
                         cnx->remote_parameters.do_grease_quic_bit = 1;
                     }
                     break;
+                case picoquic_tp_enable_multipath:
+                    if (extension_length != 0) {
+                        ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PARAMETER_ERROR, 0);
+                    }
+                    else {
+                        cnx->remote_parameters.enable_multipath = 1;
+                    }
+                    break;
                 default:
                     /* ignore unknown extensions */
                     break;
@@ -814,6 +827,13 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
         cnx->do_grease_quic_bit = cnx->remote_parameters.do_grease_quic_bit;
     }
 
+    /* Multipath is only enabled if both peers support it. The server only
+     * announces support if the client did. */
+    if (!cnx->client_mode) {
+        cnx->local_parameters.enable_multipath &= cnx->remote_parameters.enable_multipath;
+    }
+    cnx->is_multipath_enabled = cnx->local_parameters.enable_multipath && cnx->remote_parameters.enable_multipath;
+
     /* ACK Frequency is only enabled on server if negotiated by client */
     if (!cnx->client_mode && !cnx->is_ack_frequency_negotiated) {
         cnx->local_parameters.min_ack_delay = 0;
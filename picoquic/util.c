@@ -33,6 +33,9 @@
 #include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #include "picoquic_internal.h"
 #include <stdarg.h>
@@ -580,6 +583,84 @@ FILE * picoquic_file_close(FILE * F)
     return NULL;
 }
 
+/* Map a file in memory for reading. On Windows, the file is read in an
+ * allocated buffer instead. Returns NULL with *last_err set to 0 if the
+ * file is empty.
+ */
+uint8_t* picoquic_file_map(char const* file_name, size_t* file_size, int* last_err)
+{
+    uint8_t* bytes = NULL;
+
+    *file_size = 0;
+    *last_err = 0;
+#ifdef _WINDOWS
+    {
+        FILE* F = picoquic_file_open_ex(file_name, "rb", last_err);
+
+        if (F != NULL) {
+            long length;
+            if (fseek(F, 0, SEEK_END) != 0 || (length = ftell(F)) < 0 || fseek(F, 0, SEEK_SET) != 0) {
+                *last_err = -1;
+            }
+            else if (length > 0) {
+                if ((bytes = (uint8_t*)malloc((size_t)length)) == NULL) {
+                    *last_err = ENOMEM;
+                }
+                else if (fread(bytes, 1, (size_t)length, F) != (size_t)length) {
+                    free(bytes);
+                    bytes = NULL;
+                    *last_err = -1;
+                }
+                else {
+                    *file_size = (size_t)length;
+                }
+            }
+            (void)picoquic_file_close(F);
+        }
+    }
+#else
+    {
+        int fd = open(file_name, O_RDONLY);
+
+        if (fd < 0) {
+            *last_err = errno;
+        }
+        else {
+            struct stat st;
+
+            if (fstat(fd, &st) != 0) {
+                *last_err = errno;
+            }
+            else if (st.st_size > 0) {
+                void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED) {
+                    *last_err = errno;
+                }
+                else {
+                    bytes = (uint8_t*)map;
+                    *file_size = (size_t)st.st_size;
+                }
+            }
+            (void)close(fd);
+        }
+    }
+#endif
+
+    return bytes;
+}
+
+void picoquic_file_unmap(uint8_t* bytes, size_t file_size)
+{
+    if (bytes != NULL) {
+#ifdef _WINDOWS
+        UNREFERENCED_PARAMETER(file_size);
+        free(bytes);
+#else
+        (void)munmap(bytes, file_size);
+#endif
+    }
+}
+
 /* Safely delete file in a portable way */
 int picoquic_file_delete(char const * file_name, int * last_err)
 {
@@ -620,7 +701,12 @@ const uint8_t* picoquic_frames_varint_decode(const uint8_t* bytes, const uint8_t
 {
     uint8_t length;
 
-    if (bytes < bytes_max && bytes + (length = (uint8_t)VARINT_LEN(bytes)) <= bytes_max) {
+    if (bytes + 8 <= bytes_max) {
+        /* Fast path, no need to check the length */
+        *n64 = VARINT_DECODE_8(bytes);
+        bytes += VARINT_LEN(bytes);
+    }
+    else if (bytes < bytes_max && bytes + (length = (uint8_t)VARINT_LEN(bytes)) <= bytes_max) {
         uint64_t v = *bytes++ & 0x3F;
 
         while (--length > 0) {
@@ -637,6 +723,25 @@ const uint8_t* picoquic_frames_varint_decode(const uint8_t* bytes, const uint8_t
     return bytes;
 }
 
+/* Decode or skip a run of varints. In case of an error, NULL is returned */
+const uint8_t* picoquic_frames_varint_decode_n(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* n64, size_t nb_varints)
+{
+    if (nb_varints > 0 && bytes != NULL) {
+        size_t consumed = (bytes < bytes_max) ? picoquic_varint_decode_n(bytes, bytes_max - bytes, n64, nb_varints) : 0;
+        bytes = (consumed == 0) ? NULL : bytes + consumed;
+    }
+    return bytes;
+}
+
+const uint8_t* picoquic_frames_varint_skip_n(const uint8_t* bytes, const uint8_t* bytes_max, size_t nb_varints)
+{
+    if (nb_varints > 0 && bytes != NULL) {
+        size_t consumed = (bytes < bytes_max) ? picoquic_varint_skip_n(bytes, bytes_max - bytes, nb_varints) : 0;
+        bytes = (consumed == 0) ? NULL : bytes + consumed;
+    }
+    return bytes;
+}
+
 const uint8_t* picoquic_frames_varlen_decode(const uint8_t* bytes, const uint8_t* bytes_max, size_t* n)
 {
     uint64_t len = 0;
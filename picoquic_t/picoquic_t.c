@@ -54,6 +54,8 @@ static const picoquic_test_def_t test_table[] = {
     { "pn2pn64", pn2pn64test },
     { "intformat", intformattest },
     { "varint", varint_test },
+    { "varint_fuzz", varint_fuzz_test },
+    { "varint_bench", varint_bench_test },
     { "sack", sacktest },
     { "skip_frames", skip_frame_test },
     { "parse_frames", parse_frame_test },
@@ -63,17 +65,29 @@ static const picoquic_test_def_t test_table[] = {
     { "TlsStreamFrame", TlsStreamFrameTest },
     { "StreamZeroFrame", StreamZeroFrameTest },
     { "stream_splay", stream_splay_test },
+    { "stream_table", stream_table_test },
     { "stream_output", stream_output_test },
+    { "stream_priority", stream_priority_test },
+    { "stream_buffer", stream_buffer_test },
+    { "stream_file", stream_file_test },
+    { "receive_window", receive_window_test },
+    { "datagram_jit", datagram_jit_test },
+    { "datagram_queue", datagram_queue_test },
     { "stream_retransmit_copy", test_copy_for_retransmit },
     { "stream_retransmit_format", test_format_for_retransmit },
     { "sendack", sendacktest },
+    { "sendack_cache", sendack_cache_test },
     { "ackrange", ackrange_test },
     { "ack_of_ack", ack_of_ack_test },
     { "sim_link", sim_link_test },
     { "clear_text_aead", cleartext_aead_test },
     { "pn_ctr", pn_ctr_test },
     { "cleartext_pn_enc", cleartext_pn_enc_test },
+    { "pn_enc_batch", pn_enc_batch_test },
+    { "aead_bench", aead_bench_test },
+    { "initial_validation", initial_validation_test },
     { "cid_for_lb", cid_for_lb_test },
+    { "cnxid_pool", cnxid_pool_test },
     { "retry_protection_vector", retry_protection_vector_test },
     { "draft17_vector", draft17_vector_test },
     { "esni", esni_test },
@@ -117,6 +131,7 @@ static const picoquic_test_def_t test_table[] = {
     { "many_short_loss", many_short_loss_test },
     { "retry", tls_api_retry_test },
     { "retry_large", tls_api_retry_large_test},
+    { "retry_store_full", tls_api_retry_store_full_test },
     { "retry_token", tls_retry_token_test },
     { "retry_token_valid", tls_retry_token_valid_test },
     { "two_connections", tls_api_two_connections_test },
@@ -126,19 +141,26 @@ static const picoquic_test_def_t test_table[] = {
     { "excess_repeat", excess_repeat_test },
     { "netperf_basic", netperf_basic_test },
     { "netperf_bbr", netperf_bbr_test },
+    { "netperf_crypto_workers", netperf_crypto_workers_test },
     { "nat_attack", nat_attack_test },
     { "sockets", socket_test },
     { "socket_ecn", socket_ecn_test },
     { "ticket_store", ticket_store_test },
     { "token_store", token_store_test },
     { "token_reuse_api", token_reuse_api_test },
+    { "token_reuse_slots", token_reuse_slots_test },
+    { "anti_replay_store", anti_replay_store_test },
+    { "ticket_store_index", ticket_store_index_test },
     { "session_resume", session_resume_test },
+    { "shared_ticket_key", shared_ticket_key_test },
     { "zero_rtt", zero_rtt_test },
     { "zero_rtt_loss", zero_rtt_loss_test },
     { "stop_sending", stop_sending_test },
     { "unidir", unidir_test },
     { "mtu_discovery", mtu_discovery_test },
     { "mtu_drop", mtu_drop_test },
+    { "pmtud", pmtud_test },
+    { "jumbo_packet", jumbo_packet_test },
     { "red_cc", red_cc_test },
     { "pacing_cc", pacing_cc_test },
     { "spurious_retransmit", spurious_retransmit_test },
@@ -150,6 +172,7 @@ static const picoquic_test_def_t test_table[] = {
     { "different_params", tls_different_params_test },
     { "quant_params", tls_quant_params_test },
     { "set_certificate_and_key", set_certificate_and_key_test },
+    { "cert_compression", cert_compression_test },
     { "request_client_authentication", request_client_authentication_test },
     { "bad_client_certificate", bad_client_certificate_test },
     { "nat_rebinding", nat_rebinding_test },
@@ -181,6 +204,7 @@ static const picoquic_test_def_t test_table[] = {
     { "retire_cnxid", retire_cnxid_test },
     { "not_before_cnxid", not_before_cnxid_test },
     { "server_busy", server_busy_test },
+    { "handshake_budget", handshake_budget_test },
     { "initial_close", initial_close_test },
     { "initial_server_close", initial_server_close_test },
     { "new_rotated_key", new_rotated_key_test },
@@ -236,6 +260,10 @@ static const picoquic_test_def_t test_table[] = {
     { "cid_quiescence", cid_quiescence_test },
     { "migration_controlled", migration_controlled_test },
     { "migration_mtu_drop", migration_mtu_drop_test },
+    { "multipath_scheduler", multipath_scheduler_test },
+    { "multipath_min_rtt", multipath_min_rtt_test },
+    { "multipath_round_robin", multipath_round_robin_test },
+    { "multipath_redundant", multipath_redundant_test },
     { "grease_quic_bit", grease_quic_bit_test },
     { "grease_quic_bit_one_way", grease_quic_bit_one_way_test },
     { "pn_random", pn_random_test },
@@ -244,6 +272,7 @@ static const picoquic_test_def_t test_table[] = {
     { "fuzz", fuzz_test },
     { "fuzz_initial", fuzz_initial_test},
     { "cnx_stress", cnx_stress_unit_test },
+    { "cpu_scaling", cpu_scaling_test },
     { "cnx_ddos", cnx_ddos_unit_test }
 };
 
@@ -294,6 +323,7 @@ int usage(char const * argv0)
     fprintf(stderr, "  -s nnn            Run stress for nnn minutes.\n");
     fprintf(stderr, "  -f nnn            Run fuzz for nnn minutes.\n");
     fprintf(stderr, "  -c nnn ccc        Run connection stress for nnn minutes, ccc connections.\n");
+    fprintf(stderr, "  -w nnn            Run the CPU scaling benchmark with 1 to nnn workers.\n");
     fprintf(stderr, "  -d ppp uuu dir    Run connection ddoss for ppp packets, uuu usec intervals,\n");
     fprintf(stderr, "                    logs in dir. No logs if dir=\"-\"");
     fprintf(stderr, "  -n                Disable debug prints.\n");
@@ -330,10 +360,12 @@ int main(int argc, char** argv)
     int do_stress = 0;
     int do_cnx_stress = 0;
     int do_cnx_ddos = 0;
+    int do_cpu_scaling = 0;
     int disable_debug = 0;
     int retry_failed_test = 0;
     int cnx_stress_minutes = 0;
     int cnx_stress_nb_cnx = 0;
+    int cpu_scaling_workers = 0;
     int cnx_ddos_packets = 0;
     int cnx_ddos_interval = 0;
     char const* cnx_ddos_dir = NULL;
@@ -345,7 +377,7 @@ int main(int argc, char** argv)
     }
     else
     {
-        while (ret == 0 && (opt = getopt(argc, argv, "f:s:c:d:S:x:nrh")) != -1) {
+        while (ret == 0 && (opt = getopt(argc, argv, "f:s:c:d:w:S:x:nrh")) != -1) {
             switch (opt) {
             case 'x': {
                 int test_number = get_test_number(optarg);
@@ -411,6 +443,14 @@ int main(int argc, char** argv)
                     ret = usage(argv[0]);
                 }
                 break;
+            case 'w':
+                do_cpu_scaling = 1;
+                cpu_scaling_workers = atoi(optarg);
+                if (cpu_scaling_workers <= 0) {
+                    fprintf(stderr, "Incorrect number of workers: %s\n", optarg);
+                    ret = usage(argv[0]);
+                }
+                break;
             case 'S':
                 picoquic_set_solution_dir(optarg);
                 break;
@@ -437,7 +477,7 @@ int main(int argc, char** argv)
             debug_printf_push_stream(stderr);
         }
 
-        if (ret == 0 && (do_stress || do_fuzz || do_cnx_stress || do_cnx_ddos)) {
+        if (ret == 0 && (do_stress || do_fuzz || do_cnx_stress || do_cnx_ddos || do_cpu_scaling)) {
             if (optind >= argc && found_exclusion == 0) {
                 for (size_t i = 0; i < nb_tests; i++) {
                     if (strcmp(test_table[i].test_name, "stress") == 0)
@@ -461,6 +501,11 @@ int main(int argc, char** argv)
                             test_status[i] = test_excluded;
                         }
                     }
+                    else if (strcmp(test_table[i].test_name, "cpu_scaling") == 0) {
+                        if (do_cpu_scaling == 0) {
+                            test_status[i] = test_excluded;
+                        }
+                    }
                     else {
                         test_status[i] = test_excluded;
                     }
@@ -496,6 +541,16 @@ int main(int argc, char** argv)
                                 test_status[i] = test_success;
                             }
                         }
+                        else if (do_cpu_scaling && strcmp(test_table[i].test_name, "cpu_scaling") == 0) {
+                            if (cpu_scaling_do_test(cpu_scaling_workers, 1000, 10000000, 1) != 0) {
+                                test_status[i] = test_failed;
+                                nb_test_failed++;
+                                ret = -1;
+                            }
+                            else {
+                                test_status[i] = test_success;
+                            }
+                        }
                         else if (do_one_test(i, stdout) != 0) {
                             test_status[i] = test_failed;
                             nb_test_failed++;
@@ -505,7 +560,7 @@ int main(int argc, char** argv)
                             test_status[i] = test_success;
                         }
                     }
-                    else if (!(do_cnx_stress || do_fuzz || do_stress || do_cnx_ddos)) {
+                    else if (!(do_cnx_stress || do_fuzz || do_stress || do_cnx_ddos || do_cpu_scaling)) {
                         fprintf(stdout, "Test number %d (%s) is bypassed.\n", (int)i, test_table[i].test_name);
                     }
                 }
@@ -185,6 +185,9 @@ int quic_server(const char* server_name, int server_port,
                 picoquic_set_cookie_mode(qserver, 2);
             }
             qserver->mtu_max = mtu_max;
+            if (mtu_max > PICOQUIC_MAX_PACKET_SIZE) {
+                (void)picoquic_set_max_packet_size(qserver, mtu_max);
+            }
 
             if (cc_algorithm == NULL) {
                 cc_algorithm = picoquic_bbr_algorithm;
@@ -550,6 +553,9 @@ int quic_client(const char* ip_address_text, int server_port,
                 qclient->client_zero_share = 1;
             }
             qclient->mtu_max = mtu_max;
+            if (mtu_max > PICOQUIC_MAX_PACKET_SIZE) {
+                (void)picoquic_set_max_packet_size(qclient, mtu_max);
+            }
 
             (void)picoquic_set_default_connection_id_length(qclient, (uint8_t)client_cnx_id_length);
 
@@ -1055,7 +1061,7 @@ int main(int argc, char** argv)
             break;
         case 'm':
             mtu_max = atoi(optarg);
-            if (mtu_max <= 0 || mtu_max > PICOQUIC_MAX_PACKET_SIZE) {
+            if (mtu_max <= 0 || mtu_max > PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
                 fprintf(stderr, "Invalid max mtu: %s\n", optarg);
                 usage();
             }
@@ -529,6 +529,83 @@ int cleartext_pn_enc_test()
     return ret;
 }
 
+/* Verify that the batched computation of header protection masks,
+ * using either the ECB or the CTR context, produces the same masks
+ * as the packet per packet computation.
+ */
+int pn_enc_batch_test()
+{
+    int ret = 0;
+    struct sockaddr_in test_addr_c;
+    picoquic_cnx_t* cnx_client = NULL;
+    picoquic_quic_t* qclient = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (qclient == NULL) {
+        DBG_PRINTF("%s", "Could not create Quic context.\n");
+        ret = -1;
+    }
+    else {
+        memset(&test_addr_c, 0, sizeof(struct sockaddr_in));
+        test_addr_c.sin_family = AF_INET;
+        memcpy(&test_addr_c.sin_addr, addr1, 4);
+        test_addr_c.sin_port = 12345;
+
+        cnx_client = picoquic_create_cnx(qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test_addr_c, 0, 0, NULL, PICOQUIC_TEST_ALPN, 1);
+        if (cnx_client == NULL) {
+            DBG_PRINTF("%s", "Could not create client connection context.\n");
+            ret = -1;
+        }
+        else if (cnx_client->crypto_context[picoquic_epoch_initial].pn_enc == NULL ||
+            cnx_client->crypto_context[picoquic_epoch_initial].pn_enc_ecb == NULL) {
+            DBG_PRINTF("%s", "Initial HP contexts not set.\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        uint8_t sample_bytes[PICOQUIC_HP_BATCH_MAX * PICOQUIC_HP_SAMPLE_SIZE];
+        const uint8_t* samples[PICOQUIC_HP_BATCH_MAX];
+        uint8_t masks_ecb[PICOQUIC_HP_BATCH_MAX * PICOQUIC_HP_SAMPLE_SIZE];
+        uint8_t masks_ctr[PICOQUIC_HP_BATCH_MAX * PICOQUIC_HP_SAMPLE_SIZE];
+        void* pn_enc = cnx_client->crypto_context[picoquic_epoch_initial].pn_enc;
+        void* pn_ecb = cnx_client->crypto_context[picoquic_epoch_initial].pn_enc_ecb;
+
+        picoquic_public_random(sample_bytes, sizeof(sample_bytes));
+        for (size_t i = 0; i < PICOQUIC_HP_BATCH_MAX; i++) {
+            samples[i] = sample_bytes + i * PICOQUIC_HP_SAMPLE_SIZE;
+        }
+
+        picoquic_pn_encrypt_batch(pn_enc, pn_ecb, samples, masks_ecb, PICOQUIC_HP_BATCH_MAX);
+        picoquic_pn_encrypt_batch(pn_enc, NULL, samples, masks_ctr, PICOQUIC_HP_BATCH_MAX);
+
+        for (size_t i = 0; ret == 0 && i < PICOQUIC_HP_BATCH_MAX; i++) {
+            uint8_t mask_one[5] = { 0, 0, 0, 0, 0 };
+
+            picoquic_pn_encrypt(pn_enc, samples[i], mask_one, mask_one, sizeof(mask_one));
+            if (memcmp(mask_one, masks_ecb + i * PICOQUIC_HP_SAMPLE_SIZE, sizeof(mask_one)) != 0) {
+                DBG_PRINTF("ECB batch mask differs for sample %zu\n", i);
+                ret = -1;
+            }
+            else if (memcmp(mask_one, masks_ctr + i * PICOQUIC_HP_SAMPLE_SIZE, sizeof(mask_one)) != 0) {
+                DBG_PRINTF("CTR batch mask differs for sample %zu\n", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (cnx_client != NULL) {
+        picoquic_delete_cnx(cnx_client);
+    }
+
+    if (qclient != NULL) {
+        picoquic_free(qclient);
+    }
+
+    return ret;
+}
+
 /* Test vector copied from Kazuho Ohu's test code in quicly -- then changed */
 
 int cleartext_pn_vector_test()
@@ -1437,4 +1514,405 @@ int cid_for_lb_test()
         }
     }
     return ret;
-}
\ No newline at end of file
+}
+
+/* Check that the pool of prepared connection IDs is used when creating
+ * local CIDs, that the pooled reset secrets are correct, and that the
+ * pool is renewed when the CID generation policy changes.
+ */
+int cnxid_pool_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_cnx_t* cnx = NULL;
+    struct sockaddr_in test_addr_s;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    memset(&test_addr_s, 0, sizeof(struct sockaddr_in));
+    test_addr_s.sin_family = AF_INET;
+    memcpy(&test_addr_s.sin_addr, addr2, 4);
+    test_addr_s.sin_port = 4433;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Could not create the quic context.");
+        ret = -1;
+    }
+    else if ((ret = picoquic_set_cnxid_pool_size(quic, 4)) == 0) {
+        picoquic_refill_cnxid_pool(quic);
+        if (quic->cnxid_pool_count != 4) {
+            DBG_PRINTF("Pool has %zu CID instead of 4", quic->cnxid_pool_count);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_cnxid_pool_item_t expected = quic->cnxid_pool[3];
+        uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
+
+        cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test_addr_s, simulated_time, 0, NULL, NULL, 1);
+
+        if (cnx == NULL || cnx->path[0]->p_local_cnxid == NULL) {
+            DBG_PRINTF("%s", "Could not create the connection");
+            ret = -1;
+        }
+        else if (quic->cnxid_pool_count != 3 ||
+            picoquic_compare_connection_id(&cnx->path[0]->p_local_cnxid->cnx_id, &expected.cnx_id) != 0) {
+            DBG_PRINTF("%s", "Local CID was not taken from the pool");
+            ret = -1;
+        }
+        else if (picoquic_create_cnxid_reset_secret(quic, &expected.cnx_id, reset_secret) != 0 ||
+            memcmp(reset_secret, cnx->path[0]->p_local_cnxid->reset_secret, PICOQUIC_RESET_SECRET_SIZE) != 0) {
+            DBG_PRINTF("%s", "Pooled reset secret does not match");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Changing the CID policy makes the pooled values obsolete */
+        picoquic_cnxid_pool_item_t expected;
+
+        if (cnx != NULL) {
+            picoquic_delete_cnx(cnx);
+            cnx = NULL;
+        }
+
+        if ((ret = picoquic_lb_compat_cid_config(quic, &cid_for_lb_test_config[0])) != 0) {
+            DBG_PRINTF("%s", "Could not configure the CID policy");
+        }
+        else {
+            picoquic_refill_cnxid_pool(quic);
+            expected = quic->cnxid_pool[quic->cnxid_pool_count - 1];
+            if (quic->cnxid_pool_count != 4 || quic->cnxid_pool_cb_fn != picoquic_lb_compat_cid_generate ||
+                expected.cnx_id.id_len != quic->local_cnxid_length ||
+                picoquic_lb_compat_cid_verify(quic, quic->cnx_id_callback_ctx, &expected.cnx_id) !=
+                cid_for_lb_test_config[0].server_id64) {
+                DBG_PRINTF("%s", "Pool not renewed after the CID policy change");
+                ret = -1;
+            }
+            picoquic_lb_compat_cid_config_free(quic);
+            if (ret == 0 && quic->cnxid_pool_count != 0) {
+                DBG_PRINTF("%s", "Pool not emptied when the CID policy is freed");
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* A large pool is filled in several batches */
+        if ((ret = picoquic_set_cnxid_pool_size(quic, 2 * PICOQUIC_CNXID_POOL_REFILL_MAX + 1)) == 0) {
+            picoquic_refill_cnxid_pool(quic);
+            if (quic->cnxid_pool_count != PICOQUIC_CNXID_POOL_REFILL_MAX) {
+                DBG_PRINTF("Pool has %zu CID after one refill", quic->cnxid_pool_count);
+                ret = -1;
+            }
+            else {
+                picoquic_refill_cnxid_pool(quic);
+                picoquic_refill_cnxid_pool(quic);
+                if (quic->cnxid_pool_count != quic->cnxid_pool_size) {
+                    DBG_PRINTF("Pool has %zu CID after three refills", quic->cnxid_pool_count);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Benchmark of the AEAD engines used for packet protection.
+ * Measures the encryption and decryption throughput for 1-RTT packets
+ * of typical size, with the default provider (OpenSSL) and with the
+ * fusion engine if the CPU supports it. Packets encrypted with one
+ * engine are also checked to decrypt with the other.
+ */
+#define AEAD_BENCH_PACKET_SIZE 1252
+#define AEAD_BENCH_HEADER_SIZE 24
+#define AEAD_BENCH_NB_PACKETS 20000
+
+static int aead_bench_one(const uint8_t* secret, char const* engine_name, uint8_t* protected_packet, size_t* protected_length)
+{
+    int ret = 0;
+    uint8_t packet[AEAD_BENCH_PACKET_SIZE];
+    uint8_t encrypted[AEAD_BENCH_PACKET_SIZE + 32];
+    uint8_t decrypted[AEAD_BENCH_PACKET_SIZE + 32];
+    size_t payload_length = AEAD_BENCH_PACKET_SIZE - AEAD_BENCH_HEADER_SIZE - 16;
+    size_t encrypted_length = 0;
+    size_t decrypted_length = 0;
+    void* aead_encrypt = picoquic_setup_test_aead_context(1, secret);
+    void* aead_decrypt = picoquic_setup_test_aead_context(0, secret);
+
+    for (size_t i = 0; i < sizeof(packet); i++) {
+        packet[i] = (uint8_t)i;
+    }
+
+    if (aead_encrypt == NULL || aead_decrypt == NULL) {
+        DBG_PRINTF("Cannot create the %s AEAD contexts", engine_name);
+        ret = -1;
+    }
+    else {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t encrypt_time;
+        uint64_t decrypt_time;
+        double nb_bits = 8.0 * (double)payload_length * (double)AEAD_BENCH_NB_PACKETS;
+
+        for (uint64_t pn = 0; pn < AEAD_BENCH_NB_PACKETS; pn++) {
+            encrypted_length = picoquic_aead_encrypt_generic(encrypted + AEAD_BENCH_HEADER_SIZE,
+                packet + AEAD_BENCH_HEADER_SIZE, payload_length, pn, packet, AEAD_BENCH_HEADER_SIZE, aead_encrypt);
+        }
+        encrypt_time = picoquic_current_time();
+        memcpy(encrypted, packet, AEAD_BENCH_HEADER_SIZE);
+
+        for (int i = 0; ret == 0 && i < AEAD_BENCH_NB_PACKETS; i++) {
+            /* Always decrypt the last packet, so the authentication succeeds */
+            decrypted_length = picoquic_aead_decrypt_generic(decrypted, encrypted + AEAD_BENCH_HEADER_SIZE,
+                encrypted_length, AEAD_BENCH_NB_PACKETS - 1, encrypted, AEAD_BENCH_HEADER_SIZE, aead_decrypt);
+            if (decrypted_length != payload_length) {
+                DBG_PRINTF("%s decryption fails, length %zu instead of %zu", engine_name, decrypted_length, payload_length);
+                ret = -1;
+            }
+        }
+        decrypt_time = picoquic_current_time();
+
+        if (ret == 0 && memcmp(decrypted, packet + AEAD_BENCH_HEADER_SIZE, payload_length) != 0) {
+            DBG_PRINTF("%s decryption does not match", engine_name);
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            DBG_PRINTF("%s: %d packets of %d bytes, encrypt %.2f Gbps, decrypt %.2f Gbps", engine_name,
+                AEAD_BENCH_NB_PACKETS, AEAD_BENCH_PACKET_SIZE,
+                nb_bits / (1000.0 * (double)(encrypt_time - start_time + 1)),
+                nb_bits / (1000.0 * (double)(decrypt_time - encrypt_time + 1)));
+        }
+
+        if (ret == 0 && protected_packet != NULL) {
+            if (*protected_length == 0) {
+                /* Keep the packet, so it can be decrypted by the next engine */
+                memcpy(protected_packet, encrypted, AEAD_BENCH_HEADER_SIZE + encrypted_length);
+                *protected_length = AEAD_BENCH_HEADER_SIZE + encrypted_length;
+            }
+            else {
+                decrypted_length = picoquic_aead_decrypt_generic(decrypted, protected_packet + AEAD_BENCH_HEADER_SIZE,
+                    *protected_length - AEAD_BENCH_HEADER_SIZE, AEAD_BENCH_NB_PACKETS - 1,
+                    protected_packet, AEAD_BENCH_HEADER_SIZE, aead_decrypt);
+                if (decrypted_length != payload_length ||
+                    memcmp(decrypted, packet + AEAD_BENCH_HEADER_SIZE, payload_length) != 0) {
+                    DBG_PRINTF("%s cannot decrypt the packet of the previous engine", engine_name);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (aead_encrypt != NULL) {
+        picoquic_aead_free(aead_encrypt);
+    }
+
+    if (aead_decrypt != NULL) {
+        picoquic_aead_free(aead_decrypt);
+    }
+
+    return ret;
+}
+
+int aead_bench_test()
+{
+    int ret = 0;
+    uint8_t secret[32];
+    uint8_t protected_packet[AEAD_BENCH_PACKET_SIZE + 32];
+    size_t protected_length = 0;
+
+    for (size_t i = 0; i < sizeof(secret); i++) {
+        secret[i] = (uint8_t)(0xA5 + i);
+    }
+
+    (void)picoquic_set_fusion_enabled(0);
+    ret = aead_bench_one(secret, "openssl", protected_packet, &protected_length);
+
+    if (picoquic_set_fusion_enabled(1)) {
+        if (ret == 0) {
+            ret = aead_bench_one(secret, "fusion", protected_packet, &protected_length);
+        }
+    }
+    else {
+        DBG_PRINTF("%s", "Fusion is not supported on this CPU");
+    }
+
+    return ret;
+}
+
+/*
+ * Check that the server decrypts new Initial packets before creating
+ * a connection context: packets that fail decryption do not create a
+ * context, and valid packets create a context that inherits the keys.
+ * Also report the rate at which invalid Initials are rejected.
+ */
+#define INITIAL_VALIDATION_NB_BENCH 1000
+
+int initial_validation_test()
+{
+    int ret = 0;
+    uint8_t client_packet[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t incoming[PICOQUIC_MAX_PACKET_SIZE];
+    size_t client_length = 0;
+    struct sockaddr_in test_addr_c, test_addr_s;
+    struct sockaddr_storage addr_to, addr_from;
+    int if_index = 0;
+    picoquic_cnx_t* cnx_client = NULL;
+    picoquic_quic_t* qclient = NULL;
+    picoquic_quic_t* qserver = NULL;
+    char test_server_cert_file[512];
+    char test_server_key_file[512];
+    char test_server_cert_store_file[512];
+
+    memset(&test_addr_c, 0, sizeof(struct sockaddr_in));
+    test_addr_c.sin_family = AF_INET;
+    memcpy(&test_addr_c.sin_addr, addr1, 4);
+    test_addr_c.sin_port = 12345;
+    memset(&test_addr_s, 0, sizeof(struct sockaddr_in));
+    test_addr_s.sin_family = AF_INET;
+    memcpy(&test_addr_s.sin_addr, addr2, 4);
+    test_addr_s.sin_port = 4433;
+
+    ret = picoquic_get_input_path(test_server_cert_file, sizeof(test_server_cert_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT);
+
+    if (ret == 0) {
+        ret = picoquic_get_input_path(test_server_key_file, sizeof(test_server_key_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY);
+    }
+
+    if (ret == 0) {
+        ret = picoquic_get_input_path(test_server_cert_store_file, sizeof(test_server_cert_store_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_CERT_STORE);
+    }
+
+    if (ret != 0) {
+        DBG_PRINTF("%s", "Cannot set the cert, key or store file names.\n");
+    }
+    else {
+        qclient = picoquic_create(8, NULL, NULL, test_server_cert_store_file, NULL, NULL, NULL,
+            NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        qserver = picoquic_create(8,
+            test_server_cert_file, test_server_key_file, test_server_cert_store_file,
+            "test", NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+        if (qclient == NULL || qserver == NULL) {
+            DBG_PRINTF("%s", "Could not create Quic contexts.\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        cnx_client = picoquic_create_cnx(qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test_addr_s, 0, 0, PICOQUIC_TEST_SNI, "test", 1);
+        if (cnx_client == NULL) {
+            DBG_PRINTF("%s", "Could not create client connection context.\n");
+            ret = -1;
+        }
+        else if ((ret = picoquic_start_client_cnx(cnx_client)) == 0) {
+            ret = picoquic_prepare_packet(cnx_client, 0, client_packet, sizeof(client_packet), &client_length,
+                &addr_to, &addr_from, &if_index);
+            if (ret == 0 && client_length < PICOQUIC_ENFORCED_INITIAL_MTU) {
+                DBG_PRINTF("Client Initial is too short: %zu", client_length);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* An Initial that does not decrypt shall not create a context */
+        picoquic_packet_header ph;
+        picoquic_cnx_t* cnx = NULL;
+        size_t consumed = 0;
+        int new_context_created = 0;
+        int r;
+
+        memcpy(incoming, client_packet, client_length);
+        incoming[client_length - 1] ^= 0x01;
+        r = picoquic_parse_header_and_decrypt(qserver, incoming, client_length, client_length,
+            (struct sockaddr*)&test_addr_c, 0, &ph, &cnx, &consumed, &new_context_created);
+        if (r == 0 || cnx != NULL || new_context_created || qserver->cnx_list != NULL) {
+            DBG_PRINTF("Corrupted Initial accepted, ret = 0x%x", r);
+            ret = -1;
+        }
+        else {
+            /* The valid Initial creates a context that reuses the cached keys */
+            memcpy(incoming, client_packet, client_length);
+            r = picoquic_parse_header_and_decrypt(qserver, incoming, client_length, client_length,
+                (struct sockaddr*)&test_addr_c, 0, &ph, &cnx, &consumed, &new_context_created);
+            if (r != 0 || cnx == NULL || !new_context_created) {
+                DBG_PRINTF("Valid Initial rejected, ret = 0x%x", r);
+                ret = -1;
+            }
+            else if (cnx->crypto_context[picoquic_epoch_initial].aead_decrypt == NULL ||
+                cnx->crypto_context[picoquic_epoch_initial].pn_dec == NULL ||
+                qserver->initial_validation == NULL) {
+                DBG_PRINTF("%s", "Initial keys not handed to the connection");
+                ret = -1;
+            }
+            else if (ph.pn64 != 0 || memcmp(incoming + ph.offset, client_packet + ph.offset, 16) == 0) {
+                DBG_PRINTF("Initial not decrypted, pn = %" PRIu64, ph.pn64);
+                ret = -1;
+            }
+
+            if (cnx != NULL) {
+                picoquic_delete_cnx(cnx);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Flood of Initials with random CID: each requires a new key derivation, none creates a context */
+        uint64_t random_context = 0xdeadbeefcafe;
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+        size_t dcid_len = client_packet[5];
+
+        for (int i = 0; ret == 0 && i < INITIAL_VALIDATION_NB_BENCH; i++) {
+            picoquic_packet_header ph;
+            picoquic_cnx_t* cnx = NULL;
+            size_t consumed = 0;
+            int new_context_created = 0;
+
+            memcpy(incoming, client_packet, client_length);
+            for (size_t j = 0; j < dcid_len && j < 8; j++) {
+                incoming[6 + j] = (uint8_t)picoquic_test_random(&random_context);
+            }
+            if (picoquic_parse_header_and_decrypt(qserver, incoming, client_length, client_length,
+                (struct sockaddr*)&test_addr_c, 0, &ph, &cnx, &consumed, &new_context_created) == 0 ||
+                cnx != NULL || qserver->cnx_list != NULL) {
+                DBG_PRINTF("Random Initial %d accepted", i);
+                ret = -1;
+            }
+        }
+        duration = picoquic_current_time() - start_time;
+
+        if (ret == 0) {
+            DBG_PRINTF("Rejected %d invalid Initials in %" PRIu64 " us, %.0f per second",
+                INITIAL_VALIDATION_NB_BENCH, duration, 1000000.0 * INITIAL_VALIDATION_NB_BENCH / (double)(duration + 1));
+        }
+    }
+
+    if (cnx_client != NULL) {
+        picoquic_delete_cnx(cnx_client);
+    }
+
+    if (qclient != NULL) {
+        picoquic_free(qclient);
+    }
+
+    if (qserver != NULL) {
+        picoquic_free(qserver);
+    }
+
+    return ret;
+}
@@ -938,6 +938,42 @@ int cnx_stress_do_test(uint64_t duration, int nb_clients, int do_report)
     return ret;
 }
 
+/* Run one instance of the cnx stress test, without checking the wall time,
+ * and return the number of connections and messages processed. This is used
+ * by the CPU scaling benchmark, which runs several instances in parallel. */
+int cnx_stress_do_instance(uint64_t duration, int nb_clients, int* nb_connections, int* nb_messages)
+{
+    int ret = 0;
+    cnx_stress_ctx_t* stress_ctx = cnx_stress_create_ctx(duration, nb_clients);
+
+    *nb_connections = 0;
+    *nb_messages = 0;
+
+    if (stress_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        while (ret == 0 && stress_ctx->simulated_time < duration) {
+            ret = cnx_stress_loop_step(stress_ctx);
+        }
+
+        if (ret == 0 && (stress_ctx->nb_servers != stress_ctx->nb_client_target ||
+            stress_ctx->nb_messages_received != stress_ctx->nb_messages_target)) {
+            DBG_PRINTF("Expected %d connections and %d messages, got %d and %d",
+                stress_ctx->nb_client_target, stress_ctx->nb_messages_target,
+                stress_ctx->nb_servers, stress_ctx->nb_messages_received);
+            ret = -1;
+        }
+
+        *nb_connections = stress_ctx->nb_servers;
+        *nb_messages = stress_ctx->nb_messages_received;
+
+        cnx_stress_delete_ctx(stress_ctx);
+    }
+
+    return ret;
+}
+
 /* The unit test entry point executes the cnx stress test with a 
  * small duration and a small number of clients, the goal being to check that
  * the cnx stress code actually works. */
@@ -0,0 +1,275 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2021, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* CPU scaling benchmark.
+ *
+ * Each worker thread runs its own instances of the client and server
+ * QUIC contexts, connected by simulated links. Nothing is shared between
+ * the workers, so the aggregate throughput should grow linearly with the
+ * number of workers until the cores are exhausted. Deviations from linear
+ * growth point at shared state or at memory bandwidth limits.
+ *
+ * For each number of workers, the benchmark runs two phases:
+ *
+ * - the connection phase runs one cnx stress instance per worker. Each
+ *   instance establishes a number of connections and exchanges one message
+ *   per connection, from which we compute handshakes and requests per second.
+ * - the bulk phase runs one netperf scenario per worker, in which the server
+ *   sends a large response, from which we compute the aggregate Gbps.
+ *
+ * The rates are computed from the wall clock time of the phase, which
+ * includes the time needed to create and delete the QUIC contexts.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "picoquic_internal.h"
+#include "picoquictest.h"
+#include "picoquictest_internal.h"
+
+#define CPU_SCALING_WAIT 100000 /* microseconds */
+
+typedef enum {
+    cpu_scaling_phase_connections = 0,
+    cpu_scaling_phase_bulk
+} cpu_scaling_phase_enum;
+
+typedef struct st_cpu_scaling_worker_t {
+    struct st_cpu_scaling_ctx_t* scaling_ctx;
+    picoquic_thread_t thread;
+    int is_started;
+    int ret;
+    int nb_connections;
+    int nb_messages;
+    uint64_t nb_bytes;
+} cpu_scaling_worker_t;
+
+typedef struct st_cpu_scaling_ctx_t {
+    picoquic_mutex_t mutex;
+    picoquic_event_t done_event;
+    cpu_scaling_phase_enum phase;
+    int nb_clients;
+    uint64_t bulk_bytes;
+    int nb_done;
+} cpu_scaling_ctx_t;
+
+typedef struct st_cpu_scaling_result_t {
+    int nb_workers;
+    double handshakes_per_second;
+    double requests_per_second;
+    double bulk_gbps;
+} cpu_scaling_result_t;
+
+static picoquic_thread_return_t cpu_scaling_worker_thread(void* arg)
+{
+    cpu_scaling_worker_t* worker = (cpu_scaling_worker_t*)arg;
+    cpu_scaling_ctx_t* scaling_ctx = worker->scaling_ctx;
+
+    if (scaling_ctx->phase == cpu_scaling_phase_connections) {
+        /* Same ratio of simulated duration to number of clients as the cnx stress unit test */
+        uint64_t duration = ((uint64_t)scaling_ctx->nb_clients) * 1200000ull;
+
+        worker->ret = cnx_stress_do_instance(duration, scaling_ctx->nb_clients,
+            &worker->nb_connections, &worker->nb_messages);
+    }
+    else {
+        test_api_stream_desc_t scenario[] = { { 4, 0, 257, 0 } };
+
+        scenario[0].r_len = (size_t)scaling_ctx->bulk_bytes;
+        worker->ret = netperf_one_scenario(scenario, sizeof(scenario), picoquic_bbr_algorithm,
+            0, 0, 0, 0, 0, 0, NULL, NULL, 10 * PICOQUIC_MAX_PACKET_SIZE, 0);
+        if (worker->ret == 0) {
+            worker->nb_bytes = scaling_ctx->bulk_bytes;
+        }
+    }
+
+    (void)picoquic_lock_mutex(&scaling_ctx->mutex);
+    scaling_ctx->nb_done++;
+    (void)picoquic_unlock_mutex(&scaling_ctx->mutex);
+    (void)picoquic_signal_event(&scaling_ctx->done_event);
+
+    picoquic_thread_do_return;
+}
+
+/* Run one phase on the specified number of workers, and return the
+ * wall clock time elapsed until all workers are done. */
+static int cpu_scaling_run_phase(cpu_scaling_ctx_t* scaling_ctx, cpu_scaling_worker_t* workers, int nb_workers,
+    cpu_scaling_phase_enum phase, uint64_t* elapsed)
+{
+    int ret = 0;
+    int nb_started = 0;
+    int is_complete = 0;
+    uint64_t start_time = picoquic_current_time();
+
+    scaling_ctx->phase = phase;
+    scaling_ctx->nb_done = 0;
+    memset(workers, 0, sizeof(cpu_scaling_worker_t) * nb_workers);
+
+    for (int i = 0; ret == 0 && i < nb_workers; i++) {
+        workers[i].scaling_ctx = scaling_ctx;
+        if ((ret = picoquic_create_thread(&workers[i].thread, cpu_scaling_worker_thread, &workers[i])) == 0) {
+            workers[i].is_started = 1;
+            nb_started++;
+        }
+        else {
+            DBG_PRINTF("Cannot start worker %d, ret = %d", i, ret);
+        }
+    }
+
+    /* Wait for the started workers to finish before joining them, because on
+     * Windows the thread deletion only waits for a short time. */
+    while (!is_complete) {
+        (void)picoquic_lock_mutex(&scaling_ctx->mutex);
+        is_complete = (scaling_ctx->nb_done >= nb_started);
+        (void)picoquic_unlock_mutex(&scaling_ctx->mutex);
+
+        if (!is_complete) {
+            (void)picoquic_wait_for_event(&scaling_ctx->done_event, CPU_SCALING_WAIT);
+        }
+    }
+
+    *elapsed = picoquic_current_time() - start_time;
+
+    for (int i = 0; i < nb_workers; i++) {
+        if (workers[i].is_started) {
+            picoquic_delete_thread(&workers[i].thread);
+            workers[i].is_started = 0;
+            if (workers[i].ret != 0) {
+                DBG_PRINTF("Worker %d fails in phase %d, ret = %d", i, (int)phase, workers[i].ret);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int cpu_scaling_measure(cpu_scaling_ctx_t* scaling_ctx, cpu_scaling_worker_t* workers, int nb_workers,
+    cpu_scaling_result_t* result)
+{
+    uint64_t elapsed = 0;
+    int ret = cpu_scaling_run_phase(scaling_ctx, workers, nb_workers, cpu_scaling_phase_connections, &elapsed);
+
+    memset(result, 0, sizeof(cpu_scaling_result_t));
+    result->nb_workers = nb_workers;
+
+    if (ret == 0) {
+        uint64_t nb_connections = 0;
+        uint64_t nb_messages = 0;
+        double seconds = (elapsed > 0) ? ((double)elapsed) / 1000000.0 : 0.000001;
+
+        for (int i = 0; i < nb_workers; i++) {
+            nb_connections += workers[i].nb_connections;
+            nb_messages += workers[i].nb_messages;
+        }
+        result->handshakes_per_second = ((double)nb_connections) / seconds;
+        result->requests_per_second = ((double)nb_messages) / seconds;
+
+        ret = cpu_scaling_run_phase(scaling_ctx, workers, nb_workers, cpu_scaling_phase_bulk, &elapsed);
+    }
+
+    if (ret == 0) {
+        uint64_t nb_bytes = 0;
+        double seconds = (elapsed > 0) ? ((double)elapsed) / 1000000.0 : 0.000001;
+
+        for (int i = 0; i < nb_workers; i++) {
+            nb_bytes += workers[i].nb_bytes;
+        }
+        result->bulk_gbps = ((double)nb_bytes) * 8.0 / (seconds * 1000000000.0);
+    }
+
+    return ret;
+}
+
+/* Run the benchmark for 1, 2, 4, ... up to max_workers workers, and
+ * print the scaling table if do_report is set. */
+int cpu_scaling_do_test(int max_workers, int nb_clients, uint64_t bulk_bytes, int do_report)
+{
+    int ret = 0;
+    int nb_results = 0;
+    cpu_scaling_ctx_t scaling_ctx;
+    cpu_scaling_worker_t* workers = NULL;
+    cpu_scaling_result_t* results = NULL;
+
+    memset(&scaling_ctx, 0, sizeof(cpu_scaling_ctx_t));
+    scaling_ctx.nb_clients = nb_clients;
+    scaling_ctx.bulk_bytes = bulk_bytes;
+
+    if (max_workers <= 0 || nb_clients <= 0 || bulk_bytes == 0) {
+        ret = -1;
+    }
+    else if ((workers = (cpu_scaling_worker_t*)malloc(sizeof(cpu_scaling_worker_t) * max_workers)) == NULL ||
+        (results = (cpu_scaling_result_t*)malloc(sizeof(cpu_scaling_result_t) * max_workers)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((ret = picoquic_create_mutex(&scaling_ctx.mutex)) == 0) {
+        if ((ret = picoquic_create_event(&scaling_ctx.done_event)) == 0) {
+            int nb_workers = 1;
+
+            while (ret == 0 && nb_workers <= max_workers) {
+                ret = cpu_scaling_measure(&scaling_ctx, workers, nb_workers, &results[nb_results]);
+                if (ret == 0) {
+                    nb_results++;
+                }
+                if (nb_workers < max_workers && 2 * nb_workers > max_workers) {
+                    nb_workers = max_workers;
+                }
+                else {
+                    nb_workers *= 2;
+                }
+            }
+            picoquic_delete_event(&scaling_ctx.done_event);
+        }
+        (void)picoquic_delete_mutex(&scaling_ctx.mutex);
+    }
+
+    if (ret == 0 && do_report) {
+        fprintf(stdout, "CPU scaling, %d connections and %" PRIu64 " bulk bytes per worker:\n", nb_clients, bulk_bytes);
+        fprintf(stdout, "%8s %14s %14s %10s %8s\n", "workers", "handshakes/s", "requests/s", "bulk Gbps", "speedup");
+        for (int i = 0; i < nb_results; i++) {
+            double speedup = (results[0].handshakes_per_second > 0) ?
+                results[i].handshakes_per_second / results[0].handshakes_per_second : 0;
+            fprintf(stdout, "%8d %14.1f %14.1f %10.3f %8.2f\n", results[i].nb_workers,
+                results[i].handshakes_per_second, results[i].requests_per_second, results[i].bulk_gbps, speedup);
+        }
+    }
+
+    if (workers != NULL) {
+        free(workers);
+    }
+    if (results != NULL) {
+        free(results);
+    }
+
+    return ret;
+}
+
+/* The unit test runs the benchmark with two workers and small
+ * workloads, to check that the workers run correctly in parallel. */
+int cpu_scaling_test()
+{
+    return cpu_scaling_do_test(2, 20, 100000, 0);
+}
@@ -0,0 +1,436 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2021, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picoquictest_internal.h"
+
+/* Unit tests of the datagram sending logic, without a simulated network. */
+
+static picoquic_cnx_t* datagram_test_create_cnx(picoquic_quic_t** quic, uint64_t* simulated_time)
+{
+    picoquic_cnx_t* cnx = NULL;
+    struct sockaddr_in saddr;
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    *quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, *simulated_time, simulated_time, NULL, NULL, 0);
+
+    if (*quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+    }
+    else if ((cnx = picoquic_create_cnx(*quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&saddr, *simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+    }
+    else {
+        cnx->remote_parameters.max_datagram_frame_size = PICOQUIC_MAX_PACKET_SIZE;
+    }
+
+    return cnx;
+}
+
+/* Just in time datagrams: the application provides the datagram when
+ * the stack formats a packet.
+ */
+typedef struct st_datagram_jit_test_ctx_t {
+    int nb_calls;
+    int nb_sent;
+    int nb_to_send;
+    int do_not_provide;
+    size_t datagram_length;
+    size_t last_space;
+} datagram_jit_test_ctx_t;
+
+static int datagram_jit_test_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+    datagram_jit_test_ctx_t* ctx = (datagram_jit_test_ctx_t*)callback_ctx;
+    int ret = 0;
+
+    if (fin_or_event == picoquic_callback_prepare_datagram) {
+        ctx->nb_calls++;
+        ctx->last_space = length;
+        if (!ctx->do_not_provide) {
+            size_t datagram_length = (ctx->datagram_length < length) ? ctx->datagram_length : length;
+            uint8_t* buffer = picoquic_provide_datagram_buffer(bytes, datagram_length, ctx->nb_sent + 1 < ctx->nb_to_send);
+
+            if (buffer == NULL) {
+                ret = -1;
+            }
+            else {
+                memset(buffer, (uint8_t)ctx->nb_sent, datagram_length);
+                ctx->nb_sent++;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int datagram_jit_test_check_frame(uint8_t* bytes, uint8_t* bytes_next, size_t expected_length, int rank)
+{
+    int ret = 0;
+    uint64_t length = 0;
+    const uint8_t* data;
+
+    if (bytes_next <= bytes || bytes[0] != picoquic_frame_type_datagram_l ||
+        (data = picoquic_frames_varint_decode(bytes + 1, bytes_next, &length)) == NULL ||
+        length != expected_length || data + length != bytes_next) {
+        DBG_PRINTF("Unexpected datagram frame #%d\n", rank);
+        ret = -1;
+    }
+    else {
+        for (size_t i = 0; i < length; i++) {
+            if (data[i] != (uint8_t)rank) {
+                DBG_PRINTF("Unexpected content in datagram #%d\n", rank);
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int datagram_jit_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = datagram_test_create_cnx(&quic, &simulated_time);
+    datagram_jit_test_ctx_t ctx;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.nb_to_send = 3;
+    ctx.datagram_length = 100;
+
+    if (cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_set_callback(cnx, datagram_jit_test_callback, &ctx);
+        ret = picoquic_mark_datagram_ready(cnx, 1);
+    }
+
+    /* The application is polled until it has no more datagrams to send */
+    while (ret == 0 && cnx->is_datagram_ready) {
+        int more_data = 0;
+        int is_pure_ack = 1;
+        uint8_t* bytes_next = picoquic_format_ready_datagram_frame(cnx, buffer, buffer + sizeof(buffer),
+            &more_data, &is_pure_ack, &ret);
+
+        if (ret == 0) {
+            ret = datagram_jit_test_check_frame(buffer, bytes_next, ctx.datagram_length, ctx.nb_sent - 1);
+        }
+        if (ret == 0 && (is_pure_ack || more_data != cnx->is_datagram_ready)) {
+            DBG_PRINTF("Unexpected flags after datagram #%d\n", ctx.nb_sent - 1);
+            ret = -1;
+        }
+        if (ret == 0 && ctx.nb_calls > ctx.nb_to_send) {
+            DBG_PRINTF("Too many calls: %d\n", ctx.nb_calls);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (ctx.nb_sent != ctx.nb_to_send || ctx.nb_calls != ctx.nb_to_send)) {
+        DBG_PRINTF("Sent %d datagrams in %d calls\n", ctx.nb_sent, ctx.nb_calls);
+        ret = -1;
+    }
+
+    /* The space offered to the application respects the peer's limit */
+    if (ret == 0) {
+        int more_data = 0;
+        int is_pure_ack = 1;
+        uint8_t* bytes_next;
+
+        cnx->remote_parameters.max_datagram_frame_size = 50;
+        ctx.nb_to_send = ctx.nb_sent + 1;
+        (void)picoquic_mark_datagram_ready(cnx, 1);
+        bytes_next = picoquic_format_ready_datagram_frame(cnx, buffer, buffer + sizeof(buffer),
+            &more_data, &is_pure_ack, &ret);
+        if (ret == 0 && (ctx.last_space + 2 != 50 ||
+            datagram_jit_test_check_frame(buffer, bytes_next, ctx.last_space, ctx.nb_sent - 1) != 0)) {
+            DBG_PRINTF("Unexpected space %d for max frame size 50\n", (int)ctx.last_space);
+            ret = -1;
+        }
+    }
+
+    /* If the application does not provide data, nothing is sent and the connection is no longer ready */
+    if (ret == 0) {
+        int more_data = 0;
+        int is_pure_ack = 1;
+        uint8_t* bytes_next;
+
+        ctx.do_not_provide = 1;
+        (void)picoquic_mark_datagram_ready(cnx, 1);
+        bytes_next = picoquic_format_ready_datagram_frame(cnx, buffer, buffer + sizeof(buffer),
+            &more_data, &is_pure_ack, &ret);
+        if (ret == 0 && (bytes_next != buffer || !is_pure_ack || more_data || cnx->is_datagram_ready)) {
+            DBG_PRINTF("%s", "Unexpected result when no datagram is provided\n");
+            ret = -1;
+        }
+    }
+
+    /* If the peer did not negotiate datagrams, the application is not polled */
+    if (ret == 0) {
+        int more_data = 0;
+        int is_pure_ack = 1;
+        int nb_calls = ctx.nb_calls;
+        uint8_t* bytes_next;
+
+        ctx.do_not_provide = 0;
+        cnx->remote_parameters.max_datagram_frame_size = 0;
+        (void)picoquic_mark_datagram_ready(cnx, 1);
+        bytes_next = picoquic_format_ready_datagram_frame(cnx, buffer, buffer + sizeof(buffer),
+            &more_data, &is_pure_ack, &ret);
+        if (ret == 0 && (bytes_next != buffer || !is_pure_ack || more_data || cnx->is_datagram_ready ||
+            ctx.nb_calls != nb_calls)) {
+            DBG_PRINTF("%s", "Datagram sent to a peer that does not support them\n");
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Queue of datagrams with priorities, deadlines and a bound on the queue size.
+ * Datagram number N is filled with the value N, so the order of transmission
+ * can be checked with datagram_jit_test_check_frame.
+ */
+static int datagram_queue_test_one(picoquic_cnx_t* cnx, uint8_t rank, uint8_t priority, uint64_t expire_time)
+{
+    uint8_t data[100];
+
+    memset(data, rank, sizeof(data));
+    return picoquic_queue_datagram_frame_ex(cnx, sizeof(data), data, priority, expire_time);
+}
+
+static int datagram_queue_test_send(picoquic_cnx_t* cnx, const int* expected, size_t nb_expected, uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+
+    for (size_t i = 0; ret == 0 && i < nb_expected; i++) {
+        int more_data = 0;
+        int is_pure_ack = 1;
+        uint8_t* bytes_next;
+
+        if (cnx->first_datagram == NULL) {
+            DBG_PRINTF("Queue empty before datagram #%d\n", expected[i]);
+            ret = -1;
+        }
+        else {
+            bytes_next = picoquic_format_first_datagram_frame(cnx, buffer, buffer + sizeof(buffer),
+                &more_data, &is_pure_ack, current_time);
+            ret = datagram_jit_test_check_frame(buffer, bytes_next, 100, expected[i]);
+        }
+    }
+
+    if (ret == 0 && (cnx->first_datagram != NULL || cnx->datagram_queue_bytes != 0)) {
+        DBG_PRINTF("%s", "Queue not empty after sending all datagrams\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int datagram_queue_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = datagram_test_create_cnx(&quic, &simulated_time);
+    picoquic_datagram_queue_stats_t stats;
+
+    if (cnx == NULL) {
+        ret = -1;
+    }
+
+    /* Datagrams are sent by priority class, then in order of arrival */
+    if (ret == 0) {
+        int expected[4] = { 1, 3, 2, 0 };
+
+        if ((ret = datagram_queue_test_one(cnx, 0, 5, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 1, 1, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 2, PICOQUIC_DEFAULT_DATAGRAM_PRIORITY, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 3, 1, 0)) == 0) {
+            ret = datagram_queue_test_send(cnx, expected, 4, simulated_time);
+        }
+    }
+
+    /* Expired datagrams are dropped when preparing the packet */
+    if (ret == 0) {
+        int expected[2] = { 1, 3 };
+
+        if ((ret = datagram_queue_test_one(cnx, 0, 1, 1000)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 1, 1, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 2, 3, 2000)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 3, 3, 5000)) == 0) {
+            ret = datagram_queue_test_send(cnx, expected, 2, 2000);
+        }
+        picoquic_get_datagram_queue_stats(cnx, &stats);
+        if (ret == 0 && stats.nb_expired != 2) {
+            DBG_PRINTF("Expected 2 expired datagrams, got %d\n", (int)stats.nb_expired);
+            ret = -1;
+        }
+    }
+
+    /* When the queue is full, less urgent datagrams are evicted, oldest first */
+    if (ret == 0) {
+        int expected[3] = { 3, 1, 2 };
+
+        picoquic_set_datagram_queue_max(cnx, 3 * 103);
+        if ((ret = datagram_queue_test_one(cnx, 0, 3, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 1, 3, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 2, 3, 0)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 3, 1, 0)) == 0) {
+            /* The queue only holds datagrams more urgent than this one */
+            if (datagram_queue_test_one(cnx, 4, 5, 0) != PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL) {
+                DBG_PRINTF("%s", "Datagram accepted in full queue\n");
+                ret = -1;
+            }
+            else {
+                picoquic_get_datagram_queue_stats(cnx, &stats);
+                if (stats.queued_bytes != 3 * 103 || stats.nb_dropped_queue_full != 2) {
+                    DBG_PRINTF("Queue full: %d bytes, %d drops\n", (int)stats.queued_bytes, (int)stats.nb_dropped_queue_full);
+                    ret = -1;
+                }
+                else {
+                    ret = datagram_queue_test_send(cnx, expected, 3, simulated_time);
+                }
+            }
+        }
+    }
+
+    /* Expired datagrams do not count against the bound, even if no packet
+     * was sent since they expired */
+    if (ret == 0) {
+        int expected[1] = { 3 };
+        uint64_t nb_expired = 0;
+        uint64_t nb_dropped_queue_full = 0;
+
+        picoquic_get_datagram_queue_stats(cnx, &stats);
+        nb_expired = stats.nb_expired;
+        nb_dropped_queue_full = stats.nb_dropped_queue_full;
+        if ((ret = datagram_queue_test_one(cnx, 0, 1, simulated_time + 1000)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 1, 1, simulated_time + 1000)) == 0 &&
+            (ret = datagram_queue_test_one(cnx, 2, 1, simulated_time + 1000)) == 0) {
+            simulated_time += 1000;
+            if ((ret = datagram_queue_test_one(cnx, 3, 3, 0)) != 0) {
+                DBG_PRINTF("Datagram refused after expiry, ret = 0x%x\n", ret);
+            }
+            else {
+                picoquic_get_datagram_queue_stats(cnx, &stats);
+                if (stats.queued_bytes != 103 || stats.nb_expired != nb_expired + 3 ||
+                    stats.nb_dropped_queue_full != nb_dropped_queue_full) {
+                    DBG_PRINTF("After expiry: %d bytes, %d expired, %d drops\n", (int)stats.queued_bytes,
+                        (int)stats.nb_expired, (int)stats.nb_dropped_queue_full);
+                    ret = -1;
+                }
+                else {
+                    ret = datagram_queue_test_send(cnx, expected, 1, simulated_time);
+                }
+            }
+        }
+        picoquic_set_datagram_queue_max(cnx, 0);
+    }
+
+    /* Datagrams can be queued in batches */
+    if (ret == 0) {
+        int expected[3] = { 2, 0, 1 };
+        uint8_t data[3][100];
+        picoquic_datagram_desc_t batch[3];
+        size_t nb_queued = 0;
+
+        for (int i = 0; i < 3; i++) {
+            memset(data[i], i, sizeof(data[i]));
+            batch[i].bytes = data[i];
+            batch[i].length = sizeof(data[i]);
+            batch[i].priority = (i == 2) ? 0 : 2;
+            batch[i].expire_time = 0;
+        }
+
+        if ((ret = picoquic_queue_datagram_batch(cnx, batch, 3, &nb_queued)) != 0 || nb_queued != 3) {
+            DBG_PRINTF("Batch queued %d datagrams, ret = %d\n", (int)nb_queued, ret);
+            ret = -1;
+        }
+        else {
+            ret = datagram_queue_test_send(cnx, expected, 3, simulated_time);
+        }
+
+        /* An invalid entry stops the batch */
+        if (ret == 0) {
+            batch[1].priority = PICOQUIC_DATAGRAM_PRIORITY_MAX + 1;
+            if (picoquic_queue_datagram_batch(cnx, batch, 3, &nb_queued) != PICOQUIC_ERROR_INVALID_PRIORITY ||
+                nb_queued != 1) {
+                DBG_PRINTF("Invalid batch queued %d datagrams\n", (int)nb_queued);
+                ret = -1;
+            }
+            else {
+                ret = datagram_queue_test_send(cnx, expected + 1, 1, simulated_time);
+            }
+        }
+    }
+
+    /* Datagrams that do not fit in the packet are dropped */
+    if (ret == 0) {
+        uint8_t buffer[64];
+        int more_data = 0;
+        int is_pure_ack = 1;
+
+        if ((ret = datagram_queue_test_one(cnx, 0, 3, 0)) == 0 &&
+            picoquic_format_first_datagram_frame(cnx, buffer, buffer + sizeof(buffer),
+                &more_data, &is_pure_ack, simulated_time) != buffer) {
+            ret = -1;
+        }
+        picoquic_get_datagram_queue_stats(cnx, &stats);
+        if (ret == 0 && (stats.nb_dropped_too_large != 1 || cnx->first_datagram != NULL || stats.queued_bytes != 0)) {
+            DBG_PRINTF("%s", "Large datagram not dropped\n");
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
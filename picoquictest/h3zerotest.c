@@ -787,6 +787,81 @@ int h3zero_parse_qpack_test()
     return ret;
 }
 
+/*
+ * Test the parsing of the priority header, RFC 9218
+ */
+
+typedef struct st_h3zero_priority_test_case_t {
+    char const* value;
+    int ret;
+    uint8_t urgency;
+    int is_incremental;
+} h3zero_priority_test_case_t;
+
+static h3zero_priority_test_case_t priority_test_case[] = {
+    { "", 0, 3, 0 },
+    { "u=0", 0, 0, 0 },
+    { "u=7", 0, 7, 0 },
+    { "i", 0, 3, 1 },
+    { "u=1, i", 0, 1, 1 },
+    { "i, u=5", 0, 5, 1 },
+    { "u=2,i=?1", 0, 2, 1 },
+    { "u=2, i=?0", 0, 2, 0 },
+    { "u=8", 0, 3, 0 },
+    { "u=-1, i", 0, 3, 1 },
+    { "u=12", 0, 3, 0 },
+    { "u=4;p=1, x=\"a, b\", i", 0, 4, 1 },
+    { "u=1, u=6", 0, 6, 0 },
+    { "U=1", -1, 3, 0 },
+    { "u=1,", -1, 3, 0 },
+    { "u=1 i", -1, 3, 0 },
+    { "u=", -1, 3, 0 }
+};
+
+static size_t nb_priority_test_case = sizeof(priority_test_case) / sizeof(h3zero_priority_test_case_t);
+
+static uint8_t qpack_test_priority[] = {
+    0x00, 0x00, 0xd1, 0x27, 0x01, 'p', 'r', 'i', 'o', 'r', 'i', 't', 'y',
+    0x06, 'u', '=', '1', ',', ' ', 'i' };
+
+int h3zero_priority_test()
+{
+    int ret = 0;
+    h3zero_header_parts_t parts;
+
+    for (size_t i = 0; ret == 0 && i < nb_priority_test_case; i++) {
+        uint8_t urgency = 0xff;
+        int is_incremental = -1;
+        int parse_ret = h3zero_parse_priority_field((uint8_t const*)priority_test_case[i].value,
+            strlen(priority_test_case[i].value), &urgency, &is_incremental);
+
+        if (parse_ret != priority_test_case[i].ret || urgency != priority_test_case[i].urgency ||
+            is_incremental != priority_test_case[i].is_incremental) {
+            DBG_PRINTF("Priority test %d (%s) returns %d, u=%d, i=%d\n", (int)i,
+                priority_test_case[i].value, parse_ret, urgency, is_incremental);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        uint8_t* bytes = h3zero_parse_qpack_header_frame(qpack_test_priority,
+            qpack_test_priority + sizeof(qpack_test_priority), &parts);
+
+        if (bytes != qpack_test_priority + sizeof(qpack_test_priority)) {
+            DBG_PRINTF("%s", "Cannot parse the priority header frame\n");
+            ret = -1;
+        }
+        else if (parts.method != h3zero_method_get || !parts.has_priority ||
+            parts.priority_urgency != 1 || !parts.priority_incremental) {
+            DBG_PRINTF("Priority header parsed as %d, u=%d, i=%d\n", parts.has_priority,
+                parts.priority_urgency, parts.priority_incremental);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
 /*
  * Prepare frames of the different supported types, and 
  * verify that they can be decoded as expected
@@ -318,4 +318,223 @@ int varint_test()
     }
  
     return ret;
-}
\ No newline at end of file
+}
+
+/* Reference decoder, byte by byte, used to verify the optimized decoders */
+static size_t varint_reference_decode(const uint8_t* bytes, size_t max_bytes, uint64_t* n64)
+{
+    size_t length;
+    uint64_t v;
+
+    if (max_bytes == 0) {
+        return 0;
+    }
+    length = ((size_t)1) << (bytes[0] >> 6);
+    if (length > max_bytes) {
+        return 0;
+    }
+    v = bytes[0] & 0x3F;
+    for (size_t i = 1; i < length; i++) {
+        v = (v << 8) | bytes[i];
+    }
+    *n64 = v;
+
+    return length;
+}
+
+/* Fill a buffer with random varints. Small values are more frequent,
+ * so runs of single byte varints are exercised as well as the slow path. */
+static size_t varint_fuzz_fill(uint64_t* random_context, uint8_t* bytes, size_t bytes_max, uint64_t small_mask)
+{
+    size_t byte_index = 0;
+
+    while (byte_index < bytes_max) {
+        uint64_t r = picoquic_test_random(random_context);
+        uint64_t v;
+        size_t l;
+
+        switch (r & small_mask) {
+        case 0:
+            v = r >> 2;
+            break;
+        case 1:
+            v = (r >> 4) & 0x3FFFFFFF;
+            break;
+        case 2:
+        case 3:
+            v = (r >> 4) & 0x3FFF;
+            break;
+        default:
+            v = (r >> 4) & 0x3F;
+            break;
+        }
+        l = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index, v);
+        if (l == 0) {
+            /* Not enough space, fill the end with random bytes */
+            picoquic_test_random_bytes(random_context, bytes + byte_index, bytes_max - byte_index);
+            break;
+        }
+        byte_index += l;
+    }
+
+    return byte_index;
+}
+
+#define VARINT_FUZZ_BUFFER_SIZE 256
+#define VARINT_FUZZ_MAX_VALUES VARINT_FUZZ_BUFFER_SIZE
+
+int varint_fuzz_test()
+{
+    int ret = 0;
+    uint64_t random_context = 0x7A121F5E;
+    uint8_t bytes[VARINT_FUZZ_BUFFER_SIZE];
+    uint64_t expected[VARINT_FUZZ_MAX_VALUES];
+    uint64_t decoded[VARINT_FUZZ_MAX_VALUES];
+
+    for (int trial = 0; ret == 0 && trial < 10000; trial++) {
+        size_t bytes_max = (size_t)picoquic_test_uniform_random(&random_context, VARINT_FUZZ_BUFFER_SIZE + 1);
+        size_t nb_expected = 0;
+        size_t expected_length = 0;
+        size_t nb_varints;
+        size_t decoded_length;
+        const uint8_t* next_bytes;
+
+        if ((trial & 3) == 0) {
+            /* Purely random bytes */
+            picoquic_test_random_bytes(&random_context, bytes, bytes_max);
+        }
+        else {
+            /* Mix of varint sizes, or long runs of mostly single byte varints */
+            (void)varint_fuzz_fill(&random_context, bytes, bytes_max, ((trial & 3) == 1) ? 15 : 255);
+        }
+
+        /* Decode one value at a time with the single value decoders */
+        for (size_t byte_index = 0; ret == 0 && byte_index <= bytes_max; byte_index++) {
+            uint64_t v_ref = 0;
+            uint64_t v_old = 0;
+            uint64_t v_new = 0;
+            size_t l_ref = varint_reference_decode(bytes + byte_index, bytes_max - byte_index, &v_ref);
+            size_t l_old = (byte_index < bytes_max) ? picoquic_varint_decode(bytes + byte_index, bytes_max - byte_index, &v_old) : 0;
+            next_bytes = picoquic_frames_varint_decode(bytes + byte_index, bytes + bytes_max, &v_new);
+
+            if (l_ref != l_old || (l_ref == 0 && next_bytes != NULL) ||
+                (l_ref != 0 && (next_bytes != bytes + byte_index + l_ref || v_ref != v_old || v_ref != v_new))) {
+                DBG_PRINTF("Varint fuzz, trial %d, byte %" PRIst ", value mismatch", trial, byte_index);
+                ret = -1;
+            }
+        }
+
+        /* Decode the run of values with the reference decoder */
+        while (nb_expected < VARINT_FUZZ_MAX_VALUES) {
+            size_t l = varint_reference_decode(bytes + expected_length, bytes_max - expected_length, &expected[nb_expected]);
+            if (l == 0) {
+                break;
+            }
+            expected_length += l;
+            nb_expected++;
+        }
+
+        /* Compare to the run decoders, for all prefixes of the run and one past the end */
+        for (nb_varints = 0; ret == 0 && nb_varints <= nb_expected + 1 && nb_varints <= VARINT_FUZZ_MAX_VALUES; nb_varints++) {
+            size_t skipped_length;
+
+            decoded_length = picoquic_varint_decode_n(bytes, bytes_max, decoded, nb_varints);
+            skipped_length = picoquic_varint_skip_n(bytes, bytes_max, nb_varints);
+
+            if (nb_varints > nb_expected) {
+                if (decoded_length != 0 || skipped_length != 0) {
+                    DBG_PRINTF("Varint fuzz, trial %d, %" PRIst " values decoded past end", trial, nb_varints);
+                    ret = -1;
+                }
+            }
+            else if (decoded_length != skipped_length ||
+                (nb_varints == nb_expected && nb_varints > 0 && decoded_length != expected_length) ||
+                (nb_varints > 0 && memcmp(decoded, expected, nb_varints * sizeof(uint64_t)) != 0)) {
+                DBG_PRINTF("Varint fuzz, trial %d, run of %" PRIst " values mismatch", trial, nb_varints);
+                ret = -1;
+            }
+        }
+
+        /* Same test with the frame based API */
+        if (ret == 0 && nb_expected > 0) {
+            next_bytes = picoquic_frames_varint_decode_n(bytes, bytes + bytes_max, decoded, nb_expected);
+            if (next_bytes != bytes + expected_length ||
+                picoquic_frames_varint_skip_n(bytes, bytes + bytes_max, nb_expected) != next_bytes ||
+                memcmp(decoded, expected, nb_expected * sizeof(uint64_t)) != 0) {
+                DBG_PRINTF("Varint fuzz, trial %d, frame decoding mismatch", trial);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Micro benchmark of varint decoding, comparing the reference byte by byte decoder
+ * and the optimized decoders on buffers formatted like the blocks of a large ACK frame.
+ * The test only fails if the results differ; the timings are reported in the debug log.
+ */
+#define VARINT_BENCH_NB_VALUES 64
+#define VARINT_BENCH_ROUNDS 100000
+
+int varint_bench_test()
+{
+    int ret = 0;
+    uint64_t random_context = 0xBE4C4;
+    uint8_t bytes[8 * VARINT_BENCH_NB_VALUES];
+    uint64_t decoded[VARINT_BENCH_NB_VALUES];
+    uint64_t sum_ref = 0;
+    uint64_t sum_single = 0;
+    uint64_t sum_run = 0;
+    size_t bytes_max = 0;
+    uint64_t start_time;
+    uint64_t ref_time;
+    uint64_t single_time;
+    uint64_t run_time;
+
+    /* Format the gaps and ranges of a typical ACK frame: mostly small values. */
+    for (int i = 0; i < VARINT_BENCH_NB_VALUES; i++) {
+        uint64_t v = picoquic_test_uniform_random(&random_context, (i % 16 == 15) ? 1000 : 40);
+        bytes_max += picoquic_varint_encode(bytes + bytes_max, sizeof(bytes) - bytes_max, v);
+    }
+
+    start_time = picoquic_current_time();
+    for (int round = 0; round < VARINT_BENCH_ROUNDS; round++) {
+        size_t byte_index = 0;
+        for (int i = 0; i < VARINT_BENCH_NB_VALUES; i++) {
+            byte_index += varint_reference_decode(bytes + byte_index, bytes_max - byte_index, &decoded[i]);
+            sum_ref += decoded[i];
+        }
+    }
+    ref_time = picoquic_current_time();
+
+    for (int round = 0; round < VARINT_BENCH_ROUNDS; round++) {
+        const uint8_t* next_bytes = bytes;
+        for (int i = 0; i < VARINT_BENCH_NB_VALUES && next_bytes != NULL; i++) {
+            next_bytes = picoquic_frames_varint_decode(next_bytes, bytes + bytes_max, &decoded[i]);
+            sum_single += decoded[i];
+        }
+    }
+    single_time = picoquic_current_time();
+
+    for (int round = 0; round < VARINT_BENCH_ROUNDS; round++) {
+        if (picoquic_varint_decode_n(bytes, bytes_max, decoded, VARINT_BENCH_NB_VALUES) != bytes_max) {
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < VARINT_BENCH_NB_VALUES; i++) {
+            sum_run += decoded[i];
+        }
+    }
+    run_time = picoquic_current_time();
+
+    if (ret == 0 && (sum_ref != sum_single || sum_ref != sum_run)) {
+        ret = -1;
+    }
+
+    DBG_PRINTF("Varint decoding of %d x %d values: reference %" PRIu64 "us, single %" PRIu64 "us, run %" PRIu64 "us",
+        VARINT_BENCH_ROUNDS, VARINT_BENCH_NB_VALUES,
+        ref_time - start_time, single_time - ref_time, run_time - single_time);
+
+    return ret;
+}
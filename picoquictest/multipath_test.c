@@ -247,4 +247,298 @@ int migration_controlled_test()
 int migration_mtu_drop_test()
 {
     return migration_test_one(1);
-}
\ No newline at end of file
+}
+
+/* Unit test of the multipath schedulers.
+ * Create a connection with two validated paths, and verify that the
+ * schedulers only pick the paths that congestion control, pacing and
+ * validation allow, and that they pick them in the expected order. */
+
+int multipath_scheduler_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    uint64_t next_wake_time = UINT64_MAX;
+    struct sockaddr_in saddr;
+    struct sockaddr_in saddr_2;
+    int rr_expected[4] = { 0, 1, 0, 1 };
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+    saddr_2 = saddr;
+    saddr_2.sin_port = 1017;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&saddr, simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+        ret = -1;
+    }
+    else if (picoquic_create_path(cnx, simulated_time, NULL, (struct sockaddr*)&saddr_2) != 1) {
+        DBG_PRINTF("%s", "Cannot create second path\n");
+        ret = -1;
+    }
+    else if (cnx->path_scheduler != picoquic_min_rtt_scheduler) {
+        DBG_PRINTF("%s", "The default scheduler is not min RTT\n");
+        ret = -1;
+    }
+    else {
+        cnx->is_multipath_enabled = 1;
+        for (int i = 0; i < 2; i++) {
+            cnx->path[i]->challenge_verified = 1;
+            cnx->path[i]->cwin = 100000;
+            cnx->path[i]->bytes_in_transit = 0;
+        }
+        cnx->path[0]->smoothed_rtt = 50000;
+        cnx->path[1]->smoothed_rtt = 10000;
+    }
+
+    /* Min RTT uses the fastest path first, then the other path once the window is full */
+    if (ret == 0 && picoquic_min_rtt_scheduler->select_path(cnx, simulated_time, &next_wake_time) != 1) {
+        DBG_PRINTF("%s", "Min RTT does not select the fastest path\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        cnx->path[1]->bytes_in_transit = cnx->path[1]->cwin;
+        if (picoquic_min_rtt_scheduler->select_path(cnx, simulated_time, &next_wake_time) != 0) {
+            DBG_PRINTF("%s", "Min RTT does not select the path with available window\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        cnx->path[0]->bytes_in_transit = cnx->path[0]->cwin;
+        if (picoquic_min_rtt_scheduler->select_path(cnx, simulated_time, &next_wake_time) != -1) {
+            DBG_PRINTF("%s", "Min RTT selects a path without available window\n");
+            ret = -1;
+        }
+        cnx->path[0]->bytes_in_transit = 0;
+        cnx->path[1]->bytes_in_transit = 0;
+    }
+
+    /* Round robin rotates between the paths */
+    if (ret == 0) {
+        picoquic_set_path_scheduler(cnx, picoquic_round_robin_scheduler);
+        for (int i = 0; ret == 0 && i < 4; i++) {
+            int path_id = cnx->path_scheduler->select_path(cnx, simulated_time, &next_wake_time);
+            if (path_id != rr_expected[i]) {
+                DBG_PRINTF("Round robin selects path %d instead of %d\n", path_id, rr_expected[i]);
+                ret = -1;
+            }
+        }
+    }
+
+    /* Paths that are not validated or blocked by pacing are not used */
+    if (ret == 0) {
+        cnx->path[1]->challenge_verified = 0;
+        for (int i = 0; ret == 0 && i < 2; i++) {
+            if (cnx->path_scheduler->select_path(cnx, simulated_time, &next_wake_time) != 0) {
+                DBG_PRINTF("%s", "Round robin selects a path that is not validated\n");
+                ret = -1;
+            }
+        }
+        cnx->path[1]->challenge_verified = 1;
+    }
+
+    if (ret == 0) {
+        cnx->path[0]->pacing_evaluation_time = simulated_time;
+        cnx->path[0]->pacing_bucket_nanosec = 0;
+        cnx->path[0]->pacing_packet_time_nanosec = 1000000;
+        next_wake_time = UINT64_MAX;
+        if (picoquic_min_rtt_scheduler->select_path(cnx, simulated_time, &next_wake_time) != 1) {
+            DBG_PRINTF("%s", "Min RTT selects a path blocked by pacing\n");
+            ret = -1;
+        }
+        else if (next_wake_time != simulated_time + 1001) {
+            DBG_PRINTF("Pacing wake time %" PRIu64 " instead of %" PRIu64 "\n", next_wake_time, simulated_time + 1001);
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Concurrent multipath transfer.
+ * Negotiate multipath, add a second pair of links, and probe the second path.
+ * Once both peers validated it, transfer data and verify that the transfer
+ * completes, and that both paths carried a share of the traffic. With the
+ * redundant scheduler, also verify that the server sent copies of the stream
+ * frames. */
+
+static test_api_stream_desc_t test_scenario_multipath_transfer[] = {
+    { 4, 0, 257, 1000000 }
+};
+
+static int wait_multipath_ready(picoquic_test_tls_api_ctx_t* test_ctx,
+    uint64_t* simulated_time)
+{
+    int ret = 0;
+    uint64_t time_out = *simulated_time + 4000000;
+    int nb_trials = 0;
+    int nb_inactive = 0;
+    int is_ready = 0;
+
+    while (ret == 0 && !is_ready && *simulated_time < time_out &&
+        test_ctx->cnx_client->cnx_state == picoquic_state_ready &&
+        nb_trials < 1024 && nb_inactive < 64) {
+        int was_active = 0;
+
+        nb_trials++;
+        ret = tls_api_one_sim_round(test_ctx, simulated_time, time_out, &was_active);
+
+        if (was_active) {
+            nb_inactive = 0;
+        }
+        else {
+            nb_inactive++;
+        }
+
+        is_ready = test_ctx->cnx_server != NULL &&
+            test_ctx->cnx_client->nb_paths >= 2 && test_ctx->cnx_client->path[1]->challenge_verified &&
+            test_ctx->cnx_server->nb_paths >= 2 && test_ctx->cnx_server->path[1]->challenge_verified;
+    }
+
+    if (ret == 0 && !is_ready) {
+        DBG_PRINTF("Second path not validated, client state = %d\n", test_ctx->cnx_client->cnx_state);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int multipath_test_one(picoquic_path_scheduler_t const* scheduler)
+{
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    uint64_t max_completion_microsec = 1500000;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_tp_t client_parameters;
+    picoquic_tp_t server_parameters;
+    int ret;
+
+    memset(&client_parameters, 0, sizeof(picoquic_tp_t));
+    picoquic_init_transport_parameters(&client_parameters, 1);
+    client_parameters.enable_multipath = 1;
+    memset(&server_parameters, 0, sizeof(picoquic_tp_t));
+    picoquic_init_transport_parameters(&server_parameters, 0);
+    server_parameters.enable_multipath = 1;
+
+    ret = tls_api_one_scenario_init(&test_ctx, &simulated_time, 0, &client_parameters, &server_parameters);
+
+    if (ret == 0) {
+        picoquic_set_default_path_scheduler(test_ctx->qserver, scheduler);
+        picoquic_set_path_scheduler(test_ctx->cnx_client, scheduler);
+    }
+
+    /* establish the connection*/
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = wait_client_connection_ready(test_ctx, &simulated_time);
+    }
+
+    if (ret == 0 && (test_ctx->cnx_server == NULL ||
+        !test_ctx->cnx_client->is_multipath_enabled || !test_ctx->cnx_server->is_multipath_enabled)) {
+        DBG_PRINTF("%s", "Multipath was not negotiated\n");
+        ret = -1;
+    }
+
+    /* Add the second pair of links, and validate the new path */
+    if (ret == 0) {
+        ret = multipath_test_add_links(test_ctx, 0);
+    }
+
+    if (ret == 0) {
+        ret = picoquic_probe_new_path(test_ctx->cnx_client, (struct sockaddr*) & test_ctx->server_addr,
+            (struct sockaddr*) & test_ctx->client_addr_2, simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = wait_multipath_ready(test_ctx, &simulated_time);
+    }
+
+    /* Perform the data transfer */
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_multipath_transfer, sizeof(test_scenario_multipath_transfer));
+    }
+
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time, 0);
+
+        if (ret != 0)
+        {
+            DBG_PRINTF("Data sending loop returns %d\n", ret);
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_verify(test_ctx, &simulated_time, max_completion_microsec);
+    }
+
+    /* Each path shall carry at least an eighth of the server traffic */
+    if (ret == 0) {
+        uint64_t total_sent = test_ctx->s_to_c_link->packets_sent + test_ctx->s_to_c_link_2->packets_sent;
+
+        if (8 * test_ctx->s_to_c_link->packets_sent < total_sent ||
+            8 * test_ctx->s_to_c_link_2->packets_sent < total_sent) {
+            DBG_PRINTF("Unbalanced paths, %" PRIu64 " and %" PRIu64 " packets\n",
+                test_ctx->s_to_c_link->packets_sent, test_ctx->s_to_c_link_2->packets_sent);
+            ret = -1;
+        }
+    }
+
+    /* With the redundant scheduler, copies of the stream frames shall account for
+     * at least an eighth of the server traffic. Other schedulers send no copies. */
+    if (ret == 0) {
+        uint64_t total_sent = test_ctx->s_to_c_link->packets_sent + test_ctx->s_to_c_link_2->packets_sent;
+        uint64_t nb_redundant = test_ctx->cnx_server->nb_stream_frames_redundant;
+
+        if (scheduler->is_redundant ? (8 * nb_redundant < total_sent) : (nb_redundant != 0)) {
+            DBG_PRINTF("%" PRIu64 " redundant stream frames for %" PRIu64 " packets, scheduler %s\n",
+                nb_redundant, total_sent, scheduler->path_scheduler_id);
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+    }
+
+    return ret;
+}
+
+int multipath_min_rtt_test()
+{
+    return multipath_test_one(picoquic_min_rtt_scheduler);
+}
+
+int multipath_round_robin_test()
+{
+    return multipath_test_one(picoquic_round_robin_scheduler);
+}
+
+int multipath_redundant_test()
+{
+    return multipath_test_one(picoquic_redundant_scheduler);
+}
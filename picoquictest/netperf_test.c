@@ -279,8 +279,10 @@ int netperf_scenario_body_connect(picoquic_test_tls_api_ctx_t* test_ctx,
     if (ret == 0 && max_data != 0) {
         test_ctx->cnx_client->maxdata_local = max_data;
         test_ctx->cnx_client->maxdata_remote = max_data;
+        test_ctx->cnx_client->receive_window.window = max_data;
         test_ctx->cnx_server->maxdata_local = max_data;
         test_ctx->cnx_server->maxdata_remote = max_data;
+        test_ctx->cnx_server->receive_window.window = max_data;
     }
 
     return ret;
@@ -372,7 +374,7 @@ int netperf_one_scenario(test_api_stream_desc_t* scenario,
     uint64_t init_loss_mask, uint64_t max_data, uint64_t queue_delay_max,
     uint32_t proposed_version, uint64_t max_completion_microsec,
     picoquic_tp_t* client_params, picoquic_tp_t* server_params,
-    size_t send_buffer_size)
+    size_t send_buffer_size, int nb_crypto_workers)
 {
     uint64_t simulated_time = 0;
     uint64_t loss_mask;
@@ -389,6 +391,14 @@ int netperf_one_scenario(test_api_stream_desc_t* scenario,
         }
     }
 
+    if (ret == 0 && nb_crypto_workers > 0) {
+        /* The server connection is not created yet, so workers can be set */
+        ret = picoquic_set_crypto_workers(test_ctx->qserver, nb_crypto_workers);
+        if (ret != 0) {
+            DBG_PRINTF("Cannot start %d crypto workers, ret = %d\n", nb_crypto_workers, ret);
+        }
+    }
+
     if (ret == 0 && cc_algo != NULL) {
         test_ctx->qserver->padding_multiple_default = 128;
         test_ctx->qclient->padding_multiple_default = 128;
@@ -487,7 +497,7 @@ int netperf_basic_test()
 {
     int ret = netperf_one_scenario(netperf_scenario_basic, sizeof(netperf_scenario_basic),
         NULL,
-        0, 0, 0, 0, 0, 1000000, NULL, NULL, 10 * PICOQUIC_MAX_PACKET_SIZE);
+        0, 0, 0, 0, 0, 1000000, NULL, NULL, 10 * PICOQUIC_MAX_PACKET_SIZE, 0);
 
     return ret;
 }
@@ -496,7 +506,18 @@ int netperf_bbr_test()
 {
     int ret = netperf_one_scenario(netperf_scenario_basic, sizeof(netperf_scenario_basic),
         picoquic_bbr_algorithm,
-        0, 0, 0, 0, 0, 1000000, NULL, NULL, 10 * PICOQUIC_MAX_PACKET_SIZE);
+        0, 0, 0, 0, 0, 1000000, NULL, NULL, 10 * PICOQUIC_MAX_PACKET_SIZE, 0);
+
+    return ret;
+}
+
+/* Same as the bbr test, but the server encrypts the packet trains
+ * with a pool of crypto workers */
+int netperf_crypto_workers_test()
+{
+    int ret = netperf_one_scenario(netperf_scenario_basic, sizeof(netperf_scenario_basic),
+        picoquic_bbr_algorithm,
+        0, 0, 0, 0, 0, 1000000, NULL, NULL, 10 * PICOQUIC_MAX_PACKET_SIZE, 4);
 
     return ret;
 }
@@ -48,6 +48,7 @@ int intformattest();
 int sacktest();
 int StreamZeroFrameTest();
 int sendacktest();
+int sendack_cache_test();
 int tls_api_test();
 int tls_api_inject_hs_ack_test();
 int tls_api_silence_test();
@@ -74,12 +75,15 @@ int tls_api_very_long_with_err_test();
 int tls_api_very_long_congestion_test();
 int tls_api_retry_test();
 int tls_api_retry_large_test();
+int tls_api_retry_store_full_test();
 int ackrange_test();
 int ack_of_ack_test();
 int tls_api_two_connections_test();
 int cleartext_aead_test();
 int tls_api_multiple_versions_test();
 int varint_test();
+int varint_fuzz_test();
+int varint_bench_test();
 int tls_api_client_losses_test();
 int tls_api_server_losses_test();
 int skip_frame_test();
@@ -91,15 +95,21 @@ int socket_test();
 int ticket_store_test();
 int token_store_test();
 int session_resume_test();
+int shared_ticket_key_test();
 int zero_rtt_test();
 int zero_rtt_loss_test();
 int stop_sending_test();
 int unidir_test();
 int mtu_discovery_test();
 int mtu_drop_test();
+int pmtud_test();
+int jumbo_packet_test();
 int spurious_retransmit_test();
 int pn_ctr_test();
 int cleartext_pn_enc_test();
+int pn_enc_batch_test();
+int aead_bench_test();
+int initial_validation_test();
 int pn_enc_1rtt_test();
 int tls_zero_share_test();
 int transport_param_log_test();
@@ -109,6 +119,7 @@ int virtual_time_test();
 int tls_different_params_test();
 int tls_quant_params_test();
 int set_certificate_and_key_test();
+int cert_compression_test();
 int transport_param_stream_id_test();
 int request_client_authentication_test();
 int bad_client_certificate_test();
@@ -129,6 +140,8 @@ int parse_frame_test();
 int stress_test();
 int cnx_stress_unit_test();
 int cnx_stress_do_test(uint64_t duration, int nb_clients, int do_report);
+int cpu_scaling_test();
+int cpu_scaling_do_test(int max_workers, int nb_clients, uint64_t bulk_bytes, int do_report);
 int cnx_ddos_unit_test();
 int cnx_ddos_test_loop(int nb_connections, uint64_t ddos_interval, const char* qlogdir);
 int splay_test();
@@ -149,6 +162,7 @@ int migration_fail_test();
 int cnxid_renewal_test();
 int retire_cnxid_test();
 int server_busy_test();
+int handshake_budget_test();
 int initial_close_test();
 int fuzz_initial_test();
 int new_rotated_key_test();
@@ -186,6 +200,7 @@ int h3zero_integer_test();
 int qpack_huffman_test();
 int qpack_huffman_base_test();
 int h3zero_parse_qpack_test();
+int h3zero_priority_test();
 int h3zero_prepare_qpack_test();
 int h3zero_qpack_fuzz_test();
 int h3zero_stream_test();
@@ -205,13 +220,21 @@ int null_sni_test();
 int preferred_address_test();
 int preferred_address_dis_mig_test();
 int cid_for_lb_test();
+int cnxid_pool_test();
 int retry_protection_vector_test();
 int test_copy_for_retransmit();
 int test_format_for_retransmit();
 int bad_coalesce_test();
 int bad_cnxid_test();
 int stream_splay_test();
+int stream_table_test();
 int stream_output_test();
+int stream_priority_test();
+int stream_buffer_test();
+int stream_file_test();
+int receive_window_test();
+int datagram_jit_test();
+int datagram_queue_test();
 int stream_rank_test();
 int not_before_cnxid_test();
 int send_stream_blocked_test();
@@ -241,7 +264,14 @@ int chacha20_test();
 int cid_quiescence_test();
 int migration_controlled_test();
 int migration_mtu_drop_test();
+int multipath_scheduler_test();
+int multipath_min_rtt_test();
+int multipath_round_robin_test();
+int multipath_redundant_test();
 int token_reuse_api_test();
+int token_reuse_slots_test();
+int anti_replay_store_test();
+int ticket_store_index_test();
 int grease_quic_bit_test();
 int grease_quic_bit_one_way_test();
 int pn_random_test();
@@ -251,6 +281,7 @@ int integrity_limit_test();
 int excess_repeat_test();
 int netperf_basic_test();
 int netperf_bbr_test();
+int netperf_crypto_workers_test();
 int nat_attack_test();
 
 int h3zero_post_test();
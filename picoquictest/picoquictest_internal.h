@@ -217,6 +217,15 @@ int tls_api_one_scenario_test(test_api_stream_desc_t* scenario,
     uint32_t proposed_version, uint64_t max_completion_microsec,
     picoquic_tp_t* client_params, picoquic_tp_t* server_params);
 
+int netperf_one_scenario(test_api_stream_desc_t* scenario,
+    size_t sizeof_scenario, picoquic_congestion_algorithm_t* cc_algo, size_t stream0_target,
+    uint64_t init_loss_mask, uint64_t max_data, uint64_t queue_delay_max,
+    uint32_t proposed_version, uint64_t max_completion_microsec,
+    picoquic_tp_t* client_params, picoquic_tp_t* server_params,
+    size_t send_buffer_size, int nb_crypto_workers);
+
+int cnx_stress_do_instance(uint64_t duration, int nb_clients, int* nb_connections, int* nb_messages);
+
 uint64_t demo_server_test_time_from_esni_rr(char const* esni_rr_file);
 
 #ifdef __cplusplus
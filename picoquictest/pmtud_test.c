@@ -0,0 +1,204 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2021, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic.h"
+#include "picoquic_internal.h"
+#include "picoquictest_internal.h"
+
+/* Unit test of the path MTU discovery state machine.
+ * The probes are sent on a simulated path that drops the packets larger
+ * than the path MTU, and the losses and acknowledgements are fed back to
+ * the path as the sender and the ack processing would do. */
+
+#define PMTUD_TEST_CHECKSUM 16
+#define PMTUD_TEST_HEADER 20
+
+static int pmtud_test_search(picoquic_cnx_t* cnx, picoquic_path_t* path_x, size_t link_mtu, uint64_t* simulated_time)
+{
+    int ret = 0;
+    int nb_rounds = 0;
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+
+    while (ret == 0 && picoquic_is_mtu_probe_needed(cnx, path_x, *simulated_time) != picoquic_pmtu_discovery_not_needed) {
+        size_t probe_size = picoquic_prepare_mtu_probe(cnx, path_x, PMTUD_TEST_HEADER, PMTUD_TEST_CHECKSUM,
+            bytes, sizeof(bytes)) + PMTUD_TEST_CHECKSUM;
+
+        path_x->mtu_probe_sent = 1;
+        *simulated_time += 10000;
+
+        if (++nb_rounds > 32) {
+            DBG_PRINTF("MTU search does not converge, MTU = %zu\n", path_x->send_mtu);
+            ret = -1;
+        }
+        else if (probe_size <= link_mtu) {
+            picoquic_update_path_mtu_on_ack(path_x, probe_size, *simulated_time);
+        }
+        else {
+            picoquic_packet_t old_p;
+            int packet_is_pure_ack = 0;
+            int do_not_detect_spurious = 0;
+            size_t length = 0;
+
+            memset(&old_p, 0, sizeof(picoquic_packet_t));
+            old_p.send_path = path_x;
+            old_p.length = probe_size - PMTUD_TEST_CHECKSUM;
+            old_p.checksum_overhead = PMTUD_TEST_CHECKSUM;
+            old_p.send_time = *simulated_time;
+            old_p.is_mtu_probe = 1;
+
+            ret = picoquic_copy_before_retransmit(&old_p, cnx, bytes, sizeof(bytes),
+                &packet_is_pure_ack, &do_not_detect_spurious, &length);
+            if (ret == 0 && (!packet_is_pure_ack || length != 0)) {
+                DBG_PRINTF("%s", "Lost MTU probe is retransmitted\n");
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int pmtud_test_check_stats(picoquic_cnx_t* cnx, size_t send_mtu, picoquic_pmtud_state_enum pmtud_state,
+    uint64_t nb_mtu_probes_sent, uint64_t nb_mtu_probes_lost, uint64_t nb_black_holes)
+{
+    int ret = 0;
+    picoquic_path_mtu_stats_t stats;
+
+    if (picoquic_get_path_mtu_stats(cnx, 0, &stats) != 0) {
+        DBG_PRINTF("%s", "Cannot get the MTU stats\n");
+        ret = -1;
+    }
+    else if (stats.send_mtu != send_mtu || stats.pmtud_state != pmtud_state ||
+        stats.nb_mtu_probes_sent != nb_mtu_probes_sent || stats.nb_mtu_probes_lost != nb_mtu_probes_lost ||
+        stats.nb_black_holes != nb_black_holes) {
+        DBG_PRINTF("MTU %zu, state %d, probes %" PRIu64 "/%" PRIu64 ", black holes %" PRIu64 "\n",
+            stats.send_mtu, stats.pmtud_state, stats.nb_mtu_probes_sent, stats.nb_mtu_probes_lost, stats.nb_black_holes);
+        DBG_PRINTF("Expected MTU %zu, state %d, probes %" PRIu64 "/%" PRIu64 ", black holes %" PRIu64 "\n",
+            send_mtu, pmtud_state, nb_mtu_probes_sent, nb_mtu_probes_lost, nb_black_holes);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int pmtud_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_path_t* path_x = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    picoquic_path_mtu_stats_t stats;
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&saddr, simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+        ret = -1;
+    }
+    else {
+        cnx->cnx_state = picoquic_state_ready;
+        cnx->remote_parameters.max_packet_size = 1500;
+        picoquic_cnx_set_pmtud_required(cnx, 1);
+        path_x = cnx->path[0];
+        ret = pmtud_test_check_stats(cnx, PICOQUIC_INITIAL_MTU_IPV4, picoquic_pmtud_searching, 0, 0, 0);
+    }
+
+    if (ret == 0 && picoquic_get_path_mtu_stats(cnx, 1, &stats) == 0) {
+        DBG_PRINTF("%s", "MTU stats returned for a path that does not exist\n");
+        ret = -1;
+    }
+
+    /* On a 1380 bytes path, 1500 and 1400 are each lost three times before the
+     * search converges by binary steps on 1326 and then 1363 */
+    if (ret == 0) {
+        ret = pmtud_test_search(cnx, path_x, 1380, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = pmtud_test_check_stats(cnx, 1363, picoquic_pmtud_search_complete, 8, 6, 0);
+    }
+
+    /* No probe until the raise timer expires */
+    if (ret == 0 && picoquic_is_mtu_probe_needed(cnx, path_x, simulated_time + PICOQUIC_PMTUD_RAISE_TIMER - 1)
+        != picoquic_pmtu_discovery_not_needed) {
+        DBG_PRINTF("%s", "MTU probe before the raise timer\n");
+        ret = -1;
+    }
+
+    /* After the raise timer, the search resumes and finds that the path MTU increased */
+    if (ret == 0) {
+        simulated_time += PICOQUIC_PMTUD_RAISE_TIMER;
+        ret = pmtud_test_search(cnx, path_x, 1500, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = pmtud_test_check_stats(cnx, 1500, picoquic_pmtud_search_complete, 9, 6, 0);
+    }
+
+    /* Losses of full size packets sent before a full size packet was acknowledged
+     * are due to congestion, and do not reset the MTU */
+    if (ret == 0) {
+        picoquic_update_path_mtu_on_ack(path_x, 1500, simulated_time);
+        for (int i = 0; i <= 2 * PICOQUIC_MTU_LOSS_THRESHOLD; i++) {
+            picoquic_update_path_mtu_on_loss(cnx, path_x, 1500, simulated_time - 1);
+        }
+        ret = pmtud_test_check_stats(cnx, 1500, picoquic_pmtud_search_complete, 9, 6, 0);
+    }
+
+    /* Continued losses of full size packets indicate a black hole */
+    if (ret == 0) {
+        simulated_time += 10000;
+        for (int i = 0; i <= PICOQUIC_MTU_LOSS_THRESHOLD; i++) {
+            picoquic_update_path_mtu_on_loss(cnx, path_x, 1500, simulated_time);
+        }
+        ret = pmtud_test_check_stats(cnx, PICOQUIC_INITIAL_MTU_IPV4, picoquic_pmtud_searching, 9, 6, 1);
+    }
+
+    /* The search then avoids the size that failed */
+    if (ret == 0) {
+        ret = pmtud_test_search(cnx, path_x, 1380, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = pmtud_test_check_stats(cnx, 1363, picoquic_pmtud_search_complete, 14, 9, 1);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
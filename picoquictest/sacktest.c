@@ -372,3 +372,78 @@ int ackrange_test()
 
     return ret;
 }
+
+/*
+ * Verify that the ACK frames formatted from the cached ACK blocks
+ * are identical to those formatted after flushing the cache, including
+ * when the ACK frame has to be truncated to fit a small buffer.
+ */
+
+static int sendack_cache_compare(picoquic_cnx_t* cnx, picoquic_packet_context_enum pc, size_t buffer_size, uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t bytes_cached[512];
+    uint8_t bytes_fresh[512];
+    int more_data_cached = 0;
+    int more_data_fresh = 0;
+    uint8_t* next_cached = picoquic_format_ack_frame(cnx, bytes_cached, bytes_cached + buffer_size, &more_data_cached, current_time, pc);
+    uint8_t* next_fresh;
+
+    cnx->pkt_ctx[pc].ack_blocks_cache_valid = 0;
+    next_fresh = picoquic_format_ack_frame(cnx, bytes_fresh, bytes_fresh + buffer_size, &more_data_fresh, current_time, pc);
+
+    if (next_cached - bytes_cached != next_fresh - bytes_fresh || more_data_cached != more_data_fresh ||
+        memcmp(bytes_cached, bytes_fresh, next_cached - bytes_cached) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int sendack_cache_test()
+{
+    int ret = 0;
+    picoquic_cnx_t cnx;
+    uint64_t random_context = 0xAC4CAC4EULL;
+    uint64_t pn64 = 0;
+    picoquic_packet_context_enum pc = 0;
+    const size_t buffer_sizes[] = { 512, 64, 24, 12 };
+
+    memset(&cnx, 0, sizeof(cnx));
+    cnx.pkt_ctx[pc].first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
+
+    for (int i = 0; ret == 0 && i < 2000; i++) {
+        uint64_t current_time = (uint64_t)i * 1000;
+        uint64_t r = picoquic_test_uniform_random(&random_context, 16);
+
+        if (r == 0) {
+            /* Create a hole */
+            pn64 += 2 + picoquic_test_uniform_random(&random_context, 300);
+        }
+        else if (r == 1 && pn64 > 64) {
+            /* Fill a packet in the past */
+            uint64_t old_pn = pn64 - picoquic_test_uniform_random(&random_context, 64);
+            (void)picoquic_record_pn_received(&cnx, pc, old_pn, current_time);
+        }
+        else {
+            pn64++;
+        }
+
+        if (picoquic_record_pn_received(&cnx, pc, pn64, current_time) < 0) {
+            ret = -1;
+        }
+
+        for (size_t j = 0; ret == 0 && j < sizeof(buffer_sizes) / sizeof(size_t); j++) {
+            ret = sendack_cache_compare(&cnx, pc, buffer_sizes[j], current_time + 10);
+        }
+    }
+
+    /* Reset the sack lists*/
+    while (cnx.pkt_ctx[pc].first_sack_item.next_sack != NULL) {
+        picoquic_sack_item_t* next = cnx.pkt_ctx[pc].first_sack_item.next_sack;
+        cnx.pkt_ctx[pc].first_sack_item.next_sack = next->next_sack;
+        free(next);
+    }
+
+    return ret;
+}
@@ -1699,6 +1699,7 @@ int test_copy_for_retransmit()
     picoquic_cnx_t * cnx = NULL;
     int ret = 0;
     picoquic_packet_t old_p;
+    uint8_t old_bytes[PICOQUIC_MAX_PACKET_SIZE];
     uint8_t new_bytes[PICOQUIC_MAX_PACKET_SIZE];
     size_t length = 0;
     int packet_is_pure_ack = 0;
@@ -1737,6 +1738,7 @@ int test_copy_for_retransmit()
 
         /* Initialize the old packet */
         memset(&old_p, 0, sizeof(picoquic_packet_t));
+        old_p.bytes = old_bytes;
         if (copy_retransmit_case[i].packet_length > 0) {
             memcpy(old_p.bytes, copy_retransmit_case[i].packet, copy_retransmit_case[i].packet_length);
             old_p.length = copy_retransmit_case[i].packet_length;
@@ -404,37 +404,54 @@ int TlsStreamFrameTest()
 /*
  * Test creation and deletion of streams.
  */
-int check_stream_splay_node_sanity(picosplay_node_t *x, void *floor, void *ceil, picosplay_comparator comp) {
+int check_stream_table_sanity(picoquic_cnx_t* cnx)
+{
     int count = 0;
 
-    if (x != NULL) {
-        count = 1;
-        if (x->left != NULL) {
-            if (x->left->parent == x) {
-                void *new_floor;
-                if (floor == NULL || comp(picoquic_stream_from_node(x), floor) < 0)
-                    new_floor = picoquic_stream_from_node(x);
-                else
-                    new_floor = floor;
-                count += check_stream_splay_node_sanity(x->left, new_floor, ceil, comp);
+    for (int stream_type = 0; count >= 0 && stream_type < 4; stream_type++) {
+        picoquic_stream_table_t* table = &cnx->stream_table[stream_type];
+        size_t table_count = 0;
+
+        if (table->nb_pages > 0 && (table->page[0] == NULL || table->page[table->nb_pages - 1] == NULL)) {
+            DBG_PRINTF("Stream table %d has empty pages at the edges.\n", stream_type);
+            count = -1;
+            break;
+        }
+
+        for (size_t i = 0; count >= 0 && i < table->nb_pages; i++) {
+            picoquic_stream_page_t* page = table->page[i];
+            size_t page_count = 0;
+
+            if (page == NULL) {
+                continue;
             }
-            else {
-                DBG_PRINTF("%s", "Invalid node, left->parent != node.\n");
+            for (int slot = 0; slot < PICOQUIC_STREAM_PAGE_SIZE; slot++) {
+                picoquic_stream_head_t* stream = page->stream[slot];
+                if (stream != NULL) {
+                    uint64_t expected_id = ((((table->first_page + i) << PICOQUIC_STREAM_PAGE_BITS) + slot) << 2) | stream_type;
+                    if (stream->stream_id != expected_id) {
+                        DBG_PRINTF("Stream %d found at place of stream %d.\n", (int)stream->stream_id, (int)expected_id);
+                        count = -1;
+                        break;
+                    }
+                    page_count++;
+                }
+            }
+            if (count >= 0 && (page_count == 0 || page_count != page->nb_streams)) {
+                DBG_PRINTF("Page %d of table %d has %d streams, expected %d.\n",
+                    (int)i, stream_type, (int)page_count, (int)page->nb_streams);
                 count = -1;
             }
+            table_count += page_count;
         }
-        if (x->right != NULL && count > 0) {
-            if (x->right->parent == x) {
-                void *new_ceil;
-                if (ceil == NULL || comp(picoquic_stream_from_node(x), ceil) > 0)
-                    new_ceil = picoquic_stream_from_node(x);
-                else
-                    new_ceil = ceil;
-                count += check_stream_splay_node_sanity(x->right, floor, new_ceil, comp);
+
+        if (count >= 0) {
+            if (table_count != table->nb_streams) {
+                DBG_PRINTF("Table %d has %d streams, expected %d.\n", stream_type, (int)table_count, (int)table->nb_streams);
+                count = -1;
             }
             else {
-                DBG_PRINTF("%s", "Invalid node, left->parent != node.\n");
-                count = -1;
+                count += (int)table_count;
             }
         }
     }
@@ -486,15 +503,15 @@ int stream_splay_test()
             for (int i = 0; ret == 0 && i < 7; i++) {
                 picoquic_create_stream(cnx, values[i]);
                 /* Verify sanity and count after each insertion */
-                count = check_stream_splay_node_sanity(cnx->stream_tree.root, NULL, NULL, cnx->stream_tree.comp);
+                count = check_stream_table_sanity(cnx);
                 if (count != i + 1) {
                     DBG_PRINTF("Insert v[%d] = %d, expected %d nodes, got %d instead\n",
                         i, values[i], i + 1, count);
                     ret = -1;
                 }
-                else if (cnx->stream_tree.size != count) {
-                    DBG_PRINTF("Insert v[%d] = %d, expected tree size %d, got %d instead\n",
-                        i, values[i], count, cnx->stream_tree.size);
+                else if (picoquic_nb_streams(cnx) != (size_t)count) {
+                    DBG_PRINTF("Insert v[%d] = %d, expected %d streams, got %d instead\n",
+                        i, values[i], count, (int)picoquic_nb_streams(cnx));
                     ret = -1;
                 }
                 else if (picoquic_first_stream(cnx)->stream_id != values_first[i]) {
@@ -523,7 +540,7 @@ int stream_splay_test()
                     ret = -1;
                 }
                 else {
-                    stream = picoquic_next_stream(stream);
+                    stream = picoquic_next_stream(cnx, stream);
                     rank++;
                 }
             }
@@ -539,15 +556,15 @@ int stream_splay_test()
                 }
                 picoquic_delete_stream(cnx, stream);
                 /* Verify sanity and count after each deletion */
-                count = check_stream_splay_node_sanity(cnx->stream_tree.root, NULL, NULL, cnx->stream_tree.comp);
+                count = check_stream_table_sanity(cnx);
                 if (count != 6 - i) {
                     DBG_PRINTF("Delete v[%d] = %d, expected %d nodes, got %d instead\n",
                         i, values[i], 6 - i, count);
                     ret = -1;
                 }
-                else if (cnx->stream_tree.size != count) {
-                    DBG_PRINTF("Insert v[%d] = %d, expected cnx->stream_tree size %d, got %d instead\n",
-                        i, values[i], count, cnx->stream_tree.size);
+                else if (picoquic_nb_streams(cnx) != (size_t)count) {
+                    DBG_PRINTF("Delete v[%d] = %d, expected %d streams, got %d instead\n",
+                        i, values[i], count, (int)picoquic_nb_streams(cnx));
                     ret = -1;
                 }
                 else if (i < 6) {
@@ -564,8 +581,8 @@ int stream_splay_test()
                 }
             }
 
-            if (ret == 0 && cnx->stream_tree.root != NULL) {
-                DBG_PRINTF("%s", "Final cnx->stream_tree root should be NULL, is not.\n");
+            if (ret == 0 && (picoquic_first_stream(cnx) != NULL || picoquic_nb_streams(cnx) != 0)) {
+                DBG_PRINTF("%s", "Final stream table should be empty, is not.\n");
                 ret = -1;
             }
 
@@ -580,6 +597,147 @@ int stream_splay_test()
     return ret;
 }
 
+/* Test that the stream table slides as streams are opened and closed,
+ * and remains consistent when streams are opened out of order.
+ */
+int stream_table_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    const int nb_bidir = 1000;
+    const int nb_unidir = 300;
+    const int nb_deleted = 900;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic,
+        picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr*)&saddr,
+        simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+        ret = -1;
+    }
+    else {
+        picoquic_stream_head_t* stream;
+        int count = 0;
+
+        /* Open client bidir and unidir streams */
+        for (int i = 0; ret == 0 && i < nb_bidir; i++) {
+            if (picoquic_create_stream(cnx, 4 * (uint64_t)i) == NULL) {
+                ret = -1;
+            }
+        }
+        for (int i = 0; ret == 0 && i < nb_unidir; i++) {
+            if (picoquic_create_stream(cnx, 4 * (uint64_t)i + 2) == NULL) {
+                ret = -1;
+            }
+        }
+        if (ret != 0) {
+            DBG_PRINTF("%s", "Cannot create streams\n");
+        }
+        else if ((count = check_stream_table_sanity(cnx)) != nb_bidir + nb_unidir) {
+            DBG_PRINTF("Expected %d streams, got %d\n", nb_bidir + nb_unidir, count);
+            ret = -1;
+        }
+
+        /* Check that iteration follows the order of stream IDs */
+        if (ret == 0) {
+            uint64_t last_id = 0;
+
+            count = 0;
+            stream = picoquic_first_stream(cnx);
+            while (stream != NULL) {
+                if (count > 0 && stream->stream_id <= last_id) {
+                    DBG_PRINTF("Stream %d listed after %d\n", (int)stream->stream_id, (int)last_id);
+                    ret = -1;
+                    break;
+                }
+                last_id = stream->stream_id;
+                count++;
+                stream = picoquic_next_stream(cnx, stream);
+            }
+            if (ret == 0 && (count != nb_bidir + nb_unidir || last_id != 4 * (uint64_t)(nb_bidir - 1))) {
+                DBG_PRINTF("Iterated %d streams, last %d\n", count, (int)last_id);
+                ret = -1;
+            }
+        }
+
+        /* Close the oldest bidir streams, and check that the table slides */
+        for (int i = 0; ret == 0 && i < nb_deleted; i++) {
+            if ((stream = picoquic_find_stream(cnx, 4 * (uint64_t)i)) == NULL) {
+                DBG_PRINTF("Cannot find stream %d\n", 4 * i);
+                ret = -1;
+            }
+            else {
+                picoquic_delete_stream(cnx, stream);
+            }
+        }
+        if (ret == 0) {
+            picoquic_stream_table_t* table = &cnx->stream_table[0];
+
+            if ((count = check_stream_table_sanity(cnx)) != nb_bidir + nb_unidir - nb_deleted) {
+                DBG_PRINTF("Expected %d streams after deletion, got %d\n", nb_bidir + nb_unidir - nb_deleted, count);
+                ret = -1;
+            }
+            else if (table->first_page != (nb_deleted >> PICOQUIC_STREAM_PAGE_BITS) ||
+                table->nb_pages != ((nb_bidir - 1) >> PICOQUIC_STREAM_PAGE_BITS) - (nb_deleted >> PICOQUIC_STREAM_PAGE_BITS) + 1) {
+                DBG_PRINTF("Table starts at page %d with %d pages\n", (int)table->first_page, (int)table->nb_pages);
+                ret = -1;
+            }
+            else if (picoquic_find_stream(cnx, 4 * (uint64_t)(nb_deleted - 1)) != NULL ||
+                (stream = picoquic_find_stream(cnx, 4 * (uint64_t)nb_deleted)) == NULL ||
+                stream->stream_id != 4 * (uint64_t)nb_deleted ||
+                picoquic_first_stream(cnx)->stream_id != 2) {
+                DBG_PRINTF("%s", "Unexpected stream found after deletion\n");
+                ret = -1;
+            }
+        }
+
+        /* Open a lower stream again, then close it */
+        if (ret == 0) {
+            if ((stream = picoquic_create_stream(cnx, 8)) == NULL) {
+                DBG_PRINTF("%s", "Cannot create stream 8\n");
+                ret = -1;
+            }
+            else if (check_stream_table_sanity(cnx) != nb_bidir + nb_unidir - nb_deleted + 1 ||
+                picoquic_find_stream(cnx, 8) != stream || picoquic_next_stream(cnx, stream)->stream_id != 10 ||
+                cnx->stream_table[0].first_page != 0) {
+                DBG_PRINTF("%s", "Stream 8 not properly inserted\n");
+                ret = -1;
+            }
+            else {
+                picoquic_delete_stream(cnx, stream);
+                if (check_stream_table_sanity(cnx) != nb_bidir + nb_unidir - nb_deleted ||
+                    cnx->stream_table[0].first_page != (nb_deleted >> PICOQUIC_STREAM_PAGE_BITS)) {
+                    DBG_PRINTF("%s", "Stream 8 not properly removed\n");
+                    ret = -1;
+                }
+            }
+        }
+
+        /* The remaining streams are deleted with the connection */
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
 /* Test that the list of active streams is properly maintained */
 
 static int stream_output_test_callback(picoquic_cnx_t* cnx,
@@ -615,10 +773,8 @@ static int stream_output_test_list(picoquic_cnx_t * cnx, size_t nb_output, uint6
             break;
         }
         else if (nb_found >= nb_output) {
-            if (nb_found < nb_output) {
-                DBG_PRINTF("Stream[%d] is not NULL\n", (int)nb_found);
-                ret = -1;
-            }
+            DBG_PRINTF("Stream[%d] is not NULL\n", (int)nb_found);
+            ret = -1;
         }
         else if (stream->stream_id != output[nb_found]) {
             DBG_PRINTF("Stream[%d].stream_id = %d, expected %d\n", (int)nb_found, (int)stream->stream_id, (int)output[nb_found]);
@@ -767,19 +923,12 @@ int stream_output_test()
 
             cnx->high_priority_stream_id = 1;
 
-            /* Create the list of streams */
+            /* Create the list of streams. The streams are idle until they have something to send */
             for (int i = 0; i < 7; i++) {
                 picoquic_create_stream(cnx, values[i]);
             }
 
-            ret = stream_output_test_list(cnx, sizeof(output1) / sizeof(uint64_t), output1);
-
-            if (ret == 0) {
-                /* Relax the max stream id value and test order again */
-                picoquic_add_output_streams(cnx, cnx->max_stream_id_bidir_remote, 8, 1);
-                cnx->max_stream_id_bidir_remote = 8;
-                ret = stream_output_test_list(cnx, sizeof(output2) / sizeof(uint64_t), output2);
-            }
+            ret = stream_output_test_list(cnx, 0, NULL);
 
             if (ret == 0) {
                 /* Check that find ready stream returns NULL when no stream is ready */
@@ -791,15 +940,29 @@ int stream_output_test()
             }
 
             if (ret == 0) {
-                /* Mark all streams as active */
-                stream = cnx->first_output_stream;
-
-                while (stream != NULL) {
+                /* Mark all streams as active. Stream 3 cannot send, stream 8 is blocked by the stream limit */
+                for (int i = 0; i < 7; i++) {
+                    stream = picoquic_find_stream(cnx, values[i]);
                     stream->maxdata_remote = 4096;
-                    picoquic_mark_active_stream(cnx, stream->stream_id, 1, NULL);
-                    stream = stream->next_output_stream;
+                    picoquic_mark_active_stream(cnx, values[i], 1, NULL);
                 }
 
+                ret = stream_output_test_list(cnx, sizeof(output1) / sizeof(uint64_t), output1);
+
+                if (ret == 0 && (stream = picoquic_find_stream(cnx, 8)) != NULL && !stream->is_blocked_stream) {
+                    DBG_PRINTF("%s", "Stream 8 is not in the blocked list\n");
+                    ret = -1;
+                }
+            }
+
+            if (ret == 0) {
+                /* Relax the max stream id value and test order again */
+                picoquic_add_output_streams(cnx, cnx->max_stream_id_bidir_remote, 8, 1);
+                cnx->max_stream_id_bidir_remote = 8;
+                ret = stream_output_test_list(cnx, sizeof(output2) / sizeof(uint64_t), output2);
+            }
+
+            if (ret == 0) {
                 /* Check that first stream is what we expect */
                 stream = picoquic_find_ready_stream(cnx);
                 if (stream == NULL) {
@@ -830,6 +993,339 @@ int stream_output_test()
     return ret;
 }
 
+/* Test that the output list is ordered by urgency, that streams of the
+ * same urgency are served in order, and that incremental streams of
+ * the same urgency are served in round robin.
+ */
+
+static int stream_priority_test_next(picoquic_cnx_t* cnx, size_t nb_ids, const uint64_t* stream_id, uint64_t* served_id)
+{
+    int ret = 0;
+    uint8_t buffer[64];
+    uint64_t sent_offset[8];
+    int more_data = 0;
+    int is_pure_ack = 1;
+    int stream_tried_and_failed = 0;
+
+    *served_id = UINT64_MAX;
+
+    for (size_t i = 0; i < nb_ids && i < 8; i++) {
+        picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id[i]);
+        sent_offset[i] = (stream == NULL) ? 0 : stream->sent_offset;
+    }
+
+    (void)picoquic_format_available_stream_frames(cnx, buffer, buffer + sizeof(buffer), &more_data,
+        &is_pure_ack, &stream_tried_and_failed, &ret);
+
+    for (size_t i = 0; ret == 0 && i < nb_ids && i < 8; i++) {
+        picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id[i]);
+        if (stream != NULL && stream->sent_offset > sent_offset[i]) {
+            if (*served_id != UINT64_MAX) {
+                DBG_PRINTF("Streams %d and %d served in the same packet\n", (int)*served_id, (int)stream_id[i]);
+                ret = -1;
+            }
+            else {
+                *served_id = stream_id[i];
+            }
+        }
+    }
+
+    return ret;
+}
+
+int stream_priority_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    uint64_t values[] = { 0, 4, 8, 12, 16, 20 };
+    uint8_t urgency[] = { 3, 1, 5, 1, 3, 3 };
+    int is_incremental[] = { 0, 0, 0, 0, 1, 1 };
+    size_t data_length[] = { 50, 50, 1000, 50, 1000, 1000 };
+    uint64_t served_id_list[] = { 0, 4, 8, 12, 16, 20, 24 };
+    uint64_t output1[] = { 4, 12, 0, 16, 20, 8 };
+    uint64_t output2[] = { 8, 4, 12, 0, 16, 20 };
+    uint64_t output3[] = { 8, 4, 24, 12, 0, 16, 20 };
+    uint64_t served_ref[] = { 4, 24, 12, 0, 16, 20, 16, 20 };
+    uint8_t data[1000];
+
+    memset(data, 0x5a, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(quic,
+            picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr *) &saddr,
+            simulated_time, 0, "test-sni", "test-alpn", 1);
+
+        if (cnx == NULL) {
+            DBG_PRINTF("%s", "Cannot create connection\n");
+            ret = -1;
+        }
+        else {
+            picoquic_set_callback(cnx, stream_output_test_callback, NULL);
+            /* Set parameter data to a plausible value so tests can run */
+            cnx->maxdata_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+            cnx->remote_parameters.initial_max_stream_data_bidi_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+            cnx->max_stream_id_bidir_remote = 100;
+
+            /* Create the streams by setting their priorities, then queue data */
+            for (size_t i = 0; ret == 0 && i < sizeof(values) / sizeof(uint64_t); i++) {
+                if ((ret = picoquic_set_stream_priority(cnx, values[i], urgency[i], is_incremental[i])) != 0) {
+                    DBG_PRINTF("Cannot set priority of stream %d, ret = 0x%x\n", (int)values[i], ret);
+                }
+            }
+
+            if (ret == 0) {
+                /* Streams are not listed until they have something to send */
+                ret = stream_output_test_list(cnx, 0, NULL);
+            }
+
+            for (size_t i = 0; ret == 0 && i < sizeof(values) / sizeof(uint64_t); i++) {
+                ret = picoquic_add_to_stream(cnx, values[i], data, data_length[i], 0);
+            }
+
+            if (ret == 0) {
+                ret = stream_output_test_list(cnx, sizeof(output1) / sizeof(uint64_t), output1);
+            }
+
+            if (ret == 0 && picoquic_set_stream_priority(cnx, 8, PICOQUIC_STREAM_URGENCY_MAX + 1, 0) == 0) {
+                DBG_PRINTF("%s", "Out of range urgency accepted\n");
+                ret = -1;
+            }
+
+            if (ret == 0) {
+                /* Changing the urgency moves the stream in the list */
+                ret = picoquic_set_stream_priority(cnx, 8, 0, 0);
+                if (ret == 0) {
+                    ret = stream_output_test_list(cnx, sizeof(output2) / sizeof(uint64_t), output2);
+                }
+            }
+
+            if (ret == 0) {
+                /* Removing the last stream of a group, then adding a stream to that group */
+                picoquic_stream_head_t* stream = picoquic_find_stream(cnx, 12);
+                picoquic_remove_output_stream(cnx, stream, NULL);
+                if ((ret = picoquic_set_stream_priority(cnx, 24, 1, 0)) == 0 &&
+                    (ret = picoquic_add_to_stream(cnx, 24, data, 50, 0)) == 0) {
+                    picoquic_insert_output_stream(cnx, stream);
+                    ret = stream_output_test_list(cnx, sizeof(output3) / sizeof(uint64_t), output3);
+                }
+            }
+
+            if (ret == 0) {
+                /* Move stream 8 to the lowest urgency. The short messages are then
+                 * sent one at a time by urgency, followed by the incremental streams
+                 * in round robin */
+                ret = picoquic_set_stream_priority(cnx, 8, 5, 0);
+            }
+
+            /* Check the order in which streams are served */
+            for (size_t i = 0; ret == 0 && i < sizeof(served_ref) / sizeof(uint64_t); i++) {
+                uint64_t served_id;
+
+                ret = stream_priority_test_next(cnx, sizeof(served_id_list) / sizeof(uint64_t), served_id_list, &served_id);
+                if (ret == 0 && served_id != served_ref[i]) {
+                    DBG_PRINTF("Packet %d serves stream %d instead of %d\n", (int)i, (int)served_id, (int)served_ref[i]);
+                    ret = -1;
+                }
+            }
+
+            picoquic_delete_cnx(cnx);
+            cnx = NULL;
+        }
+
+        picoquic_free(quic);
+        quic = NULL;
+    }
+
+    return ret;
+}
+
+/* Test that buffers queued with picoquic_add_buffer_to_stream are sent
+ * without copy, and released exactly once, either after the last byte is
+ * sent or when the connection is deleted. Also test that the application
+ * can queue the next buffer from the release callback.
+ */
+typedef struct st_stream_buffer_test_ctx_t {
+    uint8_t* bytes;
+    size_t length;
+    int nb_released;
+    picoquic_cnx_t* cnx;
+    uint64_t refill_stream_id;
+    int nb_refills;
+} stream_buffer_test_ctx_t;
+
+static void stream_buffer_test_release(void* release_ctx, uint8_t* bytes, size_t length)
+{
+    stream_buffer_test_ctx_t* ctx = (stream_buffer_test_ctx_t*)release_ctx;
+
+    if (bytes == ctx->bytes && length == ctx->length) {
+        ctx->nb_released++;
+        if (ctx->nb_refills > 0) {
+            ctx->nb_refills--;
+            if (picoquic_add_buffer_to_stream(ctx->cnx, ctx->refill_stream_id, ctx->bytes, ctx->length,
+                ctx->nb_refills == 0, NULL, stream_buffer_test_release, ctx) != 0) {
+                ctx->nb_released = -1;
+            }
+        }
+    }
+    else {
+        ctx->nb_released = -1;
+    }
+}
+
+int stream_buffer_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    uint8_t data[3000];
+    uint8_t data2[500];
+    uint8_t data3[700];
+    stream_buffer_test_ctx_t ctx = { data, sizeof(data), 0 };
+    stream_buffer_test_ctx_t ctx2 = { data2, sizeof(data2), 0 };
+    stream_buffer_test_ctx_t ctx3 = { data3, sizeof(data3), 0 };
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+    memset(data2, 0x5a, sizeof(data2));
+    memset(data3, 0xa5, sizeof(data3));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic,
+        picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr*)&saddr,
+        simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+        ret = -1;
+    }
+    else {
+        picoquic_stream_head_t* stream = NULL;
+
+        cnx->maxdata_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+        cnx->max_stream_id_bidir_remote = 12;
+
+        if (picoquic_add_buffer_to_stream(cnx, 4, data, sizeof(data), 1, NULL, NULL, NULL) == 0) {
+            DBG_PRINTF("%s", "Buffer accepted without release function\n");
+            ret = -1;
+        }
+        else if ((ret = picoquic_add_buffer_to_stream(cnx, 4, data, sizeof(data), 1, NULL,
+            stream_buffer_test_release, &ctx)) != 0 ||
+            (ret = picoquic_add_buffer_to_stream(cnx, 8, data2, sizeof(data2), 0, NULL,
+            stream_buffer_test_release, &ctx2)) != 0) {
+            DBG_PRINTF("Cannot queue buffer, ret = 0x%x\n", ret);
+        }
+        else if ((stream = picoquic_find_stream(cnx, 4)) == NULL ||
+            stream->send_queue == NULL || stream->send_queue->bytes != data) {
+            DBG_PRINTF("%s", "Buffer was copied\n");
+            ret = -1;
+        }
+
+        /* Send the data on stream 4, in chunks smaller than the buffer */
+        while (ret == 0 && !stream->fin_sent) {
+            uint8_t buffer[1024];
+            uint8_t* bytes;
+            uint64_t sent_offset = stream->sent_offset;
+            int more_data = 0;
+            int is_pure_ack = 1;
+            int is_still_active = 0;
+
+            bytes = picoquic_format_stream_frame(cnx, stream, buffer, buffer + sizeof(buffer),
+                &more_data, &is_pure_ack, &is_still_active, &ret);
+
+            if (ret == 0) {
+                size_t length = (size_t)(stream->sent_offset - sent_offset);
+
+                if (bytes == NULL || length == 0 || bytes - buffer < (ptrdiff_t)length ||
+                    memcmp(bytes - length, data + sent_offset, length) != 0) {
+                    DBG_PRINTF("Unexpected frame content after offset %d\n", (int)sent_offset);
+                    ret = -1;
+                }
+                else if (ctx.nb_released != ((stream->sent_offset < sizeof(data)) ? 0 : 1)) {
+                    DBG_PRINTF("Buffer released %d times at offset %d\n", ctx.nb_released, (int)stream->sent_offset);
+                    ret = -1;
+                }
+            }
+        }
+
+        /* On stream 12, each buffer is queued again from the release callback,
+         * until the last one that carries the FIN */
+        if (ret == 0) {
+            ctx3.cnx = cnx;
+            ctx3.refill_stream_id = 12;
+            ctx3.nb_refills = 3;
+            if ((ret = picoquic_add_buffer_to_stream(cnx, 12, data3, sizeof(data3), 0, NULL,
+                stream_buffer_test_release, &ctx3)) != 0 ||
+                (stream = picoquic_find_stream(cnx, 12)) == NULL) {
+                DBG_PRINTF("Cannot queue buffer on stream 12, ret = 0x%x\n", ret);
+                ret = -1;
+            }
+        }
+
+        for (int nb_frames = 0; ret == 0 && !stream->fin_sent && ctx3.nb_released >= 0 && nb_frames < 16; nb_frames++) {
+            uint8_t buffer[1024];
+            int more_data = 0;
+            int is_pure_ack = 1;
+            int is_still_active = 0;
+
+            if (picoquic_format_stream_frame(cnx, stream, buffer, buffer + sizeof(buffer),
+                &more_data, &is_pure_ack, &is_still_active, &ret) == NULL && ret == 0) {
+                DBG_PRINTF("%s", "Cannot format frame on stream 12\n");
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && (ctx3.nb_released != 4 || stream->sent_offset != 4 * sizeof(data3) ||
+            stream->send_queue != NULL || !stream->fin_sent)) {
+            DBG_PRINTF("Refilled buffer released %d times, %d bytes sent\n", ctx3.nb_released, (int)stream->sent_offset);
+            ret = -1;
+        }
+
+        /* The buffer queued on stream 8 is released when the connection is deleted */
+        if (ret == 0 && ctx2.nb_released != 0) {
+            DBG_PRINTF("%s", "Second buffer released before connection deletion\n");
+            ret = -1;
+        }
+        picoquic_delete_cnx(cnx);
+        if (ret == 0 && (ctx.nb_released != 1 || ctx2.nb_released != 1)) {
+            DBG_PRINTF("Buffers released %d and %d times\n", ctx.nb_released, ctx2.nb_released);
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
 
 /* Test the STREAM ID and STREAM RANK macros
  */
@@ -875,4 +1371,239 @@ int stream_rank_test()
     ret |= stream_rank_test_one(n, stream_rank, stream_server_unidir, 1, 1);
 
     return ret;
-}
\ No newline at end of file
+}
+
+/* Test that a region of a file queued with picoquic_add_file_to_stream
+ * is sent with the expected content, after the file itself is closed.
+ */
+static char const* stream_file_test_name = "stream_file_test.bin";
+
+int stream_file_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    uint8_t data[10000];
+    const size_t region_offset = 1001;
+    const size_t region_length = 5000;
+    FILE* F = NULL;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    if ((F = picoquic_file_open(stream_file_test_name, "wb")) == NULL ||
+        fwrite(data, 1, sizeof(data), F) != sizeof(data)) {
+        DBG_PRINTF("Cannot write %s\n", stream_file_test_name);
+        ret = -1;
+    }
+    F = picoquic_file_close(F);
+
+    if (ret == 0) {
+        quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+            NULL, NULL, NULL, NULL, simulated_time,
+            &simulated_time, NULL, NULL, 0);
+
+        memset(&saddr, 0, sizeof(struct sockaddr_in));
+        saddr.sin_family = AF_INET;
+        saddr.sin_port = 1000;
+
+        if (quic == NULL) {
+            DBG_PRINTF("%s", "Cannot create QUIC context\n");
+            ret = -1;
+        }
+        else if ((cnx = picoquic_create_cnx(quic,
+            picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr*)&saddr,
+            simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+            DBG_PRINTF("%s", "Cannot create connection\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_stream_head_t* stream = NULL;
+
+        cnx->maxdata_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+        cnx->max_stream_id_bidir_remote = 4;
+
+        if ((F = picoquic_file_open(stream_file_test_name, "rb")) == NULL) {
+            DBG_PRINTF("Cannot open %s\n", stream_file_test_name);
+            ret = -1;
+        }
+        else if (picoquic_add_file_to_stream(cnx, 4, F, sizeof(data) - 10, 20, 1, NULL) != PICOQUIC_ERROR_INVALID_FILE) {
+            DBG_PRINTF("%s", "Region past the end of file was accepted\n");
+            ret = -1;
+        }
+        else if ((ret = picoquic_add_file_to_stream(cnx, 4, F, region_offset, region_length, 1, NULL)) != 0) {
+            DBG_PRINTF("Cannot queue file region, ret = 0x%x\n", ret);
+        }
+        F = picoquic_file_close(F);
+
+        if (ret == 0 && (stream = picoquic_find_stream(cnx, 4)) == NULL) {
+            DBG_PRINTF("%s", "Cannot find stream 4\n");
+            ret = -1;
+        }
+
+        while (ret == 0 && !stream->fin_sent) {
+            uint8_t buffer[1024];
+            uint8_t* bytes;
+            uint64_t sent_offset = stream->sent_offset;
+            int more_data = 0;
+            int is_pure_ack = 1;
+            int is_still_active = 0;
+
+            bytes = picoquic_format_stream_frame(cnx, stream, buffer, buffer + sizeof(buffer),
+                &more_data, &is_pure_ack, &is_still_active, &ret);
+
+            if (ret == 0) {
+                size_t length = (size_t)(stream->sent_offset - sent_offset);
+
+                if (bytes == NULL || length == 0 || bytes - buffer < (ptrdiff_t)length ||
+                    memcmp(bytes - length, data + region_offset + sent_offset, length) != 0) {
+                    DBG_PRINTF("Unexpected frame content after offset %d\n", (int)sent_offset);
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0 && stream->sent_offset != region_length) {
+            DBG_PRINTF("Sent %d bytes instead of %d\n", (int)stream->sent_offset, (int)region_length);
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Receive window auto-tuning: the window follows the measured amount of
+ * data per RTT, and the growth of connection windows is capped for the
+ * whole QUIC context.
+ */
+int receive_window_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx[2] = { NULL, NULL };
+    uint64_t simulated_time = 0;
+    uint64_t rtt = 10000;
+    struct sockaddr_in saddr;
+    picoquic_receive_window_t receive_window;
+    uint64_t tune_offset[4] = { 50000, 50000, 150000, 160000 };
+    uint64_t tune_time[4] = { 5000, 10000, 20000, 30000 };
+    uint64_t tune_expected[4] = { 10000, 100000, 400000, 400000 };
+
+    /* Twice the data per RTT, more if the rate increases, never less */
+    memset(&receive_window, 0, sizeof(picoquic_receive_window_t));
+    receive_window.window = 10000;
+    for (int i = 0; ret == 0 && i < 4; i++) {
+        uint64_t desired = picoquic_tune_receive_window(&receive_window, tune_offset[i], rtt, tune_time[i]);
+
+        if (desired != tune_expected[i]) {
+            DBG_PRINTF("Tuning step %d, window %" PRIu64 " instead of %" PRIu64 "\n", i, desired, tune_expected[i]);
+            ret = -1;
+        }
+        receive_window.window = desired;
+    }
+
+    if (ret == 0) {
+        quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+            NULL, NULL, NULL, NULL, simulated_time,
+            &simulated_time, NULL, NULL, 0);
+
+        memset(&saddr, 0, sizeof(struct sockaddr_in));
+        saddr.sin_family = AF_INET;
+
+        if (quic == NULL) {
+            DBG_PRINTF("%s", "Cannot create QUIC context\n");
+            ret = -1;
+        }
+        else {
+            picoquic_set_receive_window_growth_max(quic, 1000000);
+            for (int i = 0; ret == 0 && i < 2; i++) {
+                saddr.sin_port = (uint16_t)(1000 + i);
+                if ((cnx[i] = picoquic_create_cnx(quic,
+                    picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr*)&saddr,
+                    simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+                    DBG_PRINTF("%s", "Cannot create connection\n");
+                    ret = -1;
+                }
+                else {
+                    cnx[i]->path[0]->smoothed_rtt = rtt;
+                }
+            }
+        }
+    }
+
+    /* The first connection takes all the budget, the second cannot grow */
+    if (ret == 0) {
+        uint64_t initial_window = cnx[0]->receive_window.window;
+
+        for (int i = 0; i < 2; i++) {
+            cnx[i]->data_received = 10 * initial_window;
+            picoquic_tune_connection_receive_window(cnx[i], rtt);
+        }
+        if (cnx[0]->receive_window.window != initial_window + 1000000 ||
+            cnx[1]->receive_window.window != initial_window ||
+            quic->receive_window_growth_total != 1000000) {
+            DBG_PRINTF("Unexpected windows %" PRIu64 ", %" PRIu64 "\n",
+                cnx[0]->receive_window.window, cnx[1]->receive_window.window);
+            ret = -1;
+        }
+        else if (!picoquic_should_send_max_data(cnx[0])) {
+            DBG_PRINTF("%s", "Max data not needed after window growth\n");
+            ret = -1;
+        }
+    }
+
+    /* A stream window is tuned on consumed data, up to the connection window */
+    if (ret == 0) {
+        picoquic_stream_head_t* stream = picoquic_create_stream(cnx[0], 1);
+
+        if (stream == NULL) {
+            ret = -1;
+        }
+        else {
+            stream->consumed_offset = 100 * stream->maxdata_local;
+            if (!picoquic_is_stream_max_data_needed(cnx[0], stream, 2 * rtt) ||
+                stream->receive_window.window != cnx[0]->receive_window.window) {
+                DBG_PRINTF("Unexpected stream window %" PRIu64 "\n", stream->receive_window.window);
+                ret = -1;
+            }
+        }
+    }
+
+    /* When a connection is deleted, its growth returns to the budget */
+    if (ret == 0) {
+        picoquic_delete_cnx(cnx[0]);
+        cnx[0] = NULL;
+        cnx[1]->data_received *= 2;
+        picoquic_tune_connection_receive_window(cnx[1], 2 * rtt);
+        if (quic->receive_window_growth_total != 1000000 || cnx[1]->receive_window_growth != 1000000) {
+            DBG_PRINTF("Unexpected growth after delete: %" PRIu64 "\n", quic->receive_window_growth_total);
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (cnx[i] != NULL) {
+            picoquic_delete_cnx(cnx[i]);
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -409,7 +409,7 @@ int token_reuse_api_test()
             if (picoquic_registered_token_check_reuse(quic,
                 token_reuse_api_cases[i].token,
                 token_reuse_api_cases[i].token_length,
-                token_reuse_api_cases[i].expiry_date) != 0) {
+                token_reuse_api_cases[i].expiry_date, simulated_time) != 0) {
                 DBG_PRINTF("Token[%z] already used?", i);
                 ret = -1;
             }
@@ -419,7 +419,7 @@ int token_reuse_api_test()
             if (picoquic_registered_token_check_reuse(quic,
                 token_reuse_api_cases[i].token,
                 token_reuse_api_cases[i].token_length,
-                token_reuse_api_cases[i].expiry_date) == 0) {
+                token_reuse_api_cases[i].expiry_date, simulated_time) == 0) {
                 DBG_PRINTF("Token[%z] not already used?", i);
                 ret = -1;
             }
@@ -431,7 +431,7 @@ int token_reuse_api_test()
             int x = picoquic_registered_token_check_reuse(quic,
                 token_reuse_api_cases[i].token,
                 token_reuse_api_cases[i].token_length,
-                token_reuse_api_cases[i].expiry_date);
+                token_reuse_api_cases[i].expiry_date, test_time);
             if (x == 0 && token_reuse_api_cases[i].expiry_date >= test_time){
                 DBG_PRINTF("Token[%z], time %" PRIu64 " not already used?", i, token_reuse_api_cases[i].expiry_date);
                 ret = -1;
@@ -445,7 +445,7 @@ int token_reuse_api_test()
         for (size_t l = 0; ret == 0 && l < 8; l++) {
             if (picoquic_registered_token_check_reuse(quic,
                 token_reuse_api_cases[0].token, l,
-                token_reuse_api_cases[0].expiry_date) == 0) {
+                token_reuse_api_cases[0].expiry_date, test_time) == 0) {
                 DBG_PRINTF("Token[1] length %z accepted?", l);
                 ret = -1;
             }
@@ -455,4 +455,482 @@ int token_reuse_api_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
+
+/* Fill the store up to its cap with tokens in two slots, expiring at two
+ * different times. The tables and filters of the slots are resized several
+ * times; the replays must still be detected. Once the store is full, a new
+ * token is still accepted, and the slot nearest to expiry is evicted.
+ */
+#define TOKEN_REUSE_CAP_NB_TOKENS 1000
+
+static int token_reuse_cap_register(picoquic_quic_t* quic, uint64_t seed, uint64_t expiry_time, uint64_t current_time,
+    int nb_tokens, int is_replay)
+{
+    int ret = 0;
+    uint64_t random_context = seed;
+    uint8_t token[16];
+
+    memset(token, 0, 8);
+    for (int i = 0; ret == 0 && i < nb_tokens; i++) {
+        int r;
+
+        picoformat_64(token + 8, picoquic_test_random(&random_context));
+        r = picoquic_registered_token_check_reuse(quic, token, sizeof(token), expiry_time, current_time);
+        if ((r == 0) == (is_replay != 0)) {
+            DBG_PRINTF("Token %d, replay %d, returns %d", i, is_replay, r);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int token_reuse_cap_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    uint64_t expiry_first = PICOQUIC_TOKEN_DELAY_SHORT;
+    uint64_t expiry_last = expiry_first + PICOQUIC_TOKEN_REUSE_SLOT_WIDTH;
+    picoquic_quic_t* quic = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+        NULL, 0, &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context");
+        return -1;
+    }
+
+    picoquic_set_token_reuse_max(quic, TOKEN_REUSE_CAP_NB_TOKENS);
+
+    ret = token_reuse_cap_register(quic, 0xcab0c1a, expiry_first, simulated_time, TOKEN_REUSE_CAP_NB_TOKENS / 2, 0);
+    if (ret == 0) {
+        ret = token_reuse_cap_register(quic, 0xcab0c1b, expiry_last, simulated_time, TOKEN_REUSE_CAP_NB_TOKENS / 2, 0);
+    }
+    if (ret == 0) {
+        ret = token_reuse_cap_register(quic, 0xcab0c1a, expiry_first, simulated_time, TOKEN_REUSE_CAP_NB_TOKENS / 2, 1);
+    }
+    if (ret == 0) {
+        ret = token_reuse_cap_register(quic, 0xcab0c1b, expiry_last, simulated_time, TOKEN_REUSE_CAP_NB_TOKENS / 2, 1);
+    }
+    if (ret == 0 && quic->token_reuse.nb_tokens != TOKEN_REUSE_CAP_NB_TOKENS) {
+        DBG_PRINTF("Expected %d tokens, got %zu", TOKEN_REUSE_CAP_NB_TOKENS, quic->token_reuse.nb_tokens);
+        ret = -1;
+    }
+
+    /* The store is full: a new token evicts the slot expiring first */
+    if (ret == 0) {
+        ret = token_reuse_cap_register(quic, 0xf0110, expiry_last, simulated_time, 1, 0);
+    }
+    if (ret == 0 && quic->token_reuse.nb_tokens != TOKEN_REUSE_CAP_NB_TOKENS / 2 + 1) {
+        DBG_PRINTF("Expected %d tokens after eviction, got %zu", TOKEN_REUSE_CAP_NB_TOKENS / 2 + 1,
+            quic->token_reuse.nb_tokens);
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = token_reuse_cap_register(quic, 0xcab0c1b, expiry_last, simulated_time, TOKEN_REUSE_CAP_NB_TOKENS / 2, 1);
+    }
+    if (ret == 0) {
+        ret = token_reuse_cap_register(quic, 0xf0110, expiry_last, simulated_time, 1, 1);
+    }
+    if (ret == 0) {
+        /* The evicted tokens are forgotten */
+        ret = token_reuse_cap_register(quic, 0xcab0c1a, expiry_first, simulated_time, 1, 0);
+    }
+
+    picoquic_free(quic);
+
+    return ret;
+}
+
+/* Register a large number of tokens with short and long lifetimes over a
+ * simulated period of several hours, and verify that replays are detected
+ * until the token expires, and that expired slots are released.
+ */
+#define TOKEN_REUSE_SLOTS_NB_TOKENS 20000
+
+int token_reuse_slots_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    uint64_t random_context = 0x5ca1ab1e;
+    uint64_t* token_hash = (uint64_t*)malloc(sizeof(uint64_t) * TOKEN_REUSE_SLOTS_NB_TOKENS);
+    uint64_t* token_time = (uint64_t*)malloc(sizeof(uint64_t) * TOKEN_REUSE_SLOTS_NB_TOKENS);
+    picoquic_quic_t* quic = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+        NULL, 0, &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL || token_hash == NULL || token_time == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context");
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < TOKEN_REUSE_SLOTS_NB_TOKENS; i++) {
+        uint8_t token[16];
+        int k;
+        int r;
+
+        simulated_time += 1000000; /* One token per second */
+        picoquic_registered_token_clear(quic, simulated_time);
+
+        token_hash[i] = picoquic_test_random(&random_context);
+        token_time[i] = simulated_time + ((token_hash[i] & 1) ? PICOQUIC_TOKEN_DELAY_SHORT : PICOQUIC_TOKEN_DELAY_LONG/8);
+        memset(token, 0, 8);
+        picoformat_64(token + 8, token_hash[i]);
+
+        if (picoquic_registered_token_check_reuse(quic, token, sizeof(token), token_time[i], simulated_time) != 0) {
+            DBG_PRINTF("New token %d rejected", i);
+            ret = -1;
+            break;
+        }
+
+        /* Replay a previous token */
+        k = (int)picoquic_test_uniform_random(&random_context, (uint64_t)i + 1);
+        picoformat_64(token + 8, token_hash[k]);
+        r = picoquic_registered_token_check_reuse(quic, token, sizeof(token), token_time[k], simulated_time);
+        if ((r == 0) != (token_time[k] < simulated_time)) {
+            DBG_PRINTF("Replay of token %d at %d returns %d", k, i, r);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Tokens expiring within the last slot width may still be held, older ones must be freed */
+        size_t nb_held = 0;
+        for (int i = 0; i < PICOQUIC_TOKEN_REUSE_NB_SLOTS; i++) {
+            nb_held += quic->token_reuse.slots[i].nb_tokens;
+        }
+        if (nb_held > (size_t)((PICOQUIC_TOKEN_DELAY_LONG / 8 + PICOQUIC_TOKEN_REUSE_SLOT_WIDTH) / 1000000)) {
+            DBG_PRINTF("%zu tokens still held", nb_held);
+            ret = -1;
+        }
+        else if (nb_held != quic->token_reuse.nb_tokens) {
+            DBG_PRINTF("%zu tokens held, %zu counted", nb_held, quic->token_reuse.nb_tokens);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = token_reuse_cap_test();
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+    if (token_hash != NULL) {
+        free(token_hash);
+    }
+    if (token_time != NULL) {
+        free(token_time);
+    }
+
+    return ret;
+}
+
+/*
+ * Test that two QUIC contexts sharing an anti-replay store detect the
+ * reuse of a token first accepted by the other context, and that a
+ * context with its own store does not.
+ */
+int anti_replay_store_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 1000000;
+    picoquic_anti_replay_store_t* store = picoquic_anti_replay_store_create();
+    picoquic_quic_t* quic[3];
+
+    for (int i = 0; i < 3; i++) {
+        quic[i] = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+            NULL, 0, &simulated_time, NULL, NULL, 0);
+        if (quic[i] == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret != 0 || store == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC contexts or anti-replay store");
+        ret = -1;
+    }
+    else {
+        picoquic_set_anti_replay_fn(quic[0], picoquic_anti_replay_store_check, store);
+        picoquic_set_anti_replay_fn(quic[1], picoquic_anti_replay_store_check, store);
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_token_reuse_api_cases; i++) {
+        int x_first = (int)(i & 1);
+        uint64_t expiry_date = simulated_time + token_reuse_api_cases[i].expiry_date;
+
+        picoquic_registered_token_clear(quic[x_first], simulated_time);
+        picoquic_registered_token_clear(quic[1 - x_first], simulated_time);
+        picoquic_registered_token_clear(quic[2], simulated_time);
+
+        if (picoquic_registered_token_check_reuse(quic[x_first], token_reuse_api_cases[i].token,
+            token_reuse_api_cases[i].token_length, expiry_date, simulated_time) != 0) {
+            DBG_PRINTF("Token %zu rejected by first context", i);
+            ret = -1;
+        }
+        else if (picoquic_registered_token_check_reuse(quic[1 - x_first], token_reuse_api_cases[i].token,
+            token_reuse_api_cases[i].token_length, expiry_date, simulated_time) == 0) {
+            DBG_PRINTF("Token %zu reused on second context", i);
+            ret = -1;
+        }
+        else if (picoquic_registered_token_check_reuse(quic[2], token_reuse_api_cases[i].token,
+            token_reuse_api_cases[i].token_length, expiry_date, simulated_time) != 0) {
+            DBG_PRINTF("Token %zu rejected by separate context", i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Once the tokens have expired, the shared store ignores them. The
+         * context is not cleared, so the store only learns the current time
+         * from the check itself. */
+        uint64_t expiry_date = simulated_time + token_reuse_api_cases[0].expiry_date;
+
+        simulated_time += 1000000;
+
+        if (picoquic_registered_token_check_reuse(quic[1], token_reuse_api_cases[0].token,
+            token_reuse_api_cases[0].token_length, expiry_date, simulated_time) != 0) {
+            DBG_PRINTF("%s", "Token rejected after expiry");
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (quic[i] != NULL) {
+            picoquic_free(quic[i]);
+        }
+    }
+    if (store != NULL) {
+        picoquic_anti_replay_store_delete(store);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the indexed ticket and token stores of the QUIC context: lookups,
+ * replacement of older tickets, incremental saves, and reload of the
+ * saved file in a new context.
+ */
+static int ticket_store_index_compare(picoquic_quic_t* quic1, picoquic_quic_t* quic2, uint64_t current_time)
+{
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < nb_test_sni; i++) {
+        for (size_t j = 0; ret == 0 && j < nb_test_alpn; j++) {
+            uint8_t* ticket[2];
+            uint16_t ticket_length[2];
+            picoquic_tp_t tp[2];
+            int get_ret[2];
+
+            get_ret[0] = picoquic_get_session_ticket(quic1, current_time, test_sni[i], (uint16_t)strlen(test_sni[i]),
+                test_alpn[j], (uint16_t)strlen(test_alpn[j]), &ticket[0], &ticket_length[0], &tp[0], 0);
+            get_ret[1] = picoquic_get_session_ticket(quic2, current_time, test_sni[i], (uint16_t)strlen(test_sni[i]),
+                test_alpn[j], (uint16_t)strlen(test_alpn[j]), &ticket[1], &ticket_length[1], &tp[1], 0);
+            if (get_ret[0] != get_ret[1] || (get_ret[0] == 0 &&
+                (ticket_length[0] != ticket_length[1] || memcmp(ticket[0], ticket[1], ticket_length[0]) != 0))) {
+                DBG_PRINTF("Ticket mismatch for sni %zu, alpn %zu", i, j);
+                ret = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_test_sni; i++) {
+        for (size_t k = 0; ret == 0 && k < nb_test_ip_addr; k++) {
+            uint8_t* token[2] = { NULL, NULL };
+            uint16_t token_length[2];
+            int get_ret[2];
+
+            get_ret[0] = picoquic_get_retry_token(quic1, current_time, test_sni[i], (uint16_t)strlen(test_sni[i]),
+                test_ip_addr[k].ip_addr, test_ip_addr[k].ip_addr_length, &token[0], &token_length[0], 0);
+            get_ret[1] = picoquic_get_retry_token(quic2, current_time, test_sni[i], (uint16_t)strlen(test_sni[i]),
+                test_ip_addr[k].ip_addr, test_ip_addr[k].ip_addr_length, &token[1], &token_length[1], 0);
+            if (get_ret[0] != get_ret[1] || (get_ret[0] == 0 &&
+                (token_length[0] != token_length[1] || memcmp(token[0], token[1], token_length[0]) != 0))) {
+                DBG_PRINTF("Token mismatch for sni %zu, addr %zu", i, k);
+                ret = -1;
+            }
+            for (int x = 0; x < 2; x++) {
+                if (token[x] != NULL) {
+                    free(token[x]);
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+int ticket_store_index_test()
+{
+    int ret = 0;
+    uint64_t ticket_time = 40000000000ull;
+    uint64_t simulated_time = 50000000000ull;
+    uint32_t ttl = 100000;
+    uint8_t ticket[128];
+    uint8_t token[64];
+    uint8_t* ticket_found = NULL;
+    uint16_t ticket_length = 0;
+    uint8_t* token_found = NULL;
+    uint16_t token_length = 0;
+    picoquic_tp_t tp;
+    size_t nb_records_before = 0;
+    picoquic_quic_t* quic = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+        NULL, simulated_time, &simulated_time, NULL, NULL, 0);
+    picoquic_quic_t* quic_bis = NULL;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context");
+        ret = -1;
+    }
+
+    /* Store a ticket for each SNI and ALPN, and a token for each SNI and address */
+    for (size_t i = 0; ret == 0 && i < nb_test_sni; i++) {
+        for (size_t j = 0; ret == 0 && j < nb_test_alpn; j++) {
+            uint16_t length = (uint16_t)(64 + j * nb_test_sni + i);
+            ret = create_test_ticket((ticket_time / 1000) + 1000 * ((i * nb_test_alpn) + j), ttl, ticket, length);
+            if (ret == 0) {
+                ret = picoquic_store_session_ticket(quic, simulated_time, test_sni[i], (uint16_t)strlen(test_sni[i]),
+                    test_alpn[j], (uint16_t)strlen(test_alpn[j]), ticket, length, &test_tp);
+            }
+        }
+        for (size_t k = 0; ret == 0 && k < nb_test_ip_addr; k++) {
+            uint16_t length = (uint16_t)(40 + k * nb_test_sni + i);
+            ret = create_test_token(simulated_time, ttl, token, length);
+            if (ret == 0) {
+                ret = picoquic_store_retry_token(quic, simulated_time, test_sni[i], (uint16_t)strlen(test_sni[i]),
+                    test_ip_addr[k].ip_addr, test_ip_addr[k].ip_addr_length, token, length);
+            }
+        }
+    }
+
+    /* A newer ticket replaces the previous ticket for the same SNI and ALPN */
+    if (ret == 0) {
+        ret = create_test_ticket((ticket_time / 1000) + 100000, ttl, ticket, 100);
+        if (ret == 0) {
+            ret = picoquic_store_session_ticket(quic, simulated_time, test_sni[0], (uint16_t)strlen(test_sni[0]),
+                test_alpn[0], (uint16_t)strlen(test_alpn[0]), ticket, 100, &test_tp);
+        }
+        if (ret == 0 && (picoquic_get_session_ticket(quic, simulated_time, test_sni[0], (uint16_t)strlen(test_sni[0]),
+            test_alpn[0], (uint16_t)strlen(test_alpn[0]), &ticket_found, &ticket_length, &tp, 0) != 0 ||
+            ticket_length != 100)) {
+            DBG_PRINTF("%s", "Newer ticket not retrieved");
+            ret = -1;
+        }
+    }
+
+    /* Without an address, the token that expires last is returned */
+    if (ret == 0) {
+        if (picoquic_get_retry_token(quic, simulated_time, test_sni[1], (uint16_t)strlen(test_sni[1]),
+            NULL, 0, &token_found, &token_length, 0) != 0) {
+            DBG_PRINTF("%s", "Token not retrieved without address");
+            ret = -1;
+        }
+        else {
+            free(token_found);
+            token_found = NULL;
+        }
+    }
+
+    /* First save rewrites the file, the second one only appends the changes */
+    if (ret == 0) {
+        ret = picoquic_save_session_tickets(quic, test_ticket_file_name);
+        if (ret == 0) {
+            ret = picoquic_save_retry_tokens(quic, test_token_file_name);
+        }
+        nb_records_before = quic->ticket_store.nb_file_records;
+    }
+
+    if (ret == 0) {
+        /* Use one ticket and one token, and replace another ticket */
+        if (picoquic_get_session_ticket(quic, simulated_time, test_sni[1], (uint16_t)strlen(test_sni[1]),
+            test_alpn[1], (uint16_t)strlen(test_alpn[1]), &ticket_found, &ticket_length, &tp, 1) != 0 ||
+            picoquic_get_retry_token(quic, simulated_time, test_sni[2], (uint16_t)strlen(test_sni[2]),
+                test_ip_addr[0].ip_addr, test_ip_addr[0].ip_addr_length, &token_found, &token_length, 1) != 0) {
+            DBG_PRINTF("%s", "Cannot use ticket or token");
+            ret = -1;
+        }
+        else {
+            free(token_found);
+            token_found = NULL;
+            ret = create_test_ticket((ticket_time / 1000) + 200000, ttl, ticket, 110);
+        }
+        if (ret == 0) {
+            ret = picoquic_store_session_ticket(quic, simulated_time, test_sni[2], (uint16_t)strlen(test_sni[2]),
+                test_alpn[2], (uint16_t)strlen(test_alpn[2]), ticket, 110, &test_tp);
+        }
+        if (ret == 0) {
+            ret = picoquic_save_session_tickets(quic, test_ticket_file_name);
+        }
+        if (ret == 0) {
+            ret = picoquic_save_retry_tokens(quic, test_token_file_name);
+        }
+        if (ret == 0 && quic->ticket_store.nb_file_records != nb_records_before + 3) {
+            DBG_PRINTF("Expected %zu records, got %zu", nb_records_before + 3, quic->ticket_store.nb_file_records);
+            ret = -1;
+        }
+    }
+
+    /* Reloading the files in a new context retrieves the same tickets and tokens */
+    if (ret == 0) {
+        quic_bis = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+            NULL, simulated_time, &simulated_time, test_ticket_file_name, NULL, 0);
+        if (quic_bis == NULL) {
+            DBG_PRINTF("%s", "Cannot create second QUIC context");
+            ret = -1;
+        }
+        else {
+            ret = picoquic_load_retry_tokens(quic_bis, test_token_file_name);
+        }
+        if (ret == 0) {
+            ret = ticket_store_index_compare(quic, quic_bis, simulated_time);
+        }
+        if (ret == 0 && picoquic_get_session_ticket(quic_bis, simulated_time, test_sni[1], (uint16_t)strlen(test_sni[1]),
+            test_alpn[1], (uint16_t)strlen(test_alpn[1]), &ticket_found, &ticket_length, &tp, 0) == 0) {
+            DBG_PRINTF("%s", "Used ticket found after reload");
+            ret = -1;
+        }
+    }
+
+    /* A ticket used by a handshake stays referenced until the connection is deleted */
+    if (ret == 0) {
+        struct sockaddr_in addr;
+        picoquic_cnx_t* cnx = NULL;
+
+        memset(&addr, 0, sizeof(struct sockaddr_in));
+        addr.sin_family = AF_INET;
+        addr.sin_port = 4433;
+        if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&addr, simulated_time, 0, NULL, NULL, 1)) == NULL) {
+            DBG_PRINTF("%s", "Cannot create connection");
+            ret = -1;
+        }
+        else if (picoquic_get_session_ticket_ex(quic, simulated_time, test_sni[0], (uint16_t)strlen(test_sni[0]),
+            test_alpn[0], (uint16_t)strlen(test_alpn[0]), &ticket_found, &ticket_length, &tp, 1,
+            &cnx->resumption_ticket) != 0 || cnx->resumption_ticket == NULL || !cnx->resumption_ticket->is_referenced) {
+            DBG_PRINTF("%s", "Ticket not referenced by the connection");
+            ret = -1;
+        }
+        else {
+            picoquic_stored_ticket_t* stored = cnx->resumption_ticket;
+
+            picoquic_delete_cnx(cnx);
+            cnx = NULL;
+            if (stored->is_referenced) {
+                DBG_PRINTF("%s", "Ticket still referenced after the connection is deleted");
+                ret = -1;
+            }
+        }
+        if (cnx != NULL) {
+            picoquic_delete_cnx(cnx);
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+    if (quic_bis != NULL) {
+        picoquic_free(quic_bis);
+    }
+
+    return ret;
+}
@@ -1244,7 +1244,7 @@ int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t* test_ctx,
                     coalesced_length = hl + 21;
                 }
                 ret = picoquic_prepare_packet(test_ctx->cnx_client, *simulated_time,
-                    packet->bytes + coalesced_length, PICOQUIC_MAX_PACKET_SIZE - coalesced_length, &packet->length,
+                    packet->bytes + coalesced_length, picoquic_get_max_packet_size(test_ctx->qclient) - coalesced_length, &packet->length,
                     &packet->addr_to, &packet->addr_from, NULL);
                 if (ret != 0)
                 {
@@ -1270,7 +1270,7 @@ int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t* test_ctx,
             }
             else if (next_action == 3) {
                 ret = picoquic_prepare_packet(test_ctx->cnx_server, *simulated_time,
-                    packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length,
+                    packet->bytes, picoquic_get_max_packet_size(test_ctx->qserver), &packet->length,
                     &packet->addr_to, &packet->addr_from, NULL);
                 if (ret == PICOQUIC_ERROR_DISCONNECTED) {
                     ret = 0;
@@ -2227,8 +2227,10 @@ int tls_api_one_scenario_body_connect(picoquic_test_tls_api_ctx_t* test_ctx,
     if (ret == 0 && max_data != 0) {
         test_ctx->cnx_client->maxdata_local = max_data;
         test_ctx->cnx_client->maxdata_remote = max_data;
+        test_ctx->cnx_client->receive_window.window = max_data;
         test_ctx->cnx_server->maxdata_local = max_data;
         test_ctx->cnx_server->maxdata_remote = max_data;
+        test_ctx->cnx_server->receive_window.window = max_data;
     }
 
     return ret;
@@ -2564,7 +2566,8 @@ int tls_retry_token_test_one(int token_mode, int dup_token)
                 }
                 else {
                     uint64_t valid_until = PICOPARSE_64(text);
-                    ret = picoquic_registered_token_check_reuse(test_ctx->qserver, token, token_length, valid_until);
+                    ret = picoquic_registered_token_check_reuse(test_ctx->qserver, token, token_length, valid_until,
+                        simulated_time);
                     if (ret != 0) {
                         DBG_PRINTF("Token already registered, ret= %d\n", ret);
                     }
@@ -2785,7 +2788,11 @@ int tls_retry_token_valid_test()
     return ret;
 }
 
-int tls_api_retry_test_one(int large_client_hello)
+/* Number of tokens registered before the handshake when testing
+ * a Retry with a full token store */
+#define RETRY_STORE_FULL_NB_TOKENS 16
+
+int tls_api_retry_test_one(int large_client_hello, int fill_token_store)
 {
     uint64_t simulated_time = 0;
     const uint64_t target_time = 230000ull;
@@ -2801,6 +2808,24 @@ int tls_api_retry_test_one(int large_client_hello)
     }
 
 
+    if (ret == 0 && fill_token_store) {
+        /* Fill the server's token store with tokens that were all used once, so
+         * that the Retry token can only be registered by evicting them */
+        uint64_t random_context = 0x5707ef011;
+        uint8_t token[16];
+
+        picoquic_set_token_reuse_max(test_ctx->qserver, RETRY_STORE_FULL_NB_TOKENS);
+        memset(token, 0, 8);
+        for (int i = 0; ret == 0 && i < RETRY_STORE_FULL_NB_TOKENS; i++) {
+            picoformat_64(token + 8, picoquic_test_random(&random_context));
+            ret = picoquic_registered_token_check_reuse(test_ctx->qserver, token, sizeof(token),
+                simulated_time + PICOQUIC_TOKEN_DELAY_LONG, simulated_time);
+        }
+        if (ret != 0) {
+            DBG_PRINTF("%s", "Cannot fill the token store\n");
+        }
+    }
+
     if (ret == 0) {
         /* Set the server in HRR/Cookies mode */
         picoquic_set_cookie_mode(test_ctx->qserver, 1);
@@ -2827,12 +2852,18 @@ int tls_api_retry_test_one(int large_client_hello)
 
 int tls_api_retry_test()
 {
-    return tls_api_retry_test_one(0);
+    return tls_api_retry_test_one(0, 0);
 }
 
 int tls_api_retry_large_test()
 {
-    return tls_api_retry_test_one(1);
+    return tls_api_retry_test_one(1, 0);
+}
+
+/* A Retry handshake shall succeed even if the token store is full */
+int tls_api_retry_store_full_test()
+{
+    return tls_api_retry_test_one(0, 1);
 }
 /*
 * verify that a connection is correctly established
@@ -3147,6 +3178,96 @@ int session_resume_test()
     return ret;
 }
 
+/*
+ * Shared ticket key test. The session ticket is issued by a first server,
+ * and used with a second server that has a different local ticket key but
+ * shares the same key ring. The ring rotates its key between connections,
+ * so the ticket is decrypted with the previous key of the ring. A third
+ * server that does not use the ring cannot resume the session.
+ */
+int shared_ticket_key_test()
+{
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    char const* sni = PICOQUIC_TEST_SNI;
+    char const* alpn = PICOQUIC_TEST_ALPN;
+    uint64_t loss_mask = 0;
+    uint64_t rotation_interval = 10000000;
+    picoquic_ticket_key_ring_t* ring = picoquic_ticket_key_ring_create(NULL, 0, rotation_interval, simulated_time);
+    int ret = 0;
+
+    if (ring == NULL) {
+        DBG_PRINTF("%s", "Cannot create the ticket key ring");
+        ret = -1;
+    }
+    else {
+        /* Initialize an empty ticket store */
+        ret = picoquic_save_tickets(NULL, simulated_time, ticket_file_name);
+    }
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        if (i == 1) {
+            /* Wait until the ring rotates its key */
+            simulated_time += rotation_interval + 1000000;
+        }
+
+        /* Each connection uses a new server context, with a different local key */
+        ret = tls_api_init_ctx(&test_ctx, 0, sni, alpn, &simulated_time, ticket_file_name, NULL, 0, 0, (i == 0));
+
+        if (ret == 0 && i < 2) {
+            ret = picoquic_set_ticket_key_ring(test_ctx->qserver, ring);
+        }
+
+        if (ret == 0) {
+            test_ctx->cnx_client->max_early_data_size = 0;
+
+            ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+        }
+
+        if (ret == 0 && i > 0) {
+            int is_psk = picoquic_tls_is_psk_handshake(test_ctx->cnx_server) != 0 &&
+                picoquic_tls_is_psk_handshake(test_ctx->cnx_client) != 0;
+            if (is_psk != (i == 1)) {
+                DBG_PRINTF("Connection %d, PSK handshake: %d", i, is_psk);
+                ret = -1;
+            }
+            else if (i == 1 && (ring->nb_keys != 2 || test_ctx->qserver->nb_ticket_aead != 2)) {
+                DBG_PRINTF("Ring has %d keys, server has %d", ring->nb_keys, test_ctx->qserver->nb_ticket_aead);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && i == 0) {
+            /* Before closing, wait for the session ticket to arrive */
+            ret = session_resume_wait_for_ticket(test_ctx, &simulated_time);
+        }
+
+        if (ret == 0) {
+            ret = tls_api_attempt_to_close(test_ctx, &simulated_time);
+        }
+
+        if (ret == 0 && i == 0) {
+            if (test_ctx->qclient->p_first_ticket == NULL) {
+                ret = -1;
+            }
+            else {
+                ret = picoquic_save_tickets(test_ctx->qclient->p_first_ticket, simulated_time, ticket_file_name);
+            }
+        }
+
+        if (test_ctx != NULL) {
+            tls_api_delete_ctx(test_ctx);
+            test_ctx = NULL;
+        }
+    }
+
+    if (ring != NULL) {
+        picoquic_ticket_key_ring_release(ring);
+    }
+
+    return ret;
+}
+
 /*
  * Zero RTT test. Like the session resume test, but with a twist...
  */
@@ -3699,6 +3820,115 @@ int mtu_drop_test()
     return ret;
 }
 
+/*
+ * Jumbo packet test. Set the packet size to 9000 bytes on both contexts,
+ * then send a large response on a link that accepts packets up to
+ * link_mtu. Verify that the MTU discovery finds a value between
+ * mtu_min and link_mtu, and that the transfer completes.
+ */
+
+static test_api_stream_desc_t test_scenario_jumbo[] = {
+    { 4, 0, 257, 1000000 }
+};
+
+static int jumbo_packet_test_one(size_t link_mtu, size_t mtu_min)
+{
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    const size_t jumbo_size = 9000;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    int ret = tls_api_init_ctx(&test_ctx, PICOQUIC_INTERNAL_TEST_VERSION_1,
+        PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 1, 0);
+
+    /* The packet size cannot change while the context has connections */
+    if (ret == 0 && picoquic_set_max_packet_size(test_ctx->qclient, jumbo_size) != PICOQUIC_ERROR_CANNOT_CHANGE_ACTIVE_CONTEXT) {
+        DBG_PRINTF("%s", "Packet size changed while a connection exists\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        picoquic_delete_cnx(test_ctx->cnx_client);
+        test_ctx->cnx_client = NULL;
+
+        if (picoquic_set_max_packet_size(test_ctx->qclient, PICOQUIC_MAX_JUMBO_PACKET_SIZE + 1) != PICOQUIC_ERROR_INVALID_PACKET_SIZE) {
+            DBG_PRINTF("%s", "Packet size larger than jumbo accepted\n");
+            ret = -1;
+        }
+        else if (picoquic_set_max_packet_size(test_ctx->qclient, jumbo_size) != 0 ||
+            picoquic_set_max_packet_size(test_ctx->qserver, jumbo_size) != 0) {
+            DBG_PRINTF("%s", "Cannot set the jumbo packet size\n");
+            ret = -1;
+        }
+        else {
+            test_ctx->c_to_s_link->path_mtu = link_mtu;
+            test_ctx->s_to_c_link->path_mtu = link_mtu;
+
+            test_ctx->cnx_client = picoquic_create_cnx(test_ctx->qclient,
+                picoquic_null_connection_id, picoquic_null_connection_id,
+                (struct sockaddr*)&test_ctx->server_addr, simulated_time,
+                0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, 1);
+
+            if (test_ctx->cnx_client == NULL) {
+                ret = -1;
+            }
+            else {
+                ret = picoquic_start_client_cnx(test_ctx->cnx_client);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0 && test_ctx->cnx_client->local_parameters.max_packet_size != jumbo_size) {
+        DBG_PRINTF("Client announces max packet size %u instead of %zu\n",
+            test_ctx->cnx_client->local_parameters.max_packet_size, jumbo_size);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_jumbo, sizeof(test_scenario_jumbo));
+    }
+
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        size_t send_mtu = test_ctx->cnx_server->path[0]->send_mtu;
+
+        if (send_mtu < mtu_min || send_mtu > link_mtu) {
+            DBG_PRINTF("Server MTU %zu, expected [%zu..%zu]\n", send_mtu, mtu_min, link_mtu);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_verify(test_ctx, &simulated_time, 0);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+int jumbo_packet_test()
+{
+    /* The path supports the jumbo frames */
+    int ret = jumbo_packet_test_one(9000, 9000);
+
+    /* The path MTU is lower, and found by binary search */
+    if (ret == 0) {
+        ret = jumbo_packet_test_one(4000, 3000);
+    }
+
+    return ret;
+}
+
 
 
 /*
@@ -4222,6 +4452,130 @@ int set_certificate_and_key_test()
     return ret;
 }
 
+/*
+ * Test certificate compression. The server certificate chain is padded with
+ * copies of the server certificate, to simulate chains of different sizes.
+ * For each size, the handshake is run with and without compression, and the
+ * test compares the bytes sent by the server before the client address is
+ * validated, and the handshake duration. Large uncompressed chains exceed
+ * the anti-amplification limit, which costs an extra round trip.
+ */
+static int cert_compression_handshake(size_t nb_copies, int is_compressed, int* is_supported,
+    uint64_t* server_first_flight, uint64_t* handshake_time)
+{
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    char test_server_cert_file[512];
+    int ret = picoquic_get_input_path(test_server_cert_file, sizeof(test_server_cert_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT);
+
+    if (ret == 0) {
+        ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 1, 0);
+    }
+
+    if (ret == 0) {
+        size_t count = 0;
+        ptls_iovec_t* certs = picoquic_get_certs_from_file(test_server_cert_file, &count);
+        ptls_iovec_t* chain = (ptls_iovec_t*)malloc(sizeof(ptls_iovec_t) * (count + nb_copies));
+
+        if (certs == NULL || count == 0 || chain == NULL) {
+            ret = -1;
+        }
+        else {
+            /* The chain is the content of the certificate file, followed by copies of the first certificate */
+            for (size_t i = 0; i < count + nb_copies; i++) {
+                ptls_iovec_t* src = (i < count) ? &certs[i] : &certs[0];
+                chain[i].base = (uint8_t*)malloc(src->len);
+                chain[i].len = src->len;
+                if (chain[i].base == NULL) {
+                    ret = -1;
+                }
+                else {
+                    memcpy(chain[i].base, src->base, src->len);
+                }
+            }
+            picoquic_set_tls_certificate_chain(test_ctx->qserver, chain, count + nb_copies);
+            chain = NULL;
+        }
+
+        if (certs != NULL) {
+            for (size_t i = 0; i < count; i++) {
+                free(certs[i].base);
+            }
+            free(certs);
+        }
+        if (chain != NULL) {
+            free(chain);
+        }
+    }
+
+    if (ret == 0) {
+        if (picoquic_set_certificate_compression(test_ctx->qserver, is_compressed) != 0 ||
+            picoquic_set_certificate_compression(test_ctx->qclient, is_compressed) != 0) {
+            /* Picoquic was built without certificate compression */
+            *is_supported = 0;
+        }
+        else {
+            ret = picoquic_start_client_cnx(test_ctx->cnx_client);
+
+            if (ret == 0) {
+                ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+            }
+
+            if (ret == 0 && (!TEST_CLIENT_READY || !TEST_SERVER_READY)) {
+                DBG_PRINTF("Handshake failed, %zu copies, compression %d", nb_copies, is_compressed);
+                ret = -1;
+            }
+
+            if (ret == 0) {
+                *server_first_flight = test_ctx->cnx_server->initial_data_sent;
+                *handshake_time = simulated_time;
+            }
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+    }
+
+    return ret;
+}
+
+int cert_compression_test()
+{
+    int ret = 0;
+    size_t const chain_copies[] = { 0, 3, 7 };
+    size_t const nb_chains = sizeof(chain_copies) / sizeof(size_t);
+    int is_supported = 1;
+
+    for (size_t i = 0; ret == 0 && i < nb_chains; i++) {
+        uint64_t first_flight[2] = { 0, 0 };
+        uint64_t handshake_time[2] = { 0, 0 };
+
+        ret = cert_compression_handshake(chain_copies[i], 0, &is_supported, &first_flight[0], &handshake_time[0]);
+
+        if (ret == 0 && is_supported) {
+            ret = cert_compression_handshake(chain_copies[i], 1, &is_supported, &first_flight[1], &handshake_time[1]);
+
+            if (ret == 0 && is_supported) {
+                DBG_PRINTF("Chain +%zu certs: first flight %" PRIu64 " -> %" PRIu64 " bytes, handshake %" PRIu64 " -> %" PRIu64 " us",
+                    chain_copies[i], first_flight[0], first_flight[1], handshake_time[0], handshake_time[1]);
+
+                if (first_flight[1] > first_flight[0] || handshake_time[1] > handshake_time[0]) {
+                    DBG_PRINTF("Compression does not improve handshake for chain +%zu certs", chain_copies[i]);
+                    ret = -1;
+                }
+                else if (i == nb_chains - 1 && handshake_time[1] >= handshake_time[0]) {
+                    DBG_PRINTF("%s", "Compression does not save a round trip for the largest chain");
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
 int request_client_authentication_test()
 {
     uint64_t simulated_time = 0;
@@ -5818,6 +6172,178 @@ int server_busy_test()
     return ret;
 }
 
+/*
+ * Handshake budget test.
+ * Verify that when the server limits the number of handshakes per millisecond,
+ * the processing of the client hello is deferred to the sending loop, and
+ * that the connection completes as expected. Also verify that when several
+ * client hellos arrive together, one of them is processed per millisecond,
+ * and that a deferred handshake that fails closes with the TLS error.
+ */
+
+static int handshake_budget_count_deferred(picoquic_quic_t* quic)
+{
+    int nb_deferred = 0;
+    picoquic_cnx_t* cnx = quic->cnx_list;
+
+    while (cnx != NULL) {
+        if (cnx->is_handshake_deferred) {
+            nb_deferred++;
+        }
+        cnx = cnx->next_in_table;
+    }
+
+    return nb_deferred;
+}
+
+static int handshake_budget_multiple_test()
+{
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_cnx_t* cnx_client_2 = NULL;
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+    size_t length = 0;
+    struct sockaddr_storage addr_to;
+    struct sockaddr_storage addr_from;
+    int if_index = 0;
+    int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 0, 0);
+
+    if (ret == 0) {
+        picoquic_set_max_handshakes_per_ms(test_ctx->qserver, 1);
+        test_ctx->qserver->nb_handshakes_in_period = 1;
+        if ((cnx_client_2 = picoquic_create_cnx(test_ctx->qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test_ctx->server_addr, simulated_time, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, 1)) == NULL) {
+            ret = -1;
+        }
+        else {
+            ret = picoquic_start_client_cnx(cnx_client_2);
+        }
+    }
+
+    /* The client hellos of both connections arrive at the server */
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        ret = picoquic_prepare_packet((i == 0) ? test_ctx->cnx_client : cnx_client_2, simulated_time,
+            bytes, sizeof(bytes), &length, &addr_to, &addr_from, NULL);
+        if (ret == 0 && length == 0) {
+            DBG_PRINTF("No initial packet from client %d", i);
+            ret = -1;
+        }
+        else if (ret == 0) {
+            ret = picoquic_incoming_packet(test_ctx->qserver, bytes, length, (struct sockaddr*)&test_ctx->client_addr,
+                (struct sockaddr*)&test_ctx->server_addr, 0, 0, simulated_time);
+        }
+    }
+
+    if (ret == 0 && (test_ctx->qserver->nb_handshakes_deferred != 2 ||
+        handshake_budget_count_deferred(test_ctx->qserver) != 2)) {
+        DBG_PRINTF("Expected 2 deferred handshakes, got %llu", (unsigned long long)test_ctx->qserver->nb_handshakes_deferred);
+        ret = -1;
+    }
+
+    /* The budget is exhausted in the first period, then one handshake runs per period */
+    for (int period = 0; ret == 0 && period < 3; period++) {
+        int nb_expected = (period == 0) ? 2 : 2 - period;
+
+        simulated_time = (uint64_t)period * 1000;
+        for (int i = 0; ret == 0 && i < 16; i++) {
+            ret = picoquic_prepare_next_packet(test_ctx->qserver, simulated_time, bytes, sizeof(bytes), &length,
+                &addr_to, &addr_from, &if_index, NULL, NULL);
+        }
+        if (ret == 0 && handshake_budget_count_deferred(test_ctx->qserver) != nb_expected) {
+            DBG_PRINTF("At %llu, %d handshakes deferred instead of %d", (unsigned long long)simulated_time,
+                handshake_budget_count_deferred(test_ctx->qserver), nb_expected);
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+static int handshake_budget_failure_test()
+{
+    uint64_t loss_mask = 0;
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_WRONG_ALPN, &simulated_time, NULL, NULL, 0, 0, 0);
+
+    if (ret == 0) {
+        free((void*)test_ctx->qserver->default_alpn);
+        test_ctx->qserver->default_alpn = picoquic_string_duplicate(PICOQUIC_TEST_ALPN);
+        picoquic_set_max_handshakes_per_ms(test_ctx->qserver, 1);
+        test_ctx->qserver->nb_handshakes_in_period = 1;
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0 && test_ctx->qserver->nb_handshakes_deferred != 1) {
+        DBG_PRINTF("Expected 1 deferred handshake, got %llu", (unsigned long long)test_ctx->qserver->nb_handshakes_deferred);
+        ret = -1;
+    }
+
+    if (ret == 0 && (test_ctx->cnx_client->cnx_state != picoquic_state_disconnected ||
+        test_ctx->cnx_client->remote_error != PICOQUIC_TLS_ALERT_WRONG_ALPN)) {
+        DBG_PRINTF("Client state %d, remote error 0x%x", test_ctx->cnx_client->cnx_state,
+            test_ctx->cnx_client->remote_error);
+        ret = -1;
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+int handshake_budget_test()
+{
+    uint64_t loss_mask = 0;
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 0, 0);
+
+    if (ret == 0) {
+        picoquic_set_max_handshakes_per_ms(test_ctx->qserver, 1);
+        /* Exhaust the budget of the first period, so the handshake has to wait */
+        test_ctx->qserver->nb_handshakes_in_period = 1;
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0) {
+        if (test_ctx->qserver->nb_handshakes_deferred != 1) {
+            DBG_PRINTF("Expected 1 deferred handshake, got %llu", (unsigned long long)test_ctx->qserver->nb_handshakes_deferred);
+            ret = -1;
+        }
+        else if (test_ctx->cnx_server == NULL || test_ctx->cnx_server->is_handshake_deferred) {
+            DBG_PRINTF("%s", "Server handshake not processed");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_attempt_to_close(test_ctx, &simulated_time);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    if (ret == 0) {
+        ret = handshake_budget_multiple_test();
+    }
+
+    if (ret == 0) {
+        ret = handshake_budget_failure_test();
+    }
+
+    return ret;
+}
+
 /*
  * Initial close test. Check what happens when the client closes a connection without waiting for the full establishment
  */
@@ -6224,6 +6750,17 @@ static int key_rotation_test_one(int inject_bad_packet)
         ret = -1;
     }
 
+    if (ret == 0) {
+        /* After the rotations, the keys of the next phase should be ready on both sides */
+        for (int i = 0; ret == 0 && i < 2; i++) {
+            picoquic_cnx_t* cnx = (i == 0) ? test_ctx->cnx_client : test_ctx->cnx_server;
+            if (cnx->crypto_context_new.aead_encrypt == NULL || cnx->crypto_context_new.aead_decrypt == NULL) {
+                DBG_PRINTF("Next phase keys not precomputed on %s", (i == 0) ? "client" : "server");
+                ret = -1;
+            }
+        }
+    }
+
     if (ret == 0) {
         ret = tls_api_attempt_to_close(test_ctx, &simulated_time);
 